@@ -722,6 +722,8 @@ rspamc_stat_output (ucl_object_t *obj)
 		ucl_object_toint (ucl_object_find_key (obj, "chunks_freed")));
 	rspamd_printf_gstring (out, "Oversized chunks: %L\n",
 		ucl_object_toint (ucl_object_find_key (obj, "chunks_oversized")));
+	rspamd_printf_gstring (out, "Recycled chunks: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "chunks_recycled")));
 	/* Fuzzy */
 	rspamd_printf_gstring (out, "Fuzzy hashes stored: %L\n",
 		ucl_object_toint (ucl_object_find_key (obj, "fuzzy_stored")));
@@ -158,7 +158,7 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 		conn->key = rspamd_http_connection_make_peer_key (key);
 		if (conn->key) {
 			conn->keypair = rspamd_http_connection_gen_key ();
-			rspamd_http_connection_set_key (conn->http_conn, conn->key);
+			rspamd_http_connection_set_key (conn->http_conn, conn->keypair);
 		}
 	}
 	conn->server_name = g_string_new (name);
@@ -189,7 +189,7 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 
 	req->msg = rspamd_http_new_message (HTTP_REQUEST);
 	if (conn->key) {
-		req->msg->peer_key = g_string_new (conn->key->str);
+		req->msg->peer_key = g_string_new_len (conn->key->str, conn->key->len);
 	}
 
 	if (in != NULL) {
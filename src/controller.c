@@ -54,6 +54,7 @@
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_PROFILE "/profile"
 
 /* Graph colors */
 #define COLOR_CLEAN "#58A458"
@@ -725,8 +726,23 @@ rspamd_controller_learn_fin_task (void *ud)
 	conn_ent = task->fin_arg;
 	session = conn_ent->ud;
 
-	if (!rspamd_learn_task_spam (session->cl, task, session->is_spam, &err)) {
-		rspamd_controller_send_error (conn_ent, 500 + err->code, err->message);
+	if (task->state != WAIT_STATISTICS) {
+		/* Statfiles may be loaded and stored by events of session */
+		task->state = WAIT_STATISTICS;
+
+		if (!rspamd_learn_task_spam (session->cl, task, session->is_spam,
+				&err)) {
+			rspamd_controller_send_error (conn_ent, 500 + err->code,
+				err->message);
+			return TRUE;
+		}
+
+		return FALSE;
+	}
+
+	if (task->error_code == RSPAMD_STATFILE_ERROR) {
+		rspamd_controller_send_error (conn_ent, task->error_code,
+			task->last_error);
 		return TRUE;
 	}
 	/* Successful learn */
@@ -745,7 +761,15 @@ rspamd_controller_check_fin_task (void *ud)
 	struct rspamd_http_connection_entry *conn_ent;
 	struct rspamd_http_message *msg;
 
-	rspamd_process_statistics (task);
+	if (task->state != WAIT_STATISTICS) {
+		/* Reply is written when statfiles are loaded */
+		task->state = WAIT_STATISTICS;
+		rspamd_process_statistics (task);
+
+		return FALSE;
+	}
+
+	rspamd_make_composites (task);
 	conn_ent = task->fin_arg;
 	msg = rspamd_http_new_message (HTTP_RESPONSE);
 	msg->date = time (NULL);
@@ -806,7 +830,7 @@ rspamd_controller_handle_learn_common (
 
 	task->s = new_async_session (session->pool,
 			rspamd_controller_learn_fin_task,
-			NULL,
+			rspamd_task_restore,
 			rspamd_task_free_hard,
 			task);
 	task->s->wanna_die = TRUE;
@@ -815,7 +839,8 @@ rspamd_controller_handle_learn_common (
 	task->sock = conn_ent->conn->fd;
 
 
-	if (!rspamd_task_process (task, msg, NULL, FALSE)) {
+	if (!rspamd_task_process (task, msg, msg->body->str, msg->body->len,
+			NULL, FALSE)) {
 		msg_warn ("filters cannot be processed for %s", task->message_id);
 		rspamd_controller_send_error (conn_ent, 500, task->last_error);
 		destroy_session (task->s);
@@ -897,7 +922,7 @@ rspamd_controller_handle_scan (struct rspamd_http_connection_entry *conn_ent,
 
 	task->s = new_async_session (session->pool,
 			rspamd_controller_check_fin_task,
-			NULL,
+			rspamd_task_restore,
 			rspamd_task_free_hard,
 			task);
 	task->s->wanna_die = TRUE;
@@ -905,7 +930,8 @@ rspamd_controller_handle_scan (struct rspamd_http_connection_entry *conn_ent,
 	task->http_conn = rspamd_http_connection_ref (conn_ent->conn);
 	task->sock = conn_ent->conn->fd;
 
-	if (!rspamd_task_process (task, msg, NULL, FALSE)) {
+	if (!rspamd_task_process (task, msg, msg->body->str, msg->body->len,
+			NULL, FALSE)) {
 		msg_warn ("filters cannot be processed for %s", task->message_id);
 		rspamd_controller_send_error (conn_ent, 500, task->last_error);
 		destroy_session (task->s);
@@ -1320,11 +1346,25 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (
 			mem_st.oversized_chunks), "chunks_oversized", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (
+			mem_st.chunks_recycled), "chunks_recycled", 0, false);
 	ucl_object_insert_key (top,
 		ucl_object_fromint (stat->fuzzy_hashes), "fuzzy_stored", 0, false);
 	ucl_object_insert_key (top,
 		ucl_object_fromint (
 			stat->fuzzy_hashes_expired), "fuzzy_expired", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_cache_hits), "dns_cache_hits", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_cache_misses), "dns_cache_misses", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_requests_coalesced), "dns_coalesced", 0,
+		false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->dns_shared_hits), "dns_shared_hits", 0,
+		false);
 
 	/* Now write statistics for each statfile */
 	cur_cl = g_list_first (session->ctx->cfg->classifiers);
@@ -1342,6 +1382,9 @@ rspamd_controller_handle_stat_common (
 		session->ctx->srv->stat->messages_learned = 0;
 		session->ctx->srv->stat->connections_count = 0;
 		session->ctx->srv->stat->control_connections_count = 0;
+		session->ctx->srv->stat->dns_cache_hits = 0;
+		session->ctx->srv->stat->dns_cache_misses = 0;
+		session->ctx->srv->stat->dns_requests_coalesced = 0;
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -1411,9 +1454,9 @@ rspamd_controller_handle_counters (
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	ucl_object_t *top;
-	GList *cur;
 	struct cache_item *item;
 	struct symbols_cache *cache;
+	guint i;
 
 	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
 		return 0;
@@ -1421,24 +1464,86 @@ rspamd_controller_handle_counters (
 
 	cache = session->ctx->cfg->cache;
 	top = ucl_object_typed_new (UCL_ARRAY);
-	if (cache != NULL) {
-		cur = cache->negative_items;
-		while (cur) {
-			item = cur->data;
+	if (cache != NULL && cache->items_by_order != NULL) {
+		for (i = 0; i < cache->items_by_order->d->len; i ++) {
+			item = g_ptr_array_index (cache->items_by_order->d, i);
 			if (!item->is_callback) {
 				ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
 						item));
 			}
-			cur = g_list_next (cur);
 		}
-		cur = cache->static_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
-				ucl_array_append (top, rspamd_controller_cache_item_to_ucl (
-						item));
+	}
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
+static ucl_object_t *
+rspamd_controller_histogram_to_ucl (const struct rspamd_symbol_histogram *h)
+{
+	ucl_object_t *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj,
+		ucl_object_fromint (rspamd_symbols_cache_hist_percentile (h, 50.0)),
+		"p50", 0, false);
+	ucl_object_insert_key (obj,
+		ucl_object_fromint (rspamd_symbols_cache_hist_percentile (h, 90.0)),
+		"p90", 0, false);
+	ucl_object_insert_key (obj,
+		ucl_object_fromint (rspamd_symbols_cache_hist_percentile (h, 99.0)),
+		"p99", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (h->max),
+		"max", 0, false);
+
+	return obj;
+}
+
+/*
+ * Profile command handler:
+ * request: /profile
+ * headers: Password
+ * reply: json array of symbols latencies (cpu and real time) in microseconds
+ */
+static int
+rspamd_controller_handle_profile (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top, *obj;
+	struct cache_item *item;
+	struct symbols_cache *cache;
+	guint i;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	cache = session->ctx->cfg->cache;
+	top = ucl_object_typed_new (UCL_ARRAY);
+	if (cache != NULL && cache->items_by_order != NULL) {
+		for (i = 0; i < cache->items_by_order->d->len; i ++) {
+			item = g_ptr_array_index (cache->items_by_order->d, i);
+
+			if (item->is_virtual) {
+				continue;
 			}
-			cur = g_list_next (cur);
+
+			obj = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (obj, ucl_object_fromstring (item->s->symbol),
+				"symbol", 0, false);
+			ucl_object_insert_key (obj,
+				ucl_object_fromint (item->s->cpu_hist.count),
+				"count", 0, false);
+			ucl_object_insert_key (obj,
+				rspamd_controller_histogram_to_ucl (&item->s->cpu_hist),
+				"cpu", 0, false);
+			ucl_object_insert_key (obj,
+				rspamd_controller_histogram_to_ucl (&item->s->wall_hist),
+				"real", 0, false);
+			ucl_array_append (top, obj);
 		}
 	}
 	rspamd_controller_send_ucl (conn_ent, top);
@@ -1670,6 +1775,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 		rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_PROFILE,
+		rspamd_controller_handle_profile);
 
 	/* Attach plugins */
 	cur = g_list_first (ctx->cfg->filters);
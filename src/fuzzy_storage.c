@@ -54,6 +54,16 @@
 #define MAX_RETRIES 40
 /* Weight of hash to consider it frequent */
 #define DEFAULT_FREQUENT_SCORE 100
+/* Number of datagrams that are received and replied at once */
+#define DEFAULT_BATCH 32
+/* Maximum size of an incoming datagram */
+#define MAX_DATAGRAM 2048
+/* Number of queued updates that are written at once, 0 disables queue */
+#define DEFAULT_UPDATES_MAX 0
+/* Time in milliseconds to wait for a full socket buffer when replying */
+#define FUZZY_SEND_TIMEOUT 100
+/* Maximum time for an update to stay in queue */
+#define DEFAULT_UPDATES_TIMEOUT 1.0
 
 /* Current version of fuzzy hash file format */
 #define CURRENT_FUZZY_VERSION 1
@@ -72,12 +82,15 @@ worker_t fuzzy_worker = {
 	TRUE,                       /* Unique */
 	TRUE,                       /* Threaded */
 	FALSE,                      /* Non killable */
-	SOCK_DGRAM                  /* UDP socket */
+	SOCK_DGRAM,                 /* UDP socket */
+	TRUE                        /* Reuseport for processing threads */
 };
 
 /* For evtimer */
 static struct timeval tmv;
 static struct event tev;
+static struct timeval flush_tv;
+static struct event flush_ev;
 static struct rspamd_stat *server_stat;
 
 struct rspamd_fuzzy_storage_ctx {
@@ -88,8 +101,17 @@ struct rspamd_fuzzy_storage_ctx {
 	radix_compressed_t *update_ips;
 	gchar *update_map;
 	struct event_base *ev_base;
+	guint32 threads;
+	guint32 batch;
+	gboolean memory_index;
+	guint32 updates_max;
+	gdouble updates_timeout;
 
 	struct rspamd_fuzzy_backend *backend;
+	/* Protects backend if there are processing threads */
+	rspamd_mutex_t *backend_mtx;
+	struct fuzzy_thread *main_thread;
+	GList *threads_list;
 };
 
 struct rspamd_legacy_fuzzy_node {
@@ -102,11 +124,46 @@ struct rspamd_legacy_fuzzy_node {
 struct fuzzy_session {
 	struct rspamd_worker *worker;
 	struct rspamd_fuzzy_cmd *cmd;
-	gint fd;
+	struct rspamd_fuzzy_backend *backend;
 	guint64 time;
 	gboolean legacy;
 	rspamd_inet_addr_t addr;
 	struct rspamd_fuzzy_storage_ctx *ctx;
+	gint len;
+	gint reply_len;
+	union {
+		struct rspamd_fuzzy_reply rep;
+		gchar legacy[64];
+	} reply;
+};
+
+/*
+ * Buffers for a batch of datagrams, each processing thread owns one
+ */
+struct fuzzy_batch {
+	guint size;
+	guint8 *bufs;
+	struct fuzzy_session *sessions;
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+#endif
+};
+
+struct fuzzy_thread {
+	struct rspamd_worker *worker;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	/* Either main read-write backend or a read only handle of this thread */
+	struct rspamd_fuzzy_backend *backend;
+	struct event_base *ev_base;
+	GList *events;
+	/* Sockets bound by this thread */
+	GList *socks;
+	struct fuzzy_batch batch;
+	GThread *thread;
+	/* Main thread writes to this pipe to stop the thread's loop */
+	gint term_pipe[2];
+	struct event term_ev;
 };
 
 extern sig_atomic_t wanna_die;
@@ -151,41 +208,48 @@ rspamd_fuzzy_check_client (struct fuzzy_session *session)
 }
 
 static void
-rspamd_fuzzy_write_reply (struct fuzzy_session *session,
+rspamd_fuzzy_make_reply (struct fuzzy_session *session,
 		struct rspamd_fuzzy_reply *rep)
 {
-	gint r;
-	gchar buf[64];
-
 	if (session->legacy) {
 		if (rep->prob > 0.5) {
 			if (session->cmd->cmd == FUZZY_CHECK) {
-				r = rspamd_snprintf (buf, sizeof (buf), "OK %d %d" CRLF,
+				session->reply_len = rspamd_snprintf (session->reply.legacy,
+						sizeof (session->reply.legacy), "OK %d %d" CRLF,
 						rep->value, rep->flag);
 			}
 			else {
-				r = rspamd_snprintf (buf, sizeof (buf), "OK" CRLF);
+				session->reply_len = rspamd_snprintf (session->reply.legacy,
+						sizeof (session->reply.legacy), "OK" CRLF);
 			}
 
 		}
 		else {
-			r = rspamd_snprintf (buf, sizeof (buf), "ERR" CRLF);
+			session->reply_len = rspamd_snprintf (session->reply.legacy,
+					sizeof (session->reply.legacy), "ERR" CRLF);
 		}
-		r = sendto (session->fd, buf, r, 0, &session->addr.addr.sa,
-			session->addr.slen);
 	}
 	else {
-		r = sendto (session->fd, rep, sizeof (*rep), 0, &session->addr.addr.sa,
-				session->addr.slen);
+		memcpy (&session->reply.rep, rep, sizeof (*rep));
+		session->reply_len = sizeof (*rep);
 	}
+}
 
-	if (r == -1) {
-		if (errno == EINTR) {
-			rspamd_fuzzy_write_reply (session, rep);
-		}
-		else {
-			msg_err ("error while writing reply: %s", strerror (errno));
-		}
+static inline void
+rspamd_fuzzy_lock_backend (struct fuzzy_session *session,
+		struct rspamd_fuzzy_backend *bk)
+{
+	if (bk == session->ctx->backend && session->ctx->backend_mtx) {
+		rspamd_mutex_lock (session->ctx->backend_mtx);
+	}
+}
+
+static inline void
+rspamd_fuzzy_unlock_backend (struct fuzzy_session *session,
+		struct rspamd_fuzzy_backend *bk)
+{
+	if (bk == session->ctx->backend && session->ctx->backend_mtx) {
+		rspamd_mutex_unlock (session->ctx->backend_mtx);
 	}
 }
 
@@ -196,12 +260,16 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 	gboolean res = FALSE;
 
 	if (session->cmd->cmd == FUZZY_CHECK) {
-		rep = rspamd_fuzzy_backend_check (session->ctx->backend, session->cmd,
+		rspamd_fuzzy_lock_backend (session, session->backend);
+		rep = rspamd_fuzzy_backend_check (session->backend, session->cmd,
 				session->ctx->expire);
+		rspamd_fuzzy_unlock_backend (session, session->backend);
 	}
 	else {
 		rep.flag = session->cmd->flag;
 		if (rspamd_fuzzy_check_client (session)) {
+			/* Updates are always performed using the main backend */
+			rspamd_fuzzy_lock_backend (session, session->ctx->backend);
 			if (session->cmd->cmd == FUZZY_WRITE) {
 				res = rspamd_fuzzy_backend_add (session->ctx->backend,
 						session->cmd);
@@ -210,6 +278,9 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 				res = rspamd_fuzzy_backend_del (session->ctx->backend,
 						session->cmd);
 			}
+			server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (
+					session->ctx->backend);
+			rspamd_fuzzy_unlock_backend (session, session->ctx->backend);
 			if (!res) {
 				rep.value = 404;
 				rep.prob = 0.0;
@@ -223,11 +294,10 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 			rep.value = 403;
 			rep.prob = 0.0;
 		}
-		server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (session->ctx->backend);
 	}
 
 	rep.tag = session->cmd->tag;
-	rspamd_fuzzy_write_reply (session, &rep);
+	rspamd_fuzzy_make_reply (session, &rep);
 }
 
 
@@ -247,70 +317,452 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 
 	return FALSE;
 }
-/*
- * Accept new connection and construct task
- */
+
 static void
-accept_fuzzy_socket (gint fd, short what, void *arg)
+rspamd_fuzzy_handle_datagram (struct fuzzy_session *session, guint8 *buf)
 {
-	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
-	struct rspamd_fuzzy_storage_ctx *ctx;
-	struct fuzzy_session session;
-	gint r;
-	guint8 buf[2048];
 	struct rspamd_fuzzy_cmd *cmd = NULL, lcmd;
 	struct legacy_fuzzy_cmd *l;
+	gint r = session->len;
+
+	session->addr.af = session->addr.addr.sa.sa_family;
+	session->reply_len = 0;
+
+	if ((guint)r == sizeof (struct legacy_fuzzy_cmd)) {
+		session->legacy = TRUE;
+		l = (struct legacy_fuzzy_cmd *)buf;
+		lcmd.version = 2;
+		memcpy (lcmd.digest, l->hash, sizeof (lcmd.digest));
+		lcmd.cmd = l->cmd;
+		lcmd.flag = l->flag;
+		lcmd.shingles_count = 0;
+		lcmd.value = l->value;
+		lcmd.tag = 0;
+		cmd = &lcmd;
+	}
+	else if ((guint)r >= sizeof (struct rspamd_fuzzy_cmd)) {
+		/* Check shingles count sanity */
+		session->legacy = FALSE;
+		cmd = (struct rspamd_fuzzy_cmd *)buf;
+		if (!rspamd_fuzzy_command_valid (cmd, r)) {
+			/* Bad input */
+			msg_debug ("invalid fuzzy command of size %d received", r);
+		}
+	}
+	else {
+		/* Discard input */
+		msg_debug ("invalid fuzzy command of size %d received", r);
+	}
+	if (cmd != NULL) {
+		session->cmd = cmd;
+		rspamd_fuzzy_process_command (session);
+	}
+}
 
-	ctx = worker->ctx;
-	session.worker = worker;
-	session.fd = fd;
-	session.addr.slen = sizeof (session.addr.addr);
-	session.ctx = worker->ctx;
-	session.time = (guint64)time (NULL);
+static void
+rspamd_fuzzy_init_batch (struct fuzzy_batch *batch, guint size)
+{
+	batch->size = size;
+	batch->bufs = g_malloc (size * MAX_DATAGRAM);
+	batch->sessions = g_malloc0 (size * sizeof (struct fuzzy_session));
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+	batch->msgs = g_malloc0 (size * sizeof (struct mmsghdr));
+	batch->iovs = g_malloc0 (size * sizeof (struct iovec));
+#endif
+}
 
-	/* Got some data */
-	if (what == EV_READ) {
-		while ((r = recvfrom (fd, buf, sizeof (buf), 0,
-			&session.addr.addr.sa, &session.addr.slen)) == -1) {
-			if (errno == EINTR) {
-				continue;
-			}
+static void
+rspamd_fuzzy_free_batch (struct fuzzy_batch *batch)
+{
+	g_free (batch->bufs);
+	g_free (batch->sessions);
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+	g_free (batch->msgs);
+	g_free (batch->iovs);
+#endif
+}
+
+/*
+ * Read up to batch size datagrams without blocking
+ */
+static gint
+rspamd_fuzzy_recv_batch (gint fd, struct fuzzy_batch *batch)
+{
+	struct fuzzy_session *session;
+	gint r, i;
+
+#ifdef HAVE_RECVMMSG
+	for (i = 0; i < (gint)batch->size; i ++) {
+		session = &batch->sessions[i];
+		session->addr.slen = sizeof (session->addr.addr);
+		batch->iovs[i].iov_base = batch->bufs + i * MAX_DATAGRAM;
+		batch->iovs[i].iov_len = MAX_DATAGRAM;
+		memset (&batch->msgs[i], 0, sizeof (batch->msgs[i]));
+		batch->msgs[i].msg_hdr.msg_name = &session->addr.addr.sa;
+		batch->msgs[i].msg_hdr.msg_namelen = session->addr.slen;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while ((r = recvmmsg (fd, batch->msgs, batch->size, MSG_DONTWAIT,
+			NULL)) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
 			msg_err ("got error while reading from socket: %d, %s",
 				errno,
 				strerror (errno));
-			return;
 		}
-		session.addr.af = session.addr.addr.sa.sa_family;
-		if ((guint)r == sizeof (struct legacy_fuzzy_cmd)) {
-			session.legacy = TRUE;
-			l = (struct legacy_fuzzy_cmd *)buf;
-			lcmd.version = 2;
-			memcpy (lcmd.digest, l->hash, sizeof (lcmd.digest));
-			lcmd.cmd = l->cmd;
-			lcmd.flag = l->flag;
-			lcmd.shingles_count = 0;
-			lcmd.value = l->value;
-			lcmd.tag = 0;
-			cmd = &lcmd;
+		return 0;
+	}
+
+	for (i = 0; i < r; i ++) {
+		batch->sessions[i].addr.slen = batch->msgs[i].msg_hdr.msg_namelen;
+		batch->sessions[i].len = batch->msgs[i].msg_len;
+	}
+#else
+	for (i = 0; i < (gint)batch->size; i ++) {
+		session = &batch->sessions[i];
+		session->addr.slen = sizeof (session->addr.addr);
+
+		r = recvfrom (fd, batch->bufs + i * MAX_DATAGRAM, MAX_DATAGRAM,
+				MSG_DONTWAIT, &session->addr.addr.sa, &session->addr.slen);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				i --;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				msg_err ("got error while reading from socket: %d, %s",
+					errno,
+					strerror (errno));
+			}
+			break;
+		}
+
+		session->len = r;
+	}
+	r = i;
+#endif
+
+	return r;
+}
+
+/*
+ * Wait for the socket buffer to be drained, returns FALSE if it is still
+ * full after a short timeout
+ */
+static gboolean
+rspamd_fuzzy_wait_writable (gint fd)
+{
+	return rspamd_socket_poll (fd, FUZZY_SEND_TIMEOUT, POLLOUT) > 0;
+}
+
+static void
+rspamd_fuzzy_send_batch (gint fd, struct fuzzy_batch *batch, gint nrecv)
+{
+	struct fuzzy_session *session;
+	gint i, r;
+#ifdef HAVE_SENDMMSG
+	gint nsend = 0, sent = 0;
+
+	for (i = 0; i < nrecv; i ++) {
+		session = &batch->sessions[i];
+
+		if (session->reply_len > 0) {
+			batch->iovs[nsend].iov_base = &session->reply;
+			batch->iovs[nsend].iov_len = session->reply_len;
+			memset (&batch->msgs[nsend], 0, sizeof (batch->msgs[nsend]));
+			batch->msgs[nsend].msg_hdr.msg_name = &session->addr.addr.sa;
+			batch->msgs[nsend].msg_hdr.msg_namelen = session->addr.slen;
+			batch->msgs[nsend].msg_hdr.msg_iov = &batch->iovs[nsend];
+			batch->msgs[nsend].msg_hdr.msg_iovlen = 1;
+			nsend ++;
 		}
-		else if ((guint)r >= sizeof (struct rspamd_fuzzy_cmd)) {
-			/* Check shingles count sanity */
-			session.legacy = FALSE;
-			cmd = (struct rspamd_fuzzy_cmd *)buf;
-			if (!rspamd_fuzzy_command_valid (cmd, r)) {
-				/* Bad input */
-				msg_debug ("invalid fuzzy command of size %d received", r);
+	}
+
+	while (sent < nsend) {
+		r = sendmmsg (fd, batch->msgs + sent, nsend - sent, 0);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+					rspamd_fuzzy_wait_writable (fd)) {
+				continue;
 			}
+			msg_err ("error while writing reply: %s", strerror (errno));
+			/* Skip the failed datagram */
+			r = 1;
 		}
-		else {
-			/* Discard input */
-			msg_debug ("invalid fuzzy command of size %d received", r);
+		sent += r;
+	}
+#else
+	for (i = 0; i < nrecv; i ++) {
+		session = &batch->sessions[i];
+
+		if (session->reply_len > 0) {
+			while ((r = sendto (fd, &session->reply, session->reply_len, 0,
+					&session->addr.addr.sa, session->addr.slen)) == -1 &&
+					(errno == EINTR ||
+					((errno == EAGAIN || errno == EWOULDBLOCK) &&
+					rspamd_fuzzy_wait_writable (fd))));
+
+			if (r == -1) {
+				msg_err ("error while writing reply: %s", strerror (errno));
+			}
 		}
-		if (cmd != NULL) {
-			session.cmd = cmd;
-			rspamd_fuzzy_process_command (&session);
+	}
+#endif
+}
+
+static void
+rspamd_fuzzy_process_batch (struct fuzzy_thread *thr, gint fd)
+{
+	struct fuzzy_session *session;
+	gint r, i;
+	guint64 now;
+
+	r = rspamd_fuzzy_recv_batch (fd, &thr->batch);
+
+	if (r <= 0) {
+		return;
+	}
+
+	now = (guint64)time (NULL);
+
+	for (i = 0; i < r; i ++) {
+		session = &thr->batch.sessions[i];
+		session->worker = thr->worker;
+		session->ctx = thr->ctx;
+		session->backend = thr->backend;
+		session->time = now;
+		rspamd_fuzzy_handle_datagram (session,
+				thr->batch.bufs + i * MAX_DATAGRAM);
+	}
+
+	rspamd_fuzzy_send_batch (fd, &thr->batch, r);
+}
+
+/*
+ * Accept new datagrams in the main thread
+ */
+static void
+accept_fuzzy_socket (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+
+	ctx = worker->ctx;
+
+	/* Got some data */
+	if (what == EV_READ) {
+		rspamd_fuzzy_process_batch (ctx->main_thread, fd);
+	}
+}
+
+static void
+accept_fuzzy_socket_thread (gint fd, short what, void *arg)
+{
+	struct fuzzy_thread *thr = (struct fuzzy_thread *)arg;
+
+	if (what == EV_READ) {
+		rspamd_fuzzy_process_batch (thr, fd);
+	}
+}
+
+/*
+ * Create another socket bound to the same address as fd, so the kernel
+ * could distribute datagrams between threads. The shared socket is bound
+ * by the main process with SO_REUSEPORT as requested by fuzzy_worker
+ */
+static gint
+rspamd_fuzzy_reuseport_socket (gint fd)
+{
+#ifdef SO_REUSEPORT
+	rspamd_inet_addr_t addr;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.slen = sizeof (addr.addr);
+
+	if (getsockname (fd, &addr.addr.sa, &addr.slen) == -1) {
+		return -1;
+	}
+
+	addr.af = addr.addr.sa.sa_family;
+
+	return rspamd_inet_address_listen (&addr, SOCK_DGRAM, TRUE, TRUE);
+#else
+	return -1;
+#endif
+}
+
+static void
+rspamd_fuzzy_thread_term (gint fd, short what, gpointer arg)
+{
+	struct fuzzy_thread *thr = (struct fuzzy_thread *)arg;
+
+	event_base_loopbreak (thr->ev_base);
+}
+
+static gpointer
+rspamd_fuzzy_thread_func (gpointer data)
+{
+	struct fuzzy_thread *thr = data;
+	sigset_t sigmask;
+
+	/* Signals are handled by the main thread */
+	sigfillset (&sigmask);
+	pthread_sigmask (SIG_BLOCK, &sigmask, NULL);
+
+	event_base_loop (thr->ev_base, 0);
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_free_thread (struct fuzzy_thread *thr)
+{
+	struct event *ev;
+	GList *cur;
+
+	cur = thr->events;
+	while (cur) {
+		ev = cur->data;
+		event_del (ev);
+		g_slice_free1 (sizeof (struct event), ev);
+		cur = g_list_next (cur);
+	}
+	g_list_free (thr->events);
+
+	cur = thr->socks;
+	while (cur) {
+		close (GPOINTER_TO_INT (cur->data));
+		cur = g_list_next (cur);
+	}
+	g_list_free (thr->socks);
+
+	if (thr->term_pipe[0] != -1) {
+		event_del (&thr->term_ev);
+		close (thr->term_pipe[0]);
+		close (thr->term_pipe[1]);
+	}
+
+	if (thr->ev_base) {
+		event_base_free (thr->ev_base);
+	}
+
+	rspamd_fuzzy_free_batch (&thr->batch);
+	rspamd_fuzzy_backend_close (thr->backend);
+	g_free (thr);
+}
+
+static gboolean
+rspamd_fuzzy_start_thread (struct rspamd_worker *worker,
+		struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_thread *thr;
+	struct event *ev;
+	GList *cur;
+	GError *err = NULL;
+	gint fd, nfd;
+
+	thr = g_malloc0 (sizeof (*thr));
+	thr->worker = worker;
+	thr->ctx = ctx;
+	thr->term_pipe[0] = -1;
+	thr->term_pipe[1] = -1;
+
+	if ((thr->backend = rspamd_fuzzy_backend_open_ro (ctx->backend,
+			&err)) == NULL) {
+		msg_err ("cannot open read only backend: %s", err->message);
+		g_error_free (err);
+		g_free (thr);
+
+		return FALSE;
+	}
+
+	rspamd_fuzzy_init_batch (&thr->batch, ctx->batch);
+	thr->ev_base = event_base_new ();
+
+	if (pipe (thr->term_pipe) == -1) {
+		msg_err ("cannot create pipe: %s", strerror (errno));
+		thr->term_pipe[0] = -1;
+		rspamd_fuzzy_free_thread (thr);
+
+		return FALSE;
+	}
+
+	event_set (&thr->term_ev, thr->term_pipe[0], EV_READ,
+		rspamd_fuzzy_thread_term, thr);
+	event_base_set (thr->ev_base, &thr->term_ev);
+	event_add (&thr->term_ev, NULL);
+
+	cur = worker->cf->listen_socks;
+	while (cur) {
+		fd = GPOINTER_TO_INT (cur->data);
+		if (fd != -1) {
+			/* Fallback to the shared socket if reuseport is not available */
+			nfd = rspamd_fuzzy_reuseport_socket (fd);
+
+			if (nfd != -1) {
+				thr->socks = g_list_prepend (thr->socks, GINT_TO_POINTER (nfd));
+			}
+
+			ev = g_slice_alloc0 (sizeof (struct event));
+			event_set (ev, nfd != -1 ? nfd : fd, EV_READ | EV_PERSIST,
+				accept_fuzzy_socket_thread, thr);
+			event_base_set (thr->ev_base, ev);
+			event_add (ev, NULL);
+			thr->events = g_list_prepend (thr->events, ev);
 		}
+		cur = g_list_next (cur);
 	}
+
+	thr->thread = rspamd_create_thread ("fuzzy", rspamd_fuzzy_thread_func, thr,
+			&err);
+
+	if (thr->thread == NULL) {
+		msg_err ("cannot create fuzzy thread: %s", err->message);
+		g_error_free (err);
+		rspamd_fuzzy_free_thread (thr);
+
+		return FALSE;
+	}
+
+	ctx->threads_list = g_list_prepend (ctx->threads_list, thr);
+
+	return TRUE;
+}
+
+/*
+ * Stop processing threads and wait for them to finish, so their read only
+ * handles are closed before the main backend
+ */
+static void
+rspamd_fuzzy_stop_threads (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_thread *thr;
+	GList *cur;
+	gchar c = '\0';
+
+	cur = ctx->threads_list;
+	while (cur) {
+		thr = cur->data;
+
+		if (write (thr->term_pipe[1], &c, 1) == -1) {
+			msg_err ("cannot stop fuzzy thread: %s", strerror (errno));
+		}
+		g_thread_join (thr->thread);
+		rspamd_fuzzy_free_thread (thr);
+		cur = g_list_next (cur);
+	}
+
+	g_list_free (ctx->threads_list);
+	ctx->threads_list = NULL;
 }
 
 static void
@@ -329,9 +781,37 @@ sync_callback (gint fd, short what, void *arg)
 	evtimer_add (&tev, &tmv);
 
 	/* Call backend sync */
+	if (ctx->backend_mtx) {
+		rspamd_mutex_lock (ctx->backend_mtx);
+	}
 	rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire);
 
 	server_stat->fuzzy_hashes_expired = rspamd_fuzzy_backend_expired (ctx->backend);
+	if (ctx->backend_mtx) {
+		rspamd_mutex_unlock (ctx->backend_mtx);
+	}
+}
+
+static void
+flush_callback (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+
+	ctx = worker->ctx;
+	evtimer_add (&flush_ev, &flush_tv);
+
+	if (ctx->backend_mtx) {
+		rspamd_mutex_lock (ctx->backend_mtx);
+	}
+	if (!rspamd_fuzzy_backend_flush (ctx->backend)) {
+		msg_err ("cannot write queued fuzzy updates");
+	}
+
+	server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+	if (ctx->backend_mtx) {
+		rspamd_mutex_unlock (ctx->backend_mtx);
+	}
 }
 
 gpointer
@@ -346,6 +826,9 @@ init_fuzzy (struct rspamd_config *cfg)
 
 	ctx->max_mods = DEFAULT_MOD_LIMIT;
 	ctx->expire = DEFAULT_EXPIRE;
+	ctx->batch = DEFAULT_BATCH;
+	ctx->updates_max = DEFAULT_UPDATES_MAX;
+	ctx->updates_timeout = DEFAULT_UPDATES_TIMEOUT;
 
 	rspamd_rcl_register_worker_option (cfg, type, "hashfile",
 		rspamd_rcl_parse_struct_string, ctx,
@@ -384,6 +867,30 @@ init_fuzzy (struct rspamd_config *cfg)
 		rspamd_rcl_parse_struct_string, ctx,
 		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, update_map), 0);
 
+	rspamd_rcl_register_worker_option (cfg, type, "threads",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		threads), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "memory_index",
+		rspamd_rcl_parse_struct_boolean, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		memory_index), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "batch",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		batch), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "updates_max",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		updates_max), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "updates_timeout",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		updates_timeout), RSPAMD_CL_FLAG_TIME_FLOAT);
 
 	return ctx;
 }
@@ -427,6 +934,43 @@ start_fuzzy (struct rspamd_worker *worker)
 
 	server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
 
+	if (ctx->memory_index) {
+		if (!rspamd_fuzzy_backend_preload (ctx->backend, &err)) {
+			msg_err ("cannot load memory index: %s", err->message);
+			g_error_free (err);
+			err = NULL;
+		}
+	}
+
+	if (ctx->updates_max > 0) {
+		/* Updates are written by flush_callback or when queue is full */
+		rspamd_fuzzy_backend_write_behind (ctx->backend, ctx->updates_max);
+	}
+
+	if (ctx->batch == 0) {
+		ctx->batch = 1;
+	}
+	ctx->main_thread = g_malloc0 (sizeof (struct fuzzy_thread));
+	ctx->main_thread->worker = worker;
+	ctx->main_thread->ctx = ctx;
+	ctx->main_thread->backend = ctx->backend;
+	ctx->main_thread->ev_base = ctx->ev_base;
+	rspamd_fuzzy_init_batch (&ctx->main_thread->batch, ctx->batch);
+
+	if (ctx->threads > 0) {
+		guint i;
+
+		ctx->backend_mtx = rspamd_mutex_new ();
+		/* Make changes visible for read only handles */
+		rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire);
+
+		for (i = 0; i < ctx->threads; i ++) {
+			if (!rspamd_fuzzy_start_thread (worker, ctx)) {
+				break;
+			}
+		}
+	}
+
 	/* Timer event */
 	evtimer_set (&tev, sync_callback, worker);
 	event_base_set (ctx->ev_base, &tev);
@@ -435,6 +979,13 @@ start_fuzzy (struct rspamd_worker *worker)
 	tmv.tv_usec = 0;
 	evtimer_add (&tev, &tmv);
 
+	if (ctx->updates_max > 0 && ctx->updates_timeout > 0) {
+		evtimer_set (&flush_ev, flush_callback, worker);
+		event_base_set (ctx->ev_base, &flush_ev);
+		double_to_tv (ctx->updates_timeout, &flush_tv);
+		evtimer_add (&flush_ev, &flush_tv);
+	}
+
 	/* Create radix tree */
 	if (ctx->update_map != NULL) {
 		if (!rspamd_map_add (worker->srv->cfg, ctx->update_map,
@@ -453,6 +1004,7 @@ start_fuzzy (struct rspamd_worker *worker)
 
 	event_base_loop (ctx->ev_base, 0);
 
+	rspamd_fuzzy_stop_threads (ctx);
 	rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire);
 	rspamd_fuzzy_backend_close (ctx->backend);
 	rspamd_log_close (rspamd_main->logger);
@@ -0,0 +1,339 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "hash.h"
+#include "charset.h"
+
+#include <iconv.h>
+
+#define UTF8_CHARSET "UTF-8"
+/* Number of iconv descriptors kept open */
+#define ICONV_CACHE_SIZE 32
+
+struct rspamd_charset_table {
+	const gchar *name;              /**< lowercased name without separators */
+	const guint16 *table;           /**< codepoints of 0x80-0xff, NULL for latin1 */
+};
+
+struct rspamd_iconv_elt {
+	iconv_t cd;
+};
+
+static rspamd_lru_hash_t *iconv_cache = NULL;
+
+static const guint16 rspamd_charset_cp1251[128] = {
+	0x0402, 0x0403, 0x201A, 0x0453, 0x201E, 0x2026, 0x2020, 0x2021,
+	0x20AC, 0x2030, 0x0409, 0x2039, 0x040A, 0x040C, 0x040B, 0x040F,
+	0x0452, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+	0x003F, 0x2122, 0x0459, 0x203A, 0x045A, 0x045C, 0x045B, 0x045F,
+	0x00A0, 0x040E, 0x045E, 0x0408, 0x00A4, 0x0490, 0x00A6, 0x00A7,
+	0x0401, 0x00A9, 0x0404, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x0407,
+	0x00B0, 0x00B1, 0x0406, 0x0456, 0x0491, 0x00B5, 0x00B6, 0x00B7,
+	0x0451, 0x2116, 0x0454, 0x00BB, 0x0458, 0x0405, 0x0455, 0x0457,
+	0x0410, 0x0411, 0x0412, 0x0413, 0x0414, 0x0415, 0x0416, 0x0417,
+	0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E, 0x041F,
+	0x0420, 0x0421, 0x0422, 0x0423, 0x0424, 0x0425, 0x0426, 0x0427,
+	0x0428, 0x0429, 0x042A, 0x042B, 0x042C, 0x042D, 0x042E, 0x042F,
+	0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+	0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,
+	0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+	0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F
+};
+
+static const guint16 rspamd_charset_koi8r[128] = {
+	0x2500, 0x2502, 0x250C, 0x2510, 0x2514, 0x2518, 0x251C, 0x2524,
+	0x252C, 0x2534, 0x253C, 0x2580, 0x2584, 0x2588, 0x258C, 0x2590,
+	0x2591, 0x2592, 0x2593, 0x2320, 0x25A0, 0x2219, 0x221A, 0x2248,
+	0x2264, 0x2265, 0x00A0, 0x2321, 0x00B0, 0x00B2, 0x00B7, 0x00F7,
+	0x2550, 0x2551, 0x2552, 0x0451, 0x2553, 0x2554, 0x2555, 0x2556,
+	0x2557, 0x2558, 0x2559, 0x255A, 0x255B, 0x255C, 0x255D, 0x255E,
+	0x255F, 0x2560, 0x2561, 0x0401, 0x2562, 0x2563, 0x2564, 0x2565,
+	0x2566, 0x2567, 0x2568, 0x2569, 0x256A, 0x256B, 0x256C, 0x00A9,
+	0x044E, 0x0430, 0x0431, 0x0446, 0x0434, 0x0435, 0x0444, 0x0433,
+	0x0445, 0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E,
+	0x043F, 0x044F, 0x0440, 0x0441, 0x0442, 0x0443, 0x0436, 0x0432,
+	0x044C, 0x044B, 0x0437, 0x0448, 0x044D, 0x0449, 0x0447, 0x044A,
+	0x042E, 0x0410, 0x0411, 0x0426, 0x0414, 0x0415, 0x0424, 0x0413,
+	0x0425, 0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E,
+	0x041F, 0x042F, 0x0420, 0x0421, 0x0422, 0x0423, 0x0416, 0x0412,
+	0x042C, 0x042B, 0x0417, 0x0428, 0x042D, 0x0429, 0x0427, 0x042A
+};
+
+static const guint16 rspamd_charset_cp1252[128] = {
+	0x20AC, 0x003F, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+	0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x003F, 0x017D, 0x003F,
+	0x003F, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+	0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x003F, 0x017E, 0x0178,
+	0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+	0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+	0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+	0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+	0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+	0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+	0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+	0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+	0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+	0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+	0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+	0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF
+};
+
+static const struct rspamd_charset_table charset_tables[] = {
+	{"iso88591", NULL},
+	{"windows1251", rspamd_charset_cp1251},
+	{"koi8r", rspamd_charset_koi8r},
+	{"windows1252", rspamd_charset_cp1252},
+};
+
+/* Common aliases are folded to the same name, see rspamd_charset_normalize */
+static const struct rspamd_charset_alias {
+	const gchar *alias;
+	const gchar *name;
+} charset_aliases[] = {
+	{"latin1", "iso88591"},
+	{"l1", "iso88591"},
+	{"latin2", "iso88592"},
+	{"l2", "iso88592"},
+	{"cyrillic", "iso88595"},
+	{"latin9", "iso885915"},
+	{"ascii", "usascii"},
+	{"sjis", "shiftjis"},
+	{"xsjis", "shiftjis"},
+};
+
+static GQuark
+converter_error_quark (void)
+{
+	return g_quark_from_static_string ("conversion error");
+}
+
+/*
+ * Lowercase charset name, strip separators and fold aliases, so
+ * "Windows-1251", "CP1251" and "win1251" have the same name
+ */
+static gboolean
+rspamd_charset_normalize (const gchar *in_enc, gchar *name, gsize size)
+{
+	guint i, nlen = 0;
+
+	for (; *in_enc != '\0'; in_enc++) {
+		if (*in_enc == '-' || *in_enc == '_' || *in_enc == ' ') {
+			continue;
+		}
+		if (nlen == size - 1) {
+			return FALSE;
+		}
+		name[nlen++] = g_ascii_tolower (*in_enc);
+	}
+
+	name[nlen] = '\0';
+
+	/* cp125x and win125x are windows125x */
+	if ((nlen == 6 && memcmp (name, "cp125", 5) == 0) ||
+			(nlen == 7 && memcmp (name, "win125", 6) == 0)) {
+		rspamd_snprintf (name, size, "windows125%c", name[nlen - 1]);
+		return TRUE;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (charset_aliases); i++) {
+		if (strcmp (name, charset_aliases[i].alias) == 0) {
+			rspamd_strlcpy (name, charset_aliases[i].name, size);
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+static const struct rspamd_charset_table *
+rspamd_charset_find_table (const gchar *in_enc)
+{
+	gchar name[32];
+	guint i;
+
+	if (!rspamd_charset_normalize (in_enc, name, sizeof (name))) {
+		return NULL;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (charset_tables); i++) {
+		if (strcmp (name, charset_tables[i].name) == 0) {
+			return &charset_tables[i];
+		}
+	}
+
+	return NULL;
+}
+
+static gchar *
+rspamd_charset_convert_table (rspamd_mempool_t *pool,
+	const struct rspamd_charset_table *tbl,
+	const guchar *input, gsize len, gsize *olen)
+{
+	const guchar *p = input, *end = input + len;
+	guchar *res, *d;
+	guint16 uc;
+
+	/* Single byte charsets have only BMP characters */
+	res = rspamd_mempool_alloc (pool, len * 3 + 1);
+	d = res;
+
+	while (p < end) {
+		if (*p < 0x80) {
+			*d++ = *p++;
+			continue;
+		}
+
+		uc = tbl->table != NULL ? tbl->table[*p - 0x80] : *p;
+		p++;
+
+		if (uc < 0x80) {
+			/* Undefined characters are replaced with '?' */
+			*d++ = uc;
+		}
+		else if (uc < 0x800) {
+			*d++ = 0xc0 | (uc >> 6);
+			*d++ = 0x80 | (uc & 0x3f);
+		}
+		else {
+			*d++ = 0xe0 | (uc >> 12);
+			*d++ = 0x80 | ((uc >> 6) & 0x3f);
+			*d++ = 0x80 | (uc & 0x3f);
+		}
+	}
+
+	*d = '\0';
+	*olen = d - res;
+
+	return (gchar *)res;
+}
+
+static void
+rspamd_iconv_elt_dtor (gpointer p)
+{
+	struct rspamd_iconv_elt *elt = p;
+
+	iconv_close (elt->cd);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+static iconv_t
+rspamd_charset_get_iconv (const gchar *in_enc)
+{
+	struct rspamd_iconv_elt *elt;
+	gchar name[32];
+	const gchar *key = name;
+	iconv_t cd;
+
+	if (iconv_cache == NULL) {
+		iconv_cache = rspamd_lru_hash_new (ICONV_CACHE_SIZE, -1, g_free,
+				rspamd_iconv_elt_dtor);
+	}
+
+	/* All spellings of a charset share the same converter */
+	if (!rspamd_charset_normalize (in_enc, name, sizeof (name))) {
+		key = in_enc;
+	}
+
+	elt = rspamd_lru_hash_lookup (iconv_cache, (gpointer)key, 0);
+
+	if (elt != NULL) {
+		/* Reset shift state left by a previous conversion */
+		iconv (elt->cd, NULL, NULL, NULL, NULL);
+		return elt->cd;
+	}
+
+	cd = iconv_open (UTF8_CHARSET, in_enc);
+
+	if (cd != (iconv_t)-1) {
+		elt = g_slice_alloc (sizeof (*elt));
+		elt->cd = cd;
+		rspamd_lru_hash_insert (iconv_cache, g_strdup (key), elt, 0, 0);
+	}
+
+	return cd;
+}
+
+gchar *
+rspamd_mime_text_to_utf8 (rspamd_mempool_t *pool,
+		gchar *input, gsize len, const gchar *in_enc,
+		gsize *olen, GError **err)
+{
+	const struct rspamd_charset_table *tbl;
+	gchar *res, *s, *d;
+	gsize outlen;
+	iconv_t ic;
+	gsize processed, ret;
+
+	if ((tbl = rspamd_charset_find_table (in_enc)) != NULL) {
+		return rspamd_charset_convert_table (pool, tbl, input, len, olen);
+	}
+
+	ic = rspamd_charset_get_iconv (in_enc);
+
+	if (ic == (iconv_t)-1) {
+		g_set_error (err, converter_error_quark(), EINVAL,
+				"cannot open iconv for: %s", in_enc);
+		return NULL;
+	}
+
+	/* For the most of charsets utf8 notation is larger than native one */
+	outlen = len * 2 + 1;
+
+	res = rspamd_mempool_alloc (pool, outlen);
+	s = input;
+	d = res;
+	processed = outlen - 1;
+
+	while (len > 0 && processed > 0) {
+		ret = iconv (ic, &s, &len, &d, &processed);
+		if (ret == (gsize)-1) {
+			switch (errno) {
+			case E2BIG:
+				g_set_error (err, converter_error_quark(), EINVAL,
+						"output of size %zd is not enough to handle "
+						"converison of %zd bytes", outlen, len);
+				return NULL;
+			case EILSEQ:
+			case EINVAL:
+				/* Ignore bad characters */
+				if (processed > 0 && len > 0) {
+					*d++ = '?';
+					s++;
+					len --;
+					processed --;
+				}
+				break;
+			}
+		}
+		else if (ret == 0) {
+			break;
+		}
+	}
+
+	*d = '\0';
+	*olen = d - res;
+
+	return res;
+}
@@ -0,0 +1,50 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file charset.h
+ * Conversion of text parts to utf8
+ */
+
+#ifndef RSPAMD_CHARSET_H
+#define RSPAMD_CHARSET_H
+
+#include "config.h"
+#include "mem_pool.h"
+
+/**
+ * Convert text to utf8. Common single byte charsets are converted by tables,
+ * iconv descriptors for other charsets are cached per process.
+ * @param pool memory pool for the result
+ * @param input input text
+ * @param len length of input
+ * @param in_enc charset of input
+ * @param olen length of output
+ * @param err error
+ * @return NUL terminated utf8 text or NULL if charset is unknown
+ */
+gchar * rspamd_mime_text_to_utf8 (rspamd_mempool_t *pool,
+	gchar *input, gsize len, const gchar *in_enc,
+	gsize *olen, GError **err);
+
+#endif
@@ -637,6 +637,44 @@ parse_expression (rspamd_mempool_t * pool, gchar *line)
 	return expr;
 }
 
+/*
+ * Pools that parse regexps of the same config share a single ids counter that
+ * is bound by rspamd_regexp_share_ids, so ids of their regexps never collide.
+ * A pool without a bound counter numbers its regexps on its own
+ */
+static guint *
+rspamd_regexp_ids (rspamd_mempool_t *pool)
+{
+	guint *ids;
+
+	ids = rspamd_mempool_get_variable (pool, "re_max_id");
+
+	if (ids == NULL) {
+		ids = rspamd_mempool_alloc0 (pool, sizeof (guint));
+		rspamd_mempool_set_variable (pool, "re_max_id", ids, NULL);
+	}
+
+	return ids;
+}
+
+void
+rspamd_regexp_share_ids (rspamd_mempool_t *pool, guint *ids)
+{
+	rspamd_mempool_set_variable (pool, "re_max_id", ids, NULL);
+}
+
+static guint
+rspamd_regexp_next_id (rspamd_mempool_t *pool)
+{
+	guint *ids = rspamd_regexp_ids (pool);
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	return __sync_fetch_and_add (ids, 1);
+#else
+	return (*ids)++;
+#endif
+}
+
 /*
  * Rspamd regexp utility functions
  */
@@ -700,6 +738,7 @@ parse_regexp (rspamd_mempool_t * pool, const gchar *line, gboolean raw_mode)
 		/* Assume that line without // is just a header name */
 		result->header = rspamd_mempool_strdup (pool, line);
 		result->type = REGEXP_HEADER;
+		result->id = rspamd_regexp_next_id (pool);
 		return result;
 	}
 	else {
@@ -858,9 +897,23 @@ parse_regexp (rspamd_mempool_t * pool, const gchar *line, gboolean raw_mode)
 
 	/* Add to cache for further usage */
 	re_cache_add (result->regexp_text, result, pool);
+	result->id = rspamd_regexp_next_id (pool);
+
 	return result;
 }
 
+guint
+rspamd_regexp_max_id (rspamd_mempool_t *pool)
+{
+	guint *ids = rspamd_regexp_ids (pool);
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	return __sync_fetch_and_add (ids, 0);
+#else
+	return *ids;
+#endif
+}
+
 gboolean
 call_expression_function (struct expression_function * func,
 	struct rspamd_task * task,
@@ -1071,8 +1124,6 @@ rspamd_parts_distance (struct rspamd_task * task, GList * args, void *unused)
 	struct mime_text_part *p1, *p2;
 	GList *cur;
 	struct expression_argument *arg;
-	GMimeObject *parent;
-	const GMimeContentType *ct;
 	gint *pdiff;
 
 	if (args == NULL) {
@@ -1138,16 +1189,7 @@ rspamd_parts_distance (struct rspamd_task * task, GList * args, void *unused)
 		p2 = cur->data;
 		/* First of all check parent object */
 		if (p1->parent && p1->parent == p2->parent) {
-			parent = p1->parent;
-			ct = g_mime_object_get_content_type (parent);
-#ifndef GMIME24
-			if (ct == NULL ||
-				!g_mime_content_type_is_type (ct, "multipart", "alternative")) {
-#else
-			if (ct == NULL ||
-				!g_mime_content_type_is_type ((GMimeContentType *)ct,
-				"multipart", "alternative")) {
-#endif
+			if (g_ascii_strcasecmp (p1->parent->subtype, "alternative") != 0) {
 				debug_task (
 					"two parts are not belong to multipart/alternative container, skip check");
 				rspamd_mempool_set_variable (task->task_pool,
@@ -1415,6 +1457,10 @@ rspamd_is_recipients_sorted (struct rspamd_task * task,
 	GList * args,
 	void *unused)
 {
+	if (message_get_gmime (task) == NULL) {
+		return FALSE;
+	}
+
 	/* Check all types of addresses */
 	if (is_recipient_list_sorted (g_mime_message_get_recipients (task->message,
 		GMIME_RECIPIENT_TYPE_TO)) == TRUE) {
@@ -1462,6 +1508,10 @@ rspamd_compare_transfer_encoding (struct rspamd_task * task,
 		return FALSE;
 	}
 
+	if (message_get_gmime (task) == NULL) {
+		return FALSE;
+	}
+
 	part = g_mime_message_get_mime_part (task->message);
 	if (part) {
 		if (GMIME_IS_PART (part)) {
@@ -112,6 +112,21 @@ void * re_cache_check (const gchar *line, rspamd_mempool_t *pool);
  */
 void re_cache_del (const gchar *line, rspamd_mempool_t *pool);
 
+/**
+ * Returns number of regexps parsed from a pool so far, all ids of these
+ * regexps are less than this value
+ * @param pool pool of config
+ */
+guint rspamd_regexp_max_id (rspamd_mempool_t *pool);
+
+/**
+ * Make regexps parsed from a pool take their ids from the specified counter,
+ * all pools of a config should share the counter of this config
+ * @param pool pool to parse regexps from
+ * @param ids counter that lives at least as long as the pool
+ */
+void rspamd_regexp_share_ids (rspamd_mempool_t *pool, guint *ids);
+
 /**
  * Add regexp to regexp task cache
  * @param task task object
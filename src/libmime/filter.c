@@ -652,9 +652,6 @@ rspamd_process_statistics (struct rspamd_task *task)
 
 	/* TODO: handle err here */
 	rspamd_stat_classify (task, task->cfg->lua_state, NULL);
-
-	/* Process results */
-	rspamd_make_composites (task);
 }
 
 void
@@ -693,6 +690,10 @@ insert_metric_header (gpointer metric_name, gpointer metric_value,
 		"X-Spam-%s",
 		metric_res->metric->name);
 
+	if (message_get_gmime (task) == NULL) {
+		return;
+	}
+
 	if (!check_metric_settings (task, metric_res->metric, &ms)) {
 		ms = metric_res->metric->actions[METRIC_ACTION_REJECT].score;
 	}
@@ -96,7 +96,8 @@ struct metric_result * rspamd_create_metric_result (struct rspamd_task *task,
 gint rspamd_process_filters (struct rspamd_task *task);
 
 /**
- * Process message with statfiles
+ * Process message with statfiles, statfiles may be loaded by events of the
+ * task's session, so composites should be processed when they are finished
  * @param task worker's task that present message from user
  */
 void rspamd_process_statistics (struct rspamd_task *task);
@@ -45,7 +45,7 @@ process_images (struct rspamd_task *task)
 	while (cur) {
 		part = cur->data;
 		if (g_mime_content_type_is_type (part->type, "image",
-			"*") && part->content->len > 0) {
+			"*") && mime_part_get_content (part)->len > 0) {
 			process_image (task, part);
 		}
 		cur = g_list_next (cur);
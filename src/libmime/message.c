@@ -31,11 +31,9 @@
 #include "images.h"
 #include "utlist.h"
 #include "tokenizers/tokenizers.h"
-
-#include <iconv.h>
+#include "charset.h"
 
 #define RECURSION_LIMIT 30
-#define UTF8_CHARSET "UTF-8"
 
 GByteArray *
 strip_html_tags (struct rspamd_task *task,
@@ -889,73 +887,6 @@ charset_validate (rspamd_mempool_t *pool, const gchar *in, gchar **out)
 	return TRUE;
 }
 
-static GQuark
-converter_error_quark (void)
-{
-	return g_quark_from_static_string ("conversion error");
-}
-
-static gchar *
-rspamd_text_to_utf8 (struct rspamd_task *task,
-		gchar *input, gsize len, const gchar *in_enc,
-		gsize *olen, GError **err)
-{
-	gchar *res, *s, *d;
-	gsize outlen;
-	iconv_t ic;
-	gsize processed, ret;
-
-	ic = iconv_open (UTF8_CHARSET, in_enc);
-
-	if (ic == (iconv_t)-1) {
-		g_set_error (err, converter_error_quark(), EINVAL,
-				"cannot open iconv for: %s", in_enc);
-		return NULL;
-	}
-
-	/* For the most of charsets utf8 notation is larger than native one */
-	outlen = len * 2 + 1;
-
-	res = rspamd_mempool_alloc (task->task_pool, outlen);
-	s = input;
-	d = res;
-	processed = outlen - 1;
-
-	while (len > 0 && processed > 0) {
-		ret = iconv (ic, &s, &len, &d, &processed);
-		if (ret == (gsize)-1) {
-			switch (errno) {
-			case E2BIG:
-				g_set_error (err, converter_error_quark(), EINVAL,
-						"output of size %zd is not enough to handle "
-						"converison of %zd bytes", outlen, len);
-				iconv_close (ic);
-				return NULL;
-			case EILSEQ:
-			case EINVAL:
-				/* Ignore bad characters */
-				if (processed > 0 && len > 0) {
-					*d++ = '?';
-					s++;
-					len --;
-					processed --;
-				}
-				break;
-			}
-		}
-		else if (ret == 0) {
-			break;
-		}
-	}
-
-	*d = '\0';
-	*olen = d - res;
-
-	iconv_close (ic);
-
-	return res;
-}
-
 static GByteArray *
 convert_text_to_utf (struct rspamd_task *task,
 	GByteArray * part_content,
@@ -987,7 +918,7 @@ convert_text_to_utf (struct rspamd_task *task,
 	}
 	if (g_ascii_strcasecmp (ocharset,
 		"utf-8") == 0 || g_ascii_strcasecmp (ocharset, "utf8") == 0) {
-		if (g_utf8_validate (part_content->data, part_content->len, NULL)) {
+		if (rspamd_fast_utf8_validate (part_content->data, part_content->len)) {
 			text_part->is_raw = FALSE;
 			text_part->is_utf = TRUE;
 			return part_content;
@@ -1001,7 +932,7 @@ convert_text_to_utf (struct rspamd_task *task,
 		}
 	}
 
-	res_str = rspamd_text_to_utf8 (task, part_content->data,
+	res_str = rspamd_mime_text_to_utf8 (task->task_pool, part_content->data,
 			part_content->len,
 			ocharset,
 			&write_bytes,
@@ -1025,147 +956,22 @@ convert_text_to_utf (struct rspamd_task *task,
 	return result_array;
 }
 
-struct language_match {
-	const char *code;
-	const char *name;
-	GUnicodeScript script;
-};
-
-static int
-language_elts_cmp (const void *a, const void *b)
-{
-	GUnicodeScript sc = *(const GUnicodeScript *)a;
-	const struct language_match *bb = (const struct language_match *)b;
-
-	return (sc - bb->script);
-}
-
 static void
-detect_text_language (struct mime_text_part *part)
+detect_text_language (struct rspamd_task *task, struct mime_text_part *part)
 {
-	/* Keep sorted */
-	static const struct language_match language_codes[] = {
-			{ "", "english", G_UNICODE_SCRIPT_COMMON },
-			{ "", "", G_UNICODE_SCRIPT_INHERITED },
-			{ "ar", "arabic", G_UNICODE_SCRIPT_ARABIC },
-			{ "hy", "armenian", G_UNICODE_SCRIPT_ARMENIAN },
-			{ "bn", "chineese", G_UNICODE_SCRIPT_BENGALI },
-			{ "", "", G_UNICODE_SCRIPT_BOPOMOFO },
-			{ "chr", "", G_UNICODE_SCRIPT_CHEROKEE },
-			{ "cop", "",  G_UNICODE_SCRIPT_COPTIC  },
-			{ "ru", "russian",  G_UNICODE_SCRIPT_CYRILLIC },
-			/* Deseret was used to write English */
-			{ "", "",  G_UNICODE_SCRIPT_DESERET },
-			{ "hi", "",  G_UNICODE_SCRIPT_DEVANAGARI },
-			{ "am", "",  G_UNICODE_SCRIPT_ETHIOPIC },
-			{ "ka", "",  G_UNICODE_SCRIPT_GEORGIAN },
-			{ "", "",  G_UNICODE_SCRIPT_GOTHIC },
-			{ "el", "greek",  G_UNICODE_SCRIPT_GREEK },
-			{ "gu", "",  G_UNICODE_SCRIPT_GUJARATI },
-			{ "pa", "",  G_UNICODE_SCRIPT_GURMUKHI },
-			{ "han", "chineese",  G_UNICODE_SCRIPT_HAN },
-			{ "ko", "",  G_UNICODE_SCRIPT_HANGUL },
-			{ "he", "hebrew",  G_UNICODE_SCRIPT_HEBREW },
-			{ "ja", "",  G_UNICODE_SCRIPT_HIRAGANA },
-			{ "kn", "",  G_UNICODE_SCRIPT_KANNADA },
-			{ "ja", "",  G_UNICODE_SCRIPT_KATAKANA },
-			{ "km", "",  G_UNICODE_SCRIPT_KHMER },
-			{ "lo", "",  G_UNICODE_SCRIPT_LAO },
-			{ "en", "english",  G_UNICODE_SCRIPT_LATIN },
-			{ "ml", "",  G_UNICODE_SCRIPT_MALAYALAM },
-			{ "mn", "",  G_UNICODE_SCRIPT_MONGOLIAN },
-			{ "my", "",  G_UNICODE_SCRIPT_MYANMAR },
-			/* Ogham was used to write old Irish */
-			{ "", "",  G_UNICODE_SCRIPT_OGHAM },
-			{ "", "",  G_UNICODE_SCRIPT_OLD_ITALIC },
-			{ "or", "",  G_UNICODE_SCRIPT_ORIYA },
-			{ "", "",  G_UNICODE_SCRIPT_RUNIC },
-			{ "si", "",  G_UNICODE_SCRIPT_SINHALA },
-			{ "syr", "",  G_UNICODE_SCRIPT_SYRIAC },
-			{ "ta", "",  G_UNICODE_SCRIPT_TAMIL },
-			{ "te", "",  G_UNICODE_SCRIPT_TELUGU },
-			{ "dv", "",  G_UNICODE_SCRIPT_THAANA },
-			{ "th", "",  G_UNICODE_SCRIPT_THAI },
-			{ "bo", "",  G_UNICODE_SCRIPT_TIBETAN },
-			{ "iu", "",  G_UNICODE_SCRIPT_CANADIAN_ABORIGINAL },
-			{ "", "",  G_UNICODE_SCRIPT_YI },
-			{ "tl", "",  G_UNICODE_SCRIPT_TAGALOG },
-			/* Phillipino languages/scripts */
-			{ "hnn", "",  G_UNICODE_SCRIPT_HANUNOO },
-			{ "bku", "",  G_UNICODE_SCRIPT_BUHID },
-			{ "tbw", "",  G_UNICODE_SCRIPT_TAGBANWA },
-
-			{ "", "",  G_UNICODE_SCRIPT_BRAILLE },
-			{ "", "",  G_UNICODE_SCRIPT_CYPRIOT },
-			{ "", "",  G_UNICODE_SCRIPT_LIMBU },
-			/* Used for Somali (so) in the past */
-			{ "", "",  G_UNICODE_SCRIPT_OSMANYA },
-			/* The Shavian alphabet was designed for English */
-			{ "", "",  G_UNICODE_SCRIPT_SHAVIAN },
-			{ "", "",  G_UNICODE_SCRIPT_LINEAR_B },
-			{ "", "",  G_UNICODE_SCRIPT_TAI_LE },
-			{ "uga", "",  G_UNICODE_SCRIPT_UGARITIC },
-			{ "", "",  G_UNICODE_SCRIPT_NEW_TAI_LUE },
-			{ "bug", "",  G_UNICODE_SCRIPT_BUGINESE },
-			{ "", "",  G_UNICODE_SCRIPT_GLAGOLITIC },
-			/* Used for for Berber (ber), but Arabic script is more common */
-			{ "", "",  G_UNICODE_SCRIPT_TIFINAGH },
-			{ "syl", "",  G_UNICODE_SCRIPT_SYLOTI_NAGRI },
-			{ "peo", "",  G_UNICODE_SCRIPT_OLD_PERSIAN },
-			{ "", "",  G_UNICODE_SCRIPT_KHAROSHTHI },
-			{ "", "",  G_UNICODE_SCRIPT_UNKNOWN },
-			{ "", "",  G_UNICODE_SCRIPT_BALINESE },
-			{ "", "",  G_UNICODE_SCRIPT_CUNEIFORM },
-			{ "", "",  G_UNICODE_SCRIPT_PHOENICIAN },
-			{ "", "",  G_UNICODE_SCRIPT_PHAGS_PA },
-			{ "nqo", "", G_UNICODE_SCRIPT_NKO }
-	};
-	const struct language_match *lm;
-	const int max_chars = 32;
-
-	if (part != NULL) {
-		if (part->is_utf) {
-			/* Try to detect encoding by several symbols */
-			const gchar *p, *pp;
-			gunichar c;
-			gint32 remain = part->content->len, max = 0, processed = 0;
-			gint32 scripts[G_N_ELEMENTS (language_codes)];
-			GUnicodeScript scc, sel = G_UNICODE_SCRIPT_COMMON;
-
-			p = part->content->data;
-			memset (scripts, 0, sizeof (scripts));
-
-			while (remain > 0 && processed < max_chars) {
-				c = g_utf8_get_char_validated (p, remain);
-				if (c == (gunichar) -2 || c == (gunichar) -1) {
-					break;
-				}
-				if (g_unichar_isalpha (c)) {
-					scc = g_unichar_get_script (c);
-					if (scc < (gint)G_N_ELEMENTS (scripts)) {
-						scripts[scc]++;
-					}
-					processed ++;
-				}
-				pp = g_utf8_next_char (p);
-				remain -= pp - p;
-				p = pp;
-			}
-			for (remain = 0; remain < (gint)G_N_ELEMENTS (scripts); remain++) {
-				if (scripts[remain] > max) {
-					max = scripts[remain];
-					sel = remain;
-				}
-			}
-			part->script = sel;
-			lm = bsearch (&sel, language_codes, G_N_ELEMENTS (language_codes),
-					sizeof (language_codes[0]), &language_elts_cmp);
+	GUnicodeScript sel = G_UNICODE_SCRIPT_COMMON;
 
-			if (lm != NULL) {
-				part->lang_code = lm->code;
-				part->language = lm->name;
-			}
+	if (part->is_utf) {
+		part->scripts = rspamd_scripts_detect (task->task_pool,
+				part->content->data, part->content->len,
+				task->cfg->lang_detection_sample, &part->nscripts);
+
+		if (part->scripts != NULL) {
+			sel = part->scripts[0].script;
 		}
+
+		part->script = sel;
+		rspamd_script_language (sel, &part->lang_code, &part->language);
 	}
 }
 
@@ -1173,32 +979,17 @@ static void
 process_text_part (struct rspamd_task *task,
 	GByteArray *part_content,
 	GMimeContentType *type,
-	GMimeObject *part,
-	GMimeObject *parent,
+	gboolean is_attachment,
+	struct rspamd_mime_desc *parent,
 	gboolean is_empty)
 {
 	struct mime_text_part *text_part;
-	const gchar *cd;
 
 	/* Skip attachements */
-#ifndef GMIME24
-	cd = g_mime_part_get_content_disposition (GMIME_PART (part));
-	if (cd &&
-		g_ascii_strcasecmp (cd,
-		"attachment") == 0 && !task->cfg->check_text_attachements) {
+	if (is_attachment && !task->cfg->check_text_attachements) {
 		debug_task ("skip attachments for checking as text parts");
 		return;
 	}
-#else
-	cd = g_mime_object_get_disposition (GMIME_OBJECT (part));
-	if (cd &&
-		g_ascii_strcasecmp (cd,
-		GMIME_DISPOSITION_ATTACHMENT) == 0 &&
-		!task->cfg->check_text_attachements) {
-		debug_task ("skip attachments for checking as text parts");
-		return;
-	}
-#endif
 
 	if (g_mime_content_type_is_type (type, "text",
 		"html") || g_mime_content_type_is_type (type, "text", "xhtml")) {
@@ -1269,12 +1060,39 @@ process_text_part (struct rspamd_task *task,
 	}
 
 	/* Post process part */
-	detect_text_language (text_part);
+	detect_text_language (task, text_part);
 	text_part->words = rspamd_tokenize_text (text_part->content->data,
 			text_part->content->len, text_part->is_utf, 4,
 			&text_part->urls_offset);
 }
 
+/* Create descriptor for a multipart container found by GMime */
+static struct rspamd_mime_desc *
+gmime_container_desc (struct rspamd_task *task, GMimeObject *part)
+{
+	struct rspamd_mime_desc *desc;
+	const GMimeContentType *ct;
+	gchar *type, *subtype;
+
+	desc = rspamd_mempool_alloc0 (task->task_pool, sizeof (*desc));
+	ct = g_mime_object_get_content_type (part);
+
+	if (ct != NULL && ct->type != NULL && ct->subtype != NULL) {
+		type = rspamd_mempool_strdup (task->task_pool, ct->type);
+		rspamd_str_lc (type, strlen (type));
+		subtype = rspamd_mempool_strdup (task->task_pool, ct->subtype);
+		rspamd_str_lc (subtype, strlen (subtype));
+		desc->type = type;
+		desc->subtype = subtype;
+	}
+	else {
+		desc->type = "multipart";
+		desc->subtype = "mixed";
+	}
+
+	return desc;
+}
+
 #ifdef GMIME24
 static void
 mime_foreach_callback (GMimeObject * parent,
@@ -1291,6 +1109,8 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 	GMimeDataWrapper *wrapper;
 	GMimeStream *part_stream;
 	GByteArray *part_content;
+	const gchar *cd;
+	gboolean is_attachment;
 
 	task->parts_count++;
 
@@ -1334,7 +1154,7 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 	}
 	else if (GMIME_IS_MULTIPART (part)) {
 		/* multipart/mixed, multipart/alternative, multipart/related, multipart/signed, multipart/encrypted, etc... */
-		task->parser_parent_part = part;
+		task->parser_parent_part = gmime_container_desc (task, part);
 #ifndef GMIME24
 		debug_task ("detected multipart part");
 		/* we'll get to finding out if this is a signed/encrypted multipart later... */
@@ -1386,8 +1206,11 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 				part_content = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (
 							part_stream));
 				g_object_unref (part_stream);
+				rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t) free_byte_array_callback,
+					part_content);
 				mime_part =
-					rspamd_mempool_alloc (task->task_pool,
+					rspamd_mempool_alloc0 (task->task_pool,
 						sizeof (struct mime_part));
 
 				hdrs = g_mime_object_get_headers (GMIME_OBJECT (part));
@@ -1405,6 +1228,7 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 				mime_part->type = type;
 				mime_part->content = part_content;
 				mime_part->parent = task->parser_parent_part;
+				mime_part->pool = task->task_pool;
 				mime_part->filename = g_mime_part_get_filename (GMIME_PART (
 							part));
 
@@ -1412,11 +1236,20 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 					type->type,
 					type->subtype);
 				task->parts = g_list_prepend (task->parts, mime_part);
+#ifndef GMIME24
+				cd = g_mime_part_get_content_disposition (GMIME_PART (part));
+				is_attachment = cd && g_ascii_strcasecmp (cd,
+						"attachment") == 0;
+#else
+				cd = g_mime_object_get_disposition (GMIME_OBJECT (part));
+				is_attachment = cd && g_ascii_strcasecmp (cd,
+						GMIME_DISPOSITION_ATTACHMENT) == 0;
+#endif
 				/* Skip empty parts */
 				process_text_part (task,
 					part_content,
 					type,
-					part,
+					is_attachment,
 					task->parser_parent_part,
 					(part_content->len <= 0));
 			}
@@ -1448,21 +1281,13 @@ destroy_message (void *pointer)
 	g_object_unref (msg);
 }
 
-gint
-process_message (struct rspamd_task *task)
+static GMimeMessage *
+construct_gmime_message (struct rspamd_task *task)
 {
 	GMimeMessage *message;
 	GMimeParser *parser;
 	GMimeStream *stream;
 	GByteArray *tmp;
-	GList *first, *cur;
-	GMimePart *part;
-	GMimeDataWrapper *wrapper;
-	struct received_header *recv;
-	gchar *mid, *url_str, *p, *end, *url_end;
-	struct uri *subject_url;
-	gsize len;
-	gint rc;
 
 	tmp = rspamd_mempool_alloc (task->task_pool, sizeof (GByteArray));
 	tmp->data = task->msg->str;
@@ -1475,63 +1300,304 @@ process_message (struct rspamd_task *task)
 	 */
 	g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (stream), FALSE);
 
-	if (task->is_mime) {
+	debug_task ("construct mime parser from string length %d",
+		(gint)task->msg->len);
+	/* create a new parser object to parse the stream */
+	parser = g_mime_parser_new_with_stream (stream);
+	g_object_unref (stream);
 
-		debug_task ("construct mime parser from string length %d",
-			(gint)task->msg->len);
-		/* create a new parser object to parse the stream */
-		parser = g_mime_parser_new_with_stream (stream);
-		g_object_unref (stream);
+	/* parse the message from the stream */
+	message = g_mime_parser_construct_message (parser);
+	/* free the parser (and the stream) */
+	g_object_unref (parser);
 
-		/* parse the message from the stream */
-		message = g_mime_parser_construct_message (parser);
+	if (message != NULL) {
+		rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t) destroy_message, message);
+	}
 
-		if (message == NULL) {
-			msg_warn ("cannot construct mime from stream");
-			return -1;
-		}
+	return message;
+}
 
-		task->message = message;
+static void
+set_gmime_addresses (struct rspamd_task *task, GMimeMessage *message)
+{
+	task->rcpt_mime = g_mime_message_get_all_recipients (message);
+	if (task->rcpt_mime) {
+#ifdef GMIME24
 		rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t) destroy_message, task->message);
+			(rspamd_mempool_destruct_t) g_object_unref,
+			task->rcpt_mime);
+#else
+		rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t) internet_address_list_destroy,
+			task->rcpt_mime);
+#endif
+	}
+	task->from_mime = internet_address_list_parse_string(
+			g_mime_message_get_sender (message));
+	if (task->from_mime) {
+#ifdef GMIME24
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t) g_object_unref,
+				task->from_mime);
+#else
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t) internet_address_list_destroy,
+				task->from_mime);
+#endif
+	}
+}
+
+/* Parse addresses from headers without constructing GMime message */
+static InternetAddressList *
+parse_address_headers (struct rspamd_task *task, const gchar **fields)
+{
+	InternetAddressList *ia;
+	struct raw_header *rh;
+	GString *buf;
+
+	buf = g_string_new (NULL);
 
-		/* Save message id for future use */
-		task->message_id = g_mime_message_get_message_id (task->message);
-		if (task->message_id == NULL) {
-			task->message_id = "undef";
+	for (; *fields != NULL; fields++) {
+		LL_FOREACH (g_hash_table_lookup (task->raw_headers, *fields), rh) {
+			if (buf->len > 0) {
+				g_string_append_len (buf, ", ", 2);
+			}
+			g_string_append (buf, rh->value);
 		}
+	}
 
-		task->parser_recursion = 0;
+	if (buf->len == 0) {
+		g_string_free (buf, TRUE);
+		return NULL;
+	}
+
+	ia = internet_address_list_parse_string (buf->str);
+	g_string_free (buf, TRUE);
+
+	if (ia != NULL) {
 #ifdef GMIME24
-		g_mime_message_foreach (message, mime_foreach_callback, task);
+		rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t) g_object_unref, ia);
 #else
-		/*
-		 * This is rather strange, but gmime 2.2 do NOT pass top-level part to foreach callback
-		 * so we need to set up parent part by hands
-		 */
-		task->parser_parent_part = g_mime_message_get_mime_part (message);
-		g_object_unref (task->parser_parent_part);
-		g_mime_message_foreach_part (message, mime_foreach_callback, task);
+		rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t) internet_address_list_destroy, ia);
 #endif
+	}
 
-		debug_task ("found %d parts in message", task->parts_count);
-		if (task->queue_id == NULL) {
-			task->queue_id = "undef";
+	return ia;
+}
+
+static GHashTable *
+parse_part_headers (struct rspamd_task *task,
+	const struct rspamd_mime_desc *desc)
+{
+	GHashTable *raw_headers;
+	gchar *hdrs;
+
+	raw_headers = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t) g_hash_table_destroy, raw_headers);
+
+	if (desc->headers_len > 0) {
+		hdrs = rspamd_mempool_alloc (task->task_pool, desc->headers_len + 1);
+		rspamd_strlcpy (hdrs, desc->headers, desc->headers_len + 1);
+		process_raw_headers (raw_headers, task->task_pool, hdrs);
+	}
+
+	return raw_headers;
+}
+
+static void
+process_mime_desc (struct rspamd_task *task, struct rspamd_mime_desc *desc)
+{
+	struct rspamd_mime_desc *cur, *parent;
+	struct mime_part *mime_part;
+	GMimeContentType *type;
+
+	task->parts_count++;
+
+	if (desc->children != NULL) {
+		for (cur = desc->children; cur != NULL; cur = cur->next) {
+			process_mime_desc (task, cur);
+		}
+
+		return;
+	}
+
+	/* Leaf belongs to the nearest multipart container */
+	for (parent = desc->parent; parent != NULL; parent = parent->parent) {
+		if (strcmp (parent->type, "multipart") == 0) {
+			break;
 		}
+	}
 
+	type = g_mime_content_type_new_from_string (desc->content_type);
+	if (type == NULL) {
+		type = g_mime_content_type_new (desc->type, desc->subtype);
+	}
 #ifdef GMIME24
-		task->raw_headers_str =
-			g_mime_object_get_headers (GMIME_OBJECT (task->message));
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t) g_object_unref, type);
 #else
-		task->raw_headers_str = g_mime_message_get_headers (task->message);
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t) g_mime_content_type_destroy, type);
 #endif
 
-		if (task->raw_headers_str) {
-			rspamd_mempool_add_destructor (task->task_pool,
-					(rspamd_mempool_destruct_t) g_free, task->raw_headers_str);
-			process_raw_headers (task->raw_headers, task->task_pool,
-					task->raw_headers_str);
+	mime_part = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct mime_part));
+	mime_part->type = type;
+	mime_part->parent = parent;
+	mime_part->desc = desc;
+	mime_part->pool = task->task_pool;
+	mime_part->filename = desc->filename;
+	mime_part->raw_headers = parse_part_headers (task, desc);
+
+	debug_task ("found part with content-type: %s/%s", desc->type,
+		desc->subtype);
+	task->parts = g_list_prepend (task->parts, mime_part);
+
+	/* Only text parts are decoded here, others are decoded on demand */
+	if (strcmp (desc->type, "text") == 0) {
+		mime_part_get_content (mime_part);
+		process_text_part (task,
+			mime_part->content,
+			type,
+			desc->is_attachment,
+			parent,
+			(mime_part->content->len <= 0));
+	}
+}
+
+static gboolean
+process_message_native (struct rspamd_task *task)
+{
+	struct rspamd_mime_desc *desc;
+	struct raw_header *rh;
+	static const gchar *rcpt_fields[] = {"To", "Cc", "Bcc", NULL},
+		*from_fields[] = {"From", NULL};
+	gchar *mid;
+
+	desc = rspamd_mime_parse (task->task_pool, task->msg->str, task->msg->len);
+
+	if (desc == NULL) {
+		return FALSE;
+	}
+
+	task->raw_headers_str = rspamd_mempool_alloc (task->task_pool,
+			desc->headers_len + 1);
+	rspamd_strlcpy (task->raw_headers_str, desc->headers,
+		desc->headers_len + 1);
+	process_raw_headers (task->raw_headers, task->task_pool,
+		task->raw_headers_str);
+
+	/* Save message id for future use */
+	rh = g_hash_table_lookup (task->raw_headers, "Message-ID");
+	if (rh != NULL &&
+		(mid = g_mime_utils_decode_message_id (rh->value)) != NULL) {
+		rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t) g_free, mid);
+		task->message_id = mid;
+	}
+	else {
+		task->message_id = "undef";
+	}
+
+	process_mime_desc (task, desc);
+
+	task->rcpt_mime = parse_address_headers (task, rcpt_fields);
+	task->from_mime = parse_address_headers (task, from_fields);
+
+	return TRUE;
+}
+
+static gboolean
+process_message_gmime (struct rspamd_task *task)
+{
+	GMimeMessage *message;
+#ifndef GMIME24
+	GMimeObject *top;
+#endif
+
+	message = construct_gmime_message (task);
+
+	if (message == NULL) {
+		msg_warn ("cannot construct mime from stream");
+		return FALSE;
+	}
+
+	task->message = message;
+
+	/* Save message id for future use */
+	task->message_id = g_mime_message_get_message_id (task->message);
+	if (task->message_id == NULL) {
+		task->message_id = "undef";
+	}
+
+	task->parser_recursion = 0;
+#ifdef GMIME24
+	g_mime_message_foreach (message, mime_foreach_callback, task);
+#else
+	/*
+	 * This is rather strange, but gmime 2.2 do NOT pass top-level part to foreach callback
+	 * so we need to set up parent part by hands
+	 */
+	top = g_mime_message_get_mime_part (message);
+	task->parser_parent_part = gmime_container_desc (task, top);
+	g_object_unref (top);
+	g_mime_message_foreach_part (message, mime_foreach_callback, task);
+#endif
+
+#ifdef GMIME24
+	task->raw_headers_str =
+		g_mime_object_get_headers (GMIME_OBJECT (task->message));
+#else
+	task->raw_headers_str = g_mime_message_get_headers (task->message);
+#endif
+
+	if (task->raw_headers_str) {
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t) g_free, task->raw_headers_str);
+		process_raw_headers (task->raw_headers, task->task_pool,
+				task->raw_headers_str);
+	}
+
+	set_gmime_addresses (task, message);
+
+	return TRUE;
+}
+
+gint
+process_message (struct rspamd_task *task)
+{
+	GMimeMessage *message;
+	GMimeStream *stream;
+	GByteArray *tmp;
+	GList *first, *cur;
+	GMimePart *part;
+	GMimeDataWrapper *wrapper;
+	struct received_header *recv;
+	gchar *mid, *url_str, *p, *end, *url_end;
+	struct uri *subject_url;
+	gsize len;
+	gint rc;
+
+	if (task->is_mime) {
+
+		if (!process_message_native (task)) {
+			msg_info ("cannot parse mime structure, fallback to gmime");
+
+			if (!process_message_gmime (task)) {
+				return -1;
+			}
 		}
+
+		debug_task ("found %d parts in message", task->parts_count);
+		if (task->queue_id == NULL) {
+			task->queue_id = "undef";
+		}
+
 		process_images (task);
 
 		/* Parse received headers */
@@ -1546,11 +1612,14 @@ process_message (struct rspamd_task *task)
 			task->received = g_list_prepend (task->received, recv);
 			cur = g_list_next (cur);
 		}
-
-		/* free the parser (and the stream) */
-		g_object_unref (parser);
 	}
 	else {
+		tmp = rspamd_mempool_alloc (task->task_pool, sizeof (GByteArray));
+		tmp->data = task->msg->str;
+		tmp->len = task->msg->len;
+
+		stream = g_mime_stream_mem_new_with_byte_array (tmp);
+		g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (stream), FALSE);
 		/* We got only message, no mime headers or anything like this */
 		/* Construct fake message for it */
 		message = g_mime_message_new (TRUE);
@@ -1568,6 +1637,7 @@ process_message (struct rspamd_task *task)
 		wrapper = g_mime_data_wrapper_new_with_stream (stream,
 				GMIME_PART_ENCODING_8BIT);
 #endif
+		g_object_unref (stream);
 		g_mime_part_set_content_object (part, wrapper);
 		g_mime_message_set_mime_part (task->message, GMIME_OBJECT (part));
 		/* Register destructors */
@@ -1596,33 +1666,8 @@ process_message (struct rspamd_task *task)
 		if (task->subject) {
 			g_mime_message_set_subject (task->message, task->subject);
 		}
-	}
 
-	/* Set mime recipients and sender for the task */
-	task->rcpt_mime = g_mime_message_get_all_recipients (message);
-	if (task->rcpt_mime) {
-#ifdef GMIME24
-		rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t) g_object_unref,
-			task->rcpt_mime);
-#else
-		rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t) internet_address_list_destroy,
-			task->rcpt_mime);
-#endif
-	}
-	task->from_mime = internet_address_list_parse_string(
-			g_mime_message_get_sender (message));
-	if (task->from_mime) {
-#ifdef GMIME24
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t) g_object_unref,
-				task->from_mime);
-#else
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t) internet_address_list_destroy,
-				task->from_mime);
-#endif
+		set_gmime_addresses (task, message);
 	}
 
 	/* Parse urls inside Subject header */
@@ -1706,3 +1751,91 @@ message_get_header (struct rspamd_task *task,
 
 	return gret;
 }
+
+GByteArray *
+mime_part_get_content (struct mime_part *part)
+{
+	if (part->content == NULL && part->desc != NULL) {
+		part->content = rspamd_mime_decode (part->pool, part->desc);
+	}
+
+	return part->content;
+}
+
+GMimeMessage *
+message_get_gmime (struct rspamd_task *task)
+{
+	if (task->message == NULL && task->is_mime) {
+		task->message = construct_gmime_message (task);
+
+		if (task->message == NULL) {
+			msg_warn ("cannot construct mime from stream");
+		}
+	}
+
+	return task->message;
+}
+
+GMimeContentType *
+message_get_content_type (struct rspamd_task *task)
+{
+	struct raw_header *rh;
+	GMimeContentType *ct = NULL;
+
+	if (task->content_type != NULL) {
+		return task->content_type;
+	}
+
+	rh = g_hash_table_lookup (task->raw_headers, "Content-Type");
+
+	if (rh != NULL) {
+		ct = g_mime_content_type_new_from_string (rh->value);
+	}
+
+	if (ct == NULL) {
+		if (task->is_mime) {
+			ct = g_mime_content_type_new ("text", "plain");
+		}
+		else {
+			ct = g_mime_content_type_new ("text", "html");
+		}
+	}
+
+#ifdef GMIME24
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t) g_object_unref, ct);
+#else
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t) g_mime_content_type_destroy, ct);
+#endif
+	task->content_type = ct;
+
+	return ct;
+}
+
+void
+message_prepare_threaded (struct rspamd_task *task)
+{
+	GList *cur;
+
+	message_get_content_type (task);
+	message_get_gmime (task);
+
+	for (cur = task->parts; cur != NULL; cur = g_list_next (cur)) {
+		mime_part_get_content (cur->data);
+	}
+}
+
+const gchar *
+message_get_subject (struct rspamd_task *task)
+{
+	struct raw_header *rh;
+
+	rh = g_hash_table_lookup (task->raw_headers, "Subject");
+
+	if (rh != NULL) {
+		return rh->decoded != NULL ? rh->decoded : rh->value;
+	}
+
+	return task->subject;
+}
@@ -8,17 +8,21 @@
 
 #include "config.h"
 #include "fuzzy.h"
+#include "mime_parser.h"
+#include "scripts.h"
 
 struct rspamd_task;
 struct controller_session;
 
 struct mime_part {
 	GMimeContentType *type;
-	GByteArray *content;
-	GMimeObject *parent;
+	GByteArray *content;	/**< decoded content, use mime_part_get_content()	*/
+	struct rspamd_mime_desc *parent;	/**< multipart container of a part		*/
 	GHashTable *raw_headers;
 	gchar *checksum;
 	const gchar *filename;
+	const struct rspamd_mime_desc *desc;	/**< descriptor for lazy decoding	*/
+	rspamd_mempool_t *pool;
 };
 
 struct mime_text_part {
@@ -28,6 +32,8 @@ struct mime_text_part {
 	gboolean is_empty;
 	gboolean is_utf;
 	GUnicodeScript script;
+	struct rspamd_script_count *scripts;	/**< letters per script in a sample	*/
+	guint nscripts;
 	const gchar *lang_code;
 	const gchar *language;
 	const gchar *real_charset;
@@ -37,7 +43,7 @@ struct mime_text_part {
 	GList *urls_offset;	/**< list of offsets of urls						*/
 	rspamd_fuzzy_t *fuzzy;
 	rspamd_fuzzy_t *double_fuzzy;
-	GMimeObject *parent;
+	struct rspamd_mime_desc *parent;
 	rspamd_fstring_t *diff_str;
 	GArray *words;
 };
@@ -69,6 +75,43 @@ struct raw_header {
  */
 gint process_message (struct rspamd_task *task);
 
+/**
+ * Get decoded content of a mime part, parts other than text are decoded on
+ * the first call
+ * @param part mime part
+ * @return decoded content
+ */
+GByteArray * mime_part_get_content (struct mime_part *part);
+
+/**
+ * Get GMime representation of a message, it is constructed on demand if the
+ * message has been parsed by the native parser
+ * @param task worker task structure
+ * @return message or NULL if it cannot be parsed
+ */
+GMimeMessage * message_get_gmime (struct rspamd_task *task);
+
+/**
+ * Get content type of the top level part of a message
+ * @param task worker task structure
+ * @return content type cached for the lifetime of a task
+ */
+GMimeContentType * message_get_content_type (struct rspamd_task *task);
+
+/**
+ * Evaluate all lazily computed data of a message, this must be called before
+ * a task is processed by several threads as lazy evaluation is not locked
+ * @param task worker task structure
+ */
+void message_prepare_threaded (struct rspamd_task *task);
+
+/**
+ * Get decoded subject of a message
+ * @param task worker task structure
+ * @return subject or NULL
+ */
+const gchar * message_get_subject (struct rspamd_task *task);
+
 
 /*
  * Get a list of header's values with specified header's name using raw headers
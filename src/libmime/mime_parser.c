@@ -0,0 +1,580 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "mime_parser.h"
+
+#define MIME_MAX_DEPTH 30
+
+enum rspamd_mime_delimiter {
+	MIME_NOT_DELIMITER = 0,
+	MIME_DELIMITER,
+	MIME_CLOSE_DELIMITER
+};
+
+static gboolean rspamd_mime_parse_part (rspamd_mempool_t *pool,
+	struct rspamd_mime_desc *desc, const gchar *begin, const gchar *end,
+	gint depth);
+
+static inline const gchar *
+rspamd_mime_next_line (const gchar *p, const gchar *end)
+{
+	const gchar *nl;
+
+	nl = memchr (p, '\n', end - p);
+
+	return nl != NULL ? nl + 1 : end;
+}
+
+static inline gboolean
+rspamd_mime_is_empty_line (const gchar *p, const gchar *end)
+{
+	return *p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n');
+}
+
+/* Either a folded continuation or `name:` */
+static gboolean
+rspamd_mime_is_header_line (const gchar *p, const gchar *end)
+{
+	const gchar *c = p;
+
+	if (*p == ' ' || *p == '\t') {
+		return TRUE;
+	}
+
+	while (p < end && *p != ':') {
+		if (!g_ascii_isgraph (*p)) {
+			return FALSE;
+		}
+		p++;
+	}
+
+	return p < end && p != c;
+}
+
+/*
+ * Headers end either with an empty line or with the first line that is not
+ * a header, mbox `From ` line is allowed at the beginning of a message
+ */
+static void
+rspamd_mime_split_headers (struct rspamd_mime_desc *desc, const gchar *begin,
+	const gchar *end, gboolean toplevel)
+{
+	const gchar *p = begin;
+
+	if (toplevel && end - p > 5 && memcmp (p, "From ", 5) == 0) {
+		p = rspamd_mime_next_line (p, end);
+	}
+
+	desc->headers = begin;
+
+	while (p < end) {
+		if (rspamd_mime_is_empty_line (p, end)) {
+			desc->headers_len = p - begin;
+			desc->body = rspamd_mime_next_line (p, end);
+			desc->body_len = end - desc->body;
+			return;
+		}
+		else if (!rspamd_mime_is_header_line (p, end)) {
+			desc->headers_len = p - begin;
+			desc->body = p;
+			desc->body_len = end - p;
+			return;
+		}
+
+		p = rspamd_mime_next_line (p, end);
+	}
+
+	desc->headers_len = end - begin;
+	desc->body = end;
+	desc->body_len = 0;
+}
+
+/* Copy value skipping line breaks of folding */
+static gchar *
+rspamd_mime_unfold (rspamd_mempool_t *pool, const gchar *p, const gchar *end)
+{
+	gchar *res, *d;
+
+	while (p < end && g_ascii_isspace (*p)) {
+		p++;
+	}
+	while (end > p && g_ascii_isspace (*(end - 1))) {
+		end--;
+	}
+
+	res = rspamd_mempool_alloc (pool, end - p + 1);
+	d = res;
+
+	while (p < end) {
+		if (*p != '\r' && *p != '\n') {
+			*d++ = *p;
+		}
+		p++;
+	}
+
+	*d = '\0';
+
+	return res;
+}
+
+static gchar *
+rspamd_mime_lowercase (rspamd_mempool_t *pool, const gchar *p, gsize len)
+{
+	gchar *res;
+	gsize i;
+
+	res = rspamd_mempool_alloc (pool, len + 1);
+
+	for (i = 0; i < len; i++) {
+		res[i] = g_ascii_tolower (p[i]);
+	}
+
+	res[len] = '\0';
+
+	return res;
+}
+
+/*
+ * Find parameter in `value; name=token; name="quoted string"` and return
+ * its unquoted value
+ */
+static const gchar *
+rspamd_mime_find_param (rspamd_mempool_t *pool, const gchar *p,
+	const gchar *name)
+{
+	const gchar *c, *pname;
+	gchar *res, *d;
+	gsize nlen = strlen (name), pnlen;
+
+	p = strchr (p, ';');
+
+	while (p != NULL && *p != '\0') {
+		while (*p == ';' || g_ascii_isspace (*p)) {
+			p++;
+		}
+
+		pname = p;
+		while (*p != '\0' && *p != '=' && *p != ';' && !g_ascii_isspace (*p)) {
+			p++;
+		}
+		pnlen = p - pname;
+
+		while (g_ascii_isspace (*p)) {
+			p++;
+		}
+		if (*p != '=') {
+			p = strchr (p, ';');
+			continue;
+		}
+
+		p++;
+		while (g_ascii_isspace (*p)) {
+			p++;
+		}
+
+		if (*p == '"') {
+			p++;
+			c = p;
+			res = rspamd_mempool_alloc (pool, strlen (c) + 1);
+			d = res;
+
+			while (*p != '\0' && *p != '"') {
+				if (*p == '\\' && *(p + 1) != '\0') {
+					p++;
+				}
+				*d++ = *p++;
+			}
+			*d = '\0';
+
+			if (*p == '"') {
+				p++;
+			}
+		}
+		else {
+			c = p;
+			while (*p != '\0' && *p != ';' && !g_ascii_isspace (*p)) {
+				p++;
+			}
+			res = rspamd_mempool_alloc (pool, p - c + 1);
+			rspamd_strlcpy (res, c, p - c + 1);
+		}
+
+		if (pnlen == nlen && g_ascii_strncasecmp (pname, name, nlen) == 0) {
+			return res;
+		}
+
+		p = strchr (p, ';');
+	}
+
+	return NULL;
+}
+
+static enum rspamd_cte
+rspamd_mime_parse_cte (const gchar *val)
+{
+	if (g_ascii_strcasecmp (val, "base64") == 0) {
+		return RSPAMD_CTE_B64;
+	}
+	else if (g_ascii_strcasecmp (val, "quoted-printable") == 0) {
+		return RSPAMD_CTE_QP;
+	}
+	else if (g_ascii_strcasecmp (val, "8bit") == 0) {
+		return RSPAMD_CTE_8BIT;
+	}
+	else if (g_ascii_strcasecmp (val, "binary") == 0) {
+		return RSPAMD_CTE_BINARY;
+	}
+
+	return RSPAMD_CTE_7BIT;
+}
+
+static void
+rspamd_mime_parse_headers (rspamd_mempool_t *pool,
+	struct rspamd_mime_desc *desc)
+{
+	const gchar *p, *end, *vend, *colon, *val, *filename = NULL;
+	gsize nlen;
+
+	p = desc->headers;
+	end = p + desc->headers_len;
+
+	while (p < end) {
+		/* Field spans all folded lines */
+		vend = rspamd_mime_next_line (p, end);
+		while (vend < end && (*vend == ' ' || *vend == '\t')) {
+			vend = rspamd_mime_next_line (vend, end);
+		}
+
+		colon = memchr (p, ':', vend - p);
+
+		if (colon != NULL) {
+			nlen = colon - p;
+
+			if (nlen == sizeof ("Content-Type") - 1 &&
+				g_ascii_strncasecmp (p, "Content-Type", nlen) == 0) {
+				if (desc->content_type == NULL) {
+					desc->content_type = rspamd_mime_unfold (pool, colon + 1,
+							vend);
+				}
+			}
+			else if (nlen == sizeof ("Content-Transfer-Encoding") - 1 &&
+				g_ascii_strncasecmp (p, "Content-Transfer-Encoding",
+				nlen) == 0) {
+				desc->cte = rspamd_mime_parse_cte (rspamd_mime_unfold (pool,
+						colon + 1, vend));
+			}
+			else if (nlen == sizeof ("Content-Disposition") - 1 &&
+				g_ascii_strncasecmp (p, "Content-Disposition", nlen) == 0) {
+				val = rspamd_mime_unfold (pool, colon + 1, vend);
+				desc->is_attachment = g_ascii_strncasecmp (val, "attachment",
+						sizeof ("attachment") - 1) == 0;
+				filename = rspamd_mime_find_param (pool, val, "filename");
+			}
+		}
+
+		p = vend;
+	}
+
+	desc->filename = filename;
+}
+
+static void
+rspamd_mime_parse_content_type (rspamd_mempool_t *pool,
+	struct rspamd_mime_desc *desc)
+{
+	const gchar *p, *c;
+
+	if (desc->content_type == NULL) {
+		/* Default type depends on the container */
+		if (desc->parent != NULL &&
+			strcmp (desc->parent->type, "multipart") == 0 &&
+			strcmp (desc->parent->subtype, "digest") == 0) {
+			desc->content_type = "message/rfc822";
+		}
+		else {
+			desc->content_type = "text/plain";
+		}
+	}
+
+	p = desc->content_type;
+	c = p;
+	while (*p != '\0' && *p != '/' && *p != ';' && !g_ascii_isspace (*p)) {
+		p++;
+	}
+
+	if (*p != '/' || p == c) {
+		desc->type = "application";
+		desc->subtype = "octet-stream";
+		return;
+	}
+
+	desc->type = rspamd_mime_lowercase (pool, c, p - c);
+	p++;
+	c = p;
+	while (*p != '\0' && *p != ';' && !g_ascii_isspace (*p)) {
+		p++;
+	}
+	desc->subtype = rspamd_mime_lowercase (pool, c, p - c);
+
+	if (strcmp (desc->type, "multipart") == 0) {
+		desc->boundary = rspamd_mime_find_param (pool, p, "boundary");
+	}
+
+	if (desc->filename == NULL) {
+		desc->filename = rspamd_mime_find_param (pool, p, "name");
+	}
+}
+
+/* Check for `--boundary` or `--boundary--` followed by transport padding */
+static enum rspamd_mime_delimiter
+rspamd_mime_check_delimiter (const gchar *p, const gchar *line_end,
+	const gchar *boundary, gsize blen)
+{
+	enum rspamd_mime_delimiter ret = MIME_DELIMITER;
+
+	if ((gsize)(line_end - p) < blen + 2 || p[0] != '-' || p[1] != '-' ||
+		memcmp (p + 2, boundary, blen) != 0) {
+		return MIME_NOT_DELIMITER;
+	}
+
+	p += blen + 2;
+
+	if (line_end - p >= 2 && p[0] == '-' && p[1] == '-') {
+		ret = MIME_CLOSE_DELIMITER;
+		p += 2;
+	}
+
+	while (p < line_end) {
+		if (!g_ascii_isspace (*p)) {
+			return MIME_NOT_DELIMITER;
+		}
+		p++;
+	}
+
+	return ret;
+}
+
+static gboolean
+rspamd_mime_add_child (rspamd_mempool_t *pool, struct rspamd_mime_desc *desc,
+	struct rspamd_mime_desc **last, const gchar *begin, const gchar *end,
+	gint depth)
+{
+	struct rspamd_mime_desc *child;
+
+	child = rspamd_mempool_alloc0 (pool, sizeof (*child));
+	child->parent = desc;
+
+	if (*last == NULL) {
+		desc->children = child;
+	}
+	else {
+		(*last)->next = child;
+	}
+
+	*last = child;
+
+	return rspamd_mime_parse_part (pool, child, begin, end, depth + 1);
+}
+
+static gboolean
+rspamd_mime_parse_multipart (rspamd_mempool_t *pool,
+	struct rspamd_mime_desc *desc, gint depth)
+{
+	const gchar *p, *end, *next, *part_start = NULL, *part_end;
+	struct rspamd_mime_desc *last = NULL;
+	enum rspamd_mime_delimiter delim;
+	gboolean found = FALSE;
+	gsize blen;
+
+	p = desc->body;
+	end = p + desc->body_len;
+	blen = strlen (desc->boundary);
+
+	while (p < end) {
+		next = rspamd_mime_next_line (p, end);
+		delim = rspamd_mime_check_delimiter (p, next, desc->boundary, blen);
+
+		if (delim != MIME_NOT_DELIMITER) {
+			found = TRUE;
+
+			if (part_start != NULL) {
+				/* Line break before delimiter belongs to delimiter */
+				part_end = p;
+				if (part_end > part_start && *(part_end - 1) == '\n') {
+					part_end--;
+				}
+				if (part_end > part_start && *(part_end - 1) == '\r') {
+					part_end--;
+				}
+
+				if (!rspamd_mime_add_child (pool, desc, &last, part_start,
+					part_end, depth)) {
+					return FALSE;
+				}
+			}
+
+			if (delim == MIME_CLOSE_DELIMITER) {
+				return TRUE;
+			}
+
+			part_start = next;
+		}
+
+		p = next;
+	}
+
+	if (!found) {
+		msg_debug ("cannot find boundary %s in multipart", desc->boundary);
+		return FALSE;
+	}
+
+	/* Last part is not closed */
+	if (part_start != NULL && part_start < end) {
+		return rspamd_mime_add_child (pool, desc, &last, part_start, end,
+				depth);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_mime_parse_part (rspamd_mempool_t *pool, struct rspamd_mime_desc *desc,
+	const gchar *begin, const gchar *end, gint depth)
+{
+	struct rspamd_mime_desc *last = NULL;
+
+	if (depth > MIME_MAX_DEPTH) {
+		msg_info ("too deep nesting of mime parts: %d", depth);
+		return FALSE;
+	}
+
+	rspamd_mime_split_headers (desc, begin, end, depth == 0);
+	rspamd_mime_parse_headers (pool, desc);
+	rspamd_mime_parse_content_type (pool, desc);
+
+	if (strcmp (desc->type, "multipart") == 0) {
+		if (desc->boundary == NULL || *desc->boundary == '\0') {
+			msg_debug ("multipart has no boundary");
+			return FALSE;
+		}
+
+		return rspamd_mime_parse_multipart (pool, desc, depth);
+	}
+	else if (strcmp (desc->type, "message") == 0 &&
+		strcmp (desc->subtype, "rfc822") == 0 &&
+		desc->cte != RSPAMD_CTE_B64 && desc->cte != RSPAMD_CTE_QP) {
+		return rspamd_mime_add_child (pool, desc, &last, desc->body,
+				desc->body + desc->body_len, depth);
+	}
+
+	return TRUE;
+}
+
+struct rspamd_mime_desc *
+rspamd_mime_parse (rspamd_mempool_t *pool, const gchar *begin, gsize len)
+{
+	struct rspamd_mime_desc *desc;
+
+	desc = rspamd_mempool_alloc0 (pool, sizeof (*desc));
+
+	if (!rspamd_mime_parse_part (pool, desc, begin, begin + len, 0)) {
+		return NULL;
+	}
+
+	return desc;
+}
+
+static gsize
+rspamd_mime_decode_qp (const gchar *p, gsize len, guchar *out)
+{
+	const gchar *end = p + len, *c;
+	guchar *o = out;
+
+	while (p < end) {
+		if (*p != '=') {
+			*o++ = *p++;
+		}
+		else if (end - p >= 3 && g_ascii_isxdigit (p[1]) &&
+			g_ascii_isxdigit (p[2])) {
+			*o++ = (g_ascii_xdigit_value (p[1]) << 4) |
+				g_ascii_xdigit_value (p[2]);
+			p += 3;
+		}
+		else {
+			/* Soft line break may be followed by trailing whitespace */
+			c = p + 1;
+			while (c < end && (*c == ' ' || *c == '\t')) {
+				c++;
+			}
+			if (c < end && *c == '\r') {
+				c++;
+			}
+
+			if (c == end) {
+				p = end;
+			}
+			else if (*c == '\n') {
+				p = c + 1;
+			}
+			else {
+				/* Not an escape, keep it as is */
+				*o++ = *p++;
+			}
+		}
+	}
+
+	return o - out;
+}
+
+GByteArray *
+rspamd_mime_decode (rspamd_mempool_t *pool, const struct rspamd_mime_desc *desc)
+{
+	GByteArray *res;
+	guchar *out;
+	gint state = 0;
+	guint save = 0;
+
+	res = rspamd_mempool_alloc (pool, sizeof (GByteArray));
+
+	switch (desc->cte) {
+	case RSPAMD_CTE_B64:
+		out = rspamd_mempool_alloc (pool, desc->body_len / 4 * 3 + 3);
+		res->len = g_base64_decode_step (desc->body, desc->body_len, out,
+				&state, &save);
+		res->data = out;
+		break;
+	case RSPAMD_CTE_QP:
+		out = rspamd_mempool_alloc (pool, desc->body_len + 1);
+		res->len = rspamd_mime_decode_qp (desc->body, desc->body_len, out);
+		res->data = out;
+		break;
+	default:
+		res->data = (guint8 *)desc->body;
+		res->len = desc->body_len;
+		break;
+	}
+
+	return res;
+}
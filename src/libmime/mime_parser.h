@@ -0,0 +1,89 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file mime_parser.h
+ * Native MIME parser that splits a message into parts without copying
+ */
+
+#ifndef RSPAMD_MIME_PARSER_H
+#define RSPAMD_MIME_PARSER_H
+
+#include "config.h"
+#include "mem_pool.h"
+
+/**
+ * Content transfer encoding of a part
+ */
+enum rspamd_cte {
+	RSPAMD_CTE_7BIT = 0,
+	RSPAMD_CTE_8BIT,
+	RSPAMD_CTE_BINARY,
+	RSPAMD_CTE_QP,
+	RSPAMD_CTE_B64
+};
+
+/**
+ * Descriptor of a mime part. Headers and body point to the parsed message,
+ * strings are allocated from the memory pool. Multipart and message/rfc822
+ * descriptors have children, leaf descriptors have none.
+ */
+struct rspamd_mime_desc {
+	const gchar *headers;               /**< raw headers of a part				*/
+	gsize headers_len;
+	const gchar *body;                  /**< raw (encoded) body of a part		*/
+	gsize body_len;
+	const gchar *content_type;          /**< unfolded value of Content-Type		*/
+	const gchar *type;                  /**< lowercased media type				*/
+	const gchar *subtype;               /**< lowercased media subtype			*/
+	const gchar *boundary;
+	const gchar *filename;
+	enum rspamd_cte cte;
+	gboolean is_attachment;
+	struct rspamd_mime_desc *parent;
+	struct rspamd_mime_desc *children;
+	struct rspamd_mime_desc *next;
+};
+
+/**
+ * Parse message into a tree of part descriptors, nothing is decoded
+ * @param pool memory pool
+ * @param begin message
+ * @param len length of message
+ * @return top level descriptor or NULL if the message structure is too
+ * broken to be parsed without a full featured parser
+ */
+struct rspamd_mime_desc * rspamd_mime_parse (rspamd_mempool_t *pool,
+	const gchar *begin, gsize len);
+
+/**
+ * Decode body of a leaf part according to its transfer encoding. Bodies
+ * with identity encodings are returned without copying.
+ * @param pool memory pool
+ * @param desc part descriptor
+ * @return array allocated from the pool
+ */
+GByteArray * rspamd_mime_decode (rspamd_mempool_t *pool,
+	const struct rspamd_mime_desc *desc);
+
+#endif
@@ -0,0 +1,828 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "scripts.h"
+
+/* Minimal number of letters to make a decision */
+#define SCRIPTS_MIN_SAMPLE 32
+/* Share of letters in the most common script to stop detection, percents */
+#define SCRIPTS_MAJORITY 90
+
+struct rspamd_script_desc {
+	const gchar *script_name;
+	const gchar *code;
+	const gchar *name;
+	GUnicodeScript script;
+};
+
+struct rspamd_script_range {
+	gunichar start;
+	gunichar end;
+	GUnicodeScript script;
+};
+
+/* Indexed by script */
+static const struct rspamd_script_desc scripts_table[] = {
+	{"common", "", "english", G_UNICODE_SCRIPT_COMMON},
+	{"inherited", "", "", G_UNICODE_SCRIPT_INHERITED},
+	{"arabic", "ar", "arabic", G_UNICODE_SCRIPT_ARABIC},
+	{"armenian", "hy", "armenian", G_UNICODE_SCRIPT_ARMENIAN},
+	{"bengali", "bn", "chineese", G_UNICODE_SCRIPT_BENGALI},
+	{"bopomofo", "", "", G_UNICODE_SCRIPT_BOPOMOFO},
+	{"cherokee", "chr", "", G_UNICODE_SCRIPT_CHEROKEE},
+	{"coptic", "cop", "", G_UNICODE_SCRIPT_COPTIC},
+	{"cyrillic", "ru", "russian", G_UNICODE_SCRIPT_CYRILLIC},
+	/* Deseret was used to write English */
+	{"deseret", "", "", G_UNICODE_SCRIPT_DESERET},
+	{"devanagari", "hi", "", G_UNICODE_SCRIPT_DEVANAGARI},
+	{"ethiopic", "am", "", G_UNICODE_SCRIPT_ETHIOPIC},
+	{"georgian", "ka", "", G_UNICODE_SCRIPT_GEORGIAN},
+	{"gothic", "", "", G_UNICODE_SCRIPT_GOTHIC},
+	{"greek", "el", "greek", G_UNICODE_SCRIPT_GREEK},
+	{"gujarati", "gu", "", G_UNICODE_SCRIPT_GUJARATI},
+	{"gurmukhi", "pa", "", G_UNICODE_SCRIPT_GURMUKHI},
+	{"han", "han", "chineese", G_UNICODE_SCRIPT_HAN},
+	{"hangul", "ko", "", G_UNICODE_SCRIPT_HANGUL},
+	{"hebrew", "he", "hebrew", G_UNICODE_SCRIPT_HEBREW},
+	{"hiragana", "ja", "", G_UNICODE_SCRIPT_HIRAGANA},
+	{"kannada", "kn", "", G_UNICODE_SCRIPT_KANNADA},
+	{"katakana", "ja", "", G_UNICODE_SCRIPT_KATAKANA},
+	{"khmer", "km", "", G_UNICODE_SCRIPT_KHMER},
+	{"lao", "lo", "", G_UNICODE_SCRIPT_LAO},
+	{"latin", "en", "english", G_UNICODE_SCRIPT_LATIN},
+	{"malayalam", "ml", "", G_UNICODE_SCRIPT_MALAYALAM},
+	{"mongolian", "mn", "", G_UNICODE_SCRIPT_MONGOLIAN},
+	{"myanmar", "my", "", G_UNICODE_SCRIPT_MYANMAR},
+	/* Ogham was used to write old Irish */
+	{"ogham", "", "", G_UNICODE_SCRIPT_OGHAM},
+	{"old_italic", "", "", G_UNICODE_SCRIPT_OLD_ITALIC},
+	{"oriya", "or", "", G_UNICODE_SCRIPT_ORIYA},
+	{"runic", "", "", G_UNICODE_SCRIPT_RUNIC},
+	{"sinhala", "si", "", G_UNICODE_SCRIPT_SINHALA},
+	{"syriac", "syr", "", G_UNICODE_SCRIPT_SYRIAC},
+	{"tamil", "ta", "", G_UNICODE_SCRIPT_TAMIL},
+	{"telugu", "te", "", G_UNICODE_SCRIPT_TELUGU},
+	{"thaana", "dv", "", G_UNICODE_SCRIPT_THAANA},
+	{"thai", "th", "", G_UNICODE_SCRIPT_THAI},
+	{"tibetan", "bo", "", G_UNICODE_SCRIPT_TIBETAN},
+	{"canadian_aboriginal", "iu", "", G_UNICODE_SCRIPT_CANADIAN_ABORIGINAL},
+	{"yi", "", "", G_UNICODE_SCRIPT_YI},
+	{"tagalog", "tl", "", G_UNICODE_SCRIPT_TAGALOG},
+	/* Phillipino languages/scripts */
+	{"hanunoo", "hnn", "", G_UNICODE_SCRIPT_HANUNOO},
+	{"buhid", "bku", "", G_UNICODE_SCRIPT_BUHID},
+	{"tagbanwa", "tbw", "", G_UNICODE_SCRIPT_TAGBANWA},
+
+	{"braille", "", "", G_UNICODE_SCRIPT_BRAILLE},
+	{"cypriot", "", "", G_UNICODE_SCRIPT_CYPRIOT},
+	{"limbu", "", "", G_UNICODE_SCRIPT_LIMBU},
+	/* Used for Somali (so) in the past */
+	{"osmanya", "", "", G_UNICODE_SCRIPT_OSMANYA},
+	/* The Shavian alphabet was designed for English */
+	{"shavian", "", "", G_UNICODE_SCRIPT_SHAVIAN},
+	{"linear_b", "", "", G_UNICODE_SCRIPT_LINEAR_B},
+	{"tai_le", "", "", G_UNICODE_SCRIPT_TAI_LE},
+	{"ugaritic", "uga", "", G_UNICODE_SCRIPT_UGARITIC},
+	{"new_tai_lue", "", "", G_UNICODE_SCRIPT_NEW_TAI_LUE},
+	{"buginese", "bug", "", G_UNICODE_SCRIPT_BUGINESE},
+	{"glagolitic", "", "", G_UNICODE_SCRIPT_GLAGOLITIC},
+	/* Used for for Berber (ber), but Arabic script is more common */
+	{"tifinagh", "", "", G_UNICODE_SCRIPT_TIFINAGH},
+	{"syloti_nagri", "syl", "", G_UNICODE_SCRIPT_SYLOTI_NAGRI},
+	{"old_persian", "peo", "", G_UNICODE_SCRIPT_OLD_PERSIAN},
+	{"kharoshthi", "", "", G_UNICODE_SCRIPT_KHAROSHTHI},
+	{"unknown", "", "", G_UNICODE_SCRIPT_UNKNOWN},
+	{"balinese", "", "", G_UNICODE_SCRIPT_BALINESE},
+	{"cuneiform", "", "", G_UNICODE_SCRIPT_CUNEIFORM},
+	{"phoenician", "", "", G_UNICODE_SCRIPT_PHOENICIAN},
+	{"phags_pa", "", "", G_UNICODE_SCRIPT_PHAGS_PA},
+	{"nko", "nqo", "", G_UNICODE_SCRIPT_NKO}
+
+};
+
+/*
+ * Runs of non ascii letters of the scripts above, keep sorted. Generated from
+ * g_unichar_isalpha and g_unichar_get_script.
+ */
+static const struct rspamd_script_range script_ranges[] = {
+	{0x00AA, 0x00AA, G_UNICODE_SCRIPT_LATIN},
+	{0x00B5, 0x00B5, G_UNICODE_SCRIPT_COMMON},
+	{0x00BA, 0x00BA, G_UNICODE_SCRIPT_LATIN},
+	{0x00C0, 0x00D6, G_UNICODE_SCRIPT_LATIN},
+	{0x00D8, 0x00F6, G_UNICODE_SCRIPT_LATIN},
+	{0x00F8, 0x02B8, G_UNICODE_SCRIPT_LATIN},
+	{0x02B9, 0x02C1, G_UNICODE_SCRIPT_COMMON},
+	{0x02C6, 0x02D1, G_UNICODE_SCRIPT_COMMON},
+	{0x02E0, 0x02E4, G_UNICODE_SCRIPT_LATIN},
+	{0x02EC, 0x02EC, G_UNICODE_SCRIPT_COMMON},
+	{0x02EE, 0x02EE, G_UNICODE_SCRIPT_COMMON},
+	{0x0370, 0x0373, G_UNICODE_SCRIPT_GREEK},
+	{0x0374, 0x0374, G_UNICODE_SCRIPT_COMMON},
+	{0x0376, 0x0377, G_UNICODE_SCRIPT_GREEK},
+	{0x037A, 0x037D, G_UNICODE_SCRIPT_GREEK},
+	{0x037F, 0x037F, G_UNICODE_SCRIPT_GREEK},
+	{0x0386, 0x0386, G_UNICODE_SCRIPT_GREEK},
+	{0x0388, 0x038A, G_UNICODE_SCRIPT_GREEK},
+	{0x038C, 0x038C, G_UNICODE_SCRIPT_GREEK},
+	{0x038E, 0x03A1, G_UNICODE_SCRIPT_GREEK},
+	{0x03A3, 0x03E1, G_UNICODE_SCRIPT_GREEK},
+	{0x03E2, 0x03EF, G_UNICODE_SCRIPT_COPTIC},
+	{0x03F0, 0x03F5, G_UNICODE_SCRIPT_GREEK},
+	{0x03F7, 0x03FF, G_UNICODE_SCRIPT_GREEK},
+	{0x0400, 0x0481, G_UNICODE_SCRIPT_CYRILLIC},
+	{0x048A, 0x052F, G_UNICODE_SCRIPT_CYRILLIC},
+	{0x0531, 0x0556, G_UNICODE_SCRIPT_ARMENIAN},
+	{0x0559, 0x0559, G_UNICODE_SCRIPT_ARMENIAN},
+	{0x0560, 0x0588, G_UNICODE_SCRIPT_ARMENIAN},
+	{0x05D0, 0x05EA, G_UNICODE_SCRIPT_HEBREW},
+	{0x05EF, 0x05F2, G_UNICODE_SCRIPT_HEBREW},
+	{0x0620, 0x063F, G_UNICODE_SCRIPT_ARABIC},
+	{0x0640, 0x0640, G_UNICODE_SCRIPT_COMMON},
+	{0x0641, 0x064A, G_UNICODE_SCRIPT_ARABIC},
+	{0x066E, 0x066F, G_UNICODE_SCRIPT_ARABIC},
+	{0x0671, 0x06D3, G_UNICODE_SCRIPT_ARABIC},
+	{0x06D5, 0x06D5, G_UNICODE_SCRIPT_ARABIC},
+	{0x06E5, 0x06E6, G_UNICODE_SCRIPT_ARABIC},
+	{0x06EE, 0x06EF, G_UNICODE_SCRIPT_ARABIC},
+	{0x06FA, 0x06FC, G_UNICODE_SCRIPT_ARABIC},
+	{0x06FF, 0x06FF, G_UNICODE_SCRIPT_ARABIC},
+	{0x0710, 0x0710, G_UNICODE_SCRIPT_SYRIAC},
+	{0x0712, 0x072F, G_UNICODE_SCRIPT_SYRIAC},
+	{0x074D, 0x074F, G_UNICODE_SCRIPT_SYRIAC},
+	{0x0750, 0x077F, G_UNICODE_SCRIPT_ARABIC},
+	{0x0780, 0x07A5, G_UNICODE_SCRIPT_THAANA},
+	{0x07B1, 0x07B1, G_UNICODE_SCRIPT_THAANA},
+	{0x07CA, 0x07EA, G_UNICODE_SCRIPT_NKO},
+	{0x07F4, 0x07F5, G_UNICODE_SCRIPT_NKO},
+	{0x07FA, 0x07FA, G_UNICODE_SCRIPT_NKO},
+	{0x0860, 0x086A, G_UNICODE_SCRIPT_SYRIAC},
+	{0x0870, 0x0887, G_UNICODE_SCRIPT_ARABIC},
+	{0x0889, 0x088E, G_UNICODE_SCRIPT_ARABIC},
+	{0x08A0, 0x08C9, G_UNICODE_SCRIPT_ARABIC},
+	{0x0904, 0x0939, G_UNICODE_SCRIPT_DEVANAGARI},
+	{0x093D, 0x093D, G_UNICODE_SCRIPT_DEVANAGARI},
+	{0x0950, 0x0950, G_UNICODE_SCRIPT_DEVANAGARI},
+	{0x0958, 0x0961, G_UNICODE_SCRIPT_DEVANAGARI},
+	{0x0971, 0x097F, G_UNICODE_SCRIPT_DEVANAGARI},
+	{0x0980, 0x0980, G_UNICODE_SCRIPT_BENGALI},
+	{0x0985, 0x098C, G_UNICODE_SCRIPT_BENGALI},
+	{0x098F, 0x0990, G_UNICODE_SCRIPT_BENGALI},
+	{0x0993, 0x09A8, G_UNICODE_SCRIPT_BENGALI},
+	{0x09AA, 0x09B0, G_UNICODE_SCRIPT_BENGALI},
+	{0x09B2, 0x09B2, G_UNICODE_SCRIPT_BENGALI},
+	{0x09B6, 0x09B9, G_UNICODE_SCRIPT_BENGALI},
+	{0x09BD, 0x09BD, G_UNICODE_SCRIPT_BENGALI},
+	{0x09CE, 0x09CE, G_UNICODE_SCRIPT_BENGALI},
+	{0x09DC, 0x09DD, G_UNICODE_SCRIPT_BENGALI},
+	{0x09DF, 0x09E1, G_UNICODE_SCRIPT_BENGALI},
+	{0x09F0, 0x09F1, G_UNICODE_SCRIPT_BENGALI},
+	{0x09FC, 0x09FC, G_UNICODE_SCRIPT_BENGALI},
+	{0x0A05, 0x0A0A, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A0F, 0x0A10, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A13, 0x0A28, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A2A, 0x0A30, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A32, 0x0A33, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A35, 0x0A36, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A38, 0x0A39, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A59, 0x0A5C, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A5E, 0x0A5E, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A72, 0x0A74, G_UNICODE_SCRIPT_GURMUKHI},
+	{0x0A85, 0x0A8D, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0A8F, 0x0A91, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0A93, 0x0AA8, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0AAA, 0x0AB0, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0AB2, 0x0AB3, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0AB5, 0x0AB9, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0ABD, 0x0ABD, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0AD0, 0x0AD0, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0AE0, 0x0AE1, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0AF9, 0x0AF9, G_UNICODE_SCRIPT_GUJARATI},
+	{0x0B05, 0x0B0C, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B0F, 0x0B10, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B13, 0x0B28, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B2A, 0x0B30, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B32, 0x0B33, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B35, 0x0B39, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B3D, 0x0B3D, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B5C, 0x0B5D, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B5F, 0x0B61, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B71, 0x0B71, G_UNICODE_SCRIPT_ORIYA},
+	{0x0B83, 0x0B83, G_UNICODE_SCRIPT_TAMIL},
+	{0x0B85, 0x0B8A, G_UNICODE_SCRIPT_TAMIL},
+	{0x0B8E, 0x0B90, G_UNICODE_SCRIPT_TAMIL},
+	{0x0B92, 0x0B95, G_UNICODE_SCRIPT_TAMIL},
+	{0x0B99, 0x0B9A, G_UNICODE_SCRIPT_TAMIL},
+	{0x0B9C, 0x0B9C, G_UNICODE_SCRIPT_TAMIL},
+	{0x0B9E, 0x0B9F, G_UNICODE_SCRIPT_TAMIL},
+	{0x0BA3, 0x0BA4, G_UNICODE_SCRIPT_TAMIL},
+	{0x0BA8, 0x0BAA, G_UNICODE_SCRIPT_TAMIL},
+	{0x0BAE, 0x0BB9, G_UNICODE_SCRIPT_TAMIL},
+	{0x0BD0, 0x0BD0, G_UNICODE_SCRIPT_TAMIL},
+	{0x0C05, 0x0C0C, G_UNICODE_SCRIPT_TELUGU},
+	{0x0C0E, 0x0C10, G_UNICODE_SCRIPT_TELUGU},
+	{0x0C12, 0x0C28, G_UNICODE_SCRIPT_TELUGU},
+	{0x0C2A, 0x0C39, G_UNICODE_SCRIPT_TELUGU},
+	{0x0C3D, 0x0C3D, G_UNICODE_SCRIPT_TELUGU},
+	{0x0C58, 0x0C5A, G_UNICODE_SCRIPT_TELUGU},
+	{0x0C5D, 0x0C5D, G_UNICODE_SCRIPT_TELUGU},
+	{0x0C60, 0x0C61, G_UNICODE_SCRIPT_TELUGU},
+	{0x0C80, 0x0C80, G_UNICODE_SCRIPT_KANNADA},
+	{0x0C85, 0x0C8C, G_UNICODE_SCRIPT_KANNADA},
+	{0x0C8E, 0x0C90, G_UNICODE_SCRIPT_KANNADA},
+	{0x0C92, 0x0CA8, G_UNICODE_SCRIPT_KANNADA},
+	{0x0CAA, 0x0CB3, G_UNICODE_SCRIPT_KANNADA},
+	{0x0CB5, 0x0CB9, G_UNICODE_SCRIPT_KANNADA},
+	{0x0CBD, 0x0CBD, G_UNICODE_SCRIPT_KANNADA},
+	{0x0CDD, 0x0CDE, G_UNICODE_SCRIPT_KANNADA},
+	{0x0CE0, 0x0CE1, G_UNICODE_SCRIPT_KANNADA},
+	{0x0CF1, 0x0CF2, G_UNICODE_SCRIPT_KANNADA},
+	{0x0D04, 0x0D0C, G_UNICODE_SCRIPT_MALAYALAM},
+	{0x0D0E, 0x0D10, G_UNICODE_SCRIPT_MALAYALAM},
+	{0x0D12, 0x0D3A, G_UNICODE_SCRIPT_MALAYALAM},
+	{0x0D3D, 0x0D3D, G_UNICODE_SCRIPT_MALAYALAM},
+	{0x0D4E, 0x0D4E, G_UNICODE_SCRIPT_MALAYALAM},
+	{0x0D54, 0x0D56, G_UNICODE_SCRIPT_MALAYALAM},
+	{0x0D5F, 0x0D61, G_UNICODE_SCRIPT_MALAYALAM},
+	{0x0D7A, 0x0D7F, G_UNICODE_SCRIPT_MALAYALAM},
+	{0x0D85, 0x0D96, G_UNICODE_SCRIPT_SINHALA},
+	{0x0D9A, 0x0DB1, G_UNICODE_SCRIPT_SINHALA},
+	{0x0DB3, 0x0DBB, G_UNICODE_SCRIPT_SINHALA},
+	{0x0DBD, 0x0DBD, G_UNICODE_SCRIPT_SINHALA},
+	{0x0DC0, 0x0DC6, G_UNICODE_SCRIPT_SINHALA},
+	{0x0E01, 0x0E30, G_UNICODE_SCRIPT_THAI},
+	{0x0E32, 0x0E33, G_UNICODE_SCRIPT_THAI},
+	{0x0E40, 0x0E46, G_UNICODE_SCRIPT_THAI},
+	{0x0E81, 0x0E82, G_UNICODE_SCRIPT_LAO},
+	{0x0E84, 0x0E84, G_UNICODE_SCRIPT_LAO},
+	{0x0E86, 0x0E8A, G_UNICODE_SCRIPT_LAO},
+	{0x0E8C, 0x0EA3, G_UNICODE_SCRIPT_LAO},
+	{0x0EA5, 0x0EA5, G_UNICODE_SCRIPT_LAO},
+	{0x0EA7, 0x0EB0, G_UNICODE_SCRIPT_LAO},
+	{0x0EB2, 0x0EB3, G_UNICODE_SCRIPT_LAO},
+	{0x0EBD, 0x0EBD, G_UNICODE_SCRIPT_LAO},
+	{0x0EC0, 0x0EC4, G_UNICODE_SCRIPT_LAO},
+	{0x0EC6, 0x0EC6, G_UNICODE_SCRIPT_LAO},
+	{0x0EDC, 0x0EDF, G_UNICODE_SCRIPT_LAO},
+	{0x0F00, 0x0F00, G_UNICODE_SCRIPT_TIBETAN},
+	{0x0F40, 0x0F47, G_UNICODE_SCRIPT_TIBETAN},
+	{0x0F49, 0x0F6C, G_UNICODE_SCRIPT_TIBETAN},
+	{0x0F88, 0x0F8C, G_UNICODE_SCRIPT_TIBETAN},
+	{0x1000, 0x102A, G_UNICODE_SCRIPT_MYANMAR},
+	{0x103F, 0x103F, G_UNICODE_SCRIPT_MYANMAR},
+	{0x1050, 0x1055, G_UNICODE_SCRIPT_MYANMAR},
+	{0x105A, 0x105D, G_UNICODE_SCRIPT_MYANMAR},
+	{0x1061, 0x1061, G_UNICODE_SCRIPT_MYANMAR},
+	{0x1065, 0x1066, G_UNICODE_SCRIPT_MYANMAR},
+	{0x106E, 0x1070, G_UNICODE_SCRIPT_MYANMAR},
+	{0x1075, 0x1081, G_UNICODE_SCRIPT_MYANMAR},
+	{0x108E, 0x108E, G_UNICODE_SCRIPT_MYANMAR},
+	{0x10A0, 0x10C5, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x10C7, 0x10C7, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x10CD, 0x10CD, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x10D0, 0x10FA, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x10FC, 0x10FF, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x1100, 0x11FF, G_UNICODE_SCRIPT_HANGUL},
+	{0x1200, 0x1248, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x124A, 0x124D, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1250, 0x1256, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1258, 0x1258, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x125A, 0x125D, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1260, 0x1288, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x128A, 0x128D, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1290, 0x12B0, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x12B2, 0x12B5, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x12B8, 0x12BE, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x12C0, 0x12C0, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x12C2, 0x12C5, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x12C8, 0x12D6, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x12D8, 0x1310, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1312, 0x1315, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1318, 0x135A, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1380, 0x138F, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x13A0, 0x13F5, G_UNICODE_SCRIPT_CHEROKEE},
+	{0x13F8, 0x13FD, G_UNICODE_SCRIPT_CHEROKEE},
+	{0x1401, 0x166C, G_UNICODE_SCRIPT_CANADIAN_ABORIGINAL},
+	{0x166F, 0x167F, G_UNICODE_SCRIPT_CANADIAN_ABORIGINAL},
+	{0x1681, 0x169A, G_UNICODE_SCRIPT_OGHAM},
+	{0x16A0, 0x16EA, G_UNICODE_SCRIPT_RUNIC},
+	{0x16F1, 0x16F8, G_UNICODE_SCRIPT_RUNIC},
+	{0x1700, 0x1711, G_UNICODE_SCRIPT_TAGALOG},
+	{0x171F, 0x171F, G_UNICODE_SCRIPT_TAGALOG},
+	{0x1720, 0x1731, G_UNICODE_SCRIPT_HANUNOO},
+	{0x1740, 0x1751, G_UNICODE_SCRIPT_BUHID},
+	{0x1760, 0x176C, G_UNICODE_SCRIPT_TAGBANWA},
+	{0x176E, 0x1770, G_UNICODE_SCRIPT_TAGBANWA},
+	{0x1780, 0x17B3, G_UNICODE_SCRIPT_KHMER},
+	{0x17D7, 0x17D7, G_UNICODE_SCRIPT_KHMER},
+	{0x17DC, 0x17DC, G_UNICODE_SCRIPT_KHMER},
+	{0x1820, 0x1878, G_UNICODE_SCRIPT_MONGOLIAN},
+	{0x1880, 0x1884, G_UNICODE_SCRIPT_MONGOLIAN},
+	{0x1887, 0x18A8, G_UNICODE_SCRIPT_MONGOLIAN},
+	{0x18AA, 0x18AA, G_UNICODE_SCRIPT_MONGOLIAN},
+	{0x18B0, 0x18F5, G_UNICODE_SCRIPT_CANADIAN_ABORIGINAL},
+	{0x1900, 0x191E, G_UNICODE_SCRIPT_LIMBU},
+	{0x1950, 0x196D, G_UNICODE_SCRIPT_TAI_LE},
+	{0x1970, 0x1974, G_UNICODE_SCRIPT_TAI_LE},
+	{0x1980, 0x19AB, G_UNICODE_SCRIPT_NEW_TAI_LUE},
+	{0x19B0, 0x19C9, G_UNICODE_SCRIPT_NEW_TAI_LUE},
+	{0x1A00, 0x1A16, G_UNICODE_SCRIPT_BUGINESE},
+	{0x1B05, 0x1B33, G_UNICODE_SCRIPT_BALINESE},
+	{0x1B45, 0x1B4C, G_UNICODE_SCRIPT_BALINESE},
+	{0x1C80, 0x1C88, G_UNICODE_SCRIPT_CYRILLIC},
+	{0x1C90, 0x1CBA, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x1CBD, 0x1CBF, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x1CE9, 0x1CEC, G_UNICODE_SCRIPT_COMMON},
+	{0x1CEE, 0x1CF3, G_UNICODE_SCRIPT_COMMON},
+	{0x1CF5, 0x1CF6, G_UNICODE_SCRIPT_COMMON},
+	{0x1CFA, 0x1CFA, G_UNICODE_SCRIPT_COMMON},
+	{0x1D00, 0x1D25, G_UNICODE_SCRIPT_LATIN},
+	{0x1D26, 0x1D2A, G_UNICODE_SCRIPT_GREEK},
+	{0x1D2B, 0x1D2B, G_UNICODE_SCRIPT_CYRILLIC},
+	{0x1D2C, 0x1D5C, G_UNICODE_SCRIPT_LATIN},
+	{0x1D5D, 0x1D61, G_UNICODE_SCRIPT_GREEK},
+	{0x1D62, 0x1D65, G_UNICODE_SCRIPT_LATIN},
+	{0x1D66, 0x1D6A, G_UNICODE_SCRIPT_GREEK},
+	{0x1D6B, 0x1D77, G_UNICODE_SCRIPT_LATIN},
+	{0x1D78, 0x1D78, G_UNICODE_SCRIPT_CYRILLIC},
+	{0x1D79, 0x1DBE, G_UNICODE_SCRIPT_LATIN},
+	{0x1DBF, 0x1DBF, G_UNICODE_SCRIPT_GREEK},
+	{0x1E00, 0x1EFF, G_UNICODE_SCRIPT_LATIN},
+	{0x1F00, 0x1F15, G_UNICODE_SCRIPT_GREEK},
+	{0x1F18, 0x1F1D, G_UNICODE_SCRIPT_GREEK},
+	{0x1F20, 0x1F45, G_UNICODE_SCRIPT_GREEK},
+	{0x1F48, 0x1F4D, G_UNICODE_SCRIPT_GREEK},
+	{0x1F50, 0x1F57, G_UNICODE_SCRIPT_GREEK},
+	{0x1F59, 0x1F59, G_UNICODE_SCRIPT_GREEK},
+	{0x1F5B, 0x1F5B, G_UNICODE_SCRIPT_GREEK},
+	{0x1F5D, 0x1F5D, G_UNICODE_SCRIPT_GREEK},
+	{0x1F5F, 0x1F7D, G_UNICODE_SCRIPT_GREEK},
+	{0x1F80, 0x1FB4, G_UNICODE_SCRIPT_GREEK},
+	{0x1FB6, 0x1FBC, G_UNICODE_SCRIPT_GREEK},
+	{0x1FBE, 0x1FBE, G_UNICODE_SCRIPT_GREEK},
+	{0x1FC2, 0x1FC4, G_UNICODE_SCRIPT_GREEK},
+	{0x1FC6, 0x1FCC, G_UNICODE_SCRIPT_GREEK},
+	{0x1FD0, 0x1FD3, G_UNICODE_SCRIPT_GREEK},
+	{0x1FD6, 0x1FDB, G_UNICODE_SCRIPT_GREEK},
+	{0x1FE0, 0x1FEC, G_UNICODE_SCRIPT_GREEK},
+	{0x1FF2, 0x1FF4, G_UNICODE_SCRIPT_GREEK},
+	{0x1FF6, 0x1FFC, G_UNICODE_SCRIPT_GREEK},
+	{0x2071, 0x2071, G_UNICODE_SCRIPT_LATIN},
+	{0x207F, 0x207F, G_UNICODE_SCRIPT_LATIN},
+	{0x2090, 0x209C, G_UNICODE_SCRIPT_LATIN},
+	{0x2102, 0x2102, G_UNICODE_SCRIPT_COMMON},
+	{0x2107, 0x2107, G_UNICODE_SCRIPT_COMMON},
+	{0x210A, 0x2113, G_UNICODE_SCRIPT_COMMON},
+	{0x2115, 0x2115, G_UNICODE_SCRIPT_COMMON},
+	{0x2119, 0x211D, G_UNICODE_SCRIPT_COMMON},
+	{0x2124, 0x2124, G_UNICODE_SCRIPT_COMMON},
+	{0x2126, 0x2126, G_UNICODE_SCRIPT_GREEK},
+	{0x2128, 0x2128, G_UNICODE_SCRIPT_COMMON},
+	{0x212A, 0x212B, G_UNICODE_SCRIPT_LATIN},
+	{0x212C, 0x212D, G_UNICODE_SCRIPT_COMMON},
+	{0x212F, 0x2131, G_UNICODE_SCRIPT_COMMON},
+	{0x2132, 0x2132, G_UNICODE_SCRIPT_LATIN},
+	{0x2133, 0x2139, G_UNICODE_SCRIPT_COMMON},
+	{0x213C, 0x213F, G_UNICODE_SCRIPT_COMMON},
+	{0x2145, 0x2149, G_UNICODE_SCRIPT_COMMON},
+	{0x214E, 0x214E, G_UNICODE_SCRIPT_LATIN},
+	{0x2183, 0x2184, G_UNICODE_SCRIPT_LATIN},
+	{0x2C00, 0x2C5F, G_UNICODE_SCRIPT_GLAGOLITIC},
+	{0x2C60, 0x2C7F, G_UNICODE_SCRIPT_LATIN},
+	{0x2C80, 0x2CE4, G_UNICODE_SCRIPT_COPTIC},
+	{0x2CEB, 0x2CEE, G_UNICODE_SCRIPT_COPTIC},
+	{0x2CF2, 0x2CF3, G_UNICODE_SCRIPT_COPTIC},
+	{0x2D00, 0x2D25, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x2D27, 0x2D27, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x2D2D, 0x2D2D, G_UNICODE_SCRIPT_GEORGIAN},
+	{0x2D30, 0x2D67, G_UNICODE_SCRIPT_TIFINAGH},
+	{0x2D6F, 0x2D6F, G_UNICODE_SCRIPT_TIFINAGH},
+	{0x2D80, 0x2D96, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x2DA0, 0x2DA6, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x2DA8, 0x2DAE, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x2DB0, 0x2DB6, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x2DB8, 0x2DBE, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x2DC0, 0x2DC6, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x2DC8, 0x2DCE, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x2DD0, 0x2DD6, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x2DD8, 0x2DDE, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x2E2F, 0x2E2F, G_UNICODE_SCRIPT_COMMON},
+	{0x3005, 0x3005, G_UNICODE_SCRIPT_HAN},
+	{0x3006, 0x3006, G_UNICODE_SCRIPT_COMMON},
+	{0x3031, 0x3035, G_UNICODE_SCRIPT_COMMON},
+	{0x303B, 0x303B, G_UNICODE_SCRIPT_HAN},
+	{0x303C, 0x303C, G_UNICODE_SCRIPT_COMMON},
+	{0x3041, 0x3096, G_UNICODE_SCRIPT_HIRAGANA},
+	{0x309D, 0x309F, G_UNICODE_SCRIPT_HIRAGANA},
+	{0x30A1, 0x30FA, G_UNICODE_SCRIPT_KATAKANA},
+	{0x30FC, 0x30FC, G_UNICODE_SCRIPT_COMMON},
+	{0x30FD, 0x30FF, G_UNICODE_SCRIPT_KATAKANA},
+	{0x3105, 0x312F, G_UNICODE_SCRIPT_BOPOMOFO},
+	{0x3131, 0x318E, G_UNICODE_SCRIPT_HANGUL},
+	{0x31A0, 0x31BF, G_UNICODE_SCRIPT_BOPOMOFO},
+	{0x31F0, 0x31FF, G_UNICODE_SCRIPT_KATAKANA},
+	{0x3400, 0x4DBF, G_UNICODE_SCRIPT_HAN},
+	{0x4E00, 0x9FFF, G_UNICODE_SCRIPT_HAN},
+	{0xA000, 0xA48C, G_UNICODE_SCRIPT_YI},
+	{0xA640, 0xA66E, G_UNICODE_SCRIPT_CYRILLIC},
+	{0xA67F, 0xA69D, G_UNICODE_SCRIPT_CYRILLIC},
+	{0xA717, 0xA71F, G_UNICODE_SCRIPT_COMMON},
+	{0xA722, 0xA787, G_UNICODE_SCRIPT_LATIN},
+	{0xA788, 0xA788, G_UNICODE_SCRIPT_COMMON},
+	{0xA78B, 0xA7CA, G_UNICODE_SCRIPT_LATIN},
+	{0xA7D0, 0xA7D1, G_UNICODE_SCRIPT_LATIN},
+	{0xA7D3, 0xA7D3, G_UNICODE_SCRIPT_LATIN},
+	{0xA7D5, 0xA7D9, G_UNICODE_SCRIPT_LATIN},
+	{0xA7F2, 0xA7FF, G_UNICODE_SCRIPT_LATIN},
+	{0xA800, 0xA801, G_UNICODE_SCRIPT_SYLOTI_NAGRI},
+	{0xA803, 0xA805, G_UNICODE_SCRIPT_SYLOTI_NAGRI},
+	{0xA807, 0xA80A, G_UNICODE_SCRIPT_SYLOTI_NAGRI},
+	{0xA80C, 0xA822, G_UNICODE_SCRIPT_SYLOTI_NAGRI},
+	{0xA840, 0xA873, G_UNICODE_SCRIPT_PHAGS_PA},
+	{0xA8F2, 0xA8F7, G_UNICODE_SCRIPT_DEVANAGARI},
+	{0xA8FB, 0xA8FB, G_UNICODE_SCRIPT_DEVANAGARI},
+	{0xA8FD, 0xA8FE, G_UNICODE_SCRIPT_DEVANAGARI},
+	{0xA960, 0xA97C, G_UNICODE_SCRIPT_HANGUL},
+	{0xA9CF, 0xA9CF, G_UNICODE_SCRIPT_COMMON},
+	{0xA9E0, 0xA9E4, G_UNICODE_SCRIPT_MYANMAR},
+	{0xA9E6, 0xA9EF, G_UNICODE_SCRIPT_MYANMAR},
+	{0xA9FA, 0xA9FE, G_UNICODE_SCRIPT_MYANMAR},
+	{0xAA60, 0xAA76, G_UNICODE_SCRIPT_MYANMAR},
+	{0xAA7A, 0xAA7A, G_UNICODE_SCRIPT_MYANMAR},
+	{0xAA7E, 0xAA7F, G_UNICODE_SCRIPT_MYANMAR},
+	{0xAB01, 0xAB06, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0xAB09, 0xAB0E, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0xAB11, 0xAB16, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0xAB20, 0xAB26, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0xAB28, 0xAB2E, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0xAB30, 0xAB5A, G_UNICODE_SCRIPT_LATIN},
+	{0xAB5C, 0xAB64, G_UNICODE_SCRIPT_LATIN},
+	{0xAB65, 0xAB65, G_UNICODE_SCRIPT_GREEK},
+	{0xAB66, 0xAB69, G_UNICODE_SCRIPT_LATIN},
+	{0xAB70, 0xABBF, G_UNICODE_SCRIPT_CHEROKEE},
+	{0xAC00, 0xD7A3, G_UNICODE_SCRIPT_HANGUL},
+	{0xD7B0, 0xD7C6, G_UNICODE_SCRIPT_HANGUL},
+	{0xD7CB, 0xD7FB, G_UNICODE_SCRIPT_HANGUL},
+	{0xF900, 0xFA6D, G_UNICODE_SCRIPT_HAN},
+	{0xFA70, 0xFAD9, G_UNICODE_SCRIPT_HAN},
+	{0xFB00, 0xFB06, G_UNICODE_SCRIPT_LATIN},
+	{0xFB13, 0xFB17, G_UNICODE_SCRIPT_ARMENIAN},
+	{0xFB1D, 0xFB1D, G_UNICODE_SCRIPT_HEBREW},
+	{0xFB1F, 0xFB28, G_UNICODE_SCRIPT_HEBREW},
+	{0xFB2A, 0xFB36, G_UNICODE_SCRIPT_HEBREW},
+	{0xFB38, 0xFB3C, G_UNICODE_SCRIPT_HEBREW},
+	{0xFB3E, 0xFB3E, G_UNICODE_SCRIPT_HEBREW},
+	{0xFB40, 0xFB41, G_UNICODE_SCRIPT_HEBREW},
+	{0xFB43, 0xFB44, G_UNICODE_SCRIPT_HEBREW},
+	{0xFB46, 0xFB4F, G_UNICODE_SCRIPT_HEBREW},
+	{0xFB50, 0xFBB1, G_UNICODE_SCRIPT_ARABIC},
+	{0xFBD3, 0xFD3D, G_UNICODE_SCRIPT_ARABIC},
+	{0xFD50, 0xFD8F, G_UNICODE_SCRIPT_ARABIC},
+	{0xFD92, 0xFDC7, G_UNICODE_SCRIPT_ARABIC},
+	{0xFDF0, 0xFDFB, G_UNICODE_SCRIPT_ARABIC},
+	{0xFE70, 0xFE74, G_UNICODE_SCRIPT_ARABIC},
+	{0xFE76, 0xFEFC, G_UNICODE_SCRIPT_ARABIC},
+	{0xFF21, 0xFF3A, G_UNICODE_SCRIPT_LATIN},
+	{0xFF41, 0xFF5A, G_UNICODE_SCRIPT_LATIN},
+	{0xFF66, 0xFF6F, G_UNICODE_SCRIPT_KATAKANA},
+	{0xFF70, 0xFF70, G_UNICODE_SCRIPT_COMMON},
+	{0xFF71, 0xFF9D, G_UNICODE_SCRIPT_KATAKANA},
+	{0xFF9E, 0xFF9F, G_UNICODE_SCRIPT_COMMON},
+	{0xFFA0, 0xFFBE, G_UNICODE_SCRIPT_HANGUL},
+	{0xFFC2, 0xFFC7, G_UNICODE_SCRIPT_HANGUL},
+	{0xFFCA, 0xFFCF, G_UNICODE_SCRIPT_HANGUL},
+	{0xFFD2, 0xFFD7, G_UNICODE_SCRIPT_HANGUL},
+	{0xFFDA, 0xFFDC, G_UNICODE_SCRIPT_HANGUL},
+	{0x10000, 0x1000B, G_UNICODE_SCRIPT_LINEAR_B},
+	{0x1000D, 0x10026, G_UNICODE_SCRIPT_LINEAR_B},
+	{0x10028, 0x1003A, G_UNICODE_SCRIPT_LINEAR_B},
+	{0x1003C, 0x1003D, G_UNICODE_SCRIPT_LINEAR_B},
+	{0x1003F, 0x1004D, G_UNICODE_SCRIPT_LINEAR_B},
+	{0x10050, 0x1005D, G_UNICODE_SCRIPT_LINEAR_B},
+	{0x10080, 0x100FA, G_UNICODE_SCRIPT_LINEAR_B},
+	{0x10300, 0x1031F, G_UNICODE_SCRIPT_OLD_ITALIC},
+	{0x1032D, 0x1032F, G_UNICODE_SCRIPT_OLD_ITALIC},
+	{0x10330, 0x10340, G_UNICODE_SCRIPT_GOTHIC},
+	{0x10342, 0x10349, G_UNICODE_SCRIPT_GOTHIC},
+	{0x10380, 0x1039D, G_UNICODE_SCRIPT_UGARITIC},
+	{0x103A0, 0x103C3, G_UNICODE_SCRIPT_OLD_PERSIAN},
+	{0x103C8, 0x103CF, G_UNICODE_SCRIPT_OLD_PERSIAN},
+	{0x10400, 0x1044F, G_UNICODE_SCRIPT_DESERET},
+	{0x10450, 0x1047F, G_UNICODE_SCRIPT_SHAVIAN},
+	{0x10480, 0x1049D, G_UNICODE_SCRIPT_OSMANYA},
+	{0x10780, 0x10785, G_UNICODE_SCRIPT_LATIN},
+	{0x10787, 0x107B0, G_UNICODE_SCRIPT_LATIN},
+	{0x107B2, 0x107BA, G_UNICODE_SCRIPT_LATIN},
+	{0x10800, 0x10805, G_UNICODE_SCRIPT_CYPRIOT},
+	{0x10808, 0x10808, G_UNICODE_SCRIPT_CYPRIOT},
+	{0x1080A, 0x10835, G_UNICODE_SCRIPT_CYPRIOT},
+	{0x10837, 0x10838, G_UNICODE_SCRIPT_CYPRIOT},
+	{0x1083C, 0x1083C, G_UNICODE_SCRIPT_CYPRIOT},
+	{0x1083F, 0x1083F, G_UNICODE_SCRIPT_CYPRIOT},
+	{0x10900, 0x10915, G_UNICODE_SCRIPT_PHOENICIAN},
+	{0x10A00, 0x10A00, G_UNICODE_SCRIPT_KHAROSHTHI},
+	{0x10A10, 0x10A13, G_UNICODE_SCRIPT_KHAROSHTHI},
+	{0x10A15, 0x10A17, G_UNICODE_SCRIPT_KHAROSHTHI},
+	{0x10A19, 0x10A35, G_UNICODE_SCRIPT_KHAROSHTHI},
+	{0x11AB0, 0x11ABF, G_UNICODE_SCRIPT_CANADIAN_ABORIGINAL},
+	{0x12000, 0x12399, G_UNICODE_SCRIPT_CUNEIFORM},
+	{0x12480, 0x12543, G_UNICODE_SCRIPT_CUNEIFORM},
+	{0x16FE3, 0x16FE3, G_UNICODE_SCRIPT_HAN},
+	{0x1AFF0, 0x1AFF3, G_UNICODE_SCRIPT_KATAKANA},
+	{0x1AFF5, 0x1AFFB, G_UNICODE_SCRIPT_KATAKANA},
+	{0x1AFFD, 0x1AFFE, G_UNICODE_SCRIPT_KATAKANA},
+	{0x1B000, 0x1B000, G_UNICODE_SCRIPT_KATAKANA},
+	{0x1B001, 0x1B11F, G_UNICODE_SCRIPT_HIRAGANA},
+	{0x1B120, 0x1B122, G_UNICODE_SCRIPT_KATAKANA},
+	{0x1B132, 0x1B132, G_UNICODE_SCRIPT_HIRAGANA},
+	{0x1B150, 0x1B152, G_UNICODE_SCRIPT_HIRAGANA},
+	{0x1B155, 0x1B155, G_UNICODE_SCRIPT_KATAKANA},
+	{0x1B164, 0x1B167, G_UNICODE_SCRIPT_KATAKANA},
+	{0x1D400, 0x1D454, G_UNICODE_SCRIPT_COMMON},
+	{0x1D456, 0x1D49C, G_UNICODE_SCRIPT_COMMON},
+	{0x1D49E, 0x1D49F, G_UNICODE_SCRIPT_COMMON},
+	{0x1D4A2, 0x1D4A2, G_UNICODE_SCRIPT_COMMON},
+	{0x1D4A5, 0x1D4A6, G_UNICODE_SCRIPT_COMMON},
+	{0x1D4A9, 0x1D4AC, G_UNICODE_SCRIPT_COMMON},
+	{0x1D4AE, 0x1D4B9, G_UNICODE_SCRIPT_COMMON},
+	{0x1D4BB, 0x1D4BB, G_UNICODE_SCRIPT_COMMON},
+	{0x1D4BD, 0x1D4C3, G_UNICODE_SCRIPT_COMMON},
+	{0x1D4C5, 0x1D505, G_UNICODE_SCRIPT_COMMON},
+	{0x1D507, 0x1D50A, G_UNICODE_SCRIPT_COMMON},
+	{0x1D50D, 0x1D514, G_UNICODE_SCRIPT_COMMON},
+	{0x1D516, 0x1D51C, G_UNICODE_SCRIPT_COMMON},
+	{0x1D51E, 0x1D539, G_UNICODE_SCRIPT_COMMON},
+	{0x1D53B, 0x1D53E, G_UNICODE_SCRIPT_COMMON},
+	{0x1D540, 0x1D544, G_UNICODE_SCRIPT_COMMON},
+	{0x1D546, 0x1D546, G_UNICODE_SCRIPT_COMMON},
+	{0x1D54A, 0x1D550, G_UNICODE_SCRIPT_COMMON},
+	{0x1D552, 0x1D6A5, G_UNICODE_SCRIPT_COMMON},
+	{0x1D6A8, 0x1D6C0, G_UNICODE_SCRIPT_COMMON},
+	{0x1D6C2, 0x1D6DA, G_UNICODE_SCRIPT_COMMON},
+	{0x1D6DC, 0x1D6FA, G_UNICODE_SCRIPT_COMMON},
+	{0x1D6FC, 0x1D714, G_UNICODE_SCRIPT_COMMON},
+	{0x1D716, 0x1D734, G_UNICODE_SCRIPT_COMMON},
+	{0x1D736, 0x1D74E, G_UNICODE_SCRIPT_COMMON},
+	{0x1D750, 0x1D76E, G_UNICODE_SCRIPT_COMMON},
+	{0x1D770, 0x1D788, G_UNICODE_SCRIPT_COMMON},
+	{0x1D78A, 0x1D7A8, G_UNICODE_SCRIPT_COMMON},
+	{0x1D7AA, 0x1D7C2, G_UNICODE_SCRIPT_COMMON},
+	{0x1D7C4, 0x1D7CB, G_UNICODE_SCRIPT_COMMON},
+	{0x1DF00, 0x1DF1E, G_UNICODE_SCRIPT_LATIN},
+	{0x1DF25, 0x1DF2A, G_UNICODE_SCRIPT_LATIN},
+	{0x1E030, 0x1E06D, G_UNICODE_SCRIPT_CYRILLIC},
+	{0x1E7E0, 0x1E7E6, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1E7E8, 0x1E7EB, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1E7ED, 0x1E7EE, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1E7F0, 0x1E7FE, G_UNICODE_SCRIPT_ETHIOPIC},
+	{0x1EE00, 0x1EE03, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE05, 0x1EE1F, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE21, 0x1EE22, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE24, 0x1EE24, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE27, 0x1EE27, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE29, 0x1EE32, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE34, 0x1EE37, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE39, 0x1EE39, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE3B, 0x1EE3B, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE42, 0x1EE42, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE47, 0x1EE47, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE49, 0x1EE49, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE4B, 0x1EE4B, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE4D, 0x1EE4F, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE51, 0x1EE52, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE54, 0x1EE54, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE57, 0x1EE57, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE59, 0x1EE59, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE5B, 0x1EE5B, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE5D, 0x1EE5D, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE5F, 0x1EE5F, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE61, 0x1EE62, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE64, 0x1EE64, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE67, 0x1EE6A, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE6C, 0x1EE72, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE74, 0x1EE77, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE79, 0x1EE7C, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE7E, 0x1EE7E, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE80, 0x1EE89, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EE8B, 0x1EE9B, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EEA1, 0x1EEA3, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EEA5, 0x1EEA9, G_UNICODE_SCRIPT_ARABIC},
+	{0x1EEAB, 0x1EEBB, G_UNICODE_SCRIPT_ARABIC},
+	{0x20000, 0x2A6DF, G_UNICODE_SCRIPT_HAN},
+	{0x2A700, 0x2B739, G_UNICODE_SCRIPT_HAN},
+	{0x2B740, 0x2B81D, G_UNICODE_SCRIPT_HAN},
+	{0x2B820, 0x2CEA1, G_UNICODE_SCRIPT_HAN},
+	{0x2CEB0, 0x2EBE0, G_UNICODE_SCRIPT_HAN},
+	{0x2F800, 0x2FA1D, G_UNICODE_SCRIPT_HAN},
+	{0x30000, 0x3134A, G_UNICODE_SCRIPT_HAN},
+	{0x31350, 0x323AF, G_UNICODE_SCRIPT_HAN}
+};
+
+static const struct rspamd_script_range *
+rspamd_scripts_find_range (gunichar c)
+{
+	gint lo = 0, hi = G_N_ELEMENTS (script_ranges) - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+
+		if (c < script_ranges[mid].start) {
+			hi = mid - 1;
+		}
+		else if (c > script_ranges[mid].end) {
+			lo = mid + 1;
+		}
+		else {
+			return &script_ranges[mid];
+		}
+	}
+
+	return NULL;
+}
+
+static gint
+rspamd_scripts_cmp (const void *a, const void *b)
+{
+	const struct rspamd_script_count *sa = a, *sb = b;
+
+	if (sa->count != sb->count) {
+		return sa->count > sb->count ? -1 : 1;
+	}
+
+	return (gint)sa->script - (gint)sb->script;
+}
+
+/* Check whether the most common script cannot lose its majority */
+static gboolean
+rspamd_scripts_is_confident (const guint *counts, guint processed,
+	guint sample)
+{
+	guint i, first = 0, second = 0;
+
+	for (i = 0; i < G_N_ELEMENTS (scripts_table); i ++) {
+		if (counts[i] > first) {
+			second = first;
+			first = counts[i];
+		}
+		else if (counts[i] > second) {
+			second = counts[i];
+		}
+	}
+
+	return first * 100 >= processed * SCRIPTS_MAJORITY ||
+		   first - second > sample - processed;
+}
+
+struct rspamd_script_count *
+rspamd_scripts_detect (rspamd_mempool_t *pool,
+	const guchar *text, gsize len, guint sample, guint *nscripts)
+{
+	const guchar *p = text, *end = text + len;
+	const struct rspamd_script_range *last = NULL, *r;
+	struct rspamd_script_count *res;
+	guint counts[G_N_ELEMENTS (scripts_table)];
+	guint processed = 0, i, n;
+	gunichar c;
+
+	memset (counts, 0, sizeof (counts));
+	sample = MAX (sample, SCRIPTS_MIN_SAMPLE);
+
+	while (p < end && processed < sample) {
+		if (*p < 0x80) {
+			if (g_ascii_isalpha (*p)) {
+				counts[G_UNICODE_SCRIPT_LATIN] ++;
+				processed ++;
+			}
+			p ++;
+		}
+		else {
+			if (*p < 0xe0) {
+				if (end - p < 2) {
+					break;
+				}
+				c = ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+				p += 2;
+			}
+			else if (*p < 0xf0) {
+				if (end - p < 3) {
+					break;
+				}
+				c = ((p[0] & 0x0f) << 12) | ((p[1] & 0x3f) << 6) |
+					(p[2] & 0x3f);
+				p += 3;
+			}
+			else {
+				if (end - p < 4) {
+					break;
+				}
+				c = ((p[0] & 0x07) << 18) | ((p[1] & 0x3f) << 12) |
+					((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+				p += 4;
+			}
+
+			/* Neighbour letters are likely to belong to the same range */
+			if (last != NULL && c >= last->start && c <= last->end) {
+				r = last;
+			}
+			else {
+				r = rspamd_scripts_find_range (c);
+			}
+
+			if (r != NULL) {
+				counts[r->script] ++;
+				processed ++;
+				last = r;
+			}
+		}
+
+		if (processed >= SCRIPTS_MIN_SAMPLE &&
+			processed % SCRIPTS_MIN_SAMPLE == 0 &&
+			rspamd_scripts_is_confident (counts, processed, sample)) {
+			break;
+		}
+	}
+
+	for (i = 0, n = 0; i < G_N_ELEMENTS (counts); i ++) {
+		if (counts[i] > 0) {
+			n ++;
+		}
+	}
+
+	*nscripts = n;
+
+	if (n == 0) {
+		return NULL;
+	}
+
+	res = rspamd_mempool_alloc (pool, sizeof (*res) * n);
+
+	for (i = 0, n = 0; i < G_N_ELEMENTS (counts); i ++) {
+		if (counts[i] > 0) {
+			res[n].script = i;
+			res[n].count = counts[i];
+			n ++;
+		}
+	}
+
+	qsort (res, n, sizeof (*res), rspamd_scripts_cmp);
+
+	return res;
+}
+
+static const struct rspamd_script_desc *
+rspamd_script_desc (GUnicodeScript script)
+{
+	if ((guint)script < G_N_ELEMENTS (scripts_table) &&
+		scripts_table[script].script == script) {
+		return &scripts_table[script];
+	}
+
+	return NULL;
+}
+
+const gchar *
+rspamd_script_name (GUnicodeScript script)
+{
+	const struct rspamd_script_desc *desc;
+
+	if ((desc = rspamd_script_desc (script)) != NULL) {
+		return desc->script_name;
+	}
+
+	return NULL;
+}
+
+gboolean
+rspamd_script_language (GUnicodeScript script, const gchar **code,
+	const gchar **name)
+{
+	const struct rspamd_script_desc *desc;
+
+	if ((desc = rspamd_script_desc (script)) != NULL) {
+		*code = desc->code;
+		*name = desc->name;
+		return TRUE;
+	}
+
+	return FALSE;
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file scripts.h
+ * Detection of unicode scripts used in a text
+ */
+
+#ifndef RSPAMD_SCRIPTS_H
+#define RSPAMD_SCRIPTS_H
+
+#include "config.h"
+#include "mem_pool.h"
+
+struct rspamd_script_count {
+	GUnicodeScript script;
+	guint count;
+};
+
+/**
+ * Count letters of each script in utf8 text. Detection stops after `sample`
+ * letters or earlier if a single script is used by the most of letters.
+ * @param pool memory pool for the result
+ * @param text valid utf8 text
+ * @param len length of text
+ * @param sample maximum number of letters to check, at least 32 letters are
+ * checked
+ * @param nscripts number of scripts found
+ * @return array of scripts sorted by number of letters or NULL if no letters
+ * have been found
+ */
+struct rspamd_script_count * rspamd_scripts_detect (rspamd_mempool_t *pool,
+	const guchar *text, gsize len, guint sample, guint *nscripts);
+
+/**
+ * Get name of a script
+ * @param script script
+ * @return lowercased name or NULL for unknown scripts
+ */
+const gchar * rspamd_script_name (GUnicodeScript script);
+
+/**
+ * Get language usually written with a script
+ * @param script script
+ * @param code iso code of language, may be empty
+ * @param name name of language, may be empty
+ * @return TRUE if script is known
+ */
+gboolean rspamd_script_language (GUnicodeScript script, const gchar **code,
+	const gchar **name);
+
+#endif
@@ -26,6 +26,7 @@
 #include "filter.h"
 #include "smtp.h"
 #include "smtp_proto.h"
+#include "message.h"
 
 void
 free_smtp_session (gpointer arg)
@@ -299,6 +300,9 @@ write_smtp_reply (struct smtp_session *session)
 	}
 	else if (cd.action <= METRIC_ACTION_ADD_HEADER || cd.action <=
 		METRIC_ACTION_REWRITE_SUBJECT) {
+		if (message_get_gmime (session->task) == NULL) {
+			goto err;
+		}
 		old_fd = session->temp_fd;
 		if (!make_smtp_tempfile (session)) {
 			session->error = SMTP_ERROR_FILE;
@@ -74,6 +74,7 @@ struct rspamd_regexp {
 	gboolean is_test;                               /**< true if this expression must be tested				*/
 	gboolean is_raw;                                /**< true if this regexp is done by raw matching		*/
 	gboolean is_strong;                             /**< true if headers search must be case sensitive		*/
+	guint id;                                       /**< dense id used to index task's regexps cache		*/
 };
 
 /**
@@ -208,6 +209,7 @@ struct rspamd_config {
 	gboolean check_all_filters;                     /**< check all filters									*/
 
 	gsize max_diff;                                 /**< maximum diff size for text parts					*/
+	guint lang_detection_sample;                    /**< maximum letters to detect script of a part		*/
 
 	enum rspamd_log_type log_type;                  /**< log type											*/
 	gint log_facility;                              /**< log facility in case of syslog						*/
@@ -264,6 +266,7 @@ struct rspamd_config {
 
 	struct symbols_cache *cache;                    /**< symbols cache object								*/
 	gchar *cache_filename;                          /**< filename of cache file								*/
+	guint re_ids;                                   /**< number of regexps parsed for this config			*/
 	struct metric *default_metric;                  /**< default metric										*/
 
 	gchar * checksum;                                /**< real checksum of config file						*/
@@ -279,6 +282,9 @@ struct rspamd_config {
 	guint32 dns_throttling_errors;                  /**< maximum errors for starting resolver throttling	*/
 	guint32 dns_throttling_time;                    /**< time in seconds for DNS throttling					*/
 	guint32 dns_io_per_server;                      /**< number of sockets per DNS server					*/
+	guint32 dns_cache_size;                         /**< number of DNS replies cached by a worker			*/
+	guint32 dns_cache_negative_ttl;                 /**< time in milliseconds to cache negative replies	*/
+	guint32 dns_shared_cache_size;                  /**< number of DNS replies shared by workers			*/
 	GList *nameservers;                             /**< list of nameservers or NULL to parse resolv.conf	*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
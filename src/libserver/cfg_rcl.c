@@ -1200,6 +1200,21 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_config, dns_io_per_server),
 		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"cache_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+		RSPAMD_CL_FLAG_INT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"negative_ttl",
+		rspamd_rcl_parse_struct_time,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+		RSPAMD_CL_FLAG_TIME_UINT_32);
+	rspamd_rcl_add_default_handler (ssub,
+		"shared_cache_size",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, dns_shared_cache_size),
+		RSPAMD_CL_FLAG_INT_32);
 
 	/* New upstreams configuration */
 	ssub = rspamd_rcl_add_section (&sub->subsections, "upstream", NULL,
@@ -1255,6 +1270,11 @@ rspamd_rcl_config_init (void)
 		rspamd_rcl_parse_struct_integer,
 		G_STRUCT_OFFSET (struct rspamd_config, max_diff),
 		RSPAMD_CL_FLAG_INT_SIZE);
+	rspamd_rcl_add_default_handler (sub,
+		"lang_detection_sample",
+		rspamd_rcl_parse_struct_integer,
+		G_STRUCT_OFFSET (struct rspamd_config, lang_detection_sample),
+		RSPAMD_CL_FLAG_INT_32);
 	rspamd_rcl_add_default_handler (sub,
 		"map_watch_interval",
 		rspamd_rcl_parse_struct_time,
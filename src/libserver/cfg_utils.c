@@ -34,6 +34,7 @@
 #include "map.h"
 #include "dynamic_cfg.h"
 #include "utlist.h"
+#include "expressions.h"
 
 #define DEFAULT_SCORE 10.0
 
@@ -139,6 +140,7 @@ rspamd_parse_bind_line (struct rspamd_config *cfg,
 void
 rspamd_config_defaults (struct rspamd_config *cfg)
 {
+	rspamd_regexp_share_ids (cfg->cfg_pool, &cfg->re_ids);
 	cfg->dns_timeout = 1000;
 	cfg->dns_retransmits = 5;
 	/* After 20 errors do throttling for 10 seconds */
@@ -146,9 +148,13 @@ rspamd_config_defaults (struct rspamd_config *cfg)
 	cfg->dns_throttling_time = 10000;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	cfg->dns_cache_size = 2048;
+	cfg->dns_cache_negative_ttl = 30000;
+	cfg->dns_shared_cache_size = 8192;
 
 	/* 20 Kb */
 	cfg->max_diff = 20480;
+	cfg->lang_detection_sample = 256;
 
 	cfg->metrics = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	if (cfg->c_modules == NULL) {
@@ -27,6 +27,9 @@
 #include "dkim.h"
 #include "dns.h"
 #include "utlist.h"
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
 
 /* Parser of dkim params */
 typedef gboolean (*dkim_parse_param_f) (rspamd_dkim_context_t * ctx,
@@ -104,6 +107,23 @@ struct rspamd_dkim_header {
 	guint count;
 };
 
+/* Running hash of a canonicalized body */
+struct rspamd_dkim_body_hash {
+#ifdef HAVE_OPENSSL
+	EVP_MD_CTX *md;
+#else
+	GChecksum *ck;
+#endif
+	gsize remain;
+	gboolean limited;
+};
+
+/* Body hash cached within a task */
+struct rspamd_dkim_body_digest {
+	guchar digest[32];
+	gsize len;
+};
+
 #define DKIM_ERROR dkim_error_quark ()
 GQuark
 dkim_error_quark (void)
@@ -780,11 +800,9 @@ rspamd_create_dkim_context (const gchar *sig,
 
 	/* Create checksums for further operations */
 	if (new->sig_alg == DKIM_SIGN_RSASHA1) {
-		new->body_hash = g_checksum_new (G_CHECKSUM_SHA1);
 		new->headers_hash = g_checksum_new (G_CHECKSUM_SHA1);
 	}
 	else if (new->sig_alg == DKIM_SIGN_RSASHA256) {
-		new->body_hash = g_checksum_new (G_CHECKSUM_SHA256);
 		new->headers_hash = g_checksum_new (G_CHECKSUM_SHA256);
 	}
 	else {
@@ -795,9 +813,6 @@ rspamd_create_dkim_context (const gchar *sig,
 		return NULL;
 	}
 
-	rspamd_mempool_add_destructor (new->pool,
-		(rspamd_mempool_destruct_t)g_checksum_free,
-		new->body_hash);
 	rspamd_mempool_add_destructor (new->pool,
 		(rspamd_mempool_destruct_t)g_checksum_free,
 		new->headers_hash);
@@ -1018,192 +1033,220 @@ rspamd_get_dkim_key (rspamd_dkim_context_t *ctx,
 			   ctx->dns_key);
 }
 
-static gboolean
-rspamd_dkim_relaxed_body_step (GChecksum *ck, const gchar **start, guint size,
-		guint *remain)
+static void
+rspamd_dkim_body_hash_init (struct rspamd_dkim_body_hash *bh, gint sig_alg,
+	gsize limit)
 {
-	const gchar *h;
-	static gchar buf[BUFSIZ];
-	gchar *t;
-	guint len, inlen, added = 0;
-	gboolean got_sp;
-
-	len = size;
-	inlen = sizeof (buf) - 1;
-	h = *start;
-	t = buf;
-	got_sp = FALSE;
+#ifdef HAVE_OPENSSL
+	bh->md = EVP_MD_CTX_create ();
+	EVP_DigestInit_ex (bh->md, sig_alg == DKIM_SIGN_RSASHA256 ?
+			EVP_sha256 () : EVP_sha1 (), NULL);
+#else
+	bh->ck = g_checksum_new (sig_alg == DKIM_SIGN_RSASHA256 ?
+			G_CHECKSUM_SHA256 : G_CHECKSUM_SHA1);
+#endif
+	bh->remain = limit;
+	bh->limited = (limit != 0);
+}
 
-	while (len && inlen) {
-		if (*h == '\r' || *h == '\n') {
-			if (got_sp) {
-				/* Ignore spaces at the end of line */
-				t --;
-			}
-			*t++ = '\r';
-			*t++ = '\n';
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
-			}
-			else {
-				h ++;
-				len --;
-				added ++;
-			}
-			break;
-		}
-		else if (g_ascii_isspace (*h)) {
-			if (got_sp) {
-				/* Ignore multiply spaces */
-				h++;
-				len--;
-				continue;
-			}
-			else {
-				*t++ = ' ';
-				h++;
-				inlen--;
-				len--;
-				got_sp = TRUE;
-				continue;
-			}
-		}
-		else {
-			got_sp = FALSE;
+/* Feed canonicalized data to hash respecting l= tag */
+static void
+rspamd_dkim_body_hash_update (struct rspamd_dkim_body_hash *bh,
+	const gchar *data, gsize len)
+{
+	if (bh->limited) {
+		if (len > bh->remain) {
+			len = bh->remain;
 		}
-		*t++ = *h++;
-		inlen--;
-		len--;
+		bh->remain -= len;
 	}
 
-	*start = h;
-
-	if (*remain > 0) {
-		size_t cklen = MIN(t - buf, *remain + added);
-		g_checksum_update (ck, buf, cklen);
-		*remain = *remain - (cklen - added);
-#if 0
-		msg_debug ("update signature with buffer (%ud size, %ud remain, %ud added): %*s",
-				cklen, *remain, added, cklen, buf);
+	if (len > 0) {
+#ifdef HAVE_OPENSSL
+		EVP_DigestUpdate (bh->md, data, len);
 #else
-		msg_debug ("update signature with body buffer "
-				"(%ud size, %ud remain, %ud added)",
-						cklen, *remain, added);
+		g_checksum_update (bh->ck, data, len);
 #endif
 	}
+}
 
-	return (len != 0);
+static void
+rspamd_dkim_body_hash_final (struct rspamd_dkim_body_hash *bh,
+	guchar *digest, gsize *dlen)
+{
+#ifdef HAVE_OPENSSL
+	guint mdlen = *dlen;
+
+	EVP_DigestFinal_ex (bh->md, digest, &mdlen);
+	EVP_MD_CTX_destroy (bh->md);
+	*dlen = mdlen;
+#else
+	g_checksum_get_digest (bh->ck, digest, dlen);
+	g_checksum_free (bh->ck);
+#endif
 }
 
-static gboolean
-rspamd_dkim_simple_body_step (GChecksum *ck, const gchar **start, guint size,
-		guint *remain)
+/*
+ * Feed content of a relaxed line without trailing whitespace, runs of
+ * whitespace are reduced to a single space. Returns the start of the
+ * pending span
+ */
+static const gchar *
+rspamd_dkim_relaxed_line (struct rspamd_dkim_body_hash *bh,
+	const gchar *c, const gchar *p, const gchar *end)
 {
-	const gchar *h;
-	static gchar buf[BUFSIZ];
-	gchar *t;
-	guint len, inlen, added = 0;
-
-	len = size;
-	inlen = sizeof (buf) - 1;
-	h = *start;
-	t = &buf[0];
-
-	while (len && inlen) {
-		if (*h == '\r' || *h == '\n') {
-			*t++ = '\r';
-			*t++ = '\n';
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
+	const gchar *sp;
+
+	while (p < end) {
+		if (*p == ' ' || *p == '\t') {
+			sp = p;
+
+			while (p < end && (*p == ' ' || *p == '\t')) {
+				p ++;
 			}
-			else {
-				h ++;
-				len --;
-				added ++;
+
+			if (p - sp > 1 || *sp != ' ') {
+				rspamd_dkim_body_hash_update (bh, c, sp - c);
+				rspamd_dkim_body_hash_update (bh, " ", 1);
+				c = p;
 			}
-			break;
 		}
-		*t++ = *h++;
-		inlen--;
-		len--;
-	}
-
-	*start = h;
-
-	if (*remain > 0) {
-		size_t cklen = MIN(t - buf, *remain + added);
-		g_checksum_update (ck, buf, cklen);
-		*remain = *remain - (cklen - added);
-		msg_debug ("update signature with body buffer "
-				"(%ud size, %ud remain, %ud added)",
-				cklen, *remain, added);
+		else {
+			p ++;
+		}
 	}
 
-	return (len != 0);
+	return c;
 }
 
-static gboolean
+/*
+ * Both canonicalizations feed the longest spans that are already canonical
+ * and only emit replacements for bare CR/LF and whitespace runs. Empty lines
+ * are counted and emitted only if a non empty line follows them, so all
+ * empty lines at the end of body are ignored
+ */
+static void
 rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
 	const gchar *start,
-	const gchar *end)
+	const gchar *end,
+	guchar *digest,
+	gsize *dlen)
 {
-	const gchar *p;
-	guint remain = ctx->len ? ctx->len : end - start;
+	const gchar *p = start, *c = start, *eol, *le, *next;
+	struct rspamd_dkim_body_hash bh;
+	gboolean relaxed, crlf, emitted = FALSE;
+	guint empty = 0;
 
-	if (start == NULL) {
-		/* Empty body */
-		if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-			g_checksum_update (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
-		}
-		else {
-			g_checksum_update (ctx->body_hash, "", 0);
+	rspamd_dkim_body_hash_init (&bh, ctx->sig_alg, ctx->len);
+	relaxed = (ctx->body_canon_type == DKIM_CANON_RELAXED);
+
+	while (p < end) {
+		eol = p;
+
+		while (eol < end && *eol != '\r' && *eol != '\n') {
+			eol ++;
 		}
-	}
-	else {
-		/* Strip extra ending CRLF */
-		p = end - 1;
-		while (p >= start + 2) {
-			if (*p == '\n' && *(p - 1) == '\r' && *(p - 2) == '\n') {
-				p -= 2;
-			}
-			else if (*p == '\n' && *(p - 1) == '\n') {
-				p--;
-			}
-			else if (*p == '\r' && *(p - 1) == '\r') {
-				p--;
-			}
-			else {
-				break;
+
+		crlf = (eol + 1 < end && eol[0] == '\r' && eol[1] == '\n');
+		next = crlf ? eol + 2 : MIN (eol + 1, end);
+		le = eol;
+
+		if (relaxed) {
+			while (le > p && (le[-1] == ' ' || le[-1] == '\t')) {
+				le --;
 			}
 		}
-		end = p + 1;
-		if (end == start) {
-			/* Empty body */
-			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-				g_checksum_update (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
-			}
-			else {
-				g_checksum_update (ctx->body_hash, "", 0);
+
+		if (le == p) {
+			/* Empty line, everything before it is already canonical */
+			if (empty == 0) {
+				rspamd_dkim_body_hash_update (&bh, c, p - c);
 			}
+
+			empty ++;
+			p = next;
+			continue;
 		}
-		else {
-			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-				/* Simple canonization */
-				while (rspamd_dkim_simple_body_step (ctx->body_hash, &start,
-					end - start, &remain)) ;
-			}
-			else {
-				while (rspamd_dkim_relaxed_body_step (ctx->body_hash, &start,
-					end - start, &remain)) ;
+
+		if (empty > 0) {
+			while (empty > 0) {
+				rspamd_dkim_body_hash_update (&bh, CRLF, sizeof (CRLF) - 1);
+				empty --;
 			}
+
+			c = p;
 		}
-		return TRUE;
+
+		if (relaxed) {
+			c = rspamd_dkim_relaxed_line (&bh, c, p, le);
+		}
+
+		if (le != eol || !crlf) {
+			/* Trailing whitespace, bare CR or LF or unterminated last line */
+			rspamd_dkim_body_hash_update (&bh, c, le - c);
+			rspamd_dkim_body_hash_update (&bh, CRLF, sizeof (CRLF) - 1);
+			c = next;
+		}
+
+		emitted = TRUE;
+		p = next;
 	}
 
-	/* TODO: Implement relaxed algorithm */
-	return FALSE;
+	if (empty == 0) {
+		rspamd_dkim_body_hash_update (&bh, c, end - c);
+	}
+
+	if (!emitted && !relaxed) {
+		/* Empty body is a single CRLF in simple mode */
+		rspamd_dkim_body_hash_update (&bh, CRLF, sizeof (CRLF) - 1);
+	}
+
+	rspamd_dkim_body_hash_final (&bh, digest, dlen);
+}
+
+/*
+ * Signatures of a task with the same canonicalization, algorithm and
+ * length limit share the body hash, so it is stored in the task's pool
+ */
+static const struct rspamd_dkim_body_digest *
+rspamd_dkim_get_body_digest (rspamd_dkim_context_t *ctx,
+	struct rspamd_task *task,
+	const gchar *start,
+	const gchar *end)
+{
+	struct rspamd_dkim_body_digest *bd;
+	gchar key[64];
+
+	rspamd_snprintf (key, sizeof (key), "dkim_bh_%d_%d_%z",
+		ctx->body_canon_type, ctx->sig_alg, ctx->len);
+	bd = rspamd_mempool_get_variable (task->task_pool, key);
+
+	if (bd == NULL) {
+		bd = rspamd_mempool_alloc (task->task_pool, sizeof (*bd));
+		bd->len = sizeof (bd->digest);
+		rspamd_dkim_canonize_body (ctx, start, end, bd->digest, &bd->len);
+		rspamd_mempool_set_variable (task->task_pool, key, bd, NULL);
+	}
+	else {
+		msg_debug ("reuse cached body hash for %s", key);
+	}
+
+	return bd;
+}
+
+const guchar *
+rspamd_dkim_body_digest (rspamd_dkim_context_t *ctx,
+	struct rspamd_task *task,
+	const gchar *start,
+	const gchar *end,
+	gsize *dlen)
+{
+	const struct rspamd_dkim_body_digest *bd;
+
+	bd = rspamd_dkim_get_body_digest (ctx, task, start, end);
+	*dlen = bd->len;
+
+	return bd->digest;
 }
 
 /* Update hash converting all CR and LF to CRLF */
@@ -1585,6 +1628,7 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	gint res = DKIM_CONTINUE;
 	guint i;
 	struct rspamd_dkim_header *dh;
+	const struct rspamd_dkim_body_digest *bd;
 #ifdef HAVE_OPENSSL
 	gint nid;
 #endif
@@ -1660,11 +1704,14 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 		p++;
 	}
 
-	/* Start canonization of body part */
-	body_end = end;
-	if (!rspamd_dkim_canonize_body (ctx, headers_end, body_end)) {
+	if (headers_end == NULL) {
 		return DKIM_RECORD_ERROR;
 	}
+
+	/* Start canonization of body part */
+	body_end = end;
+	bd = rspamd_dkim_get_body_digest (ctx, task, headers_end, body_end);
+
 	/* Now canonize headers */
 	for (i = 0; i < ctx->hlist->len; i++) {
 		dh = g_ptr_array_index (ctx->hlist, i);
@@ -1674,17 +1721,15 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	/* Canonize dkim signature */
 	rspamd_dkim_canonize_header (ctx, task, DKIM_SIGNHEADER, 1, TRUE);
 
-	dlen = ctx->bhlen;
-	digest = g_alloca (dlen);
-	g_checksum_get_digest (ctx->body_hash, digest, &dlen);
-
 	/* Check bh field */
-	if (memcmp (ctx->bh, digest, dlen) != 0) {
-		msg_debug ("bh value missmatch: %*xs versus %*xs", dlen, ctx->bh,
-				dlen, digest);
+	if (bd->len != ctx->bhlen || memcmp (ctx->bh, bd->digest, bd->len) != 0) {
+		msg_debug ("bh value missmatch: %*xs versus %*xs", ctx->bhlen, ctx->bh,
+				bd->len, bd->digest);
 		return DKIM_REJECT;
 	}
 
+	dlen = ctx->bhlen;
+	digest = g_alloca (dlen);
 	g_checksum_get_digest (ctx->headers_hash, digest, &dlen);
 #ifdef HAVE_OPENSSL
 	/* Check headers signature */
@@ -148,7 +148,6 @@ typedef struct rspamd_dkim_context_s {
 	guint ver;
 	gchar *dns_key;
 	GChecksum *headers_hash;
-	GChecksum *body_hash;
 } rspamd_dkim_context_t;
 
 typedef struct rspamd_dkim_key_s {
@@ -207,6 +206,22 @@ gint rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	rspamd_dkim_key_t *key,
 	struct rspamd_task *task);
 
+/**
+ * Get digest of canonicalized body, signatures of a task with the same
+ * canonicalization, algorithm and length limit share the digest
+ * @param ctx dkim verify context
+ * @param task task to store the digest in
+ * @param start start of body
+ * @param end end of body
+ * @param dlen length of digest
+ * @return digest allocated in the task's pool
+ */
+const guchar * rspamd_dkim_body_digest (rspamd_dkim_context_t *ctx,
+	struct rspamd_task *task,
+	const gchar *start,
+	const gchar *end,
+	gsize *dlen);
+
 /**
  * Free DKIM key
  * @param key
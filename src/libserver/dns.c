@@ -28,47 +28,647 @@
 #include "main.h"
 #include "utlist.h"
 #include "uthash.h"
+#include "ref.h"
 #include "rdns_event.h"
 
+#define RSPAMD_DNS_STAT_INC(resolver, field) do {	\
+	if ((resolver)->stat != NULL) {						\
+		(resolver)->stat->field ++;						\
+	}													\
+} while (0)
+
+/* Query sent to a server, its reply is passed to all waiting requests */
+struct rspamd_dns_inflight {
+	struct rspamd_dns_resolver *resolver;
+	struct rdns_request *req;
+	gchar *key;
+	GQueue waiters;
+	gboolean replied;
+};
+
+/*
+ * Reply stored in the cache, it is owned either by its request or, if it
+ * has been rebuilt from the shared cache, by the cached reply itself
+ */
+struct rspamd_dns_cached_reply {
+	struct rdns_request *req;
+	struct rdns_reply *reply;
+	ref_entry_t ref;
+};
+
+/*
+ * Reply rebuilt from the shared cache has no request, so it keeps the type
+ * of the query. Entries and strings are placed in the same block
+ */
+struct rspamd_dns_rebuilt_reply {
+	struct rdns_reply reply;
+	enum rdns_request_type type;
+};
+
+/*
+ * Cache of replies shared by all workers. Each slot contains the key of a
+ * query followed by its serialized reply: code, name as it has been
+ * requested and entries with their types, ttls and data. Strings are
+ * stored zero terminated, so rebuilt replies point to the copied data
+ * directly
+ */
+#define RSPAMD_DNS_SHARED_SLOT_SIZE 512
+#define RSPAMD_DNS_SHARED_WAYS 4
+
+struct rspamd_dns_shared_slot {
+	time_t expire;
+	guint32 hash;
+	guint16 keylen;
+	guint16 datalen;
+	guchar data[RSPAMD_DNS_SHARED_SLOT_SIZE - sizeof (time_t) -
+		sizeof (guint32) - sizeof (guint16) * 2];
+};
+
+struct rspamd_dns_shared_cache {
+	rspamd_mempool_mutex_t *lock;
+	guint nsets;
+	struct rspamd_dns_shared_slot *slots;
+};
+
 struct rspamd_dns_request_ud {
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
 	gpointer ud;
 	rspamd_mempool_t *pool;
-	struct rdns_request *req;
+	struct rspamd_dns_inflight *inflight;   /**< query we are waiting for		*/
+	GList link;                             /**< element of waiters queue		*/
+	struct rspamd_dns_cached_reply *cached; /**< cached reply to be delivered	*/
+	struct event ev;
 };
 
+static void
+rspamd_dns_inflight_free (struct rspamd_dns_inflight *inflight)
+{
+	g_free (inflight->key);
+	g_slice_free1 (sizeof (struct rspamd_dns_inflight), inflight);
+}
+
+static void
+rspamd_dns_cached_reply_dtor (struct rspamd_dns_cached_reply *cached)
+{
+	if (cached->req != NULL) {
+		rdns_request_release (cached->req);
+	}
+	else {
+		g_free (cached->reply);
+	}
+
+	g_slice_free1 (sizeof (struct rspamd_dns_cached_reply), cached);
+}
+
+static struct rspamd_dns_cached_reply *
+rspamd_dns_cached_reply_new (struct rdns_request *req, struct rdns_reply *reply)
+{
+	struct rspamd_dns_cached_reply *cached;
+
+	cached = g_slice_alloc (sizeof (struct rspamd_dns_cached_reply));
+	cached->req = req != NULL ? rdns_request_retain (req) : NULL;
+	cached->reply = reply;
+	REF_INIT_RETAIN (cached, rspamd_dns_cached_reply_dtor);
+
+	return cached;
+}
+
+static void
+rspamd_dns_cached_reply_free (gpointer p)
+{
+	struct rspamd_dns_cached_reply *cached = p;
+
+	REF_RELEASE (cached);
+}
+
 static void
 rspamd_dns_fin_cb (gpointer arg)
 {
 	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+	struct rspamd_dns_inflight *inflight = reqdata->inflight;
+
+	if (inflight != NULL) {
+		/* Session is finished before the reply came */
+		g_queue_unlink (&inflight->waiters, &reqdata->link);
+		reqdata->inflight = NULL;
+
+		if (!inflight->replied && g_queue_is_empty (&inflight->waiters)) {
+			/* Nobody else waits for this reply, so cancel the query */
+			g_hash_table_remove (inflight->resolver->inflight, inflight->key);
+			rdns_request_release (inflight->req);
+			rspamd_dns_inflight_free (inflight);
+		}
+	}
+
+	if (reqdata->cached != NULL) {
+		event_del (&reqdata->ev);
+		REF_RELEASE (reqdata->cached);
+		reqdata->cached = NULL;
+	}
 
-	rdns_request_release (reqdata->req);
 	if (reqdata->pool == NULL) {
 		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
 	}
 }
 
 static void
-rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+rspamd_dns_deliver (struct rspamd_dns_request_ud *reqdata,
+	struct rdns_reply *reply)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rspamd_async_watcher *w, *old_w = NULL;
+
+	if (reqdata->session) {
+		/* Attach requests made from callback to the watcher of this request */
+		w = rspamd_session_get_watcher (reqdata->session, rspamd_dns_fin_cb,
+				reqdata);
+		old_w = rspamd_session_watcher_push (reqdata->session, w);
+	}
 
 	reqdata->cb (reply, reqdata->ud);
 
 	if (reqdata->session) {
-		/*
-		 * Ref event to avoid double unref by
-		 * event removing
-		 */
-		rdns_request_retain (reply->request);
+		rspamd_session_watcher_pop (reqdata->session, old_w);
 		remove_normal_event (reqdata->session, rspamd_dns_fin_cb, reqdata);
 	}
-	else if (reqdata->pool == NULL) {
-		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+	else {
+		rspamd_dns_fin_cb (reqdata);
 	}
 }
 
+/*
+ * Returns time in seconds to cache a reply or 0 if it should not be cached.
+ * Negative answers have no usable ttl, as authority section is not
+ * parsed, so the configured one is used for them
+ */
+static guint
+rspamd_dns_reply_ttl (struct rspamd_dns_resolver *resolver,
+	struct rdns_reply *reply)
+{
+	struct rdns_reply_entry *elt;
+	gint32 ttl = G_MAXINT32;
+
+	if (reply->code == RDNS_RC_NXDOMAIN || reply->code == RDNS_RC_NOREC ||
+		(reply->code == RDNS_RC_NOERROR && reply->entries == NULL)) {
+		return resolver->negative_ttl;
+	}
+	else if (reply->code != RDNS_RC_NOERROR) {
+		return 0;
+	}
+
+	DL_FOREACH (reply->entries, elt) {
+		if (elt->ttl < ttl) {
+			ttl = elt->ttl;
+		}
+	}
+
+	return ttl > 0 ? ttl : 0;
+}
+
+/* Append data to a serialized reply, returns FALSE if it does not fit */
+static inline gboolean
+rspamd_dns_shared_append (guchar *buf, gsize *pos, gsize size,
+	gconstpointer data, gsize len)
+{
+	if (*pos + len > size) {
+		return FALSE;
+	}
+
+	memcpy (buf + *pos, data, len);
+	*pos += len;
+
+	return TRUE;
+}
+
+static inline gboolean
+rspamd_dns_shared_append_str (guchar *buf, gsize *pos, gsize size,
+	const gchar *str)
+{
+	guint16 len;
+
+	len = strlen (str);
+
+	return rspamd_dns_shared_append (buf, pos, size, &len, sizeof (len)) &&
+		   rspamd_dns_shared_append (buf, pos, size, str, len + 1);
+}
+
+/*
+ * Serialize reply to buffer, returns length of data or 0 if reply cannot be
+ * stored in a slot
+ */
+static gsize
+rspamd_dns_shared_serialize (struct rdns_reply *reply, const gchar *name,
+	guchar *buf, gsize size)
+{
+	struct rdns_reply_entry *elt;
+	gsize pos = 0;
+	guint16 type, code, nentries = 0;
+	gint32 ttl;
+	gboolean ok = TRUE;
+
+	DL_FOREACH (reply->entries, elt) {
+		nentries ++;
+	}
+
+	code = reply->code;
+
+	if (!rspamd_dns_shared_append (buf, &pos, size, &code, sizeof (code)) ||
+		!rspamd_dns_shared_append (buf, &pos, size, &nentries,
+		sizeof (nentries)) ||
+		!rspamd_dns_shared_append_str (buf, &pos, size, name)) {
+		return 0;
+	}
+
+	DL_FOREACH (reply->entries, elt) {
+		type = elt->type;
+		ttl = elt->ttl;
+
+		if (!rspamd_dns_shared_append (buf, &pos, size, &type, sizeof (type)) ||
+			!rspamd_dns_shared_append (buf, &pos, size, &ttl, sizeof (ttl))) {
+			return 0;
+		}
+
+		switch (elt->type) {
+		case RDNS_REQUEST_A:
+			ok = rspamd_dns_shared_append (buf, &pos, size,
+					&elt->content.a.addr, sizeof (elt->content.a.addr));
+			break;
+		case RDNS_REQUEST_AAAA:
+			ok = rspamd_dns_shared_append (buf, &pos, size,
+					&elt->content.aaa.addr, sizeof (elt->content.aaa.addr));
+			break;
+		case RDNS_REQUEST_PTR:
+		case RDNS_REQUEST_NS:
+			ok = rspamd_dns_shared_append_str (buf, &pos, size,
+					elt->content.ptr.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			ok = rspamd_dns_shared_append_str (buf, &pos, size,
+					elt->content.txt.data);
+			break;
+		case RDNS_REQUEST_MX:
+			ok = rspamd_dns_shared_append (buf, &pos, size,
+					&elt->content.mx.priority,
+					sizeof (elt->content.mx.priority)) &&
+				rspamd_dns_shared_append_str (buf, &pos, size,
+					elt->content.mx.name);
+			break;
+		case RDNS_REQUEST_SRV:
+			ok = rspamd_dns_shared_append (buf, &pos, size,
+					&elt->content.srv.priority,
+					sizeof (elt->content.srv.priority)) &&
+				rspamd_dns_shared_append (buf, &pos, size,
+					&elt->content.srv.weight,
+					sizeof (elt->content.srv.weight)) &&
+				rspamd_dns_shared_append (buf, &pos, size,
+					&elt->content.srv.port,
+					sizeof (elt->content.srv.port)) &&
+				rspamd_dns_shared_append_str (buf, &pos, size,
+					elt->content.srv.target);
+			break;
+		default:
+			/* Other records are not shared */
+			ok = FALSE;
+			break;
+		}
+
+		if (!ok) {
+			return 0;
+		}
+	}
+
+	return pos;
+}
+
+/* Read data from a serialized reply, returns FALSE if it is truncated */
+static inline gboolean
+rspamd_dns_shared_read (const guchar *buf, gsize *pos, gsize size,
+	gpointer data, gsize len)
+{
+	if (*pos + len > size) {
+		return FALSE;
+	}
+
+	memcpy (data, buf + *pos, len);
+	*pos += len;
+
+	return TRUE;
+}
+
+static inline gboolean
+rspamd_dns_shared_read_str (guchar *buf, gsize *pos, gsize size,
+	gchar **str)
+{
+	guint16 len;
+
+	if (!rspamd_dns_shared_read (buf, pos, size, &len, sizeof (len)) ||
+		*pos + len + 1 > size) {
+		return FALSE;
+	}
+
+	*str = (gchar *)buf + *pos;
+	*pos += len + 1;
+
+	return TRUE;
+}
+
+/*
+ * Rebuild reply from serialized data. Entries and a copy of data are
+ * allocated in a single block owned by the cached reply
+ */
+static struct rdns_reply *
+rspamd_dns_shared_rebuild (const gchar *key, const guchar *data, gsize len,
+	guint ttl)
+{
+	struct rspamd_dns_rebuilt_reply *rebuilt;
+	struct rdns_reply_entry *entries, *elt;
+	guchar *copy;
+	gchar *name;
+	gsize pos = 0;
+	guint16 code, nentries, type, i;
+	gint32 elt_ttl;
+	gboolean ok = TRUE;
+
+	if (!rspamd_dns_shared_read (data, &pos, len, &code, sizeof (code)) ||
+		!rspamd_dns_shared_read (data, &pos, len, &nentries,
+		sizeof (nentries))) {
+		return NULL;
+	}
+
+	rebuilt = g_malloc0 (sizeof (*rebuilt) + sizeof (*entries) * nentries +
+			len);
+	entries = (struct rdns_reply_entry *)(rebuilt + 1);
+	copy = (guchar *)(entries + nentries);
+	memcpy (copy, data, len);
+
+	if (!rspamd_dns_shared_read_str (copy, &pos, len, &name)) {
+		g_free (rebuilt);
+		return NULL;
+	}
+
+	/* Key is made of type and lowercased name */
+	rebuilt->type = strtoul (key, NULL, 10);
+	rebuilt->reply.requested_name = name;
+	rebuilt->reply.code = code;
+
+	for (i = 0; i < nentries && ok; i ++) {
+		elt = &entries[i];
+
+		if (!rspamd_dns_shared_read (copy, &pos, len, &type, sizeof (type)) ||
+			!rspamd_dns_shared_read (copy, &pos, len, &elt_ttl,
+			sizeof (elt_ttl))) {
+			ok = FALSE;
+			break;
+		}
+
+		elt->type = type;
+		/* Entry cannot live longer than the shared slot */
+		elt->ttl = MIN ((guint)MAX (elt_ttl, 0), ttl);
+
+		switch (elt->type) {
+		case RDNS_REQUEST_A:
+			ok = rspamd_dns_shared_read (copy, &pos, len,
+					&elt->content.a.addr, sizeof (elt->content.a.addr));
+			break;
+		case RDNS_REQUEST_AAAA:
+			ok = rspamd_dns_shared_read (copy, &pos, len,
+					&elt->content.aaa.addr, sizeof (elt->content.aaa.addr));
+			break;
+		case RDNS_REQUEST_PTR:
+		case RDNS_REQUEST_NS:
+			ok = rspamd_dns_shared_read_str (copy, &pos, len,
+					&elt->content.ptr.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			ok = rspamd_dns_shared_read_str (copy, &pos, len,
+					&elt->content.txt.data);
+			break;
+		case RDNS_REQUEST_MX:
+			ok = rspamd_dns_shared_read (copy, &pos, len,
+					&elt->content.mx.priority,
+					sizeof (elt->content.mx.priority)) &&
+				rspamd_dns_shared_read_str (copy, &pos, len,
+					&elt->content.mx.name);
+			break;
+		case RDNS_REQUEST_SRV:
+			ok = rspamd_dns_shared_read (copy, &pos, len,
+					&elt->content.srv.priority,
+					sizeof (elt->content.srv.priority)) &&
+				rspamd_dns_shared_read (copy, &pos, len,
+					&elt->content.srv.weight,
+					sizeof (elt->content.srv.weight)) &&
+				rspamd_dns_shared_read (copy, &pos, len,
+					&elt->content.srv.port,
+					sizeof (elt->content.srv.port)) &&
+				rspamd_dns_shared_read_str (copy, &pos, len,
+					&elt->content.srv.target);
+			break;
+		default:
+			ok = FALSE;
+			break;
+		}
+
+		if (ok) {
+			DL_APPEND (rebuilt->reply.entries, elt);
+		}
+	}
+
+	if (!ok) {
+		g_free (rebuilt);
+		return NULL;
+	}
+
+	return &rebuilt->reply;
+}
+
+struct rspamd_dns_shared_cache *
+rspamd_dns_shared_cache_new (rspamd_mempool_t *pool, guint size)
+{
+	struct rspamd_dns_shared_cache *cache;
+
+	if (size == 0) {
+		return NULL;
+	}
+
+	cache = rspamd_mempool_alloc0_shared (pool, sizeof (*cache));
+	cache->nsets = MAX (size / RSPAMD_DNS_SHARED_WAYS, 1);
+	cache->slots = rspamd_mempool_alloc0_shared (pool,
+			sizeof (struct rspamd_dns_shared_slot) * cache->nsets *
+			RSPAMD_DNS_SHARED_WAYS);
+	cache->lock = rspamd_mempool_get_mutex (pool);
+
+	return cache;
+}
+
+/*
+ * Store reply in the shared cache, an expired slot or the one that expires
+ * first is replaced
+ */
+void
+rspamd_dns_shared_insert (struct rspamd_dns_shared_cache *cache,
+	const gchar *key, const gchar *name, struct rdns_reply *reply, guint ttl)
+{
+	struct rspamd_dns_shared_slot *set, *slot = NULL, *cur;
+	guchar buf[sizeof (set->data)];
+	gsize keylen, datalen;
+	guint32 h;
+	time_t now;
+	guint i;
+
+	keylen = strlen (key) + 1;
+
+	if (keylen >= sizeof (buf)) {
+		return;
+	}
+
+	datalen = rspamd_dns_shared_serialize (reply, name, buf,
+			sizeof (buf) - keylen);
+
+	if (datalen == 0) {
+		return;
+	}
+
+	h = rspamd_str_hash (key);
+	now = time (NULL);
+	set = &cache->slots[(h % cache->nsets) * RSPAMD_DNS_SHARED_WAYS];
+
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = 0; i < RSPAMD_DNS_SHARED_WAYS; i ++) {
+		cur = &set[i];
+
+		if (cur->hash == h && cur->keylen == keylen &&
+			memcmp (cur->data, key, keylen) == 0) {
+			slot = cur;
+			break;
+		}
+
+		if (slot == NULL || cur->expire < slot->expire) {
+			slot = cur;
+		}
+	}
+
+	slot->hash = h;
+	slot->expire = now + ttl;
+	slot->keylen = keylen;
+	slot->datalen = datalen;
+	memcpy (slot->data, key, keylen);
+	memcpy (slot->data + keylen, buf, datalen);
+
+	rspamd_mempool_unlock_mutex (cache->lock);
+}
+
+/* Find reply in the shared cache and rebuild it */
+struct rdns_reply *
+rspamd_dns_shared_lookup (struct rspamd_dns_shared_cache *cache,
+	const gchar *key, guint *ttl)
+{
+	struct rspamd_dns_shared_slot *set, *cur;
+	guchar buf[sizeof (set->data)];
+	gsize keylen, datalen = 0;
+	guint32 h;
+	time_t now;
+	guint i;
+
+	keylen = strlen (key) + 1;
+	h = rspamd_str_hash (key);
+	now = time (NULL);
+	set = &cache->slots[(h % cache->nsets) * RSPAMD_DNS_SHARED_WAYS];
+
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = 0; i < RSPAMD_DNS_SHARED_WAYS; i ++) {
+		cur = &set[i];
+
+		if (cur->hash == h && cur->keylen == keylen && cur->expire > now &&
+			memcmp (cur->data, key, keylen) == 0) {
+			datalen = cur->datalen;
+			memcpy (buf, cur->data + keylen, datalen);
+			*ttl = cur->expire - now;
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (cache->lock);
+
+	if (datalen == 0) {
+		return NULL;
+	}
+
+	return rspamd_dns_shared_rebuild (key, buf, datalen, *ttl);
+}
+
+gboolean
+rspamd_dns_reply_has_type (struct rdns_reply *reply,
+	enum rdns_request_type type)
+{
+	if (reply->request != NULL) {
+		return rdns_request_has_type (reply->request, type);
+	}
+
+	return ((struct rspamd_dns_rebuilt_reply *)reply)->type == type;
+}
+
+const gchar *
+rspamd_dns_reply_name (struct rdns_reply *reply)
+{
+	const struct rdns_request_name *req_name;
+
+	if (reply->request != NULL) {
+		req_name = rdns_request_get_name (reply->request, NULL);
+
+		return req_name[0].name;
+	}
+
+	return reply->requested_name;
+}
+
+static void
+rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_inflight *inflight = ud;
+	struct rspamd_dns_resolver *resolver = inflight->resolver;
+	struct rspamd_dns_request_ud *reqdata;
+	struct rspamd_dns_cached_reply *cached;
+	GList *cur;
+	guint ttl;
+
+	inflight->replied = TRUE;
+	g_hash_table_remove (resolver->inflight, inflight->key);
+
+	ttl = rspamd_dns_reply_ttl (resolver, reply);
+
+	if (resolver->cache != NULL && ttl > 0) {
+		cached = rspamd_dns_cached_reply_new (reply->request, reply);
+		rspamd_lru_hash_insert (resolver->cache, g_strdup (inflight->key),
+			cached, time (NULL), ttl);
+	}
+
+	if (resolver->shared != NULL && ttl > 0) {
+		rspamd_dns_shared_insert (resolver->shared, inflight->key,
+			rspamd_dns_reply_name (reply), reply, ttl);
+	}
+
+	/* Callbacks may finish sessions of other waiters, so pop them one by one */
+	while ((cur = g_queue_pop_head_link (&inflight->waiters)) != NULL) {
+		reqdata = cur->data;
+		reqdata->inflight = NULL;
+		rspamd_dns_deliver (reqdata, reply);
+	}
+
+	rspamd_dns_inflight_free (inflight);
+}
+
+static void
+rspamd_dns_cached_callback (gint fd, short what, gpointer ud)
+{
+	struct rspamd_dns_request_ud *reqdata = ud;
+
+	rspamd_dns_deliver (reqdata, reqdata->cached->reply);
+}
+
 gboolean
 make_dns_request (struct rspamd_dns_resolver *resolver,
 	struct rspamd_async_session *session,
@@ -80,44 +680,106 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 {
 	struct rdns_request *req;
 	struct rspamd_dns_request_ud *reqdata = NULL;
+	struct rspamd_dns_inflight *inflight;
+	struct rspamd_dns_cached_reply *cached = NULL;
+	struct rdns_reply *reply;
+	struct timeval tv;
+	gchar key[512];
+	gint keylen;
+	guint ttl;
 
 	if (pool != NULL) {
 		reqdata =
-			rspamd_mempool_alloc (pool, sizeof (struct rspamd_dns_request_ud));
+			rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_dns_request_ud));
 	}
 	else {
-		reqdata = g_slice_alloc (sizeof (struct rspamd_dns_request_ud));
+		reqdata = g_slice_alloc0 (sizeof (struct rspamd_dns_request_ud));
 	}
 	reqdata->pool = pool;
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
+	reqdata->link.data = reqdata;
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
-	reqdata->req = req;
+	/* Names are case insensitive */
+	keylen = rspamd_snprintf (key, sizeof (key), "%d:%s", (gint)type, name);
+	rspamd_str_lc (key, keylen);
 
-	if (session) {
-		if (req != NULL) {
-			register_async_event (session,
-					(event_finalizer_t)rspamd_dns_fin_cb,
-					reqdata,
-					g_quark_from_static_string ("dns resolver"));
+	if (resolver->cache != NULL) {
+		cached = rspamd_lru_hash_lookup (resolver->cache, key, time (NULL));
+
+		if (cached != NULL) {
+			REF_RETAIN (cached);
+			RSPAMD_DNS_STAT_INC (resolver, dns_cache_hits);
 		}
 	}
 
-	if (req == NULL) {
-		if (pool == NULL) {
-			g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+	if (cached == NULL && resolver->shared != NULL &&
+		(reply = rspamd_dns_shared_lookup (resolver->shared, key, &ttl))
+		!= NULL) {
+		/* Reply has been received by another worker */
+		RSPAMD_DNS_STAT_INC (resolver, dns_shared_hits);
+		cached = rspamd_dns_cached_reply_new (NULL, reply);
+
+		if (resolver->cache != NULL) {
+			REF_RETAIN (cached);
+			rspamd_lru_hash_insert (resolver->cache, g_strdup (key),
+				cached, time (NULL), ttl);
 		}
-		return FALSE;
+	}
+
+	if (cached != NULL) {
+		/* Reply is delivered from the event loop as usual */
+		reqdata->cached = cached;
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_set (&reqdata->ev, rspamd_dns_cached_callback, reqdata);
+		event_base_set (resolver->ev_base, &reqdata->ev);
+		evtimer_add (&reqdata->ev, &tv);
+	}
+	else {
+		inflight = g_hash_table_lookup (resolver->inflight, key);
+
+		if (inflight != NULL) {
+			/* The same query is already sent, wait for its reply */
+			RSPAMD_DNS_STAT_INC (resolver, dns_requests_coalesced);
+		}
+		else {
+			inflight = g_slice_alloc0 (sizeof (struct rspamd_dns_inflight));
+			inflight->resolver = resolver;
+			req = rdns_make_request_full (resolver->r, rspamd_dns_callback,
+					inflight, resolver->request_timeout,
+					resolver->max_retransmits, 1, name, type);
+
+			if (req == NULL) {
+				g_slice_free1 (sizeof (struct rspamd_dns_inflight), inflight);
+				if (pool == NULL) {
+					g_slice_free1 (sizeof (struct rspamd_dns_request_ud),
+						reqdata);
+				}
+				return FALSE;
+			}
+
+			RSPAMD_DNS_STAT_INC (resolver, dns_cache_misses);
+			inflight->req = req;
+			inflight->key = g_strdup (key);
+			g_hash_table_insert (resolver->inflight, inflight->key, inflight);
+		}
+
+		reqdata->inflight = inflight;
+		g_queue_push_tail_link (&inflight->waiters, &reqdata->link);
+	}
+
+	if (session) {
+		register_async_event (session,
+				(event_finalizer_t)rspamd_dns_fin_cb,
+				reqdata,
+				g_quark_from_static_string ("dns resolver"));
 	}
 
 	return TRUE;
 }
 
-
 struct rspamd_dns_resolver *
 dns_resolver_init (rspamd_logger_t *logger,
 	struct event_base *ev_base,
@@ -139,6 +801,19 @@ dns_resolver_init (rspamd_logger_t *logger,
 		new->max_retransmits = 2;
 	}
 
+	new->inflight = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	if (cfg != NULL && cfg->dns_cache_size > 0) {
+		new->cache = rspamd_lru_hash_new (cfg->dns_cache_size, 0, g_free,
+				rspamd_dns_cached_reply_free);
+	}
+	if (cfg != NULL) {
+		new->negative_ttl = cfg->dns_cache_negative_ttl / 1000;
+	}
+	if (rspamd_main != NULL) {
+		new->stat = rspamd_main->stat;
+		new->shared = rspamd_main->dns_cache;
+	}
+
 	new->r = rdns_resolver_new ();
 	rdns_bind_libevent (new->r, new->ev_base);
 
@@ -155,6 +830,10 @@ dns_resolver_init (rspamd_logger_t *logger,
 			msg_err (
 				"cannot parse resolv.conf and no nameservers defined, so no ways to resolve addresses");
 			rdns_resolver_release (new->r);
+			if (new->cache) {
+				rspamd_lru_hash_destroy (new->cache);
+			}
+			g_hash_table_destroy (new->inflight);
 			g_slice_free1 (sizeof (struct rspamd_dns_resolver), new);
 			return NULL;
 		}
@@ -30,13 +30,22 @@
 #include "mem_pool.h"
 #include "events.h"
 #include "logger.h"
+#include "hash.h"
 #include "rdns.h"
 
+struct rspamd_stat;
+struct rspamd_dns_shared_cache;
+
 struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct event_base *ev_base;
 	gdouble request_timeout;
 	guint max_retransmits;
+	rspamd_lru_hash_t *cache;           /**< replies indexed by type and name	*/
+	GHashTable *inflight;               /**< queries waiting for replies		*/
+	guint negative_ttl;                 /**< ttl of negative replies in seconds	*/
+	struct rspamd_stat *stat;           /**< shared counters					*/
+	struct rspamd_dns_shared_cache *shared; /**< replies shared by workers	*/
 };
 
 /* Rspamd DNS API */
@@ -48,7 +57,8 @@ struct rspamd_dns_resolver * dns_resolver_init (rspamd_logger_t *logger,
 	struct event_base *ev_base, struct rspamd_config *cfg);
 
 /**
- * Make a DNS request
+ * Make a DNS request. Replies are cached according to their ttl and
+ * identical queries that are in flight are sent only once
  * @param resolver resolver object
  * @param session async session to register event
  * @param pool memory pool for storage
@@ -66,4 +76,56 @@ gboolean make_dns_request (struct rspamd_dns_resolver *resolver,
 	enum rdns_request_type type,
 	const char *name);
 
+/**
+ * Create cache of replies shared by all workers, it must be created before
+ * workers are spawned
+ * @param pool pool to allocate shared memory from
+ * @param size number of replies to store
+ * @return cache or NULL if size is zero
+ */
+struct rspamd_dns_shared_cache * rspamd_dns_shared_cache_new (
+	rspamd_mempool_t *pool, guint size);
+
+/**
+ * Store reply in the shared cache unless it does not fit a slot
+ * @param cache shared cache
+ * @param key key of the query: its type and lowercased name, "%d:%s"
+ * @param name name as it has been requested
+ * @param reply dns reply, only A, AAAA, PTR, NS, TXT, SPF, MX and SRV
+ * records are stored
+ * @param ttl time in seconds to store reply
+ */
+void rspamd_dns_shared_insert (struct rspamd_dns_shared_cache *cache,
+	const gchar *key, const gchar *name, struct rdns_reply *reply, guint ttl);
+
+/**
+ * Find reply in the shared cache
+ * @param cache shared cache
+ * @param key key of the query: its type and lowercased name, "%d:%s"
+ * @param ttl here would be stored the remaining time to store reply
+ * @return reply allocated in a single block that should be freed by g_free
+ * or NULL if reply is not found
+ */
+struct rdns_reply * rspamd_dns_shared_lookup (
+	struct rspamd_dns_shared_cache *cache, const gchar *key, guint *ttl);
+
+/**
+ * Check type of the query a reply is for, replies taken from the shared
+ * cache have no request
+ * @param reply dns reply
+ * @param type request type
+ * @return TRUE if reply is for a query of this type
+ */
+gboolean rspamd_dns_reply_has_type (struct rdns_reply *reply,
+	enum rdns_request_type type);
+
+/**
+ * Get name requested by a query. Replies are cached and shared regardless
+ * of case of names, so this is the name of the query that has received
+ * the reply, with its original case
+ * @param reply dns reply
+ * @return requested name
+ */
+const gchar * rspamd_dns_reply_name (struct rdns_reply *reply);
+
 #endif
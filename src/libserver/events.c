@@ -77,6 +77,7 @@ new_async_session (rspamd_mempool_t * pool, session_finalizer_t fin,
 	new->cleanup = cleanup;
 	new->user_data = user_data;
 	new->wanna_die = FALSE;
+	new->cur_watcher = NULL;
 	new->events = g_hash_table_new (rspamd_event_hash, rspamd_event_equal);
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
 	new->mtx = g_mutex_new ();
@@ -127,6 +128,11 @@ register_async_event (struct rspamd_async_session *session,
 	new->fin = fin;
 	new->user_data = user_data;
 	new->subsystem = subsystem;
+	new->w = session->cur_watcher;
+
+	if (new->w != NULL) {
+		new->w->remain ++;
+	}
 
 	g_hash_table_insert (session->events, new, new);
 
@@ -144,6 +150,7 @@ remove_normal_event (struct rspamd_async_session *session,
 	void *ud)
 {
 	struct rspamd_async_event search_ev, *found_ev;
+	struct rspamd_async_watcher *fired = NULL;
 
 	if (session == NULL) {
 		msg_info ("session is NULL");
@@ -162,9 +169,20 @@ remove_normal_event (struct rspamd_async_session *session,
 			g_hash_table_size (session->events));
 		/* Remove event */
 		fin (ud);
+
+		if (found_ev->w != NULL) {
+			if (found_ev->w->remain > 0 && --found_ev->w->remain == 0) {
+				fired = found_ev->w;
+			}
+		}
 	}
 	g_mutex_unlock (session->mtx);
 
+	/* Watcher callback may use session, so it is called without lock */
+	if (fired != NULL) {
+		fired->cb (session->user_data, fired->ud);
+	}
+
 	check_session_pending (session);
 }
 
@@ -273,3 +291,82 @@ remove_async_thread (struct rspamd_async_session *session)
 	}
 	msg_debug ("removed thread: pending %d thread", session->threads);
 }
+
+void
+rspamd_session_watch_start (struct rspamd_async_session *session,
+	event_watcher_t cb,
+	gpointer ud)
+{
+	struct rspamd_async_watcher *w;
+
+	g_assert (session != NULL);
+
+	w = rspamd_mempool_alloc (session->pool, sizeof (*w));
+	w->cb = cb;
+	w->ud = ud;
+	w->remain = 0;
+
+	session->cur_watcher = w;
+}
+
+guint
+rspamd_session_watch_stop (struct rspamd_async_session *session)
+{
+	guint remain;
+
+	g_assert (session != NULL);
+	g_assert (session->cur_watcher != NULL);
+
+	remain = session->cur_watcher->remain;
+	session->cur_watcher = NULL;
+
+	return remain;
+}
+
+struct rspamd_async_watcher *
+rspamd_session_get_watcher (struct rspamd_async_session *session,
+	event_finalizer_t fin,
+	void *ud)
+{
+	struct rspamd_async_event search_ev, *found_ev;
+	struct rspamd_async_watcher *w = NULL;
+
+	if (session == NULL) {
+		return NULL;
+	}
+
+	g_mutex_lock (session->mtx);
+	search_ev.fin = fin;
+	search_ev.user_data = ud;
+	found_ev = g_hash_table_lookup (session->events, &search_ev);
+
+	if (found_ev != NULL) {
+		w = found_ev->w;
+	}
+	g_mutex_unlock (session->mtx);
+
+	return w;
+}
+
+struct rspamd_async_watcher *
+rspamd_session_watcher_push (struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w)
+{
+	struct rspamd_async_watcher *old;
+
+	g_assert (session != NULL);
+
+	old = session->cur_watcher;
+	session->cur_watcher = w;
+
+	return old;
+}
+
+void
+rspamd_session_watcher_pop (struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w)
+{
+	g_assert (session != NULL);
+
+	session->cur_watcher = w;
+}
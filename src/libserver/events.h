@@ -8,12 +8,20 @@ struct rspamd_async_event;
 
 typedef void (*event_finalizer_t)(void *user_data);
 typedef gboolean (*session_finalizer_t)(void *user_data);
+typedef void (*event_watcher_t)(gpointer session_data, gpointer ud);
+
+struct rspamd_async_watcher {
+	event_watcher_t cb;
+	guint remain;
+	gpointer ud;
+};
 
 struct rspamd_async_event {
 	GQuark subsystem;
 	event_finalizer_t fin;
 	void *user_data;
 	guint ref;
+	struct rspamd_async_watcher *w;
 };
 
 struct rspamd_async_session {
@@ -27,6 +35,7 @@ struct rspamd_async_session {
 	guint threads;
 	GMutex *mtx;
 	GCond *cond;
+	struct rspamd_async_watcher *cur_watcher;
 };
 
 /**
@@ -87,4 +96,56 @@ void register_async_thread (struct rspamd_async_session *session);
  */
 void remove_async_thread (struct rspamd_async_session *session);
 
+/**
+ * Start watching for events in the session, so the specified callback will be
+ * called when all events registered until `rspamd_session_watch_stop` are
+ * finished
+ * @param session session object
+ * @param cb watcher callback
+ * @param ud opaque data for the callback
+ */
+void rspamd_session_watch_start (struct rspamd_async_session *session,
+	event_watcher_t cb,
+	gpointer ud);
+
+/**
+ * Stop watching for events in the session
+ * @param session session object
+ * @return number of events pending for the current watcher, if it is zero
+ * then the watcher callback will never be called
+ */
+guint rspamd_session_watch_stop (struct rspamd_async_session *session);
+
+/**
+ * Get watcher of the event that is currently being finished (e.g. to register
+ * nested events on behalf of the same watcher)
+ * @param session session object
+ * @param fin finalizer of event
+ * @param ud user data of event
+ * @return watcher or NULL
+ */
+struct rspamd_async_watcher * rspamd_session_get_watcher (
+	struct rspamd_async_session *session,
+	event_finalizer_t fin,
+	void *ud);
+
+/**
+ * Temporary set the specified watcher as the current one, events registered
+ * until `rspamd_session_watcher_pop` are attached to it
+ * @param session session object
+ * @param w watcher object (may be NULL)
+ * @return the previous watcher
+ */
+struct rspamd_async_watcher * rspamd_session_watcher_push (
+	struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w);
+
+/**
+ * Restore the previous watcher
+ * @param session session object
+ * @param w watcher returned by `rspamd_session_watcher_push`
+ */
+void rspamd_session_watcher_pop (struct rspamd_async_session *session,
+	struct rspamd_async_watcher *w);
+
 #endif /* RSPAMD_EVENTS_H */
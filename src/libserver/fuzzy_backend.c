@@ -38,11 +38,68 @@ struct rspamd_legacy_fuzzy_node {
 	rspamd_fuzzy_t h;
 };
 
+/* Minimal size of memory index tables */
+#define MEMIDX_MIN_SIZE 1024
+/* Tombstone in memory index tables */
+#define MEMIDX_DELETED G_MAXUINT32
+
+struct rspamd_fuzzy_mem_entry {
+	gchar digest[64];
+	gint64 id;                      /**< rowid in digests table, 0 if removed	*/
+	gint64 value;
+	gint64 time;
+	gint32 flag;
+};
+
+/*
+ * Memory resident copy of digests and shingles tables. Digests table uses
+ * open addressing with linear probing over indexes in the entries array,
+ * so entries do not move when table is resized. Shingles are indexed by
+ * entry index in a banded shingles index
+ */
+struct rspamd_fuzzy_mem_index {
+	GArray *entries;
+	GArray *free_entries;
+	guint32 *digests;
+	gsize digests_size;
+	gsize digests_used;
+	struct rspamd_shingle_index *shingles;
+	rspamd_rwlock_t *lock;
+};
+
+/* Pending changes of a single digest */
+struct rspamd_fuzzy_pending {
+	gchar digest[64];
+	gint64 value;
+	gint32 flag;
+	gboolean del;                   /**< stored digest must be removed first	*/
+	gboolean add;                   /**< value must be added to digest			*/
+	struct rspamd_shingle *sgl;
+};
+
+/*
+ * Write behind queue: updates are coalesced by digest and written to the
+ * database in a single transaction by rspamd_fuzzy_backend_flush. Lock is
+ * held for reading during checks, so that readers never see an update
+ * both in the queue and in the database
+ */
+struct rspamd_fuzzy_pending_queue {
+	GHashTable *updates;
+	guint ncommands;
+	guint max_commands;
+	rspamd_rwlock_t *lock;
+};
+
 struct rspamd_fuzzy_backend {
 	sqlite3 *db;
 	char *path;
 	gsize count;
 	gsize expired;
+	gboolean read_only;
+	sqlite3_stmt **stmts;
+	/* Shared with read only handles */
+	struct rspamd_fuzzy_mem_index *idx;
+	struct rspamd_fuzzy_pending_queue *pending;
 };
 
 
@@ -66,6 +123,12 @@ const char *create_index_sql =
 		"CREATE INDEX IF NOT EXISTS t ON digests(time);"
 		"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
 		"COMMIT;";
+/*
+ * WAL allows read only handles from other threads to work while the main
+ * handle keeps its write transaction open between syncs
+ */
+const char *enable_wal_sql = "PRAGMA journal_mode=WAL;";
+
 enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_START = 0,
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
@@ -80,13 +143,14 @@ enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_COUNT,
 	RSPAMD_FUZZY_BACKEND_EXPIRE,
 	RSPAMD_FUZZY_BACKEND_VACUUM,
+	RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS,
+	RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES,
 	RSPAMD_FUZZY_BACKEND_MAX
 };
 static struct rspamd_fuzzy_stmts {
 	enum rspamd_fuzzy_statement_idx idx;
 	const gchar *sql;
 	const gchar *args;
-	sqlite3_stmt *stmt;
 	gint result;
 } prepared_stmts[RSPAMD_FUZZY_BACKEND_MAX] =
 {
@@ -94,21 +158,18 @@ static struct rspamd_fuzzy_stmts {
 		.idx = RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
 		.sql = "BEGIN TRANSACTION;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
 		.sql = "COMMIT;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK,
 		.sql = "ROLLBACK;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
@@ -116,7 +177,6 @@ static struct rspamd_fuzzy_stmts {
 		.sql = "INSERT INTO digests(flag, digest, value, time) VALUES"
 				"(?1, ?2, ?3, ?4);",
 		.args = "SDII",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
@@ -124,7 +184,6 @@ static struct rspamd_fuzzy_stmts {
 		.sql = "UPDATE digests SET value = value + ?1 WHERE "
 				"digest==?2;",
 		.args = "ID",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
@@ -132,57 +191,63 @@ static struct rspamd_fuzzy_stmts {
 		.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) "
 				"VALUES (?1, ?2, ?3);",
 		.args = "III",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_CHECK,
 		.sql = "SELECT value, time, flag FROM digests WHERE digest==?1;",
 		.args = "D",
-		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
 		.sql = "SELECT digest_id FROM shingles WHERE value=?1 AND number=?2",
 		.args = "IS",
-		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
 		.sql = "SELECT digest, value, time, flag FROM digests WHERE id=?1",
 		.args = "I",
-		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_DELETE,
 		.sql = "DELETE FROM digests WHERE digest==?1;",
 		.args = "D",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_COUNT,
 		.sql = "SELECT COUNT(*) FROM digests;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_EXPIRE,
 		.sql = "DELETE FROM digests WHERE time < ?1;",
 		.args = "I",
-		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_VACUUM,
 		.sql = "VACUUM;",
 		.args = "",
-		.stmt = NULL,
 		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS,
+		.sql = "SELECT id, digest, value, time, flag FROM digests "
+				"ORDER BY id;",
+		.args = "",
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES,
+		.sql = "SELECT value, number, digest_id FROM shingles "
+				"ORDER BY digest_id;",
+		.args = "",
+		.result = SQLITE_ROW
 	}
 };
 
@@ -198,12 +263,12 @@ rspamd_fuzzy_backend_prepare_stmts (struct rspamd_fuzzy_backend *bk, GError **er
 	int i;
 
 	for (i = 0; i < RSPAMD_FUZZY_BACKEND_MAX; i ++) {
-		if (prepared_stmts[i].stmt != NULL) {
+		if (bk->stmts[i] != NULL) {
 			/* Skip already prepared statements */
 			continue;
 		}
 		if (sqlite3_prepare_v2 (bk->db, prepared_stmts[i].sql, -1,
-				&prepared_stmts[i].stmt, NULL) != SQLITE_OK) {
+				&bk->stmts[i], NULL) != SQLITE_OK) {
 			g_set_error (err, rspamd_fuzzy_backend_quark (),
 				-1, "Cannot initialize prepared sql `%s`: %s",
 				prepared_stmts[i].sql, sqlite3_errmsg (bk->db));
@@ -229,16 +294,16 @@ rspamd_fuzzy_backend_run_stmt (struct rspamd_fuzzy_backend *bk, int idx, ...)
 		return -1;
 	}
 
-	stmt = prepared_stmts[idx].stmt;
+	stmt = bk->stmts[idx];
 	if (stmt == NULL) {
 		if ((retcode = sqlite3_prepare_v2 (bk->db, prepared_stmts[idx].sql, -1,
-				&prepared_stmts[idx].stmt, NULL)) != SQLITE_OK) {
+				&bk->stmts[idx], NULL)) != SQLITE_OK) {
 			msg_err ("Cannot initialize prepared sql `%s`: %s",
 					prepared_stmts[idx].sql, sqlite3_errmsg (bk->db));
 
 			return retcode;
 		}
-		stmt = prepared_stmts[idx].stmt;
+		stmt = bk->stmts[idx];
 	}
 
 	msg_debug ("executing `%s`", prepared_stmts[idx].sql);
@@ -286,9 +351,9 @@ rspamd_fuzzy_backend_close_stmts (struct rspamd_fuzzy_backend *bk)
 	int i;
 
 	for (i = 0; i < RSPAMD_FUZZY_BACKEND_MAX; i++) {
-		if (prepared_stmts[i].stmt != NULL) {
-			sqlite3_finalize (prepared_stmts[i].stmt);
-			prepared_stmts[i].stmt = NULL;
+		if (bk->stmts[i] != NULL) {
+			sqlite3_finalize (bk->stmts[i]);
+			bk->stmts[i] = NULL;
 		}
 	}
 
@@ -324,6 +389,223 @@ rspamd_fuzzy_backend_run_sql (const gchar *sql, struct rspamd_fuzzy_backend *bk,
 	return TRUE;
 }
 
+
+/*
+ * Memory index functions
+ */
+static inline guint64
+rspamd_fuzzy_memidx_mix (guint64 h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static guint64
+rspamd_fuzzy_memidx_digest_hash (const gchar *digest)
+{
+	guint64 h = 0, w;
+	guint i;
+
+	for (i = 0; i < 64; i += sizeof (w)) {
+		memcpy (&w, digest + i, sizeof (w));
+		h = rspamd_fuzzy_memidx_mix (h ^ w);
+	}
+
+	return h;
+}
+
+static inline struct rspamd_fuzzy_mem_entry *
+rspamd_fuzzy_memidx_entry (struct rspamd_fuzzy_mem_index *idx, guint32 n)
+{
+	return &g_array_index (idx->entries, struct rspamd_fuzzy_mem_entry, n);
+}
+
+static gsize
+rspamd_fuzzy_memidx_table_size (gsize nelts)
+{
+	gsize size = MEMIDX_MIN_SIZE;
+
+	/* Keep load factor below 0.5 after resize */
+	while (size < nelts * 2) {
+		size <<= 1;
+	}
+
+	return size;
+}
+
+static struct rspamd_fuzzy_mem_index *
+rspamd_fuzzy_memidx_new (void)
+{
+	struct rspamd_fuzzy_mem_index *idx;
+
+	idx = g_slice_alloc0 (sizeof (*idx));
+	idx->entries = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_fuzzy_mem_entry));
+	idx->free_entries = g_array_new (FALSE, FALSE, sizeof (guint32));
+	idx->digests_size = MEMIDX_MIN_SIZE;
+	idx->digests = g_malloc0 (idx->digests_size * sizeof (guint32));
+	idx->shingles = rspamd_shingle_index_new (RSPAMD_SHINGLE_INDEX_BANDS);
+	idx->lock = rspamd_rwlock_new ();
+
+	return idx;
+}
+
+static void
+rspamd_fuzzy_memidx_free (struct rspamd_fuzzy_mem_index *idx)
+{
+	g_array_free (idx->entries, TRUE);
+	g_array_free (idx->free_entries, TRUE);
+	g_free (idx->digests);
+	rspamd_shingle_index_destroy (idx->shingles);
+	rspamd_rwlock_free (idx->lock);
+	g_slice_free1 (sizeof (*idx), idx);
+}
+
+static struct rspamd_fuzzy_mem_entry *
+rspamd_fuzzy_memidx_find (struct rspamd_fuzzy_mem_index *idx,
+		const gchar *digest, gsize *pslot)
+{
+	gsize mask = idx->digests_size - 1, slot;
+	struct rspamd_fuzzy_mem_entry *entry;
+	guint32 n;
+
+	slot = rspamd_fuzzy_memidx_digest_hash (digest) & mask;
+
+	while ((n = idx->digests[slot]) != 0) {
+		if (n != MEMIDX_DELETED) {
+			entry = rspamd_fuzzy_memidx_entry (idx, n - 1);
+
+			if (memcmp (entry->digest, digest, sizeof (entry->digest)) == 0) {
+				if (pslot) {
+					*pslot = slot;
+				}
+
+				return entry;
+			}
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_memidx_place_digest (struct rspamd_fuzzy_mem_index *idx,
+		guint32 n)
+{
+	gsize mask = idx->digests_size - 1, slot;
+	struct rspamd_fuzzy_mem_entry *entry;
+
+	entry = rspamd_fuzzy_memidx_entry (idx, n);
+	slot = rspamd_fuzzy_memidx_digest_hash (entry->digest) & mask;
+
+	while (idx->digests[slot] != 0 && idx->digests[slot] != MEMIDX_DELETED) {
+		slot = (slot + 1) & mask;
+	}
+
+	if (idx->digests[slot] == 0) {
+		idx->digests_used ++;
+	}
+
+	idx->digests[slot] = n + 1;
+}
+
+static void
+rspamd_fuzzy_memidx_resize_digests (struct rspamd_fuzzy_mem_index *idx)
+{
+	struct rspamd_fuzzy_mem_entry *entry;
+	guint32 i;
+
+	idx->digests_size = rspamd_fuzzy_memidx_table_size (idx->entries->len -
+			idx->free_entries->len + 1);
+	g_free (idx->digests);
+	idx->digests = g_malloc0 (idx->digests_size * sizeof (guint32));
+	idx->digests_used = 0;
+
+	for (i = 0; i < idx->entries->len; i ++) {
+		entry = rspamd_fuzzy_memidx_entry (idx, i);
+
+		if (entry->id != 0) {
+			rspamd_fuzzy_memidx_place_digest (idx, i);
+		}
+	}
+}
+
+static guint32
+rspamd_fuzzy_memidx_insert (struct rspamd_fuzzy_mem_index *idx,
+		const gchar *digest, gint64 id, gint64 value, gint64 time,
+		gint32 flag)
+{
+	struct rspamd_fuzzy_mem_entry *entry, new;
+	guint32 n;
+
+	if ((idx->digests_used + 1) * 4 > idx->digests_size * 3) {
+		rspamd_fuzzy_memidx_resize_digests (idx);
+	}
+
+	if (idx->free_entries->len > 0) {
+		n = g_array_index (idx->free_entries, guint32,
+				idx->free_entries->len - 1);
+		g_array_set_size (idx->free_entries, idx->free_entries->len - 1);
+		entry = rspamd_fuzzy_memidx_entry (idx, n);
+	}
+	else {
+		memset (&new, 0, sizeof (new));
+		g_array_append_val (idx->entries, new);
+		n = idx->entries->len - 1;
+		entry = rspamd_fuzzy_memidx_entry (idx, n);
+	}
+
+	memcpy (entry->digest, digest, sizeof (entry->digest));
+	entry->id = id;
+	entry->value = value;
+	entry->time = time;
+	entry->flag = flag;
+	rspamd_fuzzy_memidx_place_digest (idx, n);
+
+	return n;
+}
+
+static void
+rspamd_fuzzy_memidx_remove (struct rspamd_fuzzy_mem_index *idx,
+		const gchar *digest)
+{
+	struct rspamd_fuzzy_mem_entry *entry;
+	gsize slot;
+	guint32 n;
+
+	entry = rspamd_fuzzy_memidx_find (idx, digest, &slot);
+
+	if (entry != NULL) {
+		n = idx->digests[slot] - 1;
+		idx->digests[slot] = MEMIDX_DELETED;
+		entry->id = 0;
+		rspamd_shingle_index_remove (idx->shingles, n);
+		g_array_append_val (idx->free_entries, n);
+	}
+}
+
+static gint
+rspamd_fuzzy_memidx_id_cmp (const void *k, const void *e)
+{
+	gint64 id = *(const gint64 *)k;
+	const struct rspamd_fuzzy_mem_entry *entry = e;
+
+	if (id < entry->id) {
+		return -1;
+	}
+	else if (id > entry->id) {
+		return 1;
+	}
+
+	return 0;
+}
+
 static struct rspamd_fuzzy_backend *
 rspamd_fuzzy_backend_create_db (const gchar *path, gboolean add_index,
 		GError **err)
@@ -342,11 +624,10 @@ rspamd_fuzzy_backend_create_db (const gchar *path, gboolean add_index,
 		return NULL;
 	}
 
-	bk = g_slice_alloc (sizeof (*bk));
+	bk = g_slice_alloc0 (sizeof (*bk));
 	bk->path = g_strdup (path);
 	bk->db = sqlite;
-	bk->expired = 0;
-	bk->count = 0;
+	bk->stmts = g_malloc0 (RSPAMD_FUZZY_BACKEND_MAX * sizeof (sqlite3_stmt *));
 
 	/*
 	 * Here we need to run create prior to preparing other statements
@@ -366,6 +647,7 @@ rspamd_fuzzy_backend_create_db (const gchar *path, gboolean add_index,
 		rspamd_fuzzy_backend_run_sql (create_index_sql, bk, NULL);
 	}
 
+	rspamd_fuzzy_backend_run_sql (enable_wal_sql, bk, NULL);
 	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
 			bk, NULL);
 
@@ -388,11 +670,10 @@ rspamd_fuzzy_backend_open_db (const gchar *path, GError **err)
 		return NULL;
 	}
 
-	bk = g_slice_alloc (sizeof (*bk));
+	bk = g_slice_alloc0 (sizeof (*bk));
 	bk->path = g_strdup (path);
-	bk = g_slice_alloc (sizeof (*bk));
 	bk->db = sqlite;
-	bk->expired = 0;
+	bk->stmts = g_malloc0 (RSPAMD_FUZZY_BACKEND_MAX * sizeof (sqlite3_stmt *));
 
 	/* Cleanup database */
 	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_VACUUM, bk, NULL);
@@ -400,9 +681,10 @@ rspamd_fuzzy_backend_open_db (const gchar *path, GError **err)
 	if (rspamd_fuzzy_backend_run_stmt (bk, RSPAMD_FUZZY_BACKEND_COUNT)
 			== SQLITE_OK) {
 		bk->count = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_COUNT].stmt, 0);
+				bk->stmts[RSPAMD_FUZZY_BACKEND_COUNT], 0);
 	}
 
+	rspamd_fuzzy_backend_run_sql (enable_wal_sql, bk, NULL);
 	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
 				bk, NULL);
 
@@ -539,6 +821,43 @@ rspamd_fuzzy_backend_open (const gchar *path, GError **err)
 	return res;
 }
 
+struct rspamd_fuzzy_backend*
+rspamd_fuzzy_backend_open_ro (struct rspamd_fuzzy_backend *parent,
+		GError **err)
+{
+	struct rspamd_fuzzy_backend *bk;
+	sqlite3 *sqlite;
+	const gchar *path = parent->path;
+	int rc;
+
+	if ((rc = sqlite3_open_v2 (path, &sqlite,
+			SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, NULL)) != SQLITE_OK) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+			rc, "Cannot open sqlite db %s: %d",
+			path, rc);
+
+		return NULL;
+	}
+
+	bk = g_slice_alloc0 (sizeof (*bk));
+	bk->path = g_strdup (path);
+	bk->db = sqlite;
+	bk->read_only = TRUE;
+	bk->stmts = g_malloc0 (RSPAMD_FUZZY_BACKEND_MAX * sizeof (sqlite3_stmt *));
+	bk->idx = parent->idx;
+	bk->pending = parent->pending;
+
+	/* Writer might be checkpointing WAL */
+	sqlite3_busy_timeout (sqlite, 100);
+
+	/*
+	 * No transaction is started here: each statement then reads the last
+	 * state committed by the writer
+	 */
+
+	return bk;
+}
+
 static gint
 rspamd_fuzzy_backend_int64_cmp (const void *a, const void *b)
 {
@@ -547,17 +866,226 @@ rspamd_fuzzy_backend_int64_cmp (const void *a, const void *b)
 	return (ia - ib);
 }
 
-struct rspamd_fuzzy_reply
-rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
+gboolean
+rspamd_fuzzy_backend_preload (struct rspamd_fuzzy_backend *backend,
+		GError **err)
+{
+	struct rspamd_fuzzy_mem_index *idx;
+	struct rspamd_fuzzy_mem_entry *entry;
+	sqlite3_stmt *stmt;
+	gchar digest[64];
+	const void *data;
+	struct rspamd_shingle sgl;
+	gsize nshingles = 0;
+	guint32 mask = 0;
+	gint rc, len, number;
+	gint64 id, cur_id;
+
+	g_assert (!backend->read_only);
+
+	if (backend->idx != NULL) {
+		return TRUE;
+	}
+
+	idx = rspamd_fuzzy_memidx_new ();
+
+	/* Digests are loaded in order of id, so entries are sorted by id */
+	rc = rspamd_fuzzy_backend_run_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS);
+	stmt = backend->stmts[RSPAMD_FUZZY_BACKEND_LOAD_DIGESTS];
+
+	while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+		data = sqlite3_column_blob (stmt, 1);
+		len = sqlite3_column_bytes (stmt, 1);
+		memset (digest, 0, sizeof (digest));
+		memcpy (digest, data, MIN (len, (gint)sizeof (digest)));
+		rspamd_fuzzy_memidx_insert (idx, digest,
+				sqlite3_column_int64 (stmt, 0),
+				sqlite3_column_int64 (stmt, 2),
+				sqlite3_column_int64 (stmt, 3),
+				sqlite3_column_int (stmt, 4));
+		rc = sqlite3_step (stmt);
+	}
+
+	if (rc != SQLITE_DONE) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				rc, "Cannot load digests: %s", sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_memidx_free (idx);
+
+		return FALSE;
+	}
+
+	/*
+	 * Shingles are grouped by digest. Some of them could be replaced by
+	 * shingles of other digests, such positions are marked as unknown
+	 */
+	rc = rspamd_fuzzy_backend_run_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES);
+	stmt = backend->stmts[RSPAMD_FUZZY_BACKEND_LOAD_SHINGLES];
+	entry = NULL;
+	cur_id = -1;
+	memset (&sgl, 0, sizeof (sgl));
+
+	while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+		id = sqlite3_column_int64 (stmt, 2);
+
+		if (id != cur_id) {
+			if (entry != NULL && mask != 0) {
+				rspamd_shingle_index_insert_partial (idx->shingles, &sgl, mask,
+						entry - (struct rspamd_fuzzy_mem_entry *)idx->entries->data);
+			}
+
+			cur_id = id;
+			mask = 0;
+			memset (&sgl, 0, sizeof (sgl));
+			entry = bsearch (&id, idx->entries->data, idx->entries->len,
+					sizeof (struct rspamd_fuzzy_mem_entry),
+					rspamd_fuzzy_memidx_id_cmp);
+		}
+
+		number = sqlite3_column_int (stmt, 1);
+
+		if (entry != NULL && number >= 0 && number < RSPAMD_SHINGLE_SIZE) {
+			sgl.hashes[number] = sqlite3_column_int64 (stmt, 0);
+			mask |= 1U << number;
+			nshingles ++;
+		}
+		rc = sqlite3_step (stmt);
+	}
+
+	if (entry != NULL && mask != 0) {
+		rspamd_shingle_index_insert_partial (idx->shingles, &sgl, mask,
+				entry - (struct rspamd_fuzzy_mem_entry *)idx->entries->data);
+	}
+
+	if (rc != SQLITE_DONE) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				rc, "Cannot load shingles: %s", sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_memidx_free (idx);
+
+		return FALSE;
+	}
+
+	msg_info ("loaded %ud digests and %z shingles into memory",
+			idx->entries->len, nshingles);
+	backend->idx = idx;
+
+	return TRUE;
+}
+
+/*
+ * Select id that is referenced by the most of shingles
+ */
+static gint64
+rspamd_fuzzy_backend_select_shingle (gint64 *shingle_values, gdouble *prob)
+{
+	gint64 i, sel_id, cur_id, cur_cnt, max_cnt;
+
+	qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
+			rspamd_fuzzy_backend_int64_cmp);
+	sel_id = -1;
+	cur_id = -1;
+	cur_cnt = 0;
+	max_cnt = 0;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		if (shingle_values[i] == -1) {
+			continue;
+		}
+
+		/* We have some value here, so we need to check it */
+		if (shingle_values[i] == cur_id) {
+			cur_cnt ++;
+		}
+		else {
+			cur_id = shingle_values[i];
+			if (cur_cnt >= max_cnt) {
+				max_cnt = cur_cnt;
+				sel_id = cur_id;
+			}
+			cur_cnt = 0;
+		}
+	}
+
+	if (cur_cnt > max_cnt) {
+		max_cnt = cur_cnt;
+	}
+
+	*prob = (gdouble)max_cnt / (gdouble)RSPAMD_SHINGLE_SIZE;
+
+	return sel_id;
+}
+
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_check_memory (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	struct rspamd_fuzzy_mem_index *idx = backend->idx;
+	struct rspamd_fuzzy_mem_entry *entry;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_shingle sgl;
+	guint64 sel_id;
+	gchar expired_digest[64];
+	gboolean expired = FALSE;
+	gdouble prob = 1.0;
+
+	rspamd_rwlock_reader_lock (idx->lock);
+	entry = rspamd_fuzzy_memidx_find (idx, cmd->digest, NULL);
+
+	if (entry == NULL && cmd->shingles_count > 0) {
+		/* Fuzzy match, command is packed so copy shingles first */
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+		memcpy (&sgl, &shcmd->sgl, sizeof (sgl));
+
+		if (rspamd_shingle_index_best (idx->shingles, &sgl, &sel_id, &prob)) {
+			msg_debug ("found fuzzy hash with probability %.2f", prob);
+			entry = rspamd_fuzzy_memidx_entry (idx, sel_id);
+		}
+	}
+
+	if (entry != NULL) {
+		if (time (NULL) - entry->time > expire) {
+			msg_debug ("requested hash has been expired");
+			memcpy (expired_digest, entry->digest, sizeof (expired_digest));
+			expired = TRUE;
+		}
+		else {
+			rep.value = entry->value;
+			rep.flag = entry->flag;
+			rep.prob = prob;
+		}
+	}
+
+	rspamd_rwlock_reader_unlock (idx->lock);
+
+	if (expired && !backend->read_only) {
+		rspamd_rwlock_writer_lock (idx->lock);
+		rspamd_fuzzy_memidx_remove (idx, expired_digest);
+		rspamd_rwlock_writer_unlock (idx->lock);
+		rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
+				expired_digest);
+		backend->expired ++;
+	}
+
+	return rep;
+}
+
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_check_stored (struct rspamd_fuzzy_backend *backend,
 		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
 {
 	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
 	int rc;
 	gint64 timestamp;
-	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id, cur_id,
-		cur_cnt, max_cnt;
+	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id;
 	const char *digest;
+	gdouble prob;
+
+	if (backend->idx != NULL) {
+		return rspamd_fuzzy_backend_check_memory (backend, cmd, expire);
+	}
 
 	/* Try direct match first of all */
 	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
@@ -565,20 +1093,22 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 
 	if (rc == SQLITE_OK) {
 		timestamp = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 1);
+				backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK], 1);
 		if (time (NULL) - timestamp > expire) {
 			/* Expire element */
 			msg_debug ("requested hash has been expired");
-			rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
-				cmd->digest);
-			backend->expired ++;
+			if (!backend->read_only) {
+				rspamd_fuzzy_backend_run_stmt (backend,
+					RSPAMD_FUZZY_BACKEND_DELETE, cmd->digest);
+				backend->expired ++;
+			}
 		}
 		else {
 			rep.value = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 0);
+				backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK], 0);
 			rep.prob = 1.0;
 			rep.flag = sqlite3_column_int (
-					prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 2);
+					backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK], 2);
 		}
 	}
 	else if (cmd->shingles_count > 0) {
@@ -590,7 +1120,7 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 					shcmd->sgl.hashes[i], i);
 			if (rc == SQLITE_OK) {
 				shingle_values[i] = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE].stmt,
+						backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE],
 						0);
 			}
 			else {
@@ -598,60 +1128,34 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 			}
 			msg_debug ("looking for shingle %d -> %L: %d", i, shcmd->sgl.hashes[i], rc);
 		}
-		qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
-				rspamd_fuzzy_backend_int64_cmp);
-		sel_id = -1;
-		cur_id = -1;
-		cur_cnt = 0;
-		max_cnt = 0;
-
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			if (shingle_values[i] == -1) {
-				continue;
-			}
-
-			/* We have some value here, so we need to check it */
-			if (shingle_values[i] == cur_id) {
-				cur_cnt ++;
-			}
-			else {
-				cur_id = shingle_values[i];
-				if (cur_cnt >= max_cnt) {
-					max_cnt = cur_cnt;
-					sel_id = cur_id;
-				}
-				cur_cnt = 0;
-			}
-		}
-
-		if (cur_cnt > max_cnt) {
-			max_cnt = cur_cnt;
-		}
+		sel_id = rspamd_fuzzy_backend_select_shingle (shingle_values, &prob);
 
 		if (sel_id != -1) {
 			/* We have some id selected here */
-			rep.prob = (gdouble)max_cnt / (gdouble)RSPAMD_SHINGLE_SIZE;
+			rep.prob = prob;
 			msg_debug ("found fuzzy hash with probability %.2f", rep.prob);
 			rc = rspamd_fuzzy_backend_run_stmt (backend,
 					RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID, sel_id);
 			if (rc == SQLITE_OK) {
 				digest = sqlite3_column_text (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 0);
+						backend->stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID], 0);
 				timestamp = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 2);
+						backend->stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID], 2);
 				if (time (NULL) - timestamp > expire) {
 					/* Expire element */
 					msg_debug ("requested hash has been expired");
-					backend->expired ++;
-					rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
-							digest);
+					if (!backend->read_only) {
+						backend->expired ++;
+						rspamd_fuzzy_backend_run_stmt (backend,
+							RSPAMD_FUZZY_BACKEND_DELETE, digest);
+					}
 					rep.prob = 0.0;
 				}
 				else {
 					rep.value = sqlite3_column_int64 (
-							prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 1);
+							backend->stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID], 1);
 					rep.flag = sqlite3_column_int (
-							prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 3);
+							backend->stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID], 3);
 				}
 			}
 		}
@@ -660,72 +1164,322 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 	return rep;
 }
 
-gboolean
-rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
-		const struct rspamd_fuzzy_cmd *cmd)
+/*
+ * Returns value and flag of the stored digest if it exists
+ */
+static gboolean
+rspamd_fuzzy_backend_get_stored (struct rspamd_fuzzy_backend *backend,
+		const gchar *digest, gint64 *value, gint32 *flag)
 {
-	int rc, i;
-	gint64 id;
-	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_mem_entry *entry;
+	gboolean ret = FALSE;
 
-	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
-				cmd->digest);
+	if (backend->idx != NULL) {
+		rspamd_rwlock_reader_lock (backend->idx->lock);
+		entry = rspamd_fuzzy_memidx_find (backend->idx, digest, NULL);
+
+		if (entry != NULL) {
+			*value = entry->value;
+			*flag = entry->flag;
+			ret = TRUE;
+		}
+
+		rspamd_rwlock_reader_unlock (backend->idx->lock);
+	}
+	else if (rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
+			digest) == SQLITE_OK) {
+		*value = sqlite3_column_int64 (
+				backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK], 0);
+		*flag = sqlite3_column_int (
+				backend->stmts[RSPAMD_FUZZY_BACKEND_CHECK], 2);
+		ret = TRUE;
+	}
+
+	return ret;
+}
+
+struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	struct rspamd_fuzzy_pending_queue *q = backend->pending;
+	struct rspamd_fuzzy_pending *upd = NULL;
+	gint64 value = 0;
+	gint32 flag = 0;
+
+	if (q == NULL) {
+		return rspamd_fuzzy_backend_check_stored (backend, cmd, expire);
+	}
+
+	rspamd_rwlock_reader_lock (q->lock);
+	upd = g_hash_table_lookup (q->updates, cmd->digest);
+
+	if (upd == NULL) {
+		rep = rspamd_fuzzy_backend_check_stored (backend, cmd, expire);
+	}
+	else if (upd->del) {
+		/* Stored digest is going to be replaced */
+		if (upd->add) {
+			rep.value = upd->value;
+			rep.flag = upd->flag;
+			rep.prob = 1.0;
+		}
+	}
+	else {
+		/* Pending value is added to the stored one */
+		if (rspamd_fuzzy_backend_get_stored (backend, cmd->digest, &value,
+				&flag)) {
+			rep.value = value + upd->value;
+			rep.flag = flag;
+		}
+		else {
+			rep.value = upd->value;
+			rep.flag = upd->flag;
+		}
+		rep.prob = 1.0;
+	}
+
+	rspamd_rwlock_reader_unlock (q->lock);
+
+	return rep;
+}
+
+static gboolean
+rspamd_fuzzy_backend_add_stored (struct rspamd_fuzzy_backend *backend,
+		const gchar *digest, gint32 flag, gint64 value,
+		const struct rspamd_shingle *sgl)
+{
+	int rc, i;
+	gint64 id, now;
+	guint32 n = 0;
+	struct rspamd_fuzzy_mem_entry *entry = NULL;
+
+	if (backend->idx) {
+		rspamd_rwlock_writer_lock (backend->idx->lock);
+		entry = rspamd_fuzzy_memidx_find (backend->idx, digest, NULL);
+		rc = entry != NULL ? SQLITE_OK : SQLITE_DONE;
+	}
+	else {
+		rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
+				digest);
+	}
 
 	if (rc == SQLITE_OK) {
 		/* We need to increase weight */
 		rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_UPDATE,
-			(gint64)cmd->value, cmd->digest);
+			value, digest);
+
+		if (rc == SQLITE_OK && entry != NULL) {
+			entry->value += value;
+		}
 	}
 	else {
+		now = time (NULL);
 		rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_INSERT,
-			(gint)cmd->flag, cmd->digest, (gint64)cmd->value, (gint64)time (NULL));
+			(gint)flag, digest, value, now);
 
 		if (rc == SQLITE_OK) {
 			backend->count ++;
+			id = sqlite3_last_insert_rowid (backend->db);
 
-			if (cmd->shingles_count > 0) {
-				id = sqlite3_last_insert_rowid (backend->db);
-				shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+			if (backend->idx) {
+				n = rspamd_fuzzy_memidx_insert (backend->idx, digest, id,
+						value, now, flag);
+			}
 
+			if (sgl != NULL) {
 				for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
 					rspamd_fuzzy_backend_run_stmt (backend,
 							RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-							shcmd->sgl.hashes[i], i, id);
-					msg_debug ("add shingle %d -> %L: %d", i, shcmd->sgl.hashes[i], id);
+							sgl->hashes[i], i, id);
+					msg_debug ("add shingle %d -> %L: %d", i, sgl->hashes[i], id);
+				}
+
+				if (backend->idx) {
+					rspamd_shingle_index_insert (backend->idx->shingles, sgl, n);
 				}
 			}
 		}
 	}
 
+	if (backend->idx) {
+		rspamd_rwlock_writer_unlock (backend->idx->lock);
+	}
+
 	return (rc == SQLITE_OK);
 }
 
-
-gboolean
-rspamd_fuzzy_backend_del (struct rspamd_fuzzy_backend *backend,
-		const struct rspamd_fuzzy_cmd *cmd)
+static gboolean
+rspamd_fuzzy_backend_del_stored (struct rspamd_fuzzy_backend *backend,
+		const gchar *digest)
 {
 	int rc;
 
 	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
-			cmd->digest);
+			digest);
 
 	backend->count -= sqlite3_changes (backend->db);
 
+	if (backend->idx) {
+		rspamd_rwlock_writer_lock (backend->idx->lock);
+		rspamd_fuzzy_memidx_remove (backend->idx, digest);
+		rspamd_rwlock_writer_unlock (backend->idx->lock);
+	}
+
 	return (rc == SQLITE_OK);
 }
 
-gboolean
-rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend, gint64 expire)
+static guint
+rspamd_fuzzy_pending_hash (gconstpointer key)
 {
-	gboolean ret = FALSE;
+	return rspamd_fuzzy_memidx_digest_hash (key);
+}
 
-	/* Perform expire */
-	if (expire > 0) {
-		rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_EXPIRE,
-				backend, NULL);
-		backend->expired += sqlite3_changes (backend->db);
+static gboolean
+rspamd_fuzzy_pending_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, 64) == 0;
+}
+
+static void
+rspamd_fuzzy_pending_free (gpointer p)
+{
+	struct rspamd_fuzzy_pending *upd = p;
+
+	if (upd->sgl) {
+		g_slice_free1 (sizeof (*upd->sgl), upd->sgl);
+	}
+
+	g_slice_free1 (sizeof (*upd), upd);
+}
+
+void
+rspamd_fuzzy_backend_write_behind (struct rspamd_fuzzy_backend *backend,
+		guint max_commands)
+{
+	struct rspamd_fuzzy_pending_queue *q;
+
+	g_assert (!backend->read_only);
+
+	if (backend->pending != NULL) {
+		backend->pending->max_commands = max_commands;
+		return;
 	}
+
+	q = g_slice_alloc0 (sizeof (*q));
+	/* Keys are digests stored in values */
+	q->updates = g_hash_table_new_full (rspamd_fuzzy_pending_hash,
+			rspamd_fuzzy_pending_equal, NULL, rspamd_fuzzy_pending_free);
+	q->max_commands = max_commands;
+	q->lock = rspamd_rwlock_new ();
+	backend->pending = q;
+}
+
+/*
+ * Merge command to the pending update of its digest
+ */
+static void
+rspamd_fuzzy_pending_push (struct rspamd_fuzzy_pending_queue *q,
+		const struct rspamd_fuzzy_cmd *cmd, gboolean del)
+{
+	struct rspamd_fuzzy_pending *upd;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+
+	rspamd_rwlock_writer_lock (q->lock);
+	upd = g_hash_table_lookup (q->updates, cmd->digest);
+
+	if (upd == NULL) {
+		upd = g_slice_alloc0 (sizeof (*upd));
+		memcpy (upd->digest, cmd->digest, sizeof (upd->digest));
+		g_hash_table_insert (q->updates, upd->digest, upd);
+	}
+
+	if (del) {
+		/* All previous additions are cancelled */
+		upd->del = TRUE;
+		upd->add = FALSE;
+		upd->value = 0;
+
+		if (upd->sgl) {
+			g_slice_free1 (sizeof (*upd->sgl), upd->sgl);
+			upd->sgl = NULL;
+		}
+	}
+	else {
+		if (!upd->add) {
+			upd->add = TRUE;
+			upd->flag = cmd->flag;
+		}
+
+		upd->value += cmd->value;
+
+		if (upd->sgl == NULL && cmd->shingles_count > 0) {
+			shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+			upd->sgl = g_slice_alloc (sizeof (*upd->sgl));
+			memcpy (upd->sgl, &shcmd->sgl, sizeof (*upd->sgl));
+		}
+	}
+
+	q->ncommands ++;
+	rspamd_rwlock_writer_unlock (q->lock);
+}
+
+/*
+ * Writes pending updates to the database. With memory index updates become
+ * visible to readers one by one, so each of them is removed from the queue
+ * at the same time. Otherwise they become visible after commit, so the
+ * queue is cleared by rspamd_fuzzy_backend_commit
+ */
+static void
+rspamd_fuzzy_backend_apply_pending (struct rspamd_fuzzy_backend *backend)
+{
+	struct rspamd_fuzzy_pending_queue *q = backend->pending;
+	struct rspamd_fuzzy_pending *upd;
+	GHashTableIter it;
+	gpointer v;
+
+	if (q == NULL || g_hash_table_size (q->updates) == 0) {
+		return;
+	}
+
+	msg_debug ("write %ud pending updates for %ud commands",
+			g_hash_table_size (q->updates), q->ncommands);
+
+	g_hash_table_iter_init (&it, q->updates);
+
+	while (g_hash_table_iter_next (&it, NULL, &v)) {
+		upd = v;
+
+		if (backend->idx) {
+			rspamd_rwlock_writer_lock (q->lock);
+		}
+
+		if (upd->del) {
+			rspamd_fuzzy_backend_del_stored (backend, upd->digest);
+		}
+		if (upd->add) {
+			rspamd_fuzzy_backend_add_stored (backend, upd->digest, upd->flag,
+					upd->value, upd->sgl);
+		}
+
+		if (backend->idx) {
+			g_hash_table_iter_remove (&it);
+			rspamd_rwlock_writer_unlock (q->lock);
+		}
+	}
+}
+
+static gboolean
+rspamd_fuzzy_backend_commit (struct rspamd_fuzzy_backend *backend)
+{
+	struct rspamd_fuzzy_pending_queue *q = backend->pending;
+	gboolean ret;
+
+	if (q != NULL) {
+		rspamd_rwlock_writer_lock (q->lock);
+	}
+
 	ret = rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
 			backend, NULL);
 
@@ -734,9 +1488,118 @@ rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend, gint64 expire)
 			backend, NULL);
 	}
 
+	if (q != NULL) {
+		g_hash_table_remove_all (q->updates);
+		q->ncommands = 0;
+		rspamd_rwlock_writer_unlock (q->lock);
+	}
+
 	return ret;
 }
 
+gboolean
+rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_shingle sgl;
+
+	g_assert (!backend->read_only);
+
+	if (backend->pending != NULL) {
+		rspamd_fuzzy_pending_push (backend->pending, cmd, FALSE);
+
+		if (backend->pending->ncommands >= backend->pending->max_commands) {
+			return rspamd_fuzzy_backend_flush (backend);
+		}
+
+		return TRUE;
+	}
+
+	if (cmd->shingles_count > 0) {
+		/* Command is packed, so copy shingles to an aligned structure */
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+		memcpy (&sgl, &shcmd->sgl, sizeof (sgl));
+
+		return rspamd_fuzzy_backend_add_stored (backend, cmd->digest,
+				cmd->flag, cmd->value, &sgl);
+	}
+
+	return rspamd_fuzzy_backend_add_stored (backend, cmd->digest, cmd->flag,
+			cmd->value, NULL);
+}
+
+
+gboolean
+rspamd_fuzzy_backend_del (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	g_assert (!backend->read_only);
+
+	if (backend->pending != NULL) {
+		rspamd_fuzzy_pending_push (backend->pending, cmd, TRUE);
+
+		if (backend->pending->ncommands >= backend->pending->max_commands) {
+			return rspamd_fuzzy_backend_flush (backend);
+		}
+
+		return TRUE;
+	}
+
+	return rspamd_fuzzy_backend_del_stored (backend, cmd->digest);
+}
+
+gboolean
+rspamd_fuzzy_backend_flush (struct rspamd_fuzzy_backend *backend)
+{
+	if (backend->read_only || backend->pending == NULL ||
+			backend->pending->ncommands == 0) {
+		return TRUE;
+	}
+
+	rspamd_fuzzy_backend_apply_pending (backend);
+
+	return rspamd_fuzzy_backend_commit (backend);
+}
+
+gboolean
+rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend, gint64 expire)
+{
+	struct rspamd_fuzzy_mem_entry *entry;
+	gint64 now;
+	guint i;
+
+	if (backend->read_only) {
+		return TRUE;
+	}
+
+	rspamd_fuzzy_backend_apply_pending (backend);
+
+	/* Perform expire */
+	if (expire > 0) {
+		now = time (NULL);
+		rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_EXPIRE,
+				now - expire);
+		backend->expired += sqlite3_changes (backend->db);
+
+		if (backend->idx) {
+			rspamd_rwlock_writer_lock (backend->idx->lock);
+
+			for (i = 0; i < backend->idx->entries->len; i ++) {
+				entry = rspamd_fuzzy_memidx_entry (backend->idx, i);
+
+				if (entry->id != 0 && now - entry->time > expire) {
+					rspamd_fuzzy_memidx_remove (backend->idx, entry->digest);
+				}
+			}
+
+			rspamd_rwlock_writer_unlock (backend->idx->lock);
+		}
+	}
+
+	return rspamd_fuzzy_backend_commit (backend);
+}
+
 
 void
 rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend)
@@ -747,6 +1610,18 @@ rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend)
 			sqlite3_close (backend->db);
 		}
 
+		g_free (backend->stmts);
+
+		if (backend->idx && !backend->read_only) {
+			rspamd_fuzzy_memidx_free (backend->idx);
+		}
+
+		if (backend->pending && !backend->read_only) {
+			g_hash_table_unref (backend->pending->updates);
+			rspamd_rwlock_free (backend->pending->lock);
+			g_slice_free1 (sizeof (*backend->pending), backend->pending);
+		}
+
 		if (backend->path != NULL) {
 			g_free (backend->path);
 		}
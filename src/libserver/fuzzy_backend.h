@@ -38,6 +38,42 @@ struct rspamd_fuzzy_backend;
 struct rspamd_fuzzy_backend* rspamd_fuzzy_backend_open (const gchar *path,
 		GError **err);
 
+/**
+ * Open read only handle for a fuzzy backend, that could be used to check
+ * digests from other threads. Such a handle sees changes made by the main
+ * handle after they are committed by `rspamd_fuzzy_backend_sync` or
+ * immediately if the parent backend has memory index loaded
+ * @param parent backend opened by `rspamd_fuzzy_backend_open`
+ * @param err error pointer
+ * @return backend structure or NULL
+ */
+struct rspamd_fuzzy_backend* rspamd_fuzzy_backend_open_ro (
+		struct rspamd_fuzzy_backend *parent,
+		GError **err);
+
+/**
+ * Load all digests and shingles into memory index. After that checks are
+ * served from memory and all writes update both memory and the database
+ * @param backend
+ * @param err error pointer
+ * @return TRUE if index has been loaded
+ */
+gboolean rspamd_fuzzy_backend_preload (struct rspamd_fuzzy_backend *backend,
+		GError **err);
+
+/**
+ * Enable write behind queue for the backend. Adding and deleting of digests
+ * are then merged by digest in memory and written to the database in a
+ * single transaction either by `rspamd_fuzzy_backend_flush` or when
+ * `max_commands` are queued. Checks of queued digests take pending changes
+ * into account, however, shingles of queued digests are not searched until
+ * they are written
+ * @param backend
+ * @param max_commands number of commands that causes flush
+ */
+void rspamd_fuzzy_backend_write_behind (struct rspamd_fuzzy_backend *backend,
+		guint max_commands);
+
 /**
  * Check specified fuzzy in the backend
  * @param backend
@@ -69,6 +105,13 @@ gboolean rspamd_fuzzy_backend_del (
 		struct rspamd_fuzzy_backend *backend,
 		const struct rspamd_fuzzy_cmd *cmd);
 
+/**
+ * Write queued changes to the database and commit them
+ * @param backend
+ * @return
+ */
+gboolean rspamd_fuzzy_backend_flush (struct rspamd_fuzzy_backend *backend);
+
 /**
  * Sync storage
  * @param backend
@@ -96,6 +96,7 @@
 #define HOSTNAME_HEADER "Hostname"
 #define DELIVER_TO_HEADER "Deliver-To"
 #define NO_LOG_HEADER "Log"
+#define FILE_HEADER "File"
 
 static GList *custom_commands = NULL;
 
@@ -287,6 +288,10 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 				}
 				debug_task ("read from header, value: %v", h->value);
 			}
+			else if (g_ascii_strcasecmp (headern, FILE_HEADER) == 0) {
+				/* Handled when task body is processed */
+				debug_task ("read file header, value: %v", h->value);
+			}
 			else {
 				debug_task ("wrong header: %s", headern);
 				validh = FALSE;
@@ -589,7 +594,7 @@ make_rewritten_subject (struct metric *metric, struct rspamd_task *task)
 		c = SPAM_SUBJECT;
 	}
 
-	s = g_mime_message_get_subject (task->message);
+	s = message_get_subject (task);
 
 	while (p < end) {
 		if (*c == '\0') {
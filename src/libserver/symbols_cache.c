@@ -29,49 +29,86 @@
 #include "symbols_cache.h"
 #include "cfg_file.h"
 
+#ifndef PARAM_H_HAS_BITSET
+/* Bit map related macros. */
+#define NBBY    8               /* number of bits in a byte */
+#define setbit(a, \
+		i)     (((unsigned char *)(a))[(i) / NBBY] |= 1 << ((i) % NBBY))
+#define clrbit(a, \
+		i)     (((unsigned char *)(a))[(i) / NBBY] &= ~(1 << ((i) % NBBY)))
+#define isset(a,i)                                                      \
+	(((const unsigned char *)(a))[(i) / NBBY] & (1 << ((i) % NBBY)))
+#define isclr(a,i)                                                      \
+	((((const unsigned char *)(a))[(i) / NBBY] & (1 << ((i) % NBBY))) == 0)
+#endif
+#define BITSPERBYTE (8 * sizeof (gchar))
+#define NBYTES(nbits)   (((nbits) + BITSPERBYTE - 1) / BITSPERBYTE)
+
 #define WEIGHT_MULT 4.0
 #define FREQUENCY_MULT 10.0
 #define TIME_MULT -1.0
 
-/* After which number of messages try to resort cache */
-#define MAX_USES 100
+/* Resort cache items each minute with some jitter */
+#define DEFAULT_RELOAD_TIME 60.0
+/* Maximum depth of dependencies chain */
+#define MAX_DEPS_RECURSION 16
 /*
  * Symbols cache utility functions
  */
 
 #define MIN_CACHE 17
 
-static guint64 total_frequency = 0;
-static guint32 nsymbols = 0;
+/* Wall clock timing of a symbol including its async events */
+struct cache_item_watch {
+	struct cache_item *item;
+	guint64 start;
+};
+
+/* Per task state of cache items processing */
+struct cache_savepoint {
+	guint8 *pending;
+	guint8 *finished;
+	guint8 *skipped;
+	guint pos;
+	struct symbols_cache_order *order;
+};
 
 gint
 cache_cmp (const void *p1, const void *p2)
 {
-	const struct cache_item *i1 = p1, *i2 = p2;
+	const struct cache_item *i1 = *(struct cache_item **)p1,
+		*i2 = *(struct cache_item **)p2;
 
 	return strcmp (i1->s->symbol, i2->s->symbol);
 }
 
 gint
-cache_logic_cmp (const void *p1, const void *p2)
+cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 {
-	const struct cache_item *i1 = p1, *i2 = p2;
+	const struct cache_item *i1 = *(struct cache_item **)p1,
+		*i2 = *(struct cache_item **)p2;
+	struct symbols_cache *cache = ud;
 	double w1, w2;
 	double weight1, weight2;
 	double f1 = 0, f2 = 0;
 
+	/* Negative items are always checked first */
+	if (i1->is_negative != i2->is_negative) {
+		return i1->is_negative ? -1 : 1;
+	}
+
 	if (i1->priority == 0 && i2->priority == 0) {
-		if (total_frequency > 0) {
-			f1 =
-				((double)i1->s->frequency * nsymbols) / (double)total_frequency;
-			f2 =
-				((double)i2->s->frequency * nsymbols) / (double)total_frequency;
+		if (cache->total_freq > 0) {
+			f1 = ((double)i1->s->frequency * cache->used_items) /
+				(double)cache->total_freq;
+			f2 = ((double)i2->s->frequency * cache->used_items) /
+				(double)cache->total_freq;
 		}
 		weight1 = i1->metric_weight == 0 ? i1->s->weight : i1->metric_weight;
 		weight2 = i2->metric_weight == 0 ? i2->s->weight : i2->metric_weight;
-		w1 = abs (weight1) * WEIGHT_MULT + f1 * FREQUENCY_MULT +
+		w1 = fabs (weight1) * WEIGHT_MULT + f1 * FREQUENCY_MULT +
 			i1->s->avg_time * TIME_MULT;
-		w2 = abs (weight2) * WEIGHT_MULT + f2 * FREQUENCY_MULT +
+		w2 = fabs (weight2) * WEIGHT_MULT + f2 * FREQUENCY_MULT +
 			i2->s->avg_time * TIME_MULT;
 	}
 	else {
@@ -80,7 +117,14 @@ cache_logic_cmp (const void *p1, const void *p2)
 		w2 = abs (i2->priority);
 	}
 
-	return (gint)w2 - w1;
+	if (w2 > w1) {
+		return 1;
+	}
+	else if (w2 < w1) {
+		return -1;
+	}
+
+	return 0;
 }
 
 /**
@@ -104,71 +148,293 @@ rspamd_set_counter (struct cache_item *item, guint32 value)
 	return cd->value;
 }
 
+static inline guint
+rspamd_symbols_cache_hist_bucket (guint64 value)
+{
+	guint range = 0;
+	guint64 v;
+
+	if (value < RSPAMD_HIST_SUB_BUCKETS) {
+		return value;
+	}
+
+	/* Find the most significant bit */
+	for (v = value >> RSPAMD_HIST_SUB_BITS; v != 0; v >>= 1) {
+		range ++;
+	}
+
+	if (range >= RSPAMD_HIST_RANGES) {
+		return RSPAMD_HIST_BUCKETS - 1;
+	}
+
+	return range * RSPAMD_HIST_SUB_BUCKETS +
+		((value >> (range - 1)) & (RSPAMD_HIST_SUB_BUCKETS - 1));
+}
+
+static inline guint64
+rspamd_symbols_cache_hist_bucket_max (guint bucket)
+{
+	guint range, sub;
+
+	if (bucket < RSPAMD_HIST_SUB_BUCKETS) {
+		return bucket;
+	}
+
+	range = bucket / RSPAMD_HIST_SUB_BUCKETS;
+	sub = bucket % RSPAMD_HIST_SUB_BUCKETS;
+
+	return (((guint64)RSPAMD_HIST_SUB_BUCKETS + sub + 1) << (range - 1)) - 1;
+}
+
+/*
+ * Histograms are shared between all workers, so they are updated atomically
+ * where possible. 64 bit counters need 8 byte atomics, which some 32 bit
+ * targets lack, they are updated non-atomically there
+ */
+#if defined(HAVE_ATOMIC_BUILTINS) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+#define RSPAMD_HIST_ATOMIC64
+#endif
+
+static void
+rspamd_symbols_cache_hist_add (struct rspamd_symbol_histogram *h,
+	guint64 value)
+{
+	guint bucket;
+#ifdef RSPAMD_HIST_ATOMIC64
+	guint64 old;
+#endif
+
+	bucket = rspamd_symbols_cache_hist_bucket (value);
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	__sync_fetch_and_add (&h->buckets[bucket], 1);
+#else
+	h->buckets[bucket] ++;
+#endif
+
+#ifdef RSPAMD_HIST_ATOMIC64
+	__sync_fetch_and_add (&h->count, 1);
+
+	do {
+		old = h->max;
+
+		if (old >= value) {
+			break;
+		}
+	} while (!__sync_bool_compare_and_swap (&h->max, old, value));
+#else
+	h->count ++;
+
+	if (h->max < value) {
+		h->max = value;
+	}
+#endif
+}
+
+guint64
+rspamd_symbols_cache_hist_percentile (const struct rspamd_symbol_histogram *h,
+	gdouble pct)
+{
+	guint64 total = 0, target, res;
+	guint i;
+
+	for (i = 0; i < RSPAMD_HIST_BUCKETS; i ++) {
+		total += h->buckets[i];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	target = ceil (total * CLAMP (pct, 0.0, 100.0) / 100.0);
+
+	if (target == 0) {
+		target = 1;
+	}
+
+	total = 0;
+	for (i = 0; i < RSPAMD_HIST_BUCKETS; i ++) {
+		total += h->buckets[i];
+
+		if (total >= target) {
+			res = rspamd_symbols_cache_hist_bucket_max (i);
+
+			return MIN (res, h->max);
+		}
+	}
+
+	return h->max;
+}
+
+/* Returns the current time in microseconds */
+static guint64
+rspamd_symbols_cache_get_ticks (gboolean cpu_time)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	if (cpu_time) {
+# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
+		clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+# elif defined(HAVE_CLOCK_VIRTUAL)
+		clock_gettime (CLOCK_VIRTUAL,			 &ts);
+# else
+		clock_gettime (CLOCK_REALTIME,			 &ts);
+# endif
+	}
+	else {
+# ifdef CLOCK_MONOTONIC
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+# else
+		clock_gettime (CLOCK_REALTIME, &ts);
+# endif
+	}
+
+	return ts_to_usec (&ts);
+#else
+	struct timeval tv;
+
+	if (gettimeofday (&tv, NULL) == -1) {
+		msg_warn ("gettimeofday failed: %s", strerror (errno));
+	}
+
+	return tv.tv_sec * 1000000LLU + tv.tv_usec;
+#endif
+}
+
+static void
+rspamd_symbols_cache_order_dtor (gpointer p)
+{
+	struct symbols_cache_order *ord = p;
+
+	g_ptr_array_free (ord->d, TRUE);
+	g_slice_free1 (sizeof (*ord), ord);
+}
+
+static struct symbols_cache_order *
+rspamd_symbols_cache_order_new (struct symbols_cache *cache)
+{
+	struct symbols_cache_order *ord;
+	guint i;
+
+	ord = g_slice_alloc0 (sizeof (*ord));
+	ord->d = g_ptr_array_sized_new (cache->items_by_id->len);
+	ord->id = cache->items_by_order ? cache->items_by_order->id + 1 : 0;
+	REF_INIT_RETAIN (ord, rspamd_symbols_cache_order_dtor);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		g_ptr_array_add (ord->d, g_ptr_array_index (cache->items_by_id, i));
+	}
+
+	return ord;
+}
+
 static GChecksum *
 get_mem_cksum (struct symbols_cache *cache)
 {
 	GChecksum *result;
-	GList *cur, *l;
+	GPtrArray *sorted;
 	struct cache_item *item;
+	guint i;
+	guint32 reclen;
 
 	result = g_checksum_new (G_CHECKSUM_SHA1);
 
-	l = g_list_copy (cache->negative_items);
-	l = g_list_sort (l, cache_cmp);
-	cur = g_list_first (l);
-	while (cur) {
-		item = cur->data;
-		if (item->s->symbol[0] != '\0') {
-			g_checksum_update (result, item->s->symbol,
-				strlen (item->s->symbol));
-		}
-		cur = g_list_next (cur);
+	sorted = g_ptr_array_sized_new (cache->items_by_id->len);
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		g_ptr_array_add (sorted, g_ptr_array_index (cache->items_by_id, i));
 	}
-	g_list_free (l);
-
+	g_ptr_array_sort (sorted, cache_cmp);
 
-	l = g_list_copy (cache->static_items);
-	l = g_list_sort (l, cache_cmp);
-	cur = g_list_first (l);
-	while (cur) {
-		item = cur->data;
+	for (i = 0; i < sorted->len; i ++) {
+		item = g_ptr_array_index (sorted, i);
 		if (item->s->symbol[0] != '\0') {
 			g_checksum_update (result, item->s->symbol,
 				strlen (item->s->symbol));
 		}
-		total_frequency += item->s->frequency;
-		cur = g_list_next (cur);
 	}
-	g_list_free (l);
+	g_ptr_array_free (sorted, TRUE);
+
+	/* Recreate cache file if the layout of saved items has been changed */
+	reclen = sizeof (struct saved_cache_item);
+	g_checksum_update (result, (const guchar *)&reclen, sizeof (reclen));
 
 	return result;
 }
 
-/* Sort items in logical order */
+/* Sort items in logical order and replace the current order */
 static void
-post_cache_init (struct symbols_cache *cache)
+rspamd_symbols_cache_resort (struct symbols_cache *cache)
 {
-	GList *cur;
+	struct symbols_cache_order *ord, *old;
 	struct cache_item *item;
+	guint i;
 
-	total_frequency = 0;
-	nsymbols = cache->used_items;
-	cur = g_list_first (cache->negative_items);
-	while (cur) {
-		item = cur->data;
-		total_frequency += item->s->frequency;
-		cur = g_list_next (cur);
+	cache->total_freq = 0;
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+		cache->total_freq += item->s->frequency;
+	}
+
+	ord = rspamd_symbols_cache_order_new (cache);
+	g_ptr_array_sort_with_data (ord->d, cache_logic_cmp, cache);
+
+	/*
+	 * Tasks that are being processed hold references to the old order,
+	 * so it is released when the last of them is finished
+	 */
+	old = cache->items_by_order;
+	cache->items_by_order = ord;
+
+	if (old != NULL) {
+		REF_RELEASE (old);
 	}
-	cur = g_list_first (cache->static_items);
+}
+
+static void
+rspamd_symbols_cache_resolve_deps (struct symbols_cache *cache)
+{
+	GList *cur;
+	struct cache_dependency *dep;
+	struct cache_item *it, *dit;
+	const gchar *sym;
+
+	cur = cache->delayed_deps;
 	while (cur) {
-		item = cur->data;
-		total_frequency += item->s->frequency;
+		dep = cur->data;
+		it = dep->item;
+		sym = dep->sym;
+		dit = g_hash_table_lookup (cache->items_by_symbol, sym);
+
+		if (dit == NULL) {
+			msg_err ("cannot add dependency on %s from %s: no dependency "
+					"symbol registered", sym, it->s->symbol);
+		}
+		else if (dit == it) {
+			msg_err ("cannot add dependency of %s on itself", sym);
+		}
+		else {
+			dep->id = dit->id;
+
+			if (it->deps == NULL) {
+				it->deps = g_ptr_array_new ();
+			}
+			g_ptr_array_add (it->deps, dep);
+			dep->item = dit;
+		}
+
 		cur = g_list_next (cur);
 	}
 
-	cache->negative_items =
-		g_list_sort (cache->negative_items, cache_logic_cmp);
-	cache->static_items = g_list_sort (cache->static_items, cache_logic_cmp);
+	g_list_free (cache->delayed_deps);
+	cache->delayed_deps = NULL;
+}
+
+static void
+post_cache_init (struct symbols_cache *cache)
+{
+	rspamd_symbols_cache_resolve_deps (cache);
+	rspamd_symbols_cache_resort (cache);
 }
 
 /* Unmap cache file */
@@ -185,9 +451,9 @@ static gboolean
 mmap_cache_file (struct symbols_cache *cache, gint fd, rspamd_mempool_t *pool)
 {
 	guint8 *map;
-	gint i;
-	GList *cur;
+	guint i;
 	struct cache_item *item;
+	struct saved_cache_item *saved;
 
 	if (cache->used_items > 0) {
 		map = mmap (NULL,
@@ -204,30 +470,28 @@ mmap_cache_file (struct symbols_cache *cache, gint fd, rspamd_mempool_t *pool)
 		/* Close descriptor as it would never be used */
 		close (fd);
 		cache->map = map;
-		/* Now free old values for saved cache items and fill them with mmapped ones */
-		i = 0;
-		cur = g_list_first (cache->negative_items);
-		while (cur) {
-			item = cur->data;
-			item->s =
-				(struct saved_cache_item *)(map + i *
-				sizeof (struct saved_cache_item));
-			cur = g_list_next (cur);
-			i++;
-		}
-		cur = g_list_first (cache->static_items);
-		while (cur) {
-			item = cur->data;
-			item->s =
-				(struct saved_cache_item *)(map + i *
-				sizeof (struct saved_cache_item));
-			cur = g_list_next (cur);
-			i++;
+		/*
+		 * Now replace old values for saved cache items with mmapped ones,
+		 * symbols are matched by name as the order of records in file
+		 * is not guaranteed to match items ids
+		 */
+		for (i = 0; i < cache->used_items; i ++) {
+			saved = (struct saved_cache_item *)(map + i *
+					sizeof (struct saved_cache_item));
+			item = g_hash_table_lookup (cache->items_by_symbol, saved->symbol);
+
+			if (item != NULL) {
+				item->s = saved;
+			}
+			else {
+				msg_warn ("cannot find symbol %*s from cache file",
+						(gint)sizeof (saved->symbol), saved->symbol);
+			}
 		}
-
-		post_cache_init (cache);
 	}
 
+	post_cache_init (cache);
+
 	return TRUE;
 }
 
@@ -241,7 +505,7 @@ create_cache_file (struct symbols_cache *cache,
 	GChecksum *cksum;
 	u_char *digest;
 	gsize cklen;
-	GList *cur;
+	guint i;
 	struct cache_item *item;
 
 	/* Calculate checksum */
@@ -257,21 +521,8 @@ create_cache_file (struct symbols_cache *cache,
 
 	g_checksum_get_digest (cksum, digest, &cklen);
 	/* Now write data to file */
-	cur = g_list_first (cache->negative_items);
-	while (cur) {
-		item = cur->data;
-		if (write (fd, item->s, sizeof (struct saved_cache_item)) == -1) {
-			msg_err ("cannot write to file %d, %s", errno, strerror (errno));
-			close (fd);
-			g_checksum_free (cksum);
-			g_free (digest);
-			return FALSE;
-		}
-		cur = g_list_next (cur);
-	}
-	cur = g_list_first (cache->static_items);
-	while (cur) {
-		item = cur->data;
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
 		if (write (fd, item->s, sizeof (struct saved_cache_item)) == -1) {
 			msg_err ("cannot write to file %d, %s", errno, strerror (errno));
 			close (fd);
@@ -279,7 +530,6 @@ create_cache_file (struct symbols_cache *cache,
 			g_free (digest);
 			return FALSE;
 		}
-		cur = g_list_next (cur);
 	}
 	/* Write checksum */
 	if (write (fd, digest, cklen) == -1) {
@@ -302,6 +552,22 @@ create_cache_file (struct symbols_cache *cache,
 	return mmap_cache_file (cache, fd, pool);
 }
 
+struct symbols_cache *
+rspamd_symbols_cache_new (void)
+{
+	struct symbols_cache *cache;
+
+	cache = g_new0 (struct symbols_cache, 1);
+	cache->static_pool =
+		rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	cache->items_by_symbol = g_hash_table_new (rspamd_str_hash,
+			rspamd_str_equal);
+	cache->items_by_id = g_ptr_array_new ();
+	cache->reload_time = DEFAULT_RELOAD_TIME;
+
+	return cache;
+}
+
 void
 register_symbol_common (struct symbols_cache **cache,
 	const gchar *name,
@@ -313,18 +579,14 @@ register_symbol_common (struct symbols_cache **cache,
 {
 	struct cache_item *item = NULL;
 	struct symbols_cache *pcache = *cache;
-	GList **target, *cur;
+	GList *cur;
 	struct metric *m;
 	struct rspamd_symbol_def *s;
 	gboolean skipped;
 
 	if (*cache == NULL) {
-		pcache = g_new0 (struct symbols_cache, 1);
+		pcache = rspamd_symbols_cache_new ();
 		*cache = pcache;
-		pcache->static_pool =
-			rspamd_mempool_new (rspamd_mempool_suggest_size ());
-		pcache->items_by_symbol = g_hash_table_new (rspamd_str_hash,
-				rspamd_str_equal);
 	}
 
 	item = rspamd_mempool_alloc0 (pcache->static_pool,
@@ -406,31 +668,21 @@ register_symbol_common (struct symbols_cache **cache,
 				name);
 	}
 
-	/* If we have undefined priority determine list according to weight */
+	/* If we have undefined priority determine order according to weight */
 	if (priority == 0) {
-		if (item->s->weight > 0) {
-			target = &(*cache)->static_items;
-		}
-		else {
-			target = &(*cache)->negative_items;
-		}
+		item->is_negative = item->s->weight <= 0;
 	}
 	else {
 		/* Items with more priority are called before items with less priority */
-		if (priority < 0) {
-			target = &(*cache)->negative_items;
-		}
-		else {
-			target = &(*cache)->static_items;
-		}
+		item->is_negative = priority < 0;
 	}
 
+	item->id = pcache->items_by_id->len;
+	g_ptr_array_add (pcache->items_by_id, item);
 	pcache->used_items++;
 	g_hash_table_insert (pcache->items_by_symbol, item->s->symbol, item);
 	msg_debug ("used items: %d, added symbol: %s", (*cache)->used_items, name);
 	rspamd_set_counter (item, 0);
-
-	*target = g_list_prepend (*target, item);
 }
 
 void
@@ -494,22 +746,63 @@ register_callback_symbol_priority (struct symbols_cache **cache,
 }
 
 
+void
+register_dependency (struct symbols_cache *cache,
+	const gchar *symbol,
+	const gchar *from)
+{
+	struct cache_item *item;
+	struct cache_dependency *dep;
+
+	g_assert (cache != NULL);
+
+	item = g_hash_table_lookup (cache->items_by_symbol, symbol);
+
+	if (item == NULL) {
+		msg_err ("cannot register dependency on %s for unknown symbol %s",
+				from, symbol);
+		return;
+	}
+
+	/* Dependencies are resolved when all symbols are registered */
+	dep = rspamd_mempool_alloc (cache->static_pool, sizeof (*dep));
+	dep->item = item;
+	dep->sym = rspamd_mempool_strdup (cache->static_pool, from);
+	dep->id = -1;
+	cache->delayed_deps = g_list_prepend (cache->delayed_deps, dep);
+}
 
 static void
 free_cache (gpointer arg)
 {
 	struct symbols_cache *cache = arg;
+	struct cache_item *item;
+	guint i;
 
 	if (cache->map != NULL) {
 		unmap_cache_file (cache);
 	}
 
-	if (cache->static_items) {
-		g_list_free (cache->static_items);
+	if (cache->items_by_id != NULL) {
+		for (i = 0; i < cache->items_by_id->len; i ++) {
+			item = g_ptr_array_index (cache->items_by_id, i);
+
+			if (item->deps) {
+				g_ptr_array_free (item->deps, TRUE);
+			}
+		}
+
+		g_ptr_array_free (cache->items_by_id, TRUE);
 	}
-	if (cache->negative_items) {
-		g_list_free (cache->negative_items);
+
+	if (cache->items_by_order) {
+		REF_RELEASE (cache->items_by_order);
 	}
+
+	if (cache->delayed_deps) {
+		g_list_free (cache->delayed_deps);
+	}
+
 	g_hash_table_destroy (cache->items_by_symbol);
 	rspamd_mempool_delete (cache->static_pool);
 
@@ -681,30 +974,14 @@ static void
 rspamd_symbols_cache_metric_cb (gpointer k, gpointer v, gpointer ud)
 {
 	struct symbols_cache *cache = (struct symbols_cache *)ud;
-	GList *cur;
 	const gchar *sym = k;
 	struct rspamd_symbol_def *s = (struct rspamd_symbol_def *)v;
-	gdouble weight;
 	struct cache_item *item;
 
-	weight = *s->weight_ptr;
-	cur = cache->negative_items;
-	while (cur) {
-		item = cur->data;
-		if (strcmp (item->s->symbol, sym) == 0) {
-			item->metric_weight = weight;
-			return;
-		}
-		cur = g_list_next (cur);
-	}
-	cur = cache->static_items;
-	while (cur) {
-		item = cur->data;
-		if (strcmp (item->s->symbol, sym) == 0) {
-			item->metric_weight = weight;
-			return;
-		}
-		cur = g_list_next (cur);
+	item = g_hash_table_lookup (cache->items_by_symbol, sym);
+
+	if (item != NULL) {
+		item->metric_weight = *s->weight_ptr;
 	}
 }
 
@@ -713,9 +990,7 @@ validate_cache (struct symbols_cache *cache,
 	struct rspamd_config *cfg,
 	gboolean strict)
 {
-	struct cache_item *item;
-	GList *cur, *p, *metric_symbols;
-	gboolean res;
+	GList *cur, *metric_symbols;
 
 	if (cache == NULL) {
 		msg_err ("empty cache is invalid");
@@ -726,32 +1001,12 @@ validate_cache (struct symbols_cache *cache,
 	metric_symbols = g_hash_table_get_keys (cfg->metrics_symbols);
 	cur = metric_symbols;
 	while (cur) {
-		res = FALSE;
-		p = cache->negative_items;
-		while (p) {
-			item = p->data;
-			if (strcmp (item->s->symbol, cur->data) == 0) {
-				res = TRUE;
-				break;
-			}
-			p = g_list_next (p);
-		}
-		if (!res) {
-			p = cache->static_items;
-			while (p) {
-				item = p->data;
-				if (strcmp (item->s->symbol, cur->data) == 0) {
-					res = TRUE;
-					break;
-				}
-				p = g_list_next (p);
-			}
-		}
-		if (!res) {
+		if (g_hash_table_lookup (cache->items_by_symbol, cur->data) == NULL) {
 			msg_warn (
 				"symbol '%s' is registered in metric but not found in cache",
 				cur->data);
 			if (strict) {
+				g_list_free (metric_symbols);
 				return FALSE;
 			}
 		}
@@ -766,158 +1021,197 @@ validate_cache (struct symbols_cache *cache,
 			rspamd_symbols_cache_metric_cb,
 			cache);
 		/* Resort caches */
-		cache->negative_items = g_list_sort (cache->negative_items,
-				cache_logic_cmp);
-		cache->static_items =
-			g_list_sort (cache->static_items, cache_logic_cmp);
+		rspamd_symbols_cache_resort (cache);
 	}
 
 	return TRUE;
 }
 
-struct symbol_callback_data {
-	enum {
-		CACHE_STATE_NEGATIVE,
-		CACHE_STATE_STATIC
-	} state;
-	struct cache_item *saved_item;
-	GList *list_pointer;
-};
+static void
+rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
+{
+	struct symbols_cache *cache = ud;
+	struct timeval tv;
+	gdouble tm;
 
-gboolean
-call_symbol_callback (struct rspamd_task * task,
-	struct symbols_cache * cache,
-	gpointer *save)
+	msg_debug ("resort symbols cache");
+	rspamd_symbols_cache_resort (cache);
+
+	/* Plan the next resort with some jitter */
+	tm = cache->reload_time + g_random_double () * cache->reload_time;
+	double_to_tv (tm, &tv);
+	evtimer_add (&cache->resort_ev, &tv);
+}
+
+void
+rspamd_symbols_cache_start_refresh (struct symbols_cache *cache,
+	struct event_base *ev_base)
 {
-#ifdef HAVE_CLOCK_GETTIME
-	struct timespec ts1, ts2;
-#else
-	struct timeval tv1, tv2;
-#endif
-	guint64 diff;
-	struct cache_item *item = NULL;
-	struct symbol_callback_data *s = *save;
+	struct timeval tv;
+	gdouble tm;
 
-	if (s == NULL) {
-		if (cache == NULL) {
-			return FALSE;
-		}
-		if (cache->uses++ >= MAX_USES) {
-			msg_info ("resort symbols cache");
-			cache->uses = 0;
-			/* Resort while having write lock */
-			post_cache_init (cache);
-		}
-		s =
-			rspamd_mempool_alloc0 (task->task_pool,
-				sizeof (struct symbol_callback_data));
-		*save = s;
-		if (cache->negative_items != NULL) {
-			s->list_pointer = g_list_first (cache->negative_items);
-			s->saved_item = s->list_pointer->data;
-			s->state = CACHE_STATE_NEGATIVE;
-		}
-		else {
-			s->state = CACHE_STATE_STATIC;
-			s->list_pointer = g_list_first (cache->static_items);
-			if (s->list_pointer) {
-				s->saved_item = s->list_pointer->data;
-			}
-			else {
-				return FALSE;
-			}
-		}
-		item = s->saved_item;
+	if (cache == NULL) {
+		return;
 	}
-	else {
-		if (cache == NULL) {
-			return FALSE;
-		}
-		switch (s->state) {
-		case CACHE_STATE_NEGATIVE:
-			s->list_pointer = g_list_next (s->list_pointer);
-			if (s->list_pointer == NULL) {
-				s->state = CACHE_STATE_STATIC;
-				s->list_pointer = g_list_first (cache->static_items);
-				if (s->list_pointer) {
-					s->saved_item = s->list_pointer->data;
-				}
-				else {
-					return FALSE;
-				}
+
+	tm = cache->reload_time + g_random_double () * cache->reload_time;
+	double_to_tv (tm, &tv);
+	evtimer_set (&cache->resort_ev, rspamd_symbols_cache_resort_cb, cache);
+	event_base_set (ev_base, &cache->resort_ev);
+	evtimer_add (&cache->resort_ev, &tv);
+}
+
+static void
+rspamd_symbols_cache_savepoint_dtor (gpointer p)
+{
+	struct cache_savepoint *s = p;
+
+	REF_RELEASE (s->order);
+}
+
+static inline gboolean
+rspamd_symbols_cache_item_checked (struct cache_savepoint *s,
+	struct cache_item *item)
+{
+	return isset (s->finished, item->id) || isset (s->skipped, item->id);
+}
+
+/* Called when all async events of a symbol are finished */
+static void
+rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
+{
+	struct cache_item_watch *w = ud;
+	guint64 diff;
+
+	diff = rspamd_symbols_cache_get_ticks (FALSE) - w->start;
+	rspamd_symbols_cache_hist_add (&w->item->s->wall_hist, diff);
+}
+
+static void
+rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
+	struct cache_item *item,
+	struct cache_savepoint *s,
+	gint recursion)
+{
+	guint64 t1, t2, diff;
+	struct cache_dependency *dep;
+	struct cache_item_watch *w;
+	guint i, pending = 0;
+
+	setbit (s->pending, item->id);
+
+	/* Check all dependencies first */
+	if (item->deps != NULL) {
+		for (i = 0; i < item->deps->len; i ++) {
+			dep = g_ptr_array_index (item->deps, i);
+
+			if (dep->item == NULL ||
+					rspamd_symbols_cache_item_checked (s, dep->item)) {
+				continue;
 			}
-			else {
-				s->saved_item = s->list_pointer->data;
+
+			if (isset (s->pending, dep->id)) {
+				msg_warn ("cyclic dependency between %s and %s",
+						item->s->symbol, dep->sym);
 			}
-			item = s->saved_item;
-			break;
-		case CACHE_STATE_STATIC:
-			/* Next pointer */
-			s->list_pointer = g_list_next (s->list_pointer);
-			if (s->list_pointer) {
-				s->saved_item = s->list_pointer->data;
+			else if (recursion >= MAX_DEPS_RECURSION) {
+				msg_warn ("dependencies chain of %s is too long, "
+						"stop at %s", item->s->symbol, dep->sym);
 			}
 			else {
-				return FALSE;
+				rspamd_symbols_cache_check_symbol (task, dep->item, s,
+						recursion + 1);
 			}
-			item = s->saved_item;
-			break;
 		}
 	}
-	if (!item) {
-		return FALSE;
+
+	clrbit (s->pending, item->id);
+
+	if (item->is_virtual || item->is_skipped) {
+		setbit (s->skipped, item->id);
+		return;
 	}
-	if (!item->is_virtual && !item->is_skipped) {
-#ifdef HAVE_CLOCK_GETTIME
-# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
-		clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts1);
-# elif defined(HAVE_CLOCK_VIRTUAL)
-		clock_gettime (CLOCK_VIRTUAL,			 &ts1);
-# else
-		clock_gettime (CLOCK_REALTIME,			 &ts1);
-# endif
-#else
-		if (gettimeofday (&tv1, NULL) == -1) {
-			msg_warn ("gettimeofday failed: %s", strerror (errno));
-		}
-#endif
-		if (G_UNLIKELY (check_debug_symbol (task->cfg, item->s->symbol))) {
-			rspamd_log_debug (rspamd_main->logger);
-			item->func (task, item->user_data);
-			rspamd_log_nodebug (rspamd_main->logger);
-		}
-		else {
-			item->func (task, item->user_data);
-		}
 
+	w = rspamd_mempool_alloc (task->task_pool, sizeof (*w));
+	w->item = item;
+	w->start = rspamd_symbols_cache_get_ticks (FALSE);
 
-#ifdef HAVE_CLOCK_GETTIME
-# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
-		clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts2);
-# elif defined(HAVE_CLOCK_VIRTUAL)
-		clock_gettime (CLOCK_VIRTUAL,			 &ts2);
-# else
-		clock_gettime (CLOCK_REALTIME,			 &ts2);
-# endif
-#else
-		if (gettimeofday (&tv2, NULL) == -1) {
-			msg_warn ("gettimeofday failed: %s", strerror (errno));
+	if (task->s) {
+		rspamd_session_watch_start (task->s, rspamd_symbols_cache_watcher_cb,
+				w);
+	}
+
+	t1 = rspamd_symbols_cache_get_ticks (TRUE);
+
+	if (G_UNLIKELY (check_debug_symbol (task->cfg, item->s->symbol))) {
+		rspamd_log_debug (rspamd_main->logger);
+		item->func (task, item->user_data);
+		rspamd_log_nodebug (rspamd_main->logger);
+	}
+	else {
+		item->func (task, item->user_data);
+	}
+
+	t2 = rspamd_symbols_cache_get_ticks (TRUE);
+
+	if (task->s) {
+		pending = rspamd_session_watch_stop (task->s);
+	}
+
+	setbit (s->finished, item->id);
+
+	diff = t2 - t1;
+	item->s->avg_time = rspamd_set_counter (item, diff);
+	rspamd_symbols_cache_hist_add (&item->s->cpu_hist, diff);
+
+	if (pending == 0) {
+		/* No async events, so the symbol is finished now */
+		rspamd_symbols_cache_watcher_cb (task, w);
+	}
+}
+
+gboolean
+call_symbol_callback (struct rspamd_task * task,
+	struct symbols_cache * cache,
+	gpointer *save)
+{
+	struct cache_item *item;
+	struct cache_savepoint *s = *save;
+	gsize bitlen;
+
+	if (cache == NULL) {
+		return FALSE;
+	}
+
+	if (s == NULL) {
+		if (cache->items_by_order == NULL) {
+			return FALSE;
 		}
-#endif
 
-#ifdef HAVE_CLOCK_GETTIME
-		diff =
-			(ts2.tv_sec -
-			ts1.tv_sec) * 1000000 + (ts2.tv_nsec - ts1.tv_nsec) / 1000;
-#else
-		diff =
-			(tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
-#endif
-		item->s->avg_time = rspamd_set_counter (item, diff);
+		s = rspamd_mempool_alloc0 (task->task_pool, sizeof (*s));
+		/* Task keeps the order it has started with even if cache is resorted */
+		s->order = cache->items_by_order;
+		REF_RETAIN (s->order);
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_symbols_cache_savepoint_dtor, s);
+
+		bitlen = NBYTES (cache->items_by_id->len);
+		s->pending = rspamd_mempool_alloc0 (task->task_pool, bitlen * 3);
+		s->finished = s->pending + bitlen;
+		s->skipped = s->finished + bitlen;
+		*save = s;
 	}
 
-	s->saved_item = item;
+	while (s->pos < s->order->d->len) {
+		item = g_ptr_array_index (s->order->d, s->pos);
+		s->pos ++;
 
-	return TRUE;
+		if (!rspamd_symbols_cache_item_checked (s, item)) {
+			rspamd_symbols_cache_check_symbol (task, item, s, 0);
 
+			return TRUE;
+		}
+	}
+
+	return FALSE;
 }
@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "radix.h"
+#include "ref.h"
 
 #define MAX_SYMBOL 128
 
@@ -11,11 +12,31 @@ struct rspamd_config;
 
 typedef void (*symbol_func_t)(struct rspamd_task *task, gpointer user_data);
 
+/*
+ * Log-linear histogram of latencies in microseconds: values below
+ * RSPAMD_HIST_SUB_BUCKETS are stored exactly, each next power of two range is
+ * split to RSPAMD_HIST_SUB_BUCKETS linear buckets
+ */
+#define RSPAMD_HIST_SUB_BUCKETS 8
+#define RSPAMD_HIST_SUB_BITS 3
+#define RSPAMD_HIST_RANGES 24
+#define RSPAMD_HIST_BUCKETS (RSPAMD_HIST_SUB_BUCKETS * RSPAMD_HIST_RANGES)
+
+struct rspamd_symbol_histogram {
+	guint64 count;
+	guint64 max;
+	guint32 buckets[RSPAMD_HIST_BUCKETS];
+};
+
 struct saved_cache_item {
 	gchar symbol[MAX_SYMBOL];
 	double weight;
 	guint32 frequency;
 	double avg_time;
+	/* CPU time spent in the symbol's callback */
+	struct rspamd_symbol_histogram cpu_hist;
+	/* Real time until all async events of the symbol are finished */
+	struct rspamd_symbol_histogram wall_hist;
 };
 
 struct dynamic_map_item {
@@ -54,6 +75,29 @@ struct cache_item {
 	/* Priority */
 	gint priority;
 	gdouble metric_weight;
+
+	/* Index in the flat items array */
+	gint id;
+	/* Item is checked before positive items */
+	gboolean is_negative;
+
+	/* Dependencies: symbols that must be checked before this item */
+	GPtrArray *deps;
+};
+
+struct cache_dependency {
+	struct cache_item *item;
+	gchar *sym;
+	gint id;
+};
+
+/*
+ * Immutable order of items used by tasks, it is replaced as a whole on resort
+ */
+struct symbols_cache_order {
+	GPtrArray *d;
+	guint id;
+	ref_entry_t ref;
 };
 
 enum rspamd_symbol_type {
@@ -63,24 +107,35 @@ enum rspamd_symbol_type {
 };
 
 struct symbols_cache {
-	/* Normal cache items */
-	GList *static_items;
+	/* All cache items indexed by their id */
+	GPtrArray *items_by_id;
 
-	/* Items that have negative weights */
-	GList *negative_items;
+	/* Current order of checks */
+	struct symbols_cache_order *items_by_order;
 
 	/* Hash table for fast access */
 	GHashTable *items_by_symbol;
 
+	/* Dependencies that are not resolved yet */
+	GList *delayed_deps;
+
 	rspamd_mempool_t *static_pool;
 
 	guint cur_items;
 	guint used_items;
-	guint uses;
+	guint64 total_freq;
 	gpointer map;
+	gdouble reload_time;
+	struct event resort_ev;
 	struct rspamd_config *cfg;
 };
 
+/**
+ * Creates new empty symbols cache
+ * @return new cache object
+ */
+struct symbols_cache * rspamd_symbols_cache_new (void);
+
 /**
  * Load symbols cache from file, must be called _after_ init_symbols_cache
  */
@@ -169,6 +224,16 @@ register_symbol_common (struct symbols_cache **cache,
 	gpointer user_data,
 	enum rspamd_symbol_type type);
 
+/**
+ * Register dependency between symbols: `from` is checked before `symbol`
+ * @param cache symbols cache
+ * @param symbol name of dependent symbol
+ * @param from name of symbol that must be checked first
+ */
+void register_dependency (struct symbols_cache *cache,
+	const gchar *symbol,
+	const gchar *from);
+
 /**
  * Call function for cached symbol using saved callback
  * @param task task object
@@ -195,5 +260,23 @@ gboolean validate_cache (struct symbols_cache *cache,
 	struct rspamd_config *cfg,
 	gboolean strict);
 
+/**
+ * Get the value of the specified percentile from a latency histogram
+ * @param h histogram
+ * @param pct percentile (0..100)
+ * @return upper bound of the percentile in microseconds
+ */
+guint64 rspamd_symbols_cache_hist_percentile (
+	const struct rspamd_symbol_histogram *h,
+	gdouble pct);
+
+/**
+ * Start periodic resorting of cache items according to their statistics
+ * @param cache symbols cache
+ * @param ev_base event base of a worker
+ */
+void rspamd_symbols_cache_start_refresh (struct symbols_cache *cache,
+	struct event_base *ev_base);
+
 
 #endif
@@ -26,6 +26,7 @@
 #include "filter.h"
 #include "protocol.h"
 #include "message.h"
+#include "expressions.h"
 #include "lua/lua_common.h"
 
 static void
@@ -65,16 +66,23 @@ rspamd_task_new (struct rspamd_worker *worker)
 		msg_warn ("gettimeofday failed: %s", strerror (errno));
 	}
 
-	new_task->task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	/* Task pool is made shared if classification is done in threads */
+	new_task->task_pool = rspamd_mempool_new_full (
+			rspamd_mempool_suggest_size (),
+			RSPAMD_MEMPOOL_SINGLE_OWNER | RSPAMD_MEMPOOL_RECYCLE);
 
 	new_task->results = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
 		new_task->results);
-	new_task->re_cache = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->re_cache);
+	/* Two bits per regexp, see task_cache_add */
+	if (new_task->cfg) {
+		/* Config pool shares ids with all pools that parse regexps */
+		new_task->re_cache_len = rspamd_regexp_max_id (
+				new_task->cfg->cfg_pool);
+	}
+	new_task->re_cache = rspamd_mempool_alloc0 (new_task->task_pool,
+			(new_task->re_cache_len / 16 + 1) * sizeof (guint32));
 	new_task->raw_headers = g_hash_table_new (rspamd_strcase_hash,
 			rspamd_strcase_equal);
 	new_task->request_headers = g_hash_table_new_full ((GHashFunc)g_string_hash,
@@ -140,14 +148,15 @@ rspamd_task_fin (void *arg)
 	/* We processed all filters and want to process statfiles */
 	if (task->state != WAIT_POST_FILTER && task->state != WAIT_PRE_FILTER) {
 		/* Process all statfiles */
-		if (task->classify_pool == NULL) {
-			/* Non-threaded version */
+		if (task->classify_pool == NULL && task->state != WAIT_STATISTICS) {
+			/* Non-threaded version, statfiles may be loaded by events */
+			task->state = WAIT_STATISTICS;
 			rspamd_process_statistics (task);
+			return FALSE;
 		}
-		else {
-			/* Just process composites */
-			rspamd_make_composites (task);
-		}
+
+		rspamd_make_composites (task);
+
 		if (task->cfg->post_filters) {
 			/* More to process */
 			/* Special state */
@@ -183,6 +192,7 @@ rspamd_task_fin (void *arg)
 			}
 			/* Add task to classify to classify pool */
 			if (!task->is_skipped && task->classify_pool) {
+				rspamd_mempool_set_shared (task->task_pool);
 				register_async_thread (task->s);
 				g_thread_pool_push (task->classify_pool, task, &err);
 				if (err != NULL) {
@@ -225,16 +235,12 @@ void
 rspamd_task_free (struct rspamd_task *task, gboolean is_soft)
 {
 	GList *part;
-	struct mime_part *p;
 	struct mime_text_part *tp;
 
 	if (task) {
 		debug_task ("free pointer %p", task);
-		while ((part = g_list_first (task->parts))) {
-			task->parts = g_list_remove_link (task->parts, part);
-			p = (struct mime_part *) part->data;
-			g_byte_array_free (p->content, TRUE);
-			g_list_free_1 (part);
+		if (task->parts) {
+			g_list_free (task->parts);
 		}
 		if (task->text_parts) {
 			part = task->text_parts;
@@ -288,21 +294,166 @@ rspamd_task_free_soft (gpointer ud)
 }
 
 
+/*
+ * Check that file is placed in one of directories allowed by worker's
+ * configuration, symlinks and dots are resolved before checking
+ */
+static gboolean
+rspamd_task_file_allowed (struct rspamd_task *task, const gchar *fname,
+	gchar *resolved)
+{
+	GList *cur;
+	gchar dir[PATH_MAX];
+	gsize dlen;
+
+	if (realpath (fname, resolved) == NULL) {
+		return FALSE;
+	}
+
+	for (cur = task->files_dirs; cur != NULL; cur = g_list_next (cur)) {
+		if (realpath (cur->data, dir) == NULL) {
+			continue;
+		}
+
+		dlen = strlen (dir);
+
+		if (strncmp (resolved, dir, dlen) == 0 &&
+				(resolved[dlen] == '/' || (dlen > 0 && dir[dlen - 1] == '/'))) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Load message from a local file specified in the request instead of body.
+ * File is read and not mapped as it could be truncated while being scanned
+ */
+static gboolean
+rspamd_task_load_file (struct rspamd_task *task, const gchar *fname)
+{
+	struct stat st;
+	gchar resolved[PATH_MAX];
+	gsize r = 0;
+	gssize ret;
+	gint fd;
+
+	if (task->files_dirs == NULL) {
+		msg_warn ("file %s is requested but files scanning is disabled",
+			fname);
+		task->last_error = "files scanning is disabled";
+		task->error_code = RSPAMD_PROTOCOL_ERROR;
+		return FALSE;
+	}
+
+	if (!rspamd_inet_address_is_local (&task->client_addr)) {
+		msg_warn ("file %s is requested by a non local client %s", fname,
+			rspamd_inet_address_to_string (&task->client_addr));
+		task->last_error = "files are scanned for local clients only";
+		task->error_code = RSPAMD_PROTOCOL_ERROR;
+		return FALSE;
+	}
+
+	if (!rspamd_task_file_allowed (task, fname, resolved)) {
+		msg_warn ("file %s is not in allowed directories", fname);
+		task->last_error = "file is not allowed";
+		task->error_code = RSPAMD_PROTOCOL_ERROR;
+		return FALSE;
+	}
+
+	/* Do not block on fifos and devices, they are rejected after fstat */
+	if ((fd = open (resolved, O_RDONLY | O_NONBLOCK | O_NOFOLLOW)) == -1) {
+		msg_err ("cannot open %s: %s", resolved, strerror (errno));
+		task->last_error = "cannot open file";
+		task->error_code = RSPAMD_NETWORK_ERROR;
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || !S_ISREG (st.st_mode)) {
+		msg_err ("cannot stat %s or it is not a regular file", resolved);
+		task->last_error = "not a regular file";
+		task->error_code = RSPAMD_PROTOCOL_ERROR;
+		close (fd);
+		return FALSE;
+	}
+
+	if (st.st_size == 0) {
+		msg_err ("file %s is empty", resolved);
+		task->last_error = "message's body is empty";
+		task->error_code = RSPAMD_LENGTH_ERROR;
+		close (fd);
+		return FALSE;
+	}
+
+	task->msg = rspamd_mempool_alloc0 (task->task_pool, sizeof (GString));
+	task->msg->str = rspamd_mempool_alloc (task->task_pool, st.st_size + 1);
+
+	/* File could be truncated meanwhile, so scan what has been read */
+	while (r < (gsize)st.st_size) {
+		ret = read (fd, task->msg->str + r, st.st_size - r);
+
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err ("cannot read %s: %s", resolved, strerror (errno));
+			task->last_error = "cannot read file";
+			task->error_code = RSPAMD_NETWORK_ERROR;
+			close (fd);
+			return FALSE;
+		}
+		else if (ret == 0) {
+			break;
+		}
+
+		r += ret;
+	}
+
+	close (fd);
+
+	if (r == 0) {
+		task->last_error = "message's body is empty";
+		task->error_code = RSPAMD_LENGTH_ERROR;
+		return FALSE;
+	}
+
+	task->msg->str[r] = '\0';
+	task->msg->len = r;
+	task->msg->allocated_len = st.st_size + 1;
+
+	return TRUE;
+}
+
 gboolean
 rspamd_task_process (struct rspamd_task *task,
-	struct rspamd_http_message *msg, GThreadPool *classify_pool,
-	gboolean process_extra_filters)
+	struct rspamd_http_message *msg, const gchar *start, gsize len,
+	GThreadPool *classify_pool, gboolean process_extra_filters)
 {
 	gint r;
 	GError *err = NULL;
+	const gchar *fname;
 
-	if (msg->body->len == 0) {
+	if ((fname = rspamd_http_message_find_header (msg, "File")) != NULL) {
+		/* Local clients can ask to scan a spool file without sending it */
+		if (!rspamd_task_load_file (task, fname)) {
+			return FALSE;
+		}
+	}
+	else if (len == 0) {
 		msg_err ("got zero length body");
 		task->last_error = "message's body is empty";
+		task->error_code = RSPAMD_LENGTH_ERROR;
 		return FALSE;
 	}
-
-	task->msg = msg->body;
+	else {
+		/* Body is owned by the http message that lives as long as task */
+		task->msg = rspamd_mempool_alloc (task->task_pool, sizeof (GString));
+		task->msg->str = (gchar *)start;
+		task->msg->len = len;
+		task->msg->allocated_len = len + 1;
+	}
 
 	debug_task ("got string of length %z", task->msg->len);
 
@@ -330,6 +481,7 @@ rspamd_task_process (struct rspamd_task *task,
 		}
 		/* Add task to classify to classify pool */
 		if (!task->is_skipped && classify_pool) {
+			rspamd_mempool_set_shared (task->task_pool);
 			register_async_thread (task->s);
 			g_thread_pool_push (classify_pool, task, &err);
 			if (err != NULL) {
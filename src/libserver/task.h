@@ -51,6 +51,8 @@ enum rspamd_metric_action {
 	METRIC_ACTION_MAX
 };
 
+struct rspamd_mime_desc;
+
 typedef gint (*protocol_reply_func)(struct rspamd_task *task);
 
 struct custom_command {
@@ -67,6 +69,7 @@ struct rspamd_task {
 		READ_MESSAGE,
 		WAIT_PRE_FILTER,
 		WAIT_FILTER,
+		WAIT_STATISTICS,
 		WAIT_POST_FILTER,
 		WRITE_REPLY,
 		WRITING_REPLY,
@@ -98,7 +101,8 @@ struct rspamd_task {
 	struct rspamd_async_session * s;                             /**< async session object							*/
 	gint parts_count;                                           /**< mime parts count								*/
 	GMimeMessage *message;                                      /**< message, parsed with GMime						*/
-	GMimeObject *parser_parent_part;                            /**< current parent part							*/
+	GMimeContentType *content_type;                             /**< content type of the top level part			*/
+	struct rspamd_mime_desc *parser_parent_part;                /**< current parent part							*/
 	GList *parts;                                               /**< list of parsed parts							*/
 	GList *text_parts;                                          /**< list of text parts								*/
 	gchar *raw_headers_str;                                         /**< list of raw headers							*/
@@ -118,7 +122,8 @@ struct rspamd_task {
 	InternetAddressList *from_envelope;
 
 	GList *messages;                                            /**< list of messages that would be reported		*/
-	GHashTable *re_cache;                                       /**< cache for matched or not matched regexps		*/
+	guint32 *re_cache;                                          /**< results of regexps indexed by regexp id		*/
+	guint re_cache_len;                                         /**< number of regexps in cache						*/
 	struct rspamd_config *cfg;                                  /**< pointer to config object						*/
 	gchar *last_error;                                          /**< last error										*/
 	gint error_code;                                                /**< code of last error								*/
@@ -140,6 +145,7 @@ struct rspamd_task {
 	struct event_base *ev_base;                                 /**< Event base										*/
 
 	GThreadPool *classify_pool;                                 /**< A pool of classify threads                     */
+	GList *files_dirs;                                          /**< directories of local files allowed to scan		*/
 
 	struct {
 		enum rspamd_metric_action action;                       /**< Action of pre filters							*/
@@ -175,13 +181,15 @@ gboolean rspamd_task_fin (void *arg);
  * Process task from http message and write reply or call task->fin_handler
  * @param task task to process
  * @param msg incoming http message
+ * @param start message data (e.g. decrypted body), must live as long as `msg`
+ * @param len length of message data
  * @param classify_pool classify pool (or NULL)
  * @param process_extra_filters whether to check pre and post filters
  * @return task has been successfully parsed and processed
  */
 gboolean rspamd_task_process (struct rspamd_task *task,
-	struct rspamd_http_message *msg, GThreadPool *classify_pool,
-	gboolean process_extra_filters);
+	struct rspamd_http_message *msg, const gchar *start, gsize len,
+	GThreadPool *classify_pool, gboolean process_extra_filters);
 
 /**
  * Return address of sender or NULL
@@ -838,6 +838,8 @@ url_init (void)
 					i);
 			}
 		}
+
+		rspamd_trie_compile (url_scanner->patterns);
 	}
 
 	return 0;
@@ -1820,18 +1822,160 @@ url_email_end (const gchar *begin,
 	return got_at;
 }
 
+struct url_callback_data {
+	rspamd_mempool_t *pool;
+	struct rspamd_task *task;
+	struct mime_text_part *part;
+	GHashTable *seen;
+	const gchar *begin;
+	const gchar *pos;
+	const gchar *end;
+	gboolean is_html;
+};
+
+/* Values of urls seen table */
+#define URL_SEEN_VALID GINT_TO_POINTER (1)
+#define URL_SEEN_INVALID GINT_TO_POINTER (2)
+
+/*
+ * Table of urls that are already extracted from the task's text, urls are
+ * stored as views of text parts
+ */
+static GHashTable *
+url_task_seen (struct rspamd_task *task)
+{
+	GHashTable *seen;
+
+	seen = rspamd_mempool_get_variable (task->task_pool, "urls_seen");
+
+	if (seen == NULL) {
+		seen = g_hash_table_new (rspamd_fstring_hash, rspamd_fstring_equal);
+		rspamd_mempool_set_variable (task->task_pool, "urls_seen", seen,
+			(rspamd_mempool_destruct_t)g_hash_table_unref);
+	}
+
+	return seen;
+}
+
+static gboolean
+url_parse_text_cb (gint idx, const gchar *last, void *ud)
+{
+	struct url_callback_data *cbd = ud;
+	struct url_matcher *matcher = &matchers[idx];
+	struct process_exception *ex;
+	struct uri *new;
+	rspamd_fstring_t srch, *key;
+	const gchar *pos;
+	gchar *url_str;
+	gpointer seen;
+	url_match_t m;
+	gsize plen;
+	gint rc, l;
+
+	plen = strlen (matcher->pattern);
+
+	if (matcher->flags & URL_FLAG_STRICT_MATCH) {
+		/* Pattern is followed by a delimiter */
+		plen ++;
+	}
+
+	pos = last - plen + 1;
+
+	if (pos < cbd->pos) {
+		/* This match is inside of the previous url */
+		return TRUE;
+	}
+
+	if ((matcher->flags & URL_FLAG_NOHTML) && cbd->is_html) {
+		/* Do not try to match non-html like urls in html texts */
+		return TRUE;
+	}
+
+	m.pattern = matcher->pattern;
+	m.prefix = matcher->prefix;
+	m.add_prefix = FALSE;
+
+	if (!matcher->start (cbd->pos, cbd->end, pos, &m) ||
+		!matcher->end (cbd->pos, cbd->end, pos, &m)) {
+		cbd->pos = pos + strlen (m.prefix) + 1;
+		return TRUE;
+	}
+
+	cbd->pos = m.m_begin + m.m_len + 1;
+	srch.begin = (gchar *)m.m_begin;
+	srch.len = m.m_len;
+
+	if (g_hash_table_lookup_extended (cbd->seen, &srch, NULL, &seen)) {
+		/* Do not parse the same url twice */
+		if (seen == URL_SEEN_INVALID) {
+			return TRUE;
+		}
+	}
+	else {
+		if (m.add_prefix) {
+			l = m.m_len + 1 + strlen (m.prefix);
+			url_str = rspamd_mempool_alloc (cbd->pool, l);
+			rspamd_snprintf (url_str, l, "%s%*s", m.prefix, m.m_len, m.m_begin);
+		}
+		else {
+			url_str = rspamd_mempool_alloc (cbd->pool, m.m_len + 1);
+			memcpy (url_str, m.m_begin, m.m_len);
+			url_str[m.m_len] = '\0';
+		}
+
+		key = rspamd_mempool_alloc (cbd->pool, sizeof (*key));
+		key->begin = srch.begin;
+		key->len = srch.len;
+		key->size = srch.len;
+		new = rspamd_mempool_alloc0 (cbd->pool, sizeof (struct uri));
+		g_strstrip (url_str);
+		rc = parse_uri (new, url_str, cbd->pool);
+
+		if ((rc == URI_ERRNO_OK || rc == URI_ERRNO_NO_SLASHES ||
+			rc == URI_ERRNO_NO_HOST_SLASH) && new->hostlen > 0) {
+			g_hash_table_insert (cbd->seen, key, URL_SEEN_VALID);
+
+			if (new->protocol == PROTOCOL_MAILTO) {
+				if (new->userlen > 0) {
+					if (!g_tree_lookup (cbd->task->emails, new)) {
+						g_tree_insert (cbd->task->emails, new, new);
+					}
+				}
+			}
+			else {
+				if (!g_tree_lookup (cbd->task->urls, new)) {
+					g_tree_insert (cbd->task->urls, new, new);
+				}
+			}
+		}
+		else {
+			g_hash_table_insert (cbd->seen, key, URL_SEEN_INVALID);
+
+			if (rc != URI_ERRNO_OK) {
+				msg_info ("extract of url '%s' failed: %s",
+					url_str,
+					url_strerror (rc));
+			}
+
+			return TRUE;
+		}
+	}
+
+	ex = rspamd_mempool_alloc0 (cbd->pool, sizeof (struct process_exception));
+	ex->pos = m.m_begin - cbd->begin;
+	ex->len = m.m_len;
+	cbd->part->urls_offset = g_list_prepend (cbd->part->urls_offset, ex);
+
+	return TRUE;
+}
+
 void
 url_parse_text (rspamd_mempool_t * pool,
 	struct rspamd_task *task,
 	struct mime_text_part *part,
 	gboolean is_html)
 {
-	gint rc;
-	gchar *url_str = NULL, *url_start, *url_end;
-	struct uri *new;
-	struct process_exception *ex;
-	gchar *p, *end, *begin;
-
+	struct url_callback_data cbd;
 
 	if (part->content == NULL || part->content->len == 0) {
 		msg_warn ("got empty text part");
@@ -1839,54 +1983,17 @@ url_parse_text (rspamd_mempool_t * pool,
 	}
 
 	if (url_init () == 0) {
-		begin = part->content->data;
-		end = begin + part->content->len;
-		p = begin;
-		while (p < end) {
-			if (url_try_text (pool, p, end - p, &url_start, &url_end, &url_str,
-				is_html)) {
-				if (url_str != NULL) {
-					new = rspamd_mempool_alloc0 (pool, sizeof (struct uri));
-					ex =
-						rspamd_mempool_alloc0 (pool,
-							sizeof (struct process_exception));
-					if (new != NULL) {
-						g_strstrip (url_str);
-						rc = parse_uri (new, url_str, pool);
-						if ((rc == URI_ERRNO_OK || rc == URI_ERRNO_NO_SLASHES ||
-							rc == URI_ERRNO_NO_HOST_SLASH) &&
-							new->hostlen > 0) {
-							ex->pos = url_start - begin;
-							ex->len = url_end - url_start;
-							if (new->protocol == PROTOCOL_MAILTO) {
-								if (new->userlen > 0) {
-									if (!g_tree_lookup (task->emails, new)) {
-										g_tree_insert (task->emails, new, new);
-									}
-								}
-							}
-							else {
-								if (!g_tree_lookup (task->urls, new)) {
-									g_tree_insert (task->urls, new, new);
-								}
-							}
-							part->urls_offset = g_list_prepend (
-								part->urls_offset,
-								ex);
-						}
-						else if (rc != URI_ERRNO_OK) {
-							msg_info ("extract of url '%s' failed: %s",
-								url_str,
-								url_strerror (rc));
-						}
-					}
-				}
-			}
-			else {
-				break;
-			}
-			p = url_end + 1;
-		}
+		cbd.pool = pool;
+		cbd.task = task;
+		cbd.part = part;
+		cbd.seen = url_task_seen (task);
+		cbd.begin = part->content->data;
+		cbd.pos = cbd.begin;
+		cbd.end = cbd.begin + part->content->len;
+		cbd.is_html = is_html;
+		/* Find all urls in a single pass over the text */
+		rspamd_trie_lookup_all (url_scanner->patterns, cbd.begin,
+			part->content->len, url_parse_text_cb, &cbd);
 	}
 	/* Handle offsets of this part */
 	if (part->urls_offset != NULL) {
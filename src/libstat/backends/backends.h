@@ -35,6 +35,7 @@ struct rspamd_classifier_config;
 struct rspamd_statfile_config;
 struct rspamd_config;
 struct rspamd_stat_ctx;
+struct rspamd_task;
 struct rspamd_token_result;
 struct rspamd_statfile_runtime;
 struct token_node_s;
@@ -42,28 +43,67 @@ struct token_node_s;
 struct rspamd_stat_backend {
 	const char *name;
 	gpointer (*init)(struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
-	gpointer (*runtime)(struct rspamd_statfile_config *stcf, gboolean learn, gpointer ctx);
+	gpointer (*runtime)(struct rspamd_task *task,
+			struct rspamd_statfile_config *stcf, gboolean learn, gpointer ctx);
 	gboolean (*process_token)(struct token_node_s *tok,
 			struct rspamd_token_result *res, gpointer ctx);
+	/*
+	 * Optional, resolves results with index `idx` for all tokens at once,
+	 * may register events in task's session and set results when they are
+	 * finished
+	 */
+	guint (*process_tokens)(GArray *tokens, guint idx,
+			struct rspamd_statfile_runtime *runtime, gpointer ctx);
 	gboolean (*learn_token)(struct token_node_s *tok,
 			struct rspamd_token_result *res, gpointer ctx);
+	/* Optional, stores results with index `idx` for all tokens at once */
+	guint (*learn_tokens)(GArray *tokens, guint idx,
+			struct rspamd_statfile_runtime *runtime, gpointer ctx);
 	gulong (*total_learns)(struct rspamd_statfile_runtime *runtime, gpointer ctx);
 	gulong (*inc_learns)(struct rspamd_statfile_runtime *runtime, gpointer ctx);
 	gpointer ctx;
 };
 
 gpointer rspamd_mmaped_file_init(struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
-gpointer rspamd_mmaped_file_runtime (struct rspamd_statfile_config *stcf,
+gpointer rspamd_mmaped_file_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
 		gboolean learn, gpointer ctx);
 gboolean rspamd_mmaped_file_process_token (struct token_node_s *tok,
 		struct rspamd_token_result *res,
 		gpointer ctx);
+guint rspamd_mmaped_file_process_tokens (GArray *tokens, guint idx,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
 gboolean rspamd_mmaped_file_learn_token (struct token_node_s *tok,
 		struct rspamd_token_result *res,
 		gpointer ctx);
+guint rspamd_mmaped_file_learn_tokens (GArray *tokens, guint idx,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
 gulong rspamd_mmaped_file_total_learns (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
 gulong rspamd_mmaped_file_inc_learns (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx);
 
+gpointer rspamd_redis_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg);
+gpointer rspamd_redis_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
+		gboolean learn, gpointer ctx);
+gboolean rspamd_redis_process_token (struct token_node_s *tok,
+		struct rspamd_token_result *res,
+		gpointer ctx);
+guint rspamd_redis_process_tokens (GArray *tokens, guint idx,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gboolean rspamd_redis_learn_token (struct token_node_s *tok,
+		struct rspamd_token_result *res,
+		gpointer ctx);
+guint rspamd_redis_learn_tokens (GArray *tokens, guint idx,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gulong rspamd_redis_total_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+gulong rspamd_redis_inc_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx);
+
 #endif /* BACKENDS_H_ */
@@ -26,7 +26,21 @@
 #include "stat_internal.h"
 #include "main.h"
 
-#define CHAIN_LENGTH 128
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define STATFILE_BUCKET_ENTRIES 6
+/* How many neighbouring buckets are checked if a bucket is full */
+#define STATFILE_BUCKET_PROBES 4
+/* How many tokens ahead are buckets prefetched in batched lookups */
+#define PREFETCH_DISTANCE 8
+
+#ifdef __GNUC__
+#define STATFILE_PREFETCH(p) __builtin_prefetch ((p), 0, 1)
+#else
+#define STATFILE_PREFETCH(p) do { } while (0)
+#endif
 
 /* Section types */
 #define STATFILE_SECTION_COMMON 1
@@ -51,7 +65,8 @@ struct stat_file_header {
 	guint64 rev_time;                       /**< revision time						*/
 	guint64 used_blocks;                    /**< used blocks number					*/
 	guint64 total_blocks;                   /**< total number of blocks				*/
-	u_char unused[239];                     /**< some bytes that can be used in future */
+	u_char stale;                           /**< file has been replaced by a rehashed one */
+	u_char unused[238];                     /**< some bytes that can be used in future */
 };
 
 /**
@@ -63,7 +78,7 @@ struct stat_file_section {
 };
 
 /**
- * Block of data in statfile
+ * Block of data in statfile of version 1.2
  */
 struct stat_file_block {
 	guint32 hash1;                          /**< hash1 (also acts as index)			*/
@@ -72,7 +87,7 @@ struct stat_file_block {
 };
 
 /**
- * Statistic file
+ * Statistic file of version 1.2
  */
 struct stat_file {
 	struct stat_file_header header;         /**< header								*/
@@ -80,6 +95,27 @@ struct stat_file {
 	struct stat_file_block blocks[1];       /**< first block of data				*/
 };
 
+/**
+ * Bucket of tokens that occupies exactly one cache line, tokens are
+ * identified by hash1 and a 16 bits tag made from hash2
+ */
+struct stat_file_bucket {
+	guint32 hash1[STATFILE_BUCKET_ENTRIES]; /**< hash1 of tokens (bucket is hash1 % buckets) */
+	guint32 value[STATFILE_BUCKET_ENTRIES]; /**< values of tokens					*/
+	guint16 tag[STATFILE_BUCKET_ENTRIES];   /**< tags made from hash2				*/
+	guint16 used;                           /**< number of used entries				*/
+	guint16 padding;                        /**< padding							*/
+};
+
+#define STATFILE_BUCKET_SIZE 64
+G_STATIC_ASSERT (sizeof (struct stat_file_bucket) == STATFILE_BUCKET_SIZE);
+#define STATFILE_LEGACY_OFFSET (sizeof (struct stat_file) - \
+	sizeof (struct stat_file_block))
+/* Buckets are aligned to cache lines */
+#define STATFILE_BUCKETS_OFFSET ((sizeof (struct stat_file_header) + \
+	sizeof (struct stat_file_section) + STATFILE_BUCKET_SIZE - 1) & \
+	~(STATFILE_BUCKET_SIZE - 1))
+
 /**
  * Common view of statfile object
  */
@@ -94,6 +130,7 @@ typedef struct {
 	off_t seek_pos;                         /**< current seek position				*/
 	struct stat_file_section cur_section;   /**< current section					*/
 	size_t len;                             /**< length of file(in bytes)			*/
+	size_t max_len;                         /**< maximum length for rehash			*/
 	struct rspamd_statfile_config *cf;
 } rspamd_mmaped_file_t;
 
@@ -107,8 +144,10 @@ typedef struct  {
 	gboolean mlock_ok;                      /**< whether it is possible to use mlock (2) to avoid statfiles unloading */
 } rspamd_mmaped_file_ctx;
 
-#define RSPAMD_STATFILE_VERSION {'1', '2'}
+#define RSPAMD_STATFILE_VERSION {'1', '3'}
+#define RSPAMD_STATFILE_LEGACY_VERSION {'1', '2'}
 #define BACKUP_SUFFIX ".old"
+#define REHASH_SUFFIX ".new"
 
 static void rspamd_mmaped_file_set_block_common (
 	rspamd_mmaped_file_ctx * pool, rspamd_mmaped_file_t * file,
@@ -121,40 +160,462 @@ rspamd_mmaped_file_t * rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 gint rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool,
 		const gchar *filename, size_t size, struct rspamd_statfile_config *stcf);
 
+static inline guint16
+rspamd_mmaped_file_tag (guint32 h2)
+{
+	return (h2 >> 16) ^ (h2 & 0xffff);
+}
+
+static inline guint32
+rspamd_mmaped_file_value (double value)
+{
+	if (value <= 0) {
+		return 0;
+	}
+	else if (value >= (double)G_MAXUINT32) {
+		return G_MAXUINT32;
+	}
+
+	return (guint32)(value + 0.5);
+}
+
+static inline struct stat_file_bucket *
+rspamd_mmaped_file_bucket (rspamd_mmaped_file_t *file, guint64 n)
+{
+	return ((struct stat_file_bucket *)((u_char *)file->map +
+			file->seek_pos)) + n;
+}
+
+static inline guint64
+rspamd_mmaped_file_buckets (size_t size)
+{
+	if (size < STATFILE_BUCKETS_OFFSET + STATFILE_BUCKET_SIZE) {
+		return 0;
+	}
+
+	return (size - STATFILE_BUCKETS_OFFSET) / STATFILE_BUCKET_SIZE;
+}
+
+/*
+ * Returns position of token in a bucket or -1 if it is not found, the first
+ * hashes are compared four at once if SSE2 is available
+ */
+static inline gint
+rspamd_mmaped_file_bucket_find (const struct stat_file_bucket *bk,
+		guint32 h1, guint16 tag)
+{
+	guint i, used;
+#ifdef __SSE2__
+	__m128i key;
+	guint mask;
+#endif
+
+	used = MIN (bk->used, STATFILE_BUCKET_ENTRIES);
+
+#ifdef __SSE2__
+	key = _mm_set1_epi32 (h1);
+	/* Entries 0..3 and 2..5 */
+	mask = _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpeq_epi32 (
+			_mm_loadu_si128 ((const __m128i *)&bk->hash1[0]), key)));
+	mask |= _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpeq_epi32 (
+			_mm_loadu_si128 ((const __m128i *)&bk->hash1[2]), key))) << 2;
+	mask &= (1U << used) - 1;
+
+	for (i = 0; mask != 0; i ++, mask >>= 1) {
+		if ((mask & 1) && bk->tag[i] == tag) {
+			return i;
+		}
+	}
+#else
+	for (i = 0; i < used; i ++) {
+		if (bk->hash1[i] == h1 && bk->tag[i] == tag) {
+			return i;
+		}
+	}
+#endif
+
+	return -1;
+}
+
+/*
+ * Tokens are spilled to the next buckets only if their own bucket is full and
+ * they are never removed, so we can stop at the first bucket with free space
+ */
+static struct stat_file_bucket *
+rspamd_mmaped_file_find (rspamd_mmaped_file_t *file, guint32 h1, guint16 tag,
+		gint *pos)
+{
+	struct stat_file_bucket *bk;
+	guint64 n;
+	guint i;
+	gint found;
+
+	n = h1 % file->cur_section.length;
+
+	for (i = 0; i < STATFILE_BUCKET_PROBES; i ++) {
+		bk = rspamd_mmaped_file_bucket (file, n);
+		found = rspamd_mmaped_file_bucket_find (bk, h1, tag);
+
+		if (found != -1) {
+			*pos = found;
+			return bk;
+		}
+
+		if (bk->used < STATFILE_BUCKET_ENTRIES) {
+			break;
+		}
+
+		n = (n + 1) % file->cur_section.length;
+	}
+
+	return NULL;
+}
+
+/*
+ * Insert or update token, if there is no free space and `expire` is TRUE, the
+ * token with the minimum value in the token's bucket is replaced
+ */
+static gboolean
+rspamd_mmaped_file_insert (rspamd_mmaped_file_t *file, guint32 h1, guint16 tag,
+		guint32 value, gboolean expire)
+{
+	struct stat_file_header *header;
+	struct stat_file_bucket *bk;
+	guint64 n;
+	guint i, min_pos = 0;
+	gint found;
+
+	header = (struct stat_file_header *)file->map;
+	n = h1 % file->cur_section.length;
+
+	for (i = 0; i < STATFILE_BUCKET_PROBES; i ++) {
+		bk = rspamd_mmaped_file_bucket (file, n);
+		found = rspamd_mmaped_file_bucket_find (bk, h1, tag);
+
+		if (found != -1) {
+			bk->value[found] = value;
+			return TRUE;
+		}
+
+		if (bk->used < STATFILE_BUCKET_ENTRIES) {
+			bk->hash1[bk->used] = h1;
+			bk->tag[bk->used] = tag;
+			bk->value[bk->used] = value;
+			bk->used ++;
+			header->used_blocks ++;
+
+			return TRUE;
+		}
+
+		n = (n + 1) % file->cur_section.length;
+	}
+
+	if (!expire) {
+		return FALSE;
+	}
+
+	bk = rspamd_mmaped_file_bucket (file, h1 % file->cur_section.length);
+
+	for (i = 1; i < STATFILE_BUCKET_ENTRIES; i ++) {
+		if (bk->value[i] < bk->value[min_pos]) {
+			min_pos = i;
+		}
+	}
+
+	msg_debug ("%s expire token %ud in bucket %uL, value %ud",
+			file->filename,
+			min_pos,
+			h1 % file->cur_section.length,
+			bk->value[min_pos]);
+	bk->hash1[min_pos] = h1;
+	bk->tag[min_pos] = tag;
+	bk->value[min_pos] = value;
+
+	return TRUE;
+}
+
 double
 rspamd_mmaped_file_get_block (rspamd_mmaped_file_ctx * pool,
 	rspamd_mmaped_file_t * file,
 	guint32 h1,
 	guint32 h2)
 {
-	struct stat_file_block *block;
-	guint i, blocknum;
-	u_char *c;
+	struct stat_file_bucket *bk;
+	gint pos;
 
 	if (!file->map) {
 		return 0;
 	}
 
-	blocknum = h1 % file->cur_section.length;
-	c = (u_char *) file->map + file->seek_pos + blocknum *
-		sizeof (struct stat_file_block);
-	block = (struct stat_file_block *)c;
+	bk = rspamd_mmaped_file_find (file, h1, rspamd_mmaped_file_tag (h2), &pos);
 
-	for (i = 0; i < CHAIN_LENGTH; i++) {
-		if (i + blocknum >= file->cur_section.length) {
-			break;
+	if (bk != NULL) {
+		return bk->value[pos];
+	}
+
+	return 0;
+}
+
+/*
+ * Map file and fill its length, the content is not checked
+ */
+static gboolean
+rspamd_mmaped_file_map (rspamd_mmaped_file_t *file, const gchar *filename)
+{
+	struct stat st;
+
+	if ((file->fd = open (filename, O_RDWR)) == -1) {
+		msg_info ("cannot open file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		return FALSE;
+	}
+
+	if (fstat (file->fd, &st) == -1) {
+		msg_info ("cannot stat file %s, error %s, %d", filename, strerror (
+				errno), errno);
+		close (file->fd);
+		return FALSE;
+	}
+
+	if ((file->map =
+		mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		file->fd, 0)) == MAP_FAILED) {
+		close (file->fd);
+		msg_info ("cannot mmap file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		return FALSE;
+	}
+
+	rspamd_strlcpy (file->filename, filename, sizeof (file->filename));
+	file->len = st.st_size;
+
+	return TRUE;
+}
+
+static gint rspamd_mmaped_file_check (rspamd_mmaped_file_t * file);
+static gint rspamd_mmaped_file_write_empty (const gchar *filename,
+		guint64 nbuckets);
+gboolean rspamd_mmaped_file_set_revision (rspamd_mmaped_file_t *file,
+		guint64 rev, time_t time);
+
+/*
+ * Replace mapping of `file` with mapping of `new`, so all runtimes that
+ * reference `file` see the new content
+ */
+static void
+rspamd_mmaped_file_swap (rspamd_mmaped_file_ctx * pool,
+		rspamd_mmaped_file_t *file, rspamd_mmaped_file_t *new)
+{
+	munmap (file->map, file->len);
+	close (file->fd);
+
+	file->fd = new->fd;
+	file->map = new->map;
+	file->len = new->len;
+	file->seek_pos = new->seek_pos;
+	file->cur_section = new->cur_section;
+
+	if (pool->mlock_ok) {
+		if (mlock (file->map, file->len) == -1) {
+			msg_warn (
+				"mlock of statfile failed, maybe you need to increase RLIMIT_MEMLOCK limit for a process: %s",
+				strerror (errno));
+			pool->mlock_ok = FALSE;
 		}
-		if (block->hash1 == h1 && block->hash2 == h2) {
-			return block->value;
+	}
+
+	g_slice_free1 (sizeof (*new), new);
+}
+
+/*
+ * Copy all tokens to a new file with the specified number of buckets and
+ * atomically replace the current file with it. Processes that still use the
+ * old file see the stale flag and reopen the statfile. The caller should hold
+ * the lock of `file`, on success the lock of the new file is held instead
+ */
+static gboolean
+rspamd_mmaped_file_rehash (rspamd_mmaped_file_ctx * pool,
+		rspamd_mmaped_file_t *file, guint64 nbuckets, gboolean legacy)
+{
+	rspamd_mmaped_file_t *new;
+	struct stat_file_header *header, *new_header;
+	struct stat_file_block *block;
+	struct stat_file_bucket *bk;
+	gchar *tmpname;
+	guint64 i;
+	guint j;
+
+	tmpname = g_strconcat (file->filename, REHASH_SUFFIX, NULL);
+
+	if (rspamd_mmaped_file_write_empty (tmpname, nbuckets) != 0) {
+		g_free (tmpname);
+		return FALSE;
+	}
+
+	new = g_slice_alloc0 (sizeof (*new));
+
+	if (!rspamd_mmaped_file_map (new, tmpname)) {
+		unlink (tmpname);
+		g_free (tmpname);
+		g_slice_free1 (sizeof (*new), new);
+		return FALSE;
+	}
+
+	if (rspamd_mmaped_file_check (new) != 0) {
+		munmap (new->map, new->len);
+		close (new->fd);
+		unlink (tmpname);
+		g_free (tmpname);
+		g_slice_free1 (sizeof (*new), new);
+		return FALSE;
+	}
+
+	/*
+	 * Nobody can see the new file before rename, so this lock is not
+	 * contended, but it keeps other processes waiting after they reopen
+	 * the statfile until we release it
+	 */
+	rspamd_file_lock (new->fd, FALSE);
+
+	if (legacy) {
+		block = (struct stat_file_block *)((u_char *)file->map +
+				file->seek_pos);
+
+		for (i = 0; i < file->cur_section.length; i ++) {
+			if (block[i].hash1 != 0 && block[i].value != 0) {
+				rspamd_mmaped_file_insert (new, block[i].hash1,
+						rspamd_mmaped_file_tag (block[i].hash2),
+						rspamd_mmaped_file_value (block[i].value), TRUE);
+			}
 		}
-		c += sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
 	}
+	else {
+		for (i = 0; i < file->cur_section.length; i ++) {
+			bk = rspamd_mmaped_file_bucket (file, i);
 
+			for (j = 0; j < MIN (bk->used, STATFILE_BUCKET_ENTRIES); j ++) {
+				rspamd_mmaped_file_insert (new, bk->hash1[j], bk->tag[j],
+						bk->value[j], TRUE);
+			}
+		}
+	}
 
-	return 0;
+	header = (struct stat_file_header *)file->map;
+	new_header = (struct stat_file_header *)new->map;
+	new_header->create_time = header->create_time;
+	rspamd_mmaped_file_set_revision (new, header->revision, header->rev_time);
+	msync (new->map, new->len, MS_SYNC);
+
+	if (rename (tmpname, file->filename) == -1) {
+		msg_err ("cannot rename %s to %s: %s", tmpname, file->filename,
+				strerror (errno));
+		munmap (new->map, new->len);
+		close (new->fd);
+		unlink (tmpname);
+		g_free (tmpname);
+		g_slice_free1 (sizeof (*new), new);
+
+		return FALSE;
+	}
+
+	msg_info ("rehashed statfile %s from %uL to %uL buckets, %uL tokens",
+			file->filename,
+			legacy ? 0 : file->cur_section.length,
+			nbuckets,
+			new_header->used_blocks);
+
+	header->stale = 1;
+	/* Closes the old file and releases its lock */
+	rspamd_mmaped_file_swap (pool, file, new);
+	g_free (tmpname);
+
+	return TRUE;
+}
+
+/*
+ * Reopen statfile that has been rehashed by another process
+ */
+static gboolean
+rspamd_mmaped_file_reload (rspamd_mmaped_file_ctx * pool,
+		rspamd_mmaped_file_t *file)
+{
+	rspamd_mmaped_file_t *new;
+
+	new = g_slice_alloc0 (sizeof (*new));
+
+	if (!rspamd_mmaped_file_map (new, file->filename)) {
+		g_slice_free1 (sizeof (*new), new);
+		return FALSE;
+	}
+
+	if (rspamd_mmaped_file_check (new) != 0) {
+		munmap (new->map, new->len);
+		close (new->fd);
+		g_slice_free1 (sizeof (*new), new);
+		return FALSE;
+	}
+
+	rspamd_mmaped_file_swap (pool, file, new);
+
+	return TRUE;
+}
+
+/*
+ * Lock statfile for writing. If it has been rehashed by another process
+ * while we were waiting for the lock, then reopen it and lock the new file
+ */
+static gboolean
+rspamd_mmaped_file_lock (rspamd_mmaped_file_ctx * pool,
+		rspamd_mmaped_file_t *file)
+{
+	for (;;) {
+		if (!rspamd_file_lock (file->fd, FALSE)) {
+			return FALSE;
+		}
+
+		if (!((struct stat_file_header *)file->map)->stale) {
+			return TRUE;
+		}
+
+		rspamd_file_unlock (file->fd, FALSE);
+
+		if (!rspamd_mmaped_file_reload (pool, file)) {
+			msg_err ("cannot reload statfile %s", file->filename);
+			return FALSE;
+		}
+	}
+}
+
+/*
+ * Double number of buckets unless it exceeds the maximum size of file
+ */
+static gboolean
+rspamd_mmaped_file_grow (rspamd_mmaped_file_ctx * pool,
+		rspamd_mmaped_file_t *file)
+{
+	guint64 nbuckets, max_buckets;
+
+	nbuckets = file->cur_section.length * 2;
+	max_buckets = rspamd_mmaped_file_buckets (file->max_len);
+
+	if (nbuckets > max_buckets) {
+		nbuckets = max_buckets;
+	}
+
+	if (nbuckets <= file->cur_section.length) {
+		return FALSE;
+	}
+
+	return rspamd_mmaped_file_rehash (pool, file, nbuckets, FALSE);
 }
 
+/*
+ * Should be called with the statfile locked, as it could be rehashed
+ */
 static void
 rspamd_mmaped_file_set_block_common (rspamd_mmaped_file_ctx * pool,
 		rspamd_mmaped_file_t * file,
@@ -162,80 +623,26 @@ rspamd_mmaped_file_set_block_common (rspamd_mmaped_file_ctx * pool,
 	guint32 h2,
 	double value)
 {
-	struct stat_file_block *block, *to_expire = NULL;
-	struct stat_file_header *header;
-	guint i, blocknum;
-	u_char *c;
-	double min = G_MAXDOUBLE;
+	guint16 tag;
+	guint32 v;
 
 	if (!file->map) {
 		return;
 	}
 
-	blocknum = h1 % file->cur_section.length;
-	header = (struct stat_file_header *)file->map;
-	c = (u_char *) file->map + file->seek_pos + blocknum *
-		sizeof (struct stat_file_block);
-	block = (struct stat_file_block *)c;
-
-	for (i = 0; i < CHAIN_LENGTH; i++) {
-		if (i + blocknum >= file->cur_section.length) {
-			/* Need to expire some block in chain */
-			msg_info ("chain %ud is full in statfile %s, starting expire",
-				blocknum,
-				file->filename);
-			break;
-		}
-		/* First try to find block in chain */
-		if (block->hash1 == h1 && block->hash2 == h2) {
-			msg_debug ("%s found existing block %ud in chain %ud, value %.2f",
-					file->filename,
-					i,
-					blocknum,
-					value);
-			block->value = value;
-			return;
-		}
-		/* Check whether we have a free block in chain */
-		if (block->hash1 == 0 && block->hash2 == 0) {
-			/* Write new block here */
-			msg_debug ("%s found free block %ud in chain %ud, set h1=%ud, h2=%ud",
-				file->filename,
-				i,
-				blocknum,
-				h1,
-				h2);
-			block->hash1 = h1;
-			block->hash2 = h2;
-			block->value = value;
-			header->used_blocks++;
-
-			return;
-		}
+	tag = rspamd_mmaped_file_tag (h2);
+	v = rspamd_mmaped_file_value (value);
 
-		/* Expire block with minimum value otherwise */
-		if (block->value < min) {
-			to_expire = block;
-			min = block->value;
+	if (!rspamd_mmaped_file_insert (file, h1, tag, v, FALSE)) {
+		if (!rspamd_mmaped_file_grow (pool, file)) {
+			/* Need to expire some token */
+			msg_info ("buckets for %ud are full in statfile %s, starting expire",
+				h1,
+				file->filename);
 		}
-		c += sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
-	}
 
-	/* Try expire some block */
-	if (to_expire) {
-		block = to_expire;
+		rspamd_mmaped_file_insert (file, h1, tag, v, TRUE);
 	}
-	else {
-		/* Expire first block in chain */
-		c = (u_char *) file->map + file->seek_pos + blocknum *
-			sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
-	}
-
-	block->hash1 = h1;
-	block->hash2 = h2;
-	block->value = value;
 }
 
 void
@@ -351,6 +758,7 @@ rspamd_mmaped_file_check (rspamd_mmaped_file_t * file)
 	struct stat_file *f;
 	gchar *c;
 	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	static gchar legacy_version[] = RSPAMD_STATFILE_LEGACY_VERSION;
 
 
 	if (!file || !file->map) {
@@ -375,6 +783,22 @@ rspamd_mmaped_file_check (rspamd_mmaped_file_t * file)
 	if (*c == 1 && *(c + 1) == 0) {
 		return -1;
 	}
+	else if (memcmp (c, legacy_version, sizeof (legacy_version)) == 0) {
+		/* Blocks based statfile that should be converted */
+		file->cur_section.code = f->section.code;
+		file->cur_section.length = f->section.length;
+		if (file->cur_section.length * sizeof (struct stat_file_block) >
+			file->len) {
+			msg_info ("file %s is truncated: %z, must be %z",
+				file->filename,
+				file->len,
+				file->cur_section.length * sizeof (struct stat_file_block));
+			return -1;
+		}
+		file->seek_pos = STATFILE_LEGACY_OFFSET;
+
+		return 1;
+	}
 	else if (memcmp (c, valid_version, sizeof (valid_version)) != 0) {
 		/* Unknown version */
 		msg_info ("file %s has invalid version %c.%c",
@@ -387,102 +811,20 @@ rspamd_mmaped_file_check (rspamd_mmaped_file_t * file)
 	/* Check first section and set new offset */
 	file->cur_section.code = f->section.code;
 	file->cur_section.length = f->section.length;
-	if (file->cur_section.length * sizeof (struct stat_file_block) >
-		file->len) {
+	if (file->cur_section.length == 0 || STATFILE_BUCKETS_OFFSET +
+		file->cur_section.length * STATFILE_BUCKET_SIZE > file->len) {
 		msg_info ("file %s is truncated: %z, must be %z",
 			file->filename,
 			file->len,
-			file->cur_section.length * sizeof (struct stat_file_block));
+			STATFILE_BUCKETS_OFFSET +
+			file->cur_section.length * STATFILE_BUCKET_SIZE);
 		return -1;
 	}
-	file->seek_pos = sizeof (struct stat_file) -
-		sizeof (struct stat_file_block);
+	file->seek_pos = STATFILE_BUCKETS_OFFSET;
 
 	return 0;
 }
 
-
-static rspamd_mmaped_file_t *
-rspamd_mmaped_file_reindex (rspamd_mmaped_file_ctx * pool,
-	const gchar *filename,
-	size_t old_size,
-	size_t size,
-	struct rspamd_statfile_config *stcf)
-{
-	gchar *backup;
-	gint fd;
-	rspamd_mmaped_file_t *new;
-	u_char *map, *pos;
-	struct stat_file_block *block;
-	struct stat_file_header *header;
-
-	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
-		msg_err ("file %s is too small to carry any statistic: %z",
-			filename,
-			size);
-		return NULL;
-	}
-
-	backup = g_strconcat (filename, ".old", NULL);
-	if (rename (filename, backup) == -1) {
-		msg_err ("cannot rename %s to %s: %s", filename, backup, strerror (
-				errno));
-		g_free (backup);
-		return NULL;
-	}
-
-	/* Now create new file with required size */
-	if (rspamd_mmaped_file_create (pool, filename, size, stcf) != 0) {
-		msg_err ("cannot create new file");
-		g_free (backup);
-		return NULL;
-	}
-	/* Now open new file and start copying */
-	fd = open (backup, O_RDONLY);
-	new = rspamd_mmaped_file_open (pool, filename, size, stcf);
-
-	if (fd == -1 || new == NULL) {
-		msg_err ("cannot open file: %s", strerror (errno));
-		g_free (backup);
-		return NULL;
-	}
-
-	/* Now start reading blocks from old statfile */
-	if ((map =
-		mmap (NULL, old_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-		msg_err ("cannot mmap file: %s", strerror (errno));
-		close (fd);
-		g_free (backup);
-		return NULL;
-	}
-
-	pos = map + (sizeof (struct stat_file) - sizeof (struct stat_file_block));
-	while (old_size - (pos - map) >= sizeof (struct stat_file_block)) {
-		block = (struct stat_file_block *)pos;
-		if (block->hash1 != 0 && block->value != 0) {
-			rspamd_mmaped_file_set_block_common (pool,
-				new,
-				block->hash1,
-				block->hash2,
-				block->value);
-		}
-		pos += sizeof (block);
-	}
-
-	header = (struct stat_file_header *)map;
-	rspamd_mmaped_file_set_revision (new, header->revision, header->rev_time);
-
-	munmap (map, old_size);
-	close (fd);
-	unlink (backup);
-	g_free (backup);
-
-	return new;
-
-}
-
 /*
  * Pre-load mmaped file into memory
  */
@@ -519,55 +861,23 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 		const gchar *filename, size_t size,
 		struct rspamd_statfile_config *stcf)
 {
-	struct stat st;
 	rspamd_mmaped_file_t *new_file;
+	const ucl_object_t *maxo;
+	struct stat_file_header *header;
+	guint64 nbuckets, min_buckets;
+	gint ret;
 
 	if ((new_file = rspamd_mmaped_file_is_open (pool, stcf)) != NULL) {
 		return new_file;
 	}
 
-	if (stat (filename, &st) == -1) {
-		msg_info ("cannot stat file %s, error %s, %d", filename, strerror (
-				errno), errno);
-		return NULL;
-	}
-
-	if (labs (size - st.st_size) > (long)sizeof (struct stat_file) * 2
-		&& size > sizeof (struct stat_file)) {
-		msg_warn ("need to reindex statfile old size: %Hz, new size: %Hz",
-			(size_t)st.st_size, size);
-		return rspamd_mmaped_file_reindex (pool, filename, st.st_size, size, stcf);
-	}
-	else if (size < sizeof (struct stat_file)) {
-		msg_err ("requested to shrink statfile to %Hz but it is too small",
-			size);
-	}
-
 	new_file = g_slice_alloc0 (sizeof (rspamd_mmaped_file_t));
-	if ((new_file->fd = open (filename, O_RDWR)) == -1) {
-		msg_info ("cannot open file %s, error %d, %s",
-			filename,
-			errno,
-			strerror (errno));
-		g_slice_free1 (sizeof (*new_file), new_file);
-		return NULL;
-	}
 
-	if ((new_file->map =
-		mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-		new_file->fd, 0)) == MAP_FAILED) {
-		close (new_file->fd);
-		msg_info ("cannot mmap file %s, error %d, %s",
-			filename,
-			errno,
-			strerror (errno));
+	if (!rspamd_mmaped_file_map (new_file, filename)) {
 		g_slice_free1 (sizeof (*new_file), new_file);
 		return NULL;
-
 	}
 
-	rspamd_strlcpy (new_file->filename, filename, sizeof (new_file->filename));
-	new_file->len = st.st_size;
 	/* Try to lock pages in RAM */
 	if (pool->mlock_ok) {
 		if (mlock (new_file->map, new_file->len) == -1) {
@@ -579,15 +889,71 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx * pool,
 	}
 	/* Acquire lock for this operation */
 	rspamd_file_lock (new_file->fd, FALSE);
-	if (rspamd_mmaped_file_check (new_file) == -1) {
+	if ((ret = rspamd_mmaped_file_check (new_file)) == -1) {
 		rspamd_file_unlock (new_file->fd, FALSE);
-		munmap (new_file->map, st.st_size);
+		munmap (new_file->map, new_file->len);
+		close (new_file->fd);
 		g_slice_free1 (sizeof (*new_file), new_file);
 		return NULL;
 	}
 	rspamd_file_unlock (new_file->fd, FALSE);
 
 	new_file->cf = stcf;
+	/* Statfiles grow online only if max_size is explicitly set */
+	new_file->max_len = size;
+
+	if (stcf != NULL && stcf->opts != NULL) {
+		maxo = ucl_object_find_key (stcf->opts, "max_size");
+
+		if (maxo != NULL && ucl_object_type (maxo) == UCL_INT &&
+				(size_t)ucl_object_toint (maxo) > size) {
+			new_file->max_len = ucl_object_toint (maxo);
+		}
+	}
+
+	nbuckets = rspamd_mmaped_file_buckets (size);
+
+	/*
+	 * Another process could convert or reindex the file concurrently, so
+	 * check it again under the lock
+	 */
+	if (!rspamd_mmaped_file_lock (pool, new_file) ||
+			(ret = rspamd_mmaped_file_check (new_file)) == -1) {
+		rspamd_file_unlock (new_file->fd, FALSE);
+		munmap (new_file->map, new_file->len);
+		close (new_file->fd);
+		g_slice_free1 (sizeof (*new_file), new_file);
+		return NULL;
+	}
+
+	if (ret == 1) {
+		/* Keep buckets filled by no more than 75% after conversion */
+		header = (struct stat_file_header *)new_file->map;
+		min_buckets = header->used_blocks * 4 / (STATFILE_BUCKET_ENTRIES * 3) + 1;
+		nbuckets = MAX (nbuckets, min_buckets);
+		msg_warn ("converting statfile %s to bucketed format, %uL buckets",
+			filename, nbuckets);
+
+		if (!rspamd_mmaped_file_rehash (pool, new_file, nbuckets, TRUE)) {
+			msg_err ("cannot convert statfile %s", filename);
+			rspamd_file_unlock (new_file->fd, FALSE);
+			munmap (new_file->map, new_file->len);
+			close (new_file->fd);
+			g_slice_free1 (sizeof (*new_file), new_file);
+			return NULL;
+		}
+	}
+	else if (nbuckets > new_file->cur_section.length) {
+		/* Statfiles are never shrunk as they can grow online */
+		msg_warn ("need to reindex statfile old size: %Hz, new size: %Hz",
+			new_file->len, size);
+
+		if (!rspamd_mmaped_file_rehash (pool, new_file, nbuckets, FALSE)) {
+			msg_err ("cannot reindex statfile %s, keep old size", filename);
+		}
+	}
+
+	rspamd_file_unlock (new_file->fd, FALSE);
 
 	rspamd_mmaped_file_preload (new_file);
 
@@ -623,9 +989,8 @@ rspamd_mmaped_file_close (rspamd_mmaped_file_ctx * pool,
 	return 0;
 }
 
-gint
-rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool, const gchar *filename,
-		size_t size, struct rspamd_statfile_config *stcf)
+static gint
+rspamd_mmaped_file_write_empty (const gchar *filename, guint64 nbuckets)
 {
 	struct stat_file_header header = {
 		.magic = {'r', 's', 'd'},
@@ -638,29 +1003,12 @@ rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool, const gchar *filename,
 	struct stat_file_section section = {
 		.code = STATFILE_SECTION_COMMON,
 	};
-	struct stat_file_block block = { 0, 0, 0 };
+	u_char pad[STATFILE_BUCKET_SIZE];
 	gint fd;
-	guint buflen = 0, nblocks;
+	guint buflen = 0, nbatch;
 	gchar *buf = NULL;
 
-	if (rspamd_mmaped_file_is_open (pool, stcf) != NULL) {
-		msg_info ("file %s is already opened", filename);
-		return 0;
-	}
-
-	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
-		msg_err ("file %s is too small to carry any statistic: %z",
-			filename,
-			size);
-		return -1;
-	}
-
-	nblocks =
-		(size - sizeof (struct stat_file_header) -
-		sizeof (struct stat_file_section)) / sizeof (struct stat_file_block);
-	header.total_blocks = nblocks;
+	header.total_blocks = nbuckets * STATFILE_BUCKET_ENTRIES;
 
 	if ((fd =
 		open (filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR | S_IRUSR)) == -1) {
@@ -673,7 +1021,7 @@ rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool, const gchar *filename,
 
 	rspamd_fallocate (fd,
 		0,
-		sizeof (header) + sizeof (section) + sizeof (block) * nblocks);
+		STATFILE_BUCKETS_OFFSET + STATFILE_BUCKET_SIZE * nbuckets);
 
 	header.create_time = (guint64) time (NULL);
 	if (write (fd, &header, sizeof (header)) == -1) {
@@ -686,7 +1034,7 @@ rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool, const gchar *filename,
 		return -1;
 	}
 
-	section.length = (guint64) nblocks;
+	section.length = nbuckets;
 	if (write (fd, &section, sizeof (section)) == -1) {
 		msg_info ("cannot write section header to file %s, error %d, %s",
 			filename,
@@ -697,51 +1045,67 @@ rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool, const gchar *filename,
 		return -1;
 	}
 
-	/* Buffer for write 256 blocks at once */
-	if (nblocks > 256) {
-		buflen = sizeof (block) * 256;
-		buf = g_malloc0 (buflen);
+	/* Align buckets to cache lines */
+	memset (pad, 0, sizeof (pad));
+	if (write (fd, pad, STATFILE_BUCKETS_OFFSET - sizeof (header) -
+			sizeof (section)) == -1) {
+		msg_info ("cannot write padding to file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		close (fd);
+
+		return -1;
 	}
 
-	while (nblocks) {
-		if (nblocks > 256) {
-			/* Just write buffer */
-			if (write (fd, buf, buflen) == -1) {
-				msg_info ("cannot write blocks buffer to file %s, error %d, %s",
-					filename,
-					errno,
-					strerror (errno));
-				close (fd);
-				g_free (buf);
+	/* Buffer for write 256 buckets at once */
+	buflen = STATFILE_BUCKET_SIZE * 256;
+	buf = g_malloc0 (buflen);
 
-				return -1;
-			}
-			nblocks -= 256;
-		}
-		else {
-			if (write (fd, &block, sizeof (block)) == -1) {
-				msg_info ("cannot write block to file %s, error %d, %s",
-					filename,
-					errno,
-					strerror (errno));
-				close (fd);
-				if (buf) {
-					g_free (buf);
-				}
+	while (nbuckets) {
+		nbatch = MIN (nbuckets, 256);
 
-				return -1;
-			}
-			nblocks--;
+		if (write (fd, buf, nbatch * STATFILE_BUCKET_SIZE) == -1) {
+			msg_info ("cannot write buckets buffer to file %s, error %d, %s",
+				filename,
+				errno,
+				strerror (errno));
+			close (fd);
+			g_free (buf);
+
+			return -1;
 		}
+
+		nbuckets -= nbatch;
 	}
 
 	close (fd);
+	g_free (buf);
+
+	return 0;
+}
+
+gint
+rspamd_mmaped_file_create (rspamd_mmaped_file_ctx * pool, const gchar *filename,
+		size_t size, struct rspamd_statfile_config *stcf)
+{
+	guint64 nbuckets;
 
-	if (buf) {
-		g_free (buf);
+	if (rspamd_mmaped_file_is_open (pool, stcf) != NULL) {
+		msg_info ("file %s is already opened", filename);
+		return 0;
 	}
 
-	return 0;
+	nbuckets = rspamd_mmaped_file_buckets (size);
+
+	if (nbuckets == 0) {
+		msg_err ("file %s is too small to carry any statistic: %z",
+			filename,
+			size);
+		return -1;
+	}
+
+	return rspamd_mmaped_file_write_empty (filename, nbuckets);
 }
 
 void
@@ -791,7 +1155,7 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 			 * By default, all statfiles are treated as mmaped files
 			 */
 			if (stf->backend == NULL ||
-					strcmp (stf->backend, MMAPED_BACKEND_TYPE)) {
+					strcmp (stf->backend, MMAPED_BACKEND_TYPE) == 0) {
 				/*
 				 * Check configuration sanity
 				 */
@@ -831,7 +1195,8 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 }
 
 gpointer
-rspamd_mmaped_file_runtime (struct rspamd_statfile_config *stcf, gboolean learn,
+rspamd_mmaped_file_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf, gboolean learn,
 		gpointer p)
 {
 	rspamd_mmaped_file_ctx *ctx = (rspamd_mmaped_file_ctx *)p;
@@ -844,6 +1209,14 @@ rspamd_mmaped_file_runtime (struct rspamd_statfile_config *stcf, gboolean learn,
 
 	mf = rspamd_mmaped_file_is_open (ctx, stcf);
 
+	if (mf != NULL && mf->map != NULL &&
+			((struct stat_file_header *)mf->map)->stale) {
+		/* Statfile has been rehashed by another process */
+		if (!rspamd_mmaped_file_reload (ctx, mf)) {
+			msg_err ("cannot reload statfile %s", mf->filename);
+		}
+	}
+
 	if (mf == NULL && learn) {
 		/* Create file here */
 
@@ -887,7 +1260,6 @@ rspamd_mmaped_file_process_token (rspamd_token_t *tok,
 	g_assert (p != NULL);
 	g_assert (res->st_runtime != NULL);
 	g_assert (tok != NULL);
-	g_assert (tok->datalen >= sizeof (guint32) * 2);
 
 	mf = (rspamd_mmaped_file_t *)res->st_runtime->backend_runtime;
 
@@ -897,8 +1269,8 @@ rspamd_mmaped_file_process_token (rspamd_token_t *tok,
 		return FALSE;
 	}
 
-	memcpy (&h1, tok->data, sizeof (h1));
-	memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+	h1 = tok->data & 0xffffffffULL;
+	h2 = tok->data >> 32;
 	res->value = rspamd_mmaped_file_get_block (ctx, mf, h1, h2);
 
 	if (res->value > 0.0) {
@@ -908,6 +1280,65 @@ rspamd_mmaped_file_process_token (rspamd_token_t *tok,
 	return FALSE;
 }
 
+guint
+rspamd_mmaped_file_process_tokens (GArray *tokens, guint idx,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	rspamd_mmaped_file_t *mf;
+	struct stat_file_bucket *bk;
+	struct rspamd_token_result *res;
+	rspamd_token_t *tok;
+	guint i, found = 0;
+	gint pos;
+
+	g_assert (tokens != NULL);
+	g_assert (runtime != NULL);
+	g_assert (p != NULL);
+
+	mf = (rspamd_mmaped_file_t *)runtime->backend_runtime;
+
+	if (mf == NULL || mf->map == NULL) {
+		/* Statfile is does not exist, so all values are zero */
+		for (i = 0; i < tokens->len; i ++) {
+			tok = &g_array_index (tokens, rspamd_token_t, i);
+			tok->results[idx].value = 0.0;
+		}
+
+		return 0;
+	}
+
+	/*
+	 * Buckets of tokens are spread over the whole file, so we start loading
+	 * buckets for the next tokens while checking the current one
+	 */
+	for (i = 0; i < MIN (PREFETCH_DISTANCE, tokens->len); i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		STATFILE_PREFETCH (rspamd_mmaped_file_bucket (mf,
+				(tok->data & 0xffffffffULL) % mf->cur_section.length));
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		if (i + PREFETCH_DISTANCE < tokens->len) {
+			tok = &g_array_index (tokens, rspamd_token_t, i + PREFETCH_DISTANCE);
+			STATFILE_PREFETCH (rspamd_mmaped_file_bucket (mf,
+					(tok->data & 0xffffffffULL) % mf->cur_section.length));
+		}
+
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		res = &tok->results[idx];
+		bk = rspamd_mmaped_file_find (mf, tok->data & 0xffffffffULL,
+				rspamd_mmaped_file_tag (tok->data >> 32), &pos);
+		res->value = bk != NULL ? bk->value[pos] : 0.0;
+
+		if (res->value > 0.0) {
+			found ++;
+		}
+	}
+
+	return found;
+}
+
 gboolean
 rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 		struct rspamd_token_result *res,
@@ -921,7 +1352,6 @@ rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 	g_assert (p != NULL);
 	g_assert (res->st_runtime != NULL);
 	g_assert (tok != NULL);
-	g_assert (tok->datalen >= sizeof (guint32) * 2);
 
 	mf = (rspamd_mmaped_file_t *)res->st_runtime->backend_runtime;
 
@@ -931,9 +1361,15 @@ rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 		return FALSE;
 	}
 
-	memcpy (&h1, tok->data, sizeof (h1));
-	memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+	h1 = tok->data & 0xffffffffULL;
+	h2 = tok->data >> 32;
+
+	if (!rspamd_mmaped_file_lock (ctx, mf)) {
+		return FALSE;
+	}
+
 	rspamd_mmaped_file_set_block (ctx, mf, h1, h2, res->value);
+	rspamd_file_unlock (mf->fd, FALSE);
 
 	if (res->value > 0.0) {
 		return TRUE;
@@ -942,6 +1378,70 @@ rspamd_mmaped_file_learn_token (rspamd_token_t *tok,
 	return FALSE;
 }
 
+guint
+rspamd_mmaped_file_learn_tokens (GArray *tokens, guint idx,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	rspamd_mmaped_file_ctx *ctx = (rspamd_mmaped_file_ctx *)p;
+	rspamd_mmaped_file_t *mf;
+	struct rspamd_token_result *res;
+	rspamd_token_t *tok;
+	guint i, learned = 0;
+
+	g_assert (tokens != NULL);
+	g_assert (runtime != NULL);
+	g_assert (p != NULL);
+
+	mf = (rspamd_mmaped_file_t *)runtime->backend_runtime;
+
+	if (mf == NULL) {
+		/* Statfile is does not exist, so all values are zero */
+		for (i = 0; i < tokens->len; i ++) {
+			tok = &g_array_index (tokens, rspamd_token_t, i);
+			tok->results[idx].value = 0.0;
+		}
+
+		return 0;
+	}
+
+	/*
+	 * Statfile is locked and checked for being rehashed by another process
+	 * once for all tokens, it can still be grown while inserting them but
+	 * the lock of the new file is held in that case
+	 */
+	if (!rspamd_mmaped_file_lock (ctx, mf)) {
+		return 0;
+	}
+
+	for (i = 0; i < MIN (PREFETCH_DISTANCE, tokens->len); i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		STATFILE_PREFETCH (rspamd_mmaped_file_bucket (mf,
+				(tok->data & 0xffffffffULL) % mf->cur_section.length));
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		if (i + PREFETCH_DISTANCE < tokens->len) {
+			tok = &g_array_index (tokens, rspamd_token_t, i + PREFETCH_DISTANCE);
+			STATFILE_PREFETCH (rspamd_mmaped_file_bucket (mf,
+					(tok->data & 0xffffffffULL) % mf->cur_section.length));
+		}
+
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		res = &tok->results[idx];
+		rspamd_mmaped_file_set_block_common (ctx, mf, tok->data & 0xffffffffULL,
+				tok->data >> 32, res->value);
+
+		if (res->value > 0.0) {
+			learned ++;
+		}
+	}
+
+	rspamd_file_unlock (mf->fd, FALSE);
+
+	return learned;
+}
+
 gulong
 rspamd_mmaped_file_total_learns (struct rspamd_statfile_runtime *runtime,
 		gpointer ctx)
@@ -965,9 +1465,10 @@ rspamd_mmaped_file_inc_learns (struct rspamd_statfile_runtime *runtime,
 	guint64 rev = 0;
 	time_t t;
 
-	if (mf != NULL) {
+	if (mf != NULL && rspamd_mmaped_file_lock (ctx, mf)) {
 		rspamd_mmaped_file_inc_revision (mf);
 		rspamd_mmaped_file_get_revision (mf, &rev, &t);
+		rspamd_file_unlock (mf->fd, FALSE);
 	}
 
 	return rev;
@@ -0,0 +1,621 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "stat_internal.h"
+#include "main.h"
+#include "addr.h"
+
+#ifndef WITH_SYSTEM_HIREDIS
+#include "hiredis.h"
+#include "async.h"
+#include "adapters/libevent.h"
+#else
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <hiredis/adapters/libevent.h>
+#endif
+
+#define REDIS_BACKEND_TYPE "redis"
+#define REDIS_DEFAULT_PORT 6379
+#define REDIS_DEFAULT_TIMEOUT 0.5
+/* Hash field that holds number of learns of a statfile */
+#define REDIS_LEARNS_FIELD "learns"
+/* Maximum length of a token written as decimal number */
+#define REDIS_TOKEN_LEN 24
+
+/*
+ * Each statfile is stored as a redis hash, where fields are tokens and values
+ * are numbers of learns of these tokens.
+ *
+ * Requests are asynchronous: each task opens its own connection per statfile
+ * and registers an event in its session while a reply is awaited, so the
+ * statistics step is finished from the reply callback. There is at most one
+ * callback pending per connection, commands that do not need replies are sent
+ * before it without callbacks.
+ */
+struct redis_stat_elt {
+	struct rspamd_statfile_config *stcf;
+	gchar *host;
+	guint16 port;
+	struct timeval tv;
+	const gchar *key;
+};
+
+struct redis_stat_ctx {
+	GHashTable *elts;                       /**< servers indexed by statfile config */
+};
+
+struct redis_stat_runtime {
+	struct redis_stat_elt *elt;
+	struct rspamd_task *task;
+	redisAsyncContext *redis;
+	struct event timeout_event;
+	GArray *tokens;                         /**< tokens being loaded */
+	guint idx;                              /**< index of results of this statfile */
+	gulong learns;
+	gboolean waiting;                       /**< event is registered in session */
+	gboolean storing;                       /**< learned values are being stored */
+};
+
+static gdouble
+rspamd_redis_reply_value (redisReply *reply)
+{
+	switch (reply->type) {
+	case REDIS_REPLY_STRING:
+		return strtod (reply->str, NULL);
+	case REDIS_REPLY_INTEGER:
+		return reply->integer;
+	default:
+		return 0.0;
+	}
+}
+
+static void
+rspamd_redis_disconnected (const redisAsyncContext *c, gint status)
+{
+	struct redis_stat_runtime *rt = c->data;
+
+	/* Context is freed by hiredis after this callback */
+	if (rt != NULL) {
+		rt->redis = NULL;
+	}
+}
+
+/*
+ * Connection is closed when the awaited reply is received, on timeout or
+ * when the task is destroyed, pending callback is then called with no reply
+ * and ignores it as connection is already detached from runtime
+ */
+static void
+rspamd_redis_fin (gpointer ud)
+{
+	struct redis_stat_runtime *rt = ud;
+	redisAsyncContext *redis;
+
+	if (rt->waiting) {
+		rt->waiting = FALSE;
+		event_del (&rt->timeout_event);
+	}
+
+	if (rt->redis != NULL) {
+		redis = rt->redis;
+		rt->redis = NULL;
+		redis->data = NULL;
+		redisAsyncFree (redis);
+	}
+}
+
+static void
+rspamd_redis_timeout (gint fd, short what, gpointer ud)
+{
+	struct redis_stat_runtime *rt = ud;
+
+	msg_err ("timeout while waiting for redis server %s:%d for statfile %s",
+			rt->elt->host, (gint)rt->elt->port, rt->elt->stcf->symbol);
+
+	if (rt->storing) {
+		rt->task->last_error = "cannot store statistics in redis";
+		rt->task->error_code = RSPAMD_STATFILE_ERROR;
+	}
+
+	remove_normal_event (rt->task->s, rspamd_redis_fin, rt);
+}
+
+static gboolean
+rspamd_redis_connect (struct redis_stat_runtime *rt)
+{
+	if (rt->redis != NULL) {
+		return TRUE;
+	}
+
+	rt->redis = redisAsyncConnect (rt->elt->host, rt->elt->port);
+
+	if (rt->redis == NULL) {
+		msg_err ("cannot connect to redis server %s:%d for statfile %s",
+				rt->elt->host, (gint)rt->elt->port, rt->elt->stcf->symbol);
+		return FALSE;
+	}
+	else if (rt->redis->err) {
+		msg_err ("cannot connect to redis server %s:%d for statfile %s: %s",
+				rt->elt->host, (gint)rt->elt->port, rt->elt->stcf->symbol,
+				rt->redis->errstr);
+		redisAsyncFree (rt->redis);
+		rt->redis = NULL;
+
+		return FALSE;
+	}
+
+	rt->redis->data = rt;
+	redisAsyncSetDisconnectCallback (rt->redis, rspamd_redis_disconnected);
+	redisLibeventAttach (rt->redis, rt->task->ev_base);
+
+	return TRUE;
+}
+
+/*
+ * Register event that is removed when reply of the last sent command is
+ * received or when it is not received in time
+ */
+static void
+rspamd_redis_wait (struct redis_stat_runtime *rt)
+{
+	register_async_event (rt->task->s, rspamd_redis_fin, rt,
+			g_quark_from_static_string ("redis statistics"));
+	rt->waiting = TRUE;
+
+	evtimer_set (&rt->timeout_event, rspamd_redis_timeout, rt);
+	event_base_set (rt->task->ev_base, &rt->timeout_event);
+	evtimer_add (&rt->timeout_event, &rt->elt->tv);
+}
+
+/*
+ * Check reply and detach connection that is being freed by hiredis,
+ * returns FALSE if request is cancelled and runtime must not be used
+ */
+static gboolean
+rspamd_redis_check_reply (redisAsyncContext *c, redisReply *reply,
+		struct redis_stat_runtime *rt, gboolean *ok)
+{
+	if (rt->redis == NULL) {
+		/* Request has been cancelled */
+		return FALSE;
+	}
+
+	*ok = FALSE;
+
+	if (reply == NULL) {
+		msg_err ("cannot get reply from redis server %s:%d for statfile %s: %s",
+				rt->elt->host, (gint)rt->elt->port, rt->elt->stcf->symbol,
+				c->err ? c->errstr : "connection closed");
+		c->data = NULL;
+		rt->redis = NULL;
+	}
+	else if (reply->type == REDIS_REPLY_ERROR) {
+		msg_err ("redis server %s:%d returned error for statfile %s: %s",
+				rt->elt->host, (gint)rt->elt->port, rt->elt->stcf->symbol,
+				reply->str);
+	}
+	else {
+		*ok = TRUE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = priv;
+	redisReply *reply = r;
+	rspamd_token_t *tok;
+	gboolean ok;
+	guint i;
+
+	if (!rspamd_redis_check_reply (c, reply, rt, &ok)) {
+		return;
+	}
+
+	if (ok) {
+		/* The first element is the number of learns of statfile */
+		if (reply->type == REDIS_REPLY_ARRAY &&
+				reply->elements == rt->tokens->len + 1) {
+			rt->learns = rspamd_redis_reply_value (reply->element[0]);
+
+			for (i = 0; i < rt->tokens->len; i ++) {
+				tok = &g_array_index (rt->tokens, rspamd_token_t, i);
+				tok->results[rt->idx].value =
+						rspamd_redis_reply_value (reply->element[i + 1]);
+			}
+		}
+		else {
+			msg_err ("invalid reply from redis for statfile %s: type %d, "
+					"%z elements", rt->elt->stcf->symbol, reply->type,
+					(gsize)reply->elements);
+		}
+	}
+
+	remove_normal_event (rt->task->s, rspamd_redis_fin, rt);
+}
+
+static void
+rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = priv;
+	redisReply *reply = r;
+	gboolean ok;
+
+	if (!rspamd_redis_check_reply (c, reply, rt, &ok)) {
+		return;
+	}
+
+	if (ok) {
+		rt->learns = rspamd_redis_reply_value (reply);
+	}
+	else {
+		rt->task->last_error = "cannot store statistics in redis";
+		rt->task->error_code = RSPAMD_STATFILE_ERROR;
+	}
+
+	remove_normal_event (rt->task->s, rspamd_redis_fin, rt);
+}
+
+static struct redis_stat_elt *
+rspamd_redis_elt_new (struct rspamd_statfile_config *stf,
+		struct rspamd_config *cfg)
+{
+	struct redis_stat_elt *elt;
+	const ucl_object_t *obj;
+	rspamd_inet_addr_t *addrs = NULL;
+	guint naddrs = 1;
+	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
+
+	obj = ucl_object_find_key (stf->opts, "servers");
+	if (obj == NULL || ucl_object_type (obj) != UCL_STRING) {
+		obj = ucl_object_find_key (stf->opts, "server");
+		if (obj == NULL || ucl_object_type (obj) != UCL_STRING) {
+			msg_err ("statfile %s has no redis server defined", stf->symbol);
+			return NULL;
+		}
+	}
+
+	if (!rspamd_parse_host_port (ucl_object_tostring (obj), &addrs, &naddrs,
+			NULL, REDIS_DEFAULT_PORT, cfg->cfg_pool) || naddrs == 0) {
+		msg_err ("statfile %s has invalid redis server: %s", stf->symbol,
+				ucl_object_tostring (obj));
+		return NULL;
+	}
+
+	elt = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*elt));
+	elt->stcf = stf;
+	elt->host = rspamd_mempool_strdup (cfg->cfg_pool,
+			rspamd_inet_address_to_string (&addrs[0]));
+	elt->port = rspamd_inet_address_get_port (&addrs[0]);
+
+	obj = ucl_object_find_key (stf->opts, "timeout");
+	if (obj != NULL) {
+		ucl_object_todouble_safe (obj, &timeout);
+	}
+	double_to_tv (timeout, &elt->tv);
+
+	obj = ucl_object_find_key (stf->opts, "key");
+	if (obj != NULL && ucl_object_type (obj) == UCL_STRING) {
+		elt->key = ucl_object_tostring (obj);
+	}
+	else {
+		elt->key = stf->symbol;
+	}
+
+	return elt;
+}
+
+gpointer
+rspamd_redis_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
+{
+	struct redis_stat_ctx *new;
+	struct redis_stat_elt *elt;
+	struct rspamd_classifier_config *clf;
+	struct rspamd_statfile_config *stf;
+	GList *cur, *curst;
+
+	new = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*new));
+	new->elts = g_hash_table_new (g_direct_hash, g_direct_equal);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, new->elts);
+
+	cur = cfg->classifiers;
+
+	while (cur) {
+		clf = cur->data;
+
+		curst = clf->statfiles;
+		while (curst) {
+			stf = curst->data;
+
+			if (stf->backend != NULL &&
+					strcmp (stf->backend, REDIS_BACKEND_TYPE) == 0) {
+				elt = rspamd_redis_elt_new (stf, cfg);
+
+				if (elt != NULL) {
+					g_hash_table_insert (new->elts, stf, elt);
+					ctx->statfiles ++;
+					ctx->async_statfiles ++;
+				}
+			}
+
+			curst = curst->next;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	return (gpointer)new;
+}
+
+gpointer
+rspamd_redis_runtime (struct rspamd_task *task,
+		struct rspamd_statfile_config *stcf,
+		gboolean learn, gpointer p)
+{
+	struct redis_stat_ctx *ctx = (struct redis_stat_ctx *)p;
+	struct redis_stat_elt *elt;
+	struct redis_stat_runtime *rt;
+
+	g_assert (ctx != NULL);
+
+	elt = g_hash_table_lookup (ctx->elts, stcf);
+
+	if (elt == NULL || task->s == NULL || task->ev_base == NULL) {
+		return NULL;
+	}
+
+	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+	rt->elt = elt;
+	rt->task = task;
+	/* Connection must not outlive task */
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_redis_fin, rt);
+
+	return rt;
+}
+
+gboolean
+rspamd_redis_process_token (rspamd_token_t *tok,
+		struct rspamd_token_result *res,
+		gpointer p)
+{
+	/* Tokens are loaded in batches only, see rspamd_redis_process_tokens */
+	res->value = 0.0;
+
+	return FALSE;
+}
+
+guint
+rspamd_redis_process_tokens (GArray *tokens, guint idx,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct redis_stat_runtime *rt;
+	rspamd_token_t *tok;
+	const gchar **argv;
+	gsize *argvlen;
+	gchar *tokbuf;
+	guint i;
+	gint ret;
+
+	g_assert (tokens != NULL);
+	g_assert (runtime != NULL);
+
+	rt = (struct redis_stat_runtime *)runtime->backend_runtime;
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		tok->results[idx].value = 0.0;
+	}
+
+	if (rt == NULL || rt->waiting || !rspamd_redis_connect (rt)) {
+		return 0;
+	}
+
+	rt->tokens = tokens;
+	rt->idx = idx;
+
+	/* Learns and all tokens are fetched by a single HMGET */
+	argv = g_malloc (sizeof (*argv) * (tokens->len + 3));
+	argvlen = g_malloc (sizeof (*argvlen) * (tokens->len + 3));
+	tokbuf = g_malloc (REDIS_TOKEN_LEN * MAX (tokens->len, 1));
+
+	argv[0] = "HMGET";
+	argvlen[0] = sizeof ("HMGET") - 1;
+	argv[1] = rt->elt->key;
+	argvlen[1] = strlen (rt->elt->key);
+	argv[2] = REDIS_LEARNS_FIELD;
+	argvlen[2] = sizeof (REDIS_LEARNS_FIELD) - 1;
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		argv[i + 3] = &tokbuf[i * REDIS_TOKEN_LEN];
+		argvlen[i + 3] = rspamd_snprintf (&tokbuf[i * REDIS_TOKEN_LEN],
+				REDIS_TOKEN_LEN, "%uL", tok->data);
+	}
+
+	/* Arguments are copied to the output buffer by hiredis */
+	ret = redisAsyncCommandArgv (rt->redis, rspamd_redis_processed, rt,
+			tokens->len + 3, argv, argvlen);
+
+	g_free (argv);
+	g_free (argvlen);
+	g_free (tokbuf);
+
+	if (ret == REDIS_OK) {
+		rspamd_redis_wait (rt);
+	}
+
+	/* Values are set when reply is received */
+	return 0;
+}
+
+/*
+ * Learning adds the difference between the learned and the loaded value of
+ * each token by HINCRBYFLOAT, so concurrent learns on several nodes are not
+ * lost. These commands are sent without callbacks, errors are reported by
+ * the HINCRBY of learns that follows them on the same connection
+ */
+static guint
+rspamd_redis_incr_tokens (struct redis_stat_runtime *rt, rspamd_token_t *toks,
+		guint ntoks, guint idx)
+{
+	rspamd_token_t *tok;
+	struct rspamd_token_result *res;
+	const gchar *argv[4];
+	gsize argvlen[4];
+	gchar tokbuf[REDIS_TOKEN_LEN], valbuf[32];
+	guint i, learned = 0;
+
+	if (rt->waiting || !rspamd_redis_connect (rt)) {
+		return 0;
+	}
+
+	argv[0] = "HINCRBYFLOAT";
+	argvlen[0] = sizeof ("HINCRBYFLOAT") - 1;
+	argv[1] = rt->elt->key;
+	argvlen[1] = strlen (rt->elt->key);
+	argv[2] = tokbuf;
+	argv[3] = valbuf;
+
+	for (i = 0; i < ntoks; i ++) {
+		tok = &toks[i];
+		res = &tok->results[idx];
+
+		if (res->value > 0.0) {
+			learned ++;
+		}
+
+		if (res->value == res->orig_value) {
+			continue;
+		}
+
+		argvlen[2] = rspamd_snprintf (tokbuf, sizeof (tokbuf), "%uL", tok->data);
+		argvlen[3] = rspamd_snprintf (valbuf, sizeof (valbuf), "%.2f",
+				res->value - res->orig_value);
+
+		if (redisAsyncCommandArgv (rt->redis, NULL, NULL, 4, argv,
+				argvlen) != REDIS_OK) {
+			return 0;
+		}
+	}
+
+	return learned;
+}
+
+gboolean
+rspamd_redis_learn_token (rspamd_token_t *tok,
+		struct rspamd_token_result *res,
+		gpointer p)
+{
+	struct redis_stat_runtime *rt;
+
+	g_assert (res != NULL);
+	g_assert (res->st_runtime != NULL);
+	g_assert (tok != NULL);
+
+	rt = (struct redis_stat_runtime *)res->st_runtime->backend_runtime;
+
+	if (rt == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_redis_incr_tokens (rt, tok, 1, res - tok->results) > 0;
+}
+
+guint
+rspamd_redis_learn_tokens (GArray *tokens, guint idx,
+		struct rspamd_statfile_runtime *runtime,
+		gpointer p)
+{
+	struct redis_stat_runtime *rt;
+
+	g_assert (tokens != NULL);
+	g_assert (runtime != NULL);
+
+	rt = (struct redis_stat_runtime *)runtime->backend_runtime;
+
+	if (rt == NULL || tokens->len == 0) {
+		return 0;
+	}
+
+	return rspamd_redis_incr_tokens (rt, (rspamd_token_t *)tokens->data,
+			tokens->len, idx);
+}
+
+gulong
+rspamd_redis_total_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt = (struct redis_stat_runtime *)runtime;
+
+	if (rt == NULL) {
+		return 0;
+	}
+
+	/* Learns are loaded with tokens */
+	return rt->learns;
+}
+
+gulong
+rspamd_redis_inc_learns (struct rspamd_statfile_runtime *runtime,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt = (struct redis_stat_runtime *)runtime;
+	const gchar *argv[4];
+	gsize argvlen[4];
+
+	if (rt == NULL || rt->waiting) {
+		return 0;
+	}
+
+	if (!rspamd_redis_connect (rt)) {
+		rt->task->last_error = "cannot store statistics in redis";
+		rt->task->error_code = RSPAMD_STATFILE_ERROR;
+
+		return 0;
+	}
+
+	argv[0] = "HINCRBY";
+	argvlen[0] = sizeof ("HINCRBY") - 1;
+	argv[1] = rt->elt->key;
+	argvlen[1] = strlen (rt->elt->key);
+	argv[2] = REDIS_LEARNS_FIELD;
+	argvlen[2] = sizeof (REDIS_LEARNS_FIELD) - 1;
+	argv[3] = "1";
+	argvlen[3] = 1;
+
+	if (redisAsyncCommandArgv (rt->redis, rspamd_redis_learned, rt, 4,
+			argv, argvlen) == REDIS_OK) {
+		rt->storing = TRUE;
+		rspamd_redis_wait (rt);
+	}
+
+	/* The new value is set when reply is received */
+	return rt->learns + 1;
+}
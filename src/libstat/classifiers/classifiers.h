@@ -26,10 +26,10 @@ struct rspamd_stat_classifier {
 	struct classifier_ctx * (*init_func)(rspamd_mempool_t *pool,
 		struct rspamd_classifier_config *cf);
 	gboolean (*classify_func)(struct classifier_ctx * ctx,
-		GTree *input, struct rspamd_classifier_runtime *rt,
+		GArray *input, struct rspamd_classifier_runtime *rt,
 		struct rspamd_task *task);
 	gboolean (*learn_spam_func)(struct classifier_ctx * ctx,
-		GTree *input, struct rspamd_classifier_runtime *rt,
+		GArray *input, struct rspamd_classifier_runtime *rt,
 		struct rspamd_task *task, gboolean is_spam,
 		GError **err);
 };
@@ -38,11 +38,11 @@ struct rspamd_stat_classifier {
 struct classifier_ctx * bayes_init (rspamd_mempool_t *pool,
 	struct rspamd_classifier_config *cf);
 gboolean bayes_classify (struct classifier_ctx * ctx,
-	GTree *input,
+	GArray *input,
 	struct rspamd_classifier_runtime *rt,
 	struct rspamd_task *task);
 gboolean bayes_learn_spam (struct classifier_ctx * ctx,
-	GTree *input,
+	GArray *input,
 	struct rspamd_classifier_runtime *rt,
 	struct rspamd_task *task,
 	gboolean is_spam,
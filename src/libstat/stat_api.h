@@ -39,7 +39,9 @@
 void rspamd_stat_init (struct rspamd_config *cfg);
 
 /**
- * Classify the task specified and insert symbols if needed
+ * Classify the task specified and insert symbols if needed, if statfiles are
+ * loaded asynchronously then symbols are inserted when events registered in
+ * the task's session are finished
  * @param task
  * @return TRUE if task has been classified
  */
@@ -47,7 +49,10 @@ gboolean rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **
 
 
 /**
- * Learn task as spam or ham, task must be processed prior to this call
+ * Learn task as spam or ham, task must be processed prior to this call. If
+ * statfiles are loaded asynchronously then learning is finished when events
+ * registered in the task's session are finished, errors are then reported by
+ * setting task's error code to RSPAMD_STATFILE_ERROR
  * @param task task to learn
  * @param spam if TRUE learn spam, otherwise learn ham
  * @return TRUE if task has been learned
@@ -55,6 +60,13 @@ gboolean rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **
 gboolean rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 		GError **err);
 
+/**
+ * Check whether some statfiles are loaded asynchronously, classification
+ * should not be moved to threads then
+ * @return TRUE if there are asynchronous statfiles
+ */
+gboolean rspamd_stat_is_async (void);
+
 
 void rspamd_stat_unload (void);
 
@@ -50,9 +50,22 @@ struct rspamd_stat_backend stat_backends[] = {
 		.init = rspamd_mmaped_file_init,
 		.runtime = rspamd_mmaped_file_runtime,
 		.process_token = rspamd_mmaped_file_process_token,
+		.process_tokens = rspamd_mmaped_file_process_tokens,
 		.learn_token = rspamd_mmaped_file_learn_token,
+		.learn_tokens = rspamd_mmaped_file_learn_tokens,
 		.total_learns = rspamd_mmaped_file_total_learns,
 		.inc_learns = rspamd_mmaped_file_inc_learns
+	},
+	{
+		.name = "redis",
+		.init = rspamd_redis_init,
+		.runtime = rspamd_redis_runtime,
+		.process_token = rspamd_redis_process_token,
+		.process_tokens = rspamd_redis_process_tokens,
+		.learn_token = rspamd_redis_learn_token,
+		.learn_tokens = rspamd_redis_learn_tokens,
+		.total_learns = rspamd_redis_total_learns,
+		.inc_learns = rspamd_redis_inc_learns
 	}
 };
 
@@ -86,6 +99,12 @@ rspamd_stat_get_ctx (void)
 	return stat_ctx;
 }
 
+gboolean
+rspamd_stat_is_async (void)
+{
+	return stat_ctx != NULL && stat_ctx->async_statfiles > 0;
+}
+
 struct rspamd_stat_classifier *
 rspamd_stat_get_classifier (const gchar *name)
 {
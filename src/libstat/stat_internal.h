@@ -30,9 +30,10 @@
 #include "backends/backends.h"
 
 struct rspamd_tokenizer_runtime {
-	GTree *tokens;
+	GArray *tokens;
 	const gchar *name;
 	struct rspamd_stat_tokenizer *tokenizer;
+	gboolean tokenized;
 	struct rspamd_tokenizer_runtime *next;
 };
 
@@ -40,6 +41,7 @@ struct rspamd_statfile_runtime {
 	struct rspamd_statfile_config *st;
 	struct rspamd_stat_backend *backend;
 	gpointer backend_runtime;
+	guint idx;
 	guint64 hits;
 	guint64 total_hits;
 };
@@ -60,16 +62,19 @@ struct rspamd_classifier_runtime {
 
 struct rspamd_token_result {
 	double value;
+	double orig_value;                      /**< value loaded before learning */
 	struct rspamd_statfile_runtime *st_runtime;
 
 	struct rspamd_classifier_runtime *cl_runtime;
 };
 
-#define RSPAMD_MAX_TOKEN_LEN 64
+/*
+ * Tokens are stored in a sorted array without duplicates, results of all
+ * statfiles for a token are stored in a contiguous block of a single array
+ */
 typedef struct token_node_s {
-	guchar data[RSPAMD_MAX_TOKEN_LEN];
-	guint datalen;
-	GArray *results;
+	guint64 data;
+	struct rspamd_token_result *results;
 } rspamd_token_t;
 
 struct rspamd_stat_ctx {
@@ -81,6 +86,7 @@ struct rspamd_stat_ctx {
 	guint backends_count;
 
 	guint statfiles;
+	guint async_statfiles;                  /**< statfiles that are loaded by events */
 };
 
 struct rspamd_stat_ctx * rspamd_stat_get_ctx (void);
@@ -34,8 +34,17 @@ struct preprocess_cb_data {
 	GList *classifier_runtimes;
 	struct rspamd_tokenizer_runtime *tok;
 	guint results_count;
+	gboolean learn;
 };
 
+static void
+rspamd_stat_tokens_free (gpointer p)
+{
+	GArray *tokens = p;
+
+	g_array_free (tokens, TRUE);
+}
+
 static struct rspamd_tokenizer_runtime *
 rspamd_stat_get_tokenizer_runtime (const gchar *name, rspamd_mempool_t *pool,
 		struct rspamd_tokenizer_runtime **ls)
@@ -57,9 +66,10 @@ rspamd_stat_get_tokenizer_runtime (const gchar *name, rspamd_mempool_t *pool,
 			return NULL;
 		}
 
-		tok->tokens = g_tree_new (token_node_compare_func);
+		tok->tokens = g_array_new (FALSE, FALSE, sizeof (rspamd_token_t));
+		tok->tokenized = FALSE;
 		rspamd_mempool_add_destructor (pool,
-				(rspamd_mempool_destruct_t)g_tree_destroy, tok->tokens);
+				rspamd_stat_tokens_free, tok->tokens);
 		tok->name = name;
 		LL_PREPEND(*ls, tok);
 	}
@@ -67,20 +77,21 @@ rspamd_stat_get_tokenizer_runtime (const gchar *name, rspamd_mempool_t *pool,
 	return tok;
 }
 
-static gboolean
-preprocess_init_stat_token (gpointer k, gpointer v, gpointer d)
+/*
+ * Resolve tokens statfile by statfile, so backends could process all tokens
+ * of a statfile at once. Backends may load tokens asynchronously, so results
+ * are used only when all events registered here are finished
+ */
+static void
+preprocess_init_stat_tokens (GArray *tokens,
+		struct preprocess_cb_data *cbdata)
 {
-	rspamd_token_t *t = (rspamd_token_t *)v;
-	struct preprocess_cb_data *cbdata = (struct preprocess_cb_data *)d;
 	struct rspamd_statfile_runtime *st_runtime;
 	struct rspamd_classifier_runtime *cl_runtime;
 	struct rspamd_token_result *res;
+	rspamd_token_t *t;
 	GList *cur, *curst;
-	gint i = 0;
-
-	t->results = g_array_sized_new (FALSE, TRUE,
-			sizeof (struct rspamd_token_result), cbdata->results_count);
-	g_array_set_size (t->results, cbdata->results_count);
+	guint i = 0, j;
 
 	cur = g_list_first (cbdata->classifier_runtimes);
 
@@ -88,11 +99,11 @@ preprocess_init_stat_token (gpointer k, gpointer v, gpointer d)
 		cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
 
 		if (cl_runtime->clcf->min_tokens > 0 &&
-				(guint32)g_tree_nnodes (cbdata->tok->tokens) < cl_runtime->clcf->min_tokens) {
+				tokens->len < cl_runtime->clcf->min_tokens) {
 			/* Skip this classifier */
 			msg_debug ("<%s> contains less tokens than required for %s classifier: "
 					"%ud < %ud", cbdata->task->message_id, cl_runtime->clcf->name,
-					g_tree_nnodes (cbdata->tok->tokens),
+					tokens->len,
 					cl_runtime->clcf->min_tokens);
 			cur = g_list_next (cur);
 			continue;
@@ -101,23 +112,25 @@ preprocess_init_stat_token (gpointer k, gpointer v, gpointer d)
 		curst = cl_runtime->st_runtime;
 
 		while (curst) {
-
 			st_runtime = (struct rspamd_statfile_runtime *)curst->data;
-			res = &g_array_index (t->results, struct rspamd_token_result, i);
-			res->cl_runtime = cl_runtime;
-			res->st_runtime = st_runtime;
-
-			if (st_runtime->backend->process_token (t, res,
-					st_runtime->backend->ctx)) {
+			st_runtime->idx = i;
 
-				if (cl_runtime->clcf->max_tokens > 0 &&
-						cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
-					msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
-							"%ud > %ud", cbdata->task, cl_runtime->clcf->name,
-							cl_runtime->processed_tokens,
-							cl_runtime->clcf->max_tokens);
+			for (j = 0; j < tokens->len; j ++) {
+				t = &g_array_index (tokens, rspamd_token_t, j);
+				res = &t->results[i];
+				res->cl_runtime = cl_runtime;
+				res->st_runtime = st_runtime;
+			}
 
-					return TRUE;
+			if (st_runtime->backend->process_tokens != NULL) {
+				st_runtime->backend->process_tokens (tokens, i, st_runtime,
+						st_runtime->backend->ctx);
+			}
+			else {
+				for (j = 0; j < tokens->len; j ++) {
+					t = &g_array_index (tokens, rspamd_token_t, j);
+					st_runtime->backend->process_token (t, &t->results[i],
+							st_runtime->backend->ctx);
 				}
 			}
 
@@ -126,9 +139,6 @@ preprocess_init_stat_token (gpointer k, gpointer v, gpointer d)
 		}
 		cur = g_list_next (cur);
 	}
-
-
-	return FALSE;
 }
 
 static GList*
@@ -144,8 +154,11 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 	gpointer backend_runtime;
 	GList *cur, *st_list = NULL, *curst;
 	GList *cl_runtimes = NULL;
-	guint result_size = 0, start_pos = 0, end_pos = 0;
+	guint result_size = 0, start_pos = 0, end_pos = 0, i;
 	struct preprocess_cb_data cbdata;
+	struct rspamd_token_result *results;
+	rspamd_token_t *t;
+	GArray *tokens;
 
 	cur = g_list_first (task->cfg->classifiers);
 
@@ -198,7 +211,7 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 				continue;
 			}
 
-			backend_runtime = bk->runtime (stcf, learn, bk->ctx);
+			backend_runtime = bk->runtime (task, stcf, learn, bk->ctx);
 
 			st_runtime = rspamd_mempool_alloc0 (task->task_pool,
 					sizeof (*st_runtime));
@@ -206,15 +219,6 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 			st_runtime->backend_runtime = backend_runtime;
 			st_runtime->backend = bk;
 
-			if (stcf->is_spam) {
-				cl_runtime->total_spam += bk->total_learns (backend_runtime,
-						bk->ctx);
-			}
-			else {
-				cl_runtime->total_ham += bk->total_learns (backend_runtime,
-						bk->ctx);
-			}
-
 			cl_runtime->st_runtime = g_list_prepend (cl_runtime->st_runtime,
 					st_runtime);
 			result_size ++;
@@ -251,9 +255,21 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 		cbdata.results_count = result_size;
 		cbdata.classifier_runtimes = cl_runtimes;
 		cbdata.task = task;
+		cbdata.learn = learn;
 		cbdata.tok = cl_runtime->tok;
-		g_tree_foreach (cl_runtime->tok->tokens, preprocess_init_stat_token,
-				&cbdata);
+		tokens = cl_runtime->tok->tokens;
+
+		/* Results of all tokens are allocated as a single block */
+		results = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (struct rspamd_token_result) * result_size *
+				MAX (tokens->len, 1));
+
+		for (i = 0; i < tokens->len; i ++) {
+			t = &g_array_index (tokens, rspamd_token_t, i);
+			t->results = &results[i * result_size];
+		}
+
+		preprocess_init_stat_tokens (tokens, &cbdata);
 	}
 
 	return cl_runtimes;
@@ -271,6 +287,11 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 	gchar *sub;
 	GList *cur;
 
+	if (tok->tokenized) {
+		/* Tokenizer is shared between several classifiers */
+		return;
+	}
+
 	cur = task->text_parts;
 
 	while (cur != NULL) {
@@ -291,7 +312,7 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 		sub = task->subject;
 	}
 	else {
-		sub = (gchar *)g_mime_message_get_subject (task->message);
+		sub = (gchar *)message_get_subject (task);
 	}
 
 	if (sub != NULL) {
@@ -305,8 +326,105 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 			g_array_free (words, TRUE);
 		}
 	}
+
+	rspamd_tokenizer_unique (tok->tokens);
+	tok->tokenized = TRUE;
+}
+
+
+/* Data to finish classification or learning when statfiles are loaded */
+struct rspamd_stat_cbdata {
+	struct rspamd_task *task;
+	GList *classifier_runtimes;
+	gboolean spam;
+};
+
+/*
+ * Statfiles could be loaded asynchronously only by the thread that runs the
+ * event loop of task, so session watcher is not used otherwise
+ */
+static void
+rspamd_stat_watch_start (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_task *task,
+		event_watcher_t cb,
+		struct rspamd_stat_cbdata *cbdata)
+{
+	if (st_ctx->async_statfiles > 0 && task->s != NULL) {
+		rspamd_session_watch_start (task->s, cb, cbdata);
+	}
+}
+
+static guint
+rspamd_stat_watch_stop (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_task *task)
+{
+	if (st_ctx->async_statfiles > 0 && task->s != NULL) {
+		return rspamd_session_watch_stop (task->s);
+	}
+
+	return 0;
+}
+
+static void
+rspamd_stat_count_learns (struct rspamd_classifier_runtime *cl_runtime)
+{
+	struct rspamd_statfile_runtime *st_runtime;
+	GList *curst;
+
+	curst = cl_runtime->st_runtime;
+
+	while (curst) {
+		st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+
+		if (st_runtime->st->is_spam) {
+			cl_runtime->total_spam += st_runtime->backend->total_learns (
+					st_runtime->backend_runtime, st_runtime->backend->ctx);
+		}
+		else {
+			cl_runtime->total_ham += st_runtime->backend->total_learns (
+					st_runtime->backend_runtime, st_runtime->backend->ctx);
+		}
+
+		curst = g_list_next (curst);
+	}
+}
+
+static gboolean
+rspamd_stat_classify_fin (struct rspamd_task *task, GList *cl_runtimes)
+{
+	struct rspamd_classifier_runtime *cl_run;
+	struct classifier_ctx *cl_ctx;
+	GList *cur;
+	gboolean ret = FALSE;
+
+	cur = cl_runtimes;
+
+	while (cur) {
+		cl_run = (struct rspamd_classifier_runtime *)cur->data;
+		rspamd_stat_count_learns (cl_run);
+
+		if (cl_run->cl) {
+			cl_ctx = cl_run->cl->init_func (task->task_pool, cl_run->clcf);
+
+			if (cl_ctx != NULL) {
+				ret |= cl_run->cl->classify_func (cl_ctx, cl_run->tok->tokens,
+						cl_run, task);
+			}
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	return ret;
 }
 
+static void
+rspamd_stat_classify_watcher (gpointer session_data, gpointer ud)
+{
+	struct rspamd_stat_cbdata *cbdata = ud;
+
+	rspamd_stat_classify_fin (cbdata->task, cbdata->classifier_runtimes);
+}
 
 gboolean
 rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
@@ -315,11 +433,9 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 	struct rspamd_classifier_config *clcf;
 	struct rspamd_stat_ctx *st_ctx;
 	struct rspamd_tokenizer_runtime *tklist = NULL, *tok;
-	struct rspamd_classifier_runtime *cl_run;
-	struct classifier_ctx *cl_ctx;
+	struct rspamd_stat_cbdata *cbdata;
 	GList *cl_runtimes;
 	GList *cur;
-	gboolean ret = FALSE;
 
 	st_ctx = rspamd_stat_get_ctx ();
 	g_assert (st_ctx != NULL);
@@ -351,89 +467,199 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, GError **err)
 		cur = g_list_next (cur);
 	}
 
+	cbdata = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbdata));
+	cbdata->task = task;
+
 	/* Initialize classifiers and statfiles runtime */
-	if ((cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
-			FALSE, FALSE, err)) == NULL) {
+	rspamd_stat_watch_start (st_ctx, task, rspamd_stat_classify_watcher, cbdata);
+	cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
+			FALSE, FALSE, err);
+
+	if (rspamd_stat_watch_stop (st_ctx, task) > 0) {
+		/* Classification is finished when statfiles are loaded */
+		cbdata->classifier_runtimes = cl_runtimes;
+
+		return TRUE;
+	}
+
+	if (cl_runtimes == NULL) {
 		return FALSE;
 	}
 
-	cur = cl_runtimes;
+	return rspamd_stat_classify_fin (task, cl_runtimes);
+}
 
-	while (cur) {
-		cl_run = (struct rspamd_classifier_runtime *)cur->data;
+/*
+ * Store learned values of tokens statfile by statfile
+ */
+static void
+rspamd_stat_learn_tokens (struct rspamd_task *task,
+		struct rspamd_classifier_runtime *cl_runtime)
+{
+	struct rspamd_statfile_runtime *st_runtime;
+	GArray *tokens = cl_runtime->tok->tokens;
+	rspamd_token_t *t;
+	GList *curst;
+	guint i;
+
+	if (cl_runtime->clcf->min_tokens > 0 &&
+			tokens->len < cl_runtime->clcf->min_tokens) {
+		/* Skip this classifier */
+		msg_debug ("<%s> contains less tokens than required for %s classifier: "
+				"%ud < %ud", task->message_id, cl_runtime->clcf->name,
+				tokens->len,
+				cl_runtime->clcf->min_tokens);
+		return;
+	}
 
-		if (cl_run->cl) {
-			cl_ctx = cl_run->cl->init_func (task->task_pool, cl_run->clcf);
+	curst = cl_runtime->st_runtime;
 
-			if (cl_ctx != NULL) {
-				ret |= cl_run->cl->classify_func (cl_ctx, cl_run->tok->tokens,
-						cl_run, task);
+	while (curst) {
+		st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+
+		if (st_runtime->backend->learn_tokens != NULL) {
+			cl_runtime->processed_tokens += st_runtime->backend->learn_tokens (
+					tokens, st_runtime->idx, st_runtime,
+					st_runtime->backend->ctx);
+
+			/* Tokens of a statfile are stored at once, so skip the next ones */
+			if (cl_runtime->clcf->max_tokens > 0 &&
+					cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
+				msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
+						"%ud > %ud", task->message_id, cl_runtime->clcf->name,
+						cl_runtime->processed_tokens,
+						cl_runtime->clcf->max_tokens);
+
+				return;
+			}
+		}
+		else {
+			for (i = 0; i < tokens->len; i ++) {
+				t = &g_array_index (tokens, rspamd_token_t, i);
+
+				if (st_runtime->backend->learn_token (t,
+						&t->results[st_runtime->idx],
+						st_runtime->backend->ctx)) {
+					cl_runtime->processed_tokens ++;
+
+					if (cl_runtime->clcf->max_tokens > 0 &&
+							cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
+						msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
+								"%ud > %ud", task->message_id, cl_runtime->clcf->name,
+								cl_runtime->processed_tokens,
+								cl_runtime->clcf->max_tokens);
+
+						return;
+					}
+				}
 			}
 		}
 
-		cur = g_list_next (cur);
+		curst = g_list_next (curst);
 	}
-
-	return ret;
 }
 
 static gboolean
-rspamd_stat_learn_token (gpointer k, gpointer v, gpointer d)
+rspamd_stat_learn_fin (struct rspamd_task *task, GList *cl_runtimes,
+		gboolean spam, GError **err)
 {
-	rspamd_token_t *t = (rspamd_token_t *)v;
-	struct preprocess_cb_data *cbdata = (struct preprocess_cb_data *)d;
-	struct rspamd_statfile_runtime *st_runtime;
-	struct rspamd_classifier_runtime *cl_runtime;
-	struct rspamd_token_result *res;
+	struct rspamd_classifier_runtime *cl_run;
+	struct rspamd_statfile_runtime *st_run;
+	struct classifier_ctx *cl_ctx;
+	GArray *tokens;
+	rspamd_token_t *t;
 	GList *cur, *curst;
-	gint i = 0;
+	gboolean ret = FALSE;
+	gulong nrev;
+	guint i;
 
-	cur = g_list_first (cbdata->classifier_runtimes);
+	cur = cl_runtimes;
 
+	/* Backends could store the difference made by learning */
 	while (cur) {
-		cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
+		cl_run = (struct rspamd_classifier_runtime *)cur->data;
+		tokens = cl_run->tok->tokens;
+		curst = cl_run->st_runtime;
 
-		if (cl_runtime->clcf->min_tokens > 0 &&
-				(guint32)g_tree_nnodes (cbdata->tok->tokens) < cl_runtime->clcf->min_tokens) {
-			/* Skip this classifier */
-			msg_debug ("<%s> contains less tokens than required for %s classifier: "
-					"%ud < %ud", cbdata->task->message_id, cl_runtime->clcf->name,
-					g_tree_nnodes (cbdata->tok->tokens),
-					cl_runtime->clcf->min_tokens);
-			cur = g_list_next (cur);
-			continue;
+		while (curst) {
+			st_run = (struct rspamd_statfile_runtime *)curst->data;
+
+			for (i = 0; i < tokens->len; i ++) {
+				t = &g_array_index (tokens, rspamd_token_t, i);
+				t->results[st_run->idx].orig_value =
+						t->results[st_run->idx].value;
+			}
+
+			curst = g_list_next (curst);
 		}
 
-		res = &g_array_index (t->results, struct rspamd_token_result, i);
+		cur = g_list_next (cur);
+	}
+
+	cur = cl_runtimes;
 
-		curst = res->cl_runtime->st_runtime;
+	while (cur) {
+		cl_run = (struct rspamd_classifier_runtime *)cur->data;
+		rspamd_stat_count_learns (cl_run);
 
-		while (curst) {
-			st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+		if (cl_run->cl) {
+			cl_ctx = cl_run->cl->init_func (task->task_pool, cl_run->clcf);
+
+			if (cl_ctx != NULL) {
+				if (cl_run->cl->learn_spam_func (cl_ctx, cl_run->tok->tokens,
+						cl_run, task, spam, err)) {
+					msg_debug ("learned %s classifier %s", spam ? "spam" : "ham",
+							cl_run->clcf->name);
+					ret = TRUE;
+
+					rspamd_stat_learn_tokens (task, cl_run);
 
-			if (st_runtime->backend->learn_token (t, res,
-					st_runtime->backend->ctx)) {
-				cl_runtime->processed_tokens ++;
+					curst = g_list_first (cl_run->st_runtime);
+
+					while (curst) {
+						st_run = (struct rspamd_statfile_runtime *)curst->data;
 
-				if (cl_runtime->clcf->max_tokens > 0 &&
-						cl_runtime->processed_tokens > cl_runtime->clcf->max_tokens) {
-					msg_debug ("<%s> contains more tokens than allowed for %s classifier: "
-							"%ud > %ud", cbdata->task, cl_runtime->clcf->name,
-							cl_runtime->processed_tokens,
-							cl_runtime->clcf->max_tokens);
+						nrev = st_run->backend->inc_learns (st_run->backend_runtime,
+								st_run->backend->ctx);
 
-					return TRUE;
+						msg_debug ("learned %s, new revision: %ul",
+								st_run->st->symbol, nrev);
+
+						curst = g_list_next (curst);
+					}
+				}
+				else {
+					return FALSE;
 				}
-			}
 
-			i ++;
-			curst = g_list_next (curst);
+			}
 		}
+
 		cur = g_list_next (cur);
 	}
 
+	return ret;
+}
 
-	return FALSE;
+static void
+rspamd_stat_learn_watcher (gpointer session_data, gpointer ud)
+{
+	struct rspamd_stat_cbdata *cbdata = ud;
+	struct rspamd_task *task = cbdata->task;
+	GError *err = NULL;
+
+	if (!rspamd_stat_learn_fin (task, cbdata->classifier_runtimes,
+			cbdata->spam, &err)) {
+		msg_err ("<%s> cannot learn statistics: %s", task->message_id,
+				err ? err->message : "no classifier learned");
+		task->last_error = err ? rspamd_mempool_strdup (task->task_pool,
+				err->message) : "no classifier learned";
+		task->error_code = RSPAMD_STATFILE_ERROR;
+
+		if (err) {
+			g_error_free (err);
+		}
+	}
 }
 
 gboolean
@@ -444,14 +670,9 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 	struct rspamd_classifier_config *clcf;
 	struct rspamd_stat_ctx *st_ctx;
 	struct rspamd_tokenizer_runtime *tklist = NULL, *tok;
-	struct rspamd_classifier_runtime *cl_run;
-	struct rspamd_statfile_runtime *st_run;
-	struct classifier_ctx *cl_ctx;
-	struct preprocess_cb_data cbdata;
+	struct rspamd_stat_cbdata *cbdata;
 	GList *cl_runtimes;
-	GList *cur, *curst;
-	gboolean ret = FALSE;
-	gulong nrev;
+	GList *cur;
 
 	st_ctx = rspamd_stat_get_ctx ();
 	g_assert (st_ctx != NULL);
@@ -483,56 +704,25 @@ rspamd_stat_learn (struct rspamd_task *task, gboolean spam, lua_State *L,
 		cur = g_list_next (cur);
 	}
 
-	/* Initialize classifiers and statfiles runtime */
-	if ((cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
-			TRUE, spam, err)) == NULL) {
-		return FALSE;
-	}
-
-	cur = cl_runtimes;
-
-	while (cur) {
-		cl_run = (struct rspamd_classifier_runtime *)cur->data;
-
-		if (cl_run->cl) {
-			cl_ctx = cl_run->cl->init_func (task->task_pool, cl_run->clcf);
-
-			if (cl_ctx != NULL) {
-				if (cl_run->cl->learn_spam_func (cl_ctx, cl_run->tok->tokens,
-						cl_run, task, spam, err)) {
-					msg_debug ("learned %s classifier %s", spam ? "spam" : "ham",
-							cl_run->clcf->name);
-					ret = TRUE;
-
-					cbdata.classifier_runtimes = cur;
-					cbdata.task = task;
-					cbdata.tok = cl_run->tok;
-					g_tree_foreach (cl_run->tok->tokens, rspamd_stat_learn_token,
-							&cbdata);
-
-					curst = g_list_first (cl_run->st_runtime);
-
-					while (curst) {
-						st_run = (struct rspamd_statfile_runtime *)curst->data;
-
-						nrev = st_run->backend->inc_learns (st_run->backend_runtime,
-								st_run->backend->ctx);
+	cbdata = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbdata));
+	cbdata->task = task;
+	cbdata->spam = spam;
 
-						msg_debug ("learned %s, new revision: %ul",
-								st_run->st->symbol, nrev);
+	/* Initialize classifiers and statfiles runtime */
+	rspamd_stat_watch_start (st_ctx, task, rspamd_stat_learn_watcher, cbdata);
+	cl_runtimes = rspamd_stat_preprocess (st_ctx, task, tklist, L,
+			TRUE, spam, err);
 
-						curst = g_list_next (curst);
-					}
-				}
-				else {
-					return FALSE;
-				}
+	if (rspamd_stat_watch_stop (st_ctx, task) > 0) {
+		/* Learning is finished when statfiles are loaded */
+		cbdata->classifier_runtimes = cl_runtimes;
 
-			}
-		}
+		return TRUE;
+	}
 
-		cur = g_list_next (cur);
+	if (cl_runtimes == NULL) {
+		return FALSE;
 	}
 
-	return ret;
+	return rspamd_stat_learn_fin (task, cl_runtimes, spam, err);
 }
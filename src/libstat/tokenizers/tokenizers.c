@@ -77,11 +77,37 @@ token_node_compare_func (gconstpointer a, gconstpointer b)
 {
 	const rspamd_token_t *aa = a, *bb = b;
 
-	if (aa->datalen != bb->datalen) {
-		return aa->datalen - bb->datalen;
+	if (aa->data < bb->data) {
+		return -1;
+	}
+	else if (aa->data > bb->data) {
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+rspamd_tokenizer_unique (GArray *tokens)
+{
+	rspamd_token_t *tok;
+	guint i, n = 0;
+
+	if (tokens->len < 2) {
+		return;
+	}
+
+	qsort (tokens->data, tokens->len, sizeof (rspamd_token_t),
+			token_node_compare_func);
+	tok = (rspamd_token_t *)tokens->data;
+
+	for (i = 1; i < tokens->len; i ++) {
+		if (tok[i].data != tok[n].data) {
+			tok[++n] = tok[i];
+		}
 	}
 
-	return memcmp (aa->data, bb->data, aa->datalen);
+	g_array_set_size (tokens, n + 1);
 }
 
 /* Get next word from specified f_str_t buf */
@@ -15,13 +15,16 @@ struct rspamd_stat_tokenizer {
 	gint (*tokenize_func)(struct rspamd_stat_tokenizer *rspamd_stat_tokenizer,
 			rspamd_mempool_t *pool,
 			GArray *words,
-			GTree *result,
+			GArray *result,
 			gboolean is_utf);
 };
 
 /* Compare two token nodes */
 int token_node_compare_func (gconstpointer a, gconstpointer b);
 
+/* Sort array of tokens and remove duplicates */
+void rspamd_tokenizer_unique (GArray *tokens);
+
 /* Get next word from specified f_str_t buf */
 gchar * rspamd_tokenizer_get_word (rspamd_fstring_t *buf,
 		rspamd_fstring_t *token, GList **exceptions);
@@ -34,7 +37,7 @@ GArray * rspamd_tokenize_text (gchar *text, gsize len, gboolean is_utf,
 int osb_tokenize_text (struct rspamd_stat_tokenizer *tokenizer,
 	rspamd_mempool_t *pool,
 	GArray *input,
-	GTree *tokens,
+	GArray *tokens,
 	gboolean is_utf);
 
 #endif
@@ -113,6 +113,22 @@ rspamd_ip_is_valid (rspamd_inet_addr_t *addr)
 	return ret;
 }
 
+gboolean
+rspamd_inet_address_is_local (rspamd_inet_addr_t *addr)
+{
+	if (addr->af == AF_UNIX) {
+		return TRUE;
+	}
+	else if (addr->af == AF_INET) {
+		return (ntohl (addr->addr.s4.sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+	}
+	else if (addr->af == AF_INET6) {
+		return IN6_IS_ADDR_LOOPBACK (&addr->addr.s6.sin6_addr);
+	}
+
+	return FALSE;
+}
+
 gint
 rspamd_accept_from_socket (gint sock, rspamd_inet_addr_t *addr)
 {
@@ -260,7 +276,7 @@ rspamd_inet_address_connect (rspamd_inet_addr_t *addr, gint type,
 
 int
 rspamd_inet_address_listen (rspamd_inet_addr_t *addr, gint type,
-		gboolean async)
+		gboolean async, gboolean reuseport)
 {
 	gint fd, r;
 	gint on = 1;
@@ -276,6 +292,12 @@ rspamd_inet_address_listen (rspamd_inet_addr_t *addr, gint type,
 	}
 
 	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (gint));
+#ifdef SO_REUSEPORT
+	if (reuseport) {
+		setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+			sizeof (gint));
+	}
+#endif
 	r = bind (fd, &addr->addr.sa, addr->slen);
 	if (r == -1) {
 		if (!async || errno != EINPROGRESS) {
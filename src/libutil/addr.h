@@ -85,10 +85,11 @@ int rspamd_inet_address_connect (rspamd_inet_addr_t *addr, gint type,
  * @param addr
  * @param type
  * @param async
+ * @param reuseport set SO_REUSEPORT, so other sockets could be bound to addr
  * @return
  */
 int rspamd_inet_address_listen (rspamd_inet_addr_t *addr, gint type,
-	gboolean async);
+	gboolean async, gboolean reuseport);
 /**
  * Check whether specified ip is valid (not INADDR_ANY or INADDR_NONE) for ipv4 or ipv6
  * @param ptr pointer to struct in_addr or struct in6_addr
@@ -97,6 +98,13 @@ int rspamd_inet_address_listen (rspamd_inet_addr_t *addr, gint type,
  */
 gboolean rspamd_ip_is_valid (rspamd_inet_addr_t *addr);
 
+/**
+ * Check whether address belongs to the local host (unix socket or loopback)
+ * @param addr
+ * @return TRUE if the address is local
+ */
+gboolean rspamd_inet_address_is_local (rspamd_inet_addr_t *addr);
+
 /**
  * Accept from listening socket filling addr structure
  * @param sock listening socket
@@ -28,6 +28,7 @@
 #include "printf.h"
 #include "logger.h"
 #include "ref.h"
+#include "hash.h"
 #include "tweetnacl.h"
 #include "blake2.h"
 #include "ottery.h"
@@ -38,6 +39,7 @@ struct rspamd_http_keypair {
 	guchar pk[crypto_box_PUBLICKEYBYTES];
 	guchar sk[crypto_box_SECRETKEYBYTES];
 	guchar id[BLAKE2B_OUTBYTES];
+	rspamd_lru_hash_t *nm_cache;
 	ref_entry_t ref;
 };
 
@@ -48,6 +50,7 @@ struct rspamd_http_connection_private {
 	} *buf;
 	gboolean new_header;
 	gboolean encrypted;
+	gboolean body_direct;
 	struct rspamd_http_keypair *local_key;
 	struct rspamd_http_header *header;
 	struct http_parser parser;
@@ -90,6 +93,8 @@ static const gchar *key_header = "Key";
 static const gchar *date_header = "Date";
 
 #define RSPAMD_HTTP_KEY_ID_LEN 5
+/* Number of peers for which shared keys are cached by each keypair */
+#define RSPAMD_HTTP_NM_CACHE_SIZE 512
 
 #define HTTP_ERROR http_error_quark ()
 GQuark
@@ -422,7 +427,7 @@ rspamd_http_parse_key (GString *data, struct rspamd_http_connection_private *pri
 						RSPAMD_HTTP_KEY_ID_LEN) == 0) {
 					priv->msg->peer_key = g_string_sized_new (sizeof (priv->local_key->pk));
 					g_string_append_len (priv->msg->peer_key,
-							decoded + sizeof (priv->local_key->id),
+							decoded + RSPAMD_HTTP_KEY_ID_LEN,
 							sizeof (priv->local_key->pk));
 				}
 			}
@@ -432,6 +437,39 @@ rspamd_http_parse_key (GString *data, struct rspamd_http_connection_private *pri
 	}
 }
 
+/*
+ * Returns the shared key for the local keypair and the peer's public key,
+ * curve25519 multiplication is done once per peer while it stays in cache
+ */
+static const guchar *
+rspamd_http_keypair_nm (struct rspamd_http_keypair *kp, const guchar *pk)
+{
+	gchar *b32_pk;
+	guchar *nm;
+	time_t now;
+
+	if (kp->nm_cache == NULL) {
+		kp->nm_cache = rspamd_lru_hash_new (RSPAMD_HTTP_NM_CACHE_SIZE, 0,
+				g_free, g_free);
+	}
+
+	now = time (NULL);
+	b32_pk = rspamd_encode_base32 (pk, crypto_box_PUBLICKEYBYTES);
+	nm = rspamd_lru_hash_lookup (kp->nm_cache, b32_pk, now);
+
+	if (nm == NULL) {
+		nm = g_malloc (crypto_box_BEFORENMBYTES);
+		crypto_box_beforenm (nm, pk, kp->sk);
+		/* Key is owned by cache now */
+		rspamd_lru_hash_insert (kp->nm_cache, b32_pk, nm, now, 0);
+	}
+	else {
+		g_free (b32_pk);
+	}
+
+	return nm;
+}
+
 static inline void
 rspamd_http_check_special_header (struct rspamd_http_connection_private *priv)
 {
@@ -546,9 +584,12 @@ rspamd_http_on_headers_complete (http_parser * parser)
 
 	if (parser->content_length != 0 && parser->content_length != ULLONG_MAX) {
 		priv->msg->body = g_string_sized_new (parser->content_length + 1);
+		/* The rest of body is read directly to the message */
+		priv->body_direct = TRUE;
 	}
 	else {
 		priv->msg->body = g_string_sized_new (BUFSIZ);
+		priv->body_direct = FALSE;
 	}
 
 	priv->msg->method = parser->method;
@@ -566,7 +607,14 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 
 	priv = conn->priv;
 
-	g_string_append_len (priv->msg->body, at, length);
+	if (at == priv->msg->body->str + priv->msg->body->len) {
+		/* Data has been read directly to the body */
+		priv->msg->body->len += length;
+		priv->msg->body->str[priv->msg->body->len] = '\0';
+	}
+	else {
+		g_string_append_len (priv->msg->body, at, length);
+	}
 
 	if ((conn->opts & RSPAMD_HTTP_BODY_PARTIAL) && !priv->encrypted) {
 		/* Incremental update is basically impossible for encrypted requests */
@@ -584,10 +632,12 @@ rspamd_http_on_message_complete (http_parser * parser)
 	struct rspamd_http_connection_private *priv;
 	int ret = 0;
 	guchar *nonce, *m;
+	const guchar *nm;
 	gsize dec_len;
 	GError *err;
 
 	priv = conn->priv;
+	priv->body_direct = FALSE;
 
 	if (conn->body_handler != NULL) {
 
@@ -602,13 +652,14 @@ rspamd_http_on_message_complete (http_parser * parser)
 				return -1;
 			}
 			/* We have keys, so we can decrypt message */
-			/* TODO: add pubkey<->privkey pairs to LRU cache */
 			nonce = priv->msg->body->str;
 			m = priv->msg->body->str + crypto_box_NONCEBYTES;
 			dec_len = priv->msg->body->len - crypto_box_NONCEBYTES;
+			nm = rspamd_http_keypair_nm (priv->local_key,
+					priv->msg->peer_key->str);
 
-			if (crypto_box_open (m + crypto_box_ZEROBYTES, m, dec_len, nonce,
-					priv->msg->peer_key->str, priv->local_key->sk) != 0) {
+			if (crypto_box_open_afternm (m + crypto_box_ZEROBYTES, m, dec_len,
+					nonce, nm) != 0) {
 				err = g_error_new (HTTP_ERROR, 500, "Cannot verify encrypted message");
 				rspamd_http_connection_ref (conn);
 				conn->error_handler (conn, err);
@@ -754,7 +805,9 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	struct rspamd_http_connection *conn = (struct rspamd_http_connection *)ud;
 	struct rspamd_http_connection_private *priv;
 	struct _rspamd_http_privbuf *pbuf;
-	GString *buf;
+	GString *buf, *body;
+	gchar *dst;
+	gsize want;
 	gssize r;
 	GError *err;
 
@@ -765,7 +818,22 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	buf = priv->buf->data;
 
 	if (what == EV_READ) {
-		r = read (fd, buf->str, buf->allocated_len);
+		dst = buf->str;
+		want = buf->allocated_len;
+
+		if (priv->body_direct) {
+			/* Avoid copying of body from the read buffer */
+			body = priv->msg->body;
+
+			if (body->allocated_len > body->len + 1 &&
+				priv->parser.content_length > 0) {
+				dst = body->str + body->len;
+				want = MIN (priv->parser.content_length,
+						body->allocated_len - body->len - 1);
+			}
+		}
+
+		r = read (fd, dst, want);
 		if (r == -1) {
 			err = g_error_new (HTTP_ERROR,
 					errno,
@@ -801,9 +869,11 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 			}
 		}
 		else {
-			buf->len = r;
+			if (dst == buf->str) {
+				buf->len = r;
+			}
 
-			if (http_parser_execute (&priv->parser, &priv->parser_cb, buf->str,
+			if (http_parser_execute (&priv->parser, &priv->parser_cb, dst,
 				r) != (size_t)r) {
 				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
 						"HTTP parser error: %s",
@@ -903,6 +973,7 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 		priv->msg = NULL;
 	}
 	conn->finished = FALSE;
+	priv->body_direct = FALSE;
 	/* Clear priv */
 	event_del (&priv->ev);
 	if (priv->buf != NULL) {
@@ -1094,8 +1165,9 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				bodylen);
 		}
 		if (encrypted) {
-			blake2b (id, priv->local_key->pk, NULL, sizeof (id),
-					sizeof (priv->local_key->pk), 0);
+			/* Peer selects its keypair by id, so we send id of the peer's key */
+			blake2b (id, msg->peer_key->str, NULL, sizeof (id),
+					msg->peer_key->len, 0);
 			b32_key = rspamd_encode_base32 (priv->local_key->pk,
 					sizeof (priv->local_key->pk));
 			b32_id = rspamd_encode_base32 (id, RSPAMD_HTTP_KEY_ID_LEN);
@@ -1153,9 +1225,10 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 	}
 	if (msg->body != NULL) {
 		if (encrypted) {
-			crypto_box_detached (pbody, pbody,
+			crypto_box_afternm_detached (pbody, pbody,
 					bodylen - sizeof (nonce) - sizeof (mac), np,
-					msg->peer_key->str, priv->local_key->sk, mp);
+					rspamd_http_keypair_nm (priv->local_key, msg->peer_key->str),
+					mp);
 			priv->out[i].iov_base = np;
 			priv->out[i++].iov_len = sizeof (nonce);
 			priv->out[i].iov_base = mp;
@@ -1194,6 +1267,7 @@ rspamd_http_new_message (enum http_parser_type type)
 	new->body = NULL;
 	new->status = NULL;
 	new->host = NULL;
+	new->peer_key = NULL;
 	new->port = 80;
 	new->type = type;
 	new->method = HTTP_GET;
@@ -1655,6 +1729,10 @@ rspamd_http_router_free (struct rspamd_http_connection_router *router)
 static void
 rspamd_http_keypair_dtor (struct rspamd_http_keypair *kp)
 {
+	if (kp->nm_cache != NULL) {
+		rspamd_lru_hash_destroy (kp->nm_cache);
+	}
+
 	g_slice_free1 (sizeof (*kp), kp);
 }
 
@@ -1669,12 +1747,13 @@ rspamd_http_connection_make_key (gchar *key, gsize keylen)
 
 	if (decoded != NULL) {
 		if (decoded_len == crypto_box_PUBLICKEYBYTES + crypto_box_SECRETKEYBYTES) {
-			kp = g_slice_alloc (sizeof (*kp));
+			kp = g_slice_alloc0 (sizeof (*kp));
 			REF_INIT_RETAIN (kp, rspamd_http_keypair_dtor);
 			memcpy (kp->sk, decoded, crypto_box_SECRETKEYBYTES);
 			memcpy (kp->pk, decoded + crypto_box_SECRETKEYBYTES,
 					crypto_box_PUBLICKEYBYTES);
 			blake2b (kp->id, kp->pk, NULL, sizeof (kp->id), sizeof (kp->pk), 0);
+			g_free (decoded);
 
 			return (gpointer)kp;
 		}
@@ -1689,7 +1768,7 @@ rspamd_http_connection_gen_key (void)
 {
 	struct rspamd_http_keypair *kp;
 
-	kp = g_slice_alloc (sizeof (*kp));
+	kp = g_slice_alloc0 (sizeof (*kp));
 	REF_INIT_RETAIN (kp, rspamd_http_keypair_dtor);
 
 	crypto_box_keypair (kp->pk, kp->sk);
@@ -1772,8 +1851,6 @@ rspamd_http_connection_key_destroy (gpointer key)
 GString *
 rspamd_http_connection_make_peer_key (const gchar *key)
 {
-	guchar hashbuf[RSPAMD_HTTP_KEY_ID_LEN];
-	gchar *b32_id;
 	guchar *pk_decoded;
 	GString *res = NULL;
 	gsize dec_len;
@@ -1782,12 +1859,8 @@ rspamd_http_connection_make_peer_key (const gchar *key)
 
 	if (pk_decoded != NULL) {
 		if (dec_len == crypto_box_PUBLICKEYBYTES) {
-			res = g_string_new (NULL);
-			blake2b (hashbuf, pk_decoded, NULL, sizeof (hashbuf), dec_len, 0);
-			b32_id = rspamd_encode_base32 (hashbuf, sizeof (hashbuf));
-
-			g_string_printf (res, "%s%s", b32_id, key);
-			g_free (b32_id);
+			res = g_string_sized_new (dec_len);
+			g_string_append_len (res, pk_decoded, dec_len);
 		}
 
 		g_free (pk_decoded);
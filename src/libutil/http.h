@@ -195,6 +195,11 @@ GString *rspamd_http_connection_print_key (gpointer key, guint how);
  */
 void rspamd_http_connection_key_destroy (gpointer key);
 
+/**
+ * Decode peer's public key to be used as `peer_key` of a message
+ * @param key base32 encoded public key
+ * @return raw public key or NULL if key is invalid
+ */
 GString *rspamd_http_connection_make_peer_key (const gchar *key);
 
 /**
@@ -33,6 +33,49 @@
 /* How much message should be repeated before it is count to be repeated one */
 #define REPEATS_MIN 3
 #define REPEATS_MAX 300
+/* Number of records in logger ring (must be power of 2) */
+#define LOG_RING_SLOTS 256
+/* Records that are longer than this are copied to the heap */
+#define LOG_SLOT_SIZE 384
+/* Maximum number of records written by a single writev call */
+#define LOG_MAX_IOV 64
+/* Buffered ring is flushed at least once per this number of seconds */
+#define LOG_FLUSH_INTERVAL 1
+
+/**
+ * Formatted log record
+ */
+struct rspamd_log_slot {
+	gint ready;
+	guint len;
+	gchar *data;
+	gchar buf[LOG_SLOT_SIZE];
+};
+
+/**
+ * Ring of records that are formatted by any thread of a process and are
+ * written by a single writer thread at a time
+ */
+struct rspamd_log_ring {
+	struct rspamd_log_slot *slots;
+	gint head;                      /**< next slot to reserve by producers      */
+	gint tail;                      /**< next slot to write by the writer       */
+	gint pending;                   /**< bytes pending in the ring              */
+	gint dropped;                   /**< records dropped as the ring was full   */
+	gint writer;                    /**< set while some thread writes the ring  */
+	gint last_flush;                /**< time of the last flush                 */
+};
+
+/**
+ * Per thread logger state
+ */
+struct rspamd_logger_thread {
+	gchar logbuf[BUFSIZ];
+	guint32 last_line_cksum;
+	guint32 repeats;
+	gchar *saved_message;
+	gchar *saved_function;
+};
 
 /**
  * Static structure that store logging parameters
@@ -41,11 +84,8 @@
 struct rspamd_logger_s {
 	rspamd_log_func_t log_func;
 	struct rspamd_config *cfg;
-	struct {
-		guint32 size;
-		guint32 used;
-		u_char *buf;
-	}                        io_buf;
+	struct rspamd_log_ring ring;
+	guint32 flush_size;
 	gint fd;
 	gboolean is_buffered;
 	gboolean enabled;
@@ -57,18 +97,52 @@ struct rspamd_logger_s {
 	pid_t pid;
 	GQuark process_type;
 	radix_compressed_t *debug_ip;
-	guint32 last_line_cksum;
-	guint32 repeats;
-	gchar *saved_message;
-	gchar *saved_function;
-	rspamd_mempool_t *pool;
-	rspamd_mempool_mutex_t *mtx;
 };
 
 static const gchar lf_chr = '\n';
 
 static rspamd_logger_t *default_logger = NULL;
 
+static void
+rspamd_log_thread_free (gpointer p)
+{
+	struct rspamd_logger_thread *st = p;
+
+	g_free (st->saved_message);
+	g_free (st->saved_function);
+	g_free (st);
+}
+
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+static GPrivate log_thread_key = G_PRIVATE_INIT (rspamd_log_thread_free);
+#else
+static GStaticPrivate log_thread_key = G_STATIC_PRIVATE_INIT;
+#endif
+
+static struct rspamd_logger_thread *
+rspamd_log_thread_state (void)
+{
+	struct rspamd_logger_thread *st;
+
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+	st = g_private_get (&log_thread_key);
+
+	if (st == NULL) {
+		st = g_malloc0 (sizeof (*st));
+		g_private_set (&log_thread_key, st);
+	}
+#else
+	st = g_static_private_get (&log_thread_key);
+
+	if (st == NULL) {
+		st = g_malloc0 (sizeof (*st));
+		g_static_private_set (&log_thread_key, st, rspamd_log_thread_free);
+	}
+#endif
+
+	return st;
+}
+
 
 static void
 syslog_log_function (const gchar * log_domain, const gchar *function,
@@ -140,6 +214,184 @@ direct_write_log_line (rspamd_logger_t *rspamd_log,
 	}
 }
 
+/*
+ * Write all ready records from the ring, must be called by the writer only
+ */
+static void
+rspamd_log_ring_write (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_log_ring *ring = &rspamd_log->ring;
+	struct rspamd_log_slot *slot;
+	struct iovec iov[LOG_MAX_IOV];
+	gchar tmpbuf[64];
+	guint tail, i, n;
+	gint dropped, r;
+
+	dropped = g_atomic_int_get (&ring->dropped);
+
+	if (dropped > 0) {
+		g_atomic_int_add (&ring->dropped, -dropped);
+		r = rspamd_snprintf (tmpbuf, sizeof (tmpbuf),
+				"%d log messages have been dropped\n", dropped);
+		direct_write_log_line (rspamd_log, tmpbuf, r, FALSE);
+	}
+
+	tail = ring->tail;
+
+	for (;;) {
+		for (n = 0; n < LOG_MAX_IOV; n ++) {
+			slot = &ring->slots[(tail + n) & (LOG_RING_SLOTS - 1)];
+
+			if (!g_atomic_int_get (&slot->ready)) {
+				break;
+			}
+
+			iov[n].iov_base = slot->data;
+			iov[n].iov_len = slot->len;
+		}
+
+		if (n == 0) {
+			break;
+		}
+
+		direct_write_log_line (rspamd_log, iov, n, TRUE);
+
+		for (i = 0; i < n; i ++) {
+			slot = &ring->slots[(tail + i) & (LOG_RING_SLOTS - 1)];
+
+			if (slot->data != slot->buf) {
+				g_free (slot->data);
+			}
+
+			g_atomic_int_add (&ring->pending, -(gint)slot->len);
+			g_atomic_int_set (&slot->ready, 0);
+		}
+
+		tail += n;
+		g_atomic_int_set (&ring->tail, tail);
+	}
+
+	g_atomic_int_set (&ring->last_flush, time (NULL));
+}
+
+static inline gboolean
+rspamd_log_writer_try_acquire (rspamd_logger_t *rspamd_log)
+{
+	return g_atomic_int_compare_and_exchange (&rspamd_log->ring.writer, 0, 1);
+}
+
+static void
+rspamd_log_writer_acquire (rspamd_logger_t *rspamd_log)
+{
+	while (!rspamd_log_writer_try_acquire (rspamd_log)) {
+		g_thread_yield ();
+	}
+}
+
+static inline void
+rspamd_log_writer_release (rspamd_logger_t *rspamd_log)
+{
+	g_atomic_int_set (&rspamd_log->ring.writer, 0);
+}
+
+/*
+ * Flush ring if no other thread is writing it. Records that are pushed while
+ * the writer is busy are either written by that writer or by this thread
+ */
+static void
+rspamd_log_ring_flush (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_log_ring *ring = &rspamd_log->ring;
+	struct rspamd_log_slot *slot;
+
+	do {
+		if (!rspamd_log_writer_try_acquire (rspamd_log)) {
+			return;
+		}
+
+		rspamd_log_ring_write (rspamd_log);
+		rspamd_log_writer_release (rspamd_log);
+		slot = &ring->slots[g_atomic_int_get (&ring->tail) &
+				(LOG_RING_SLOTS - 1)];
+	} while (g_atomic_int_get (&slot->ready));
+}
+
+/*
+ * Copy record to the ring, this function takes no locks and drops the record
+ * if the ring is full
+ */
+static void
+rspamd_log_ring_push (rspamd_logger_t *rspamd_log,
+	const struct iovec *iov,
+	gint iovcnt)
+{
+	struct rspamd_log_ring *ring = &rspamd_log->ring;
+	struct rspamd_log_slot *slot;
+	guint head, len = 0;
+	gchar *p;
+	gint i;
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	do {
+		head = g_atomic_int_get (&ring->head);
+
+		if (head - (guint)g_atomic_int_get (&ring->tail) >= LOG_RING_SLOTS) {
+			g_atomic_int_inc (&ring->dropped);
+			return;
+		}
+	} while (!g_atomic_int_compare_and_exchange (&ring->head, head, head + 1));
+
+	slot = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+
+	if (len <= sizeof (slot->buf)) {
+		slot->data = slot->buf;
+	}
+	else {
+		slot->data = g_malloc (len);
+	}
+
+	p = slot->data;
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy (p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	slot->len = len;
+	g_atomic_int_add (&ring->pending, len);
+	g_atomic_int_set (&slot->ready, 1);
+}
+
+/*
+ * Drop records that are not written, used after fork as the parent writes them
+ */
+static void
+rspamd_log_ring_reset (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_log_ring *ring = &rspamd_log->ring;
+	struct rspamd_log_slot *slot;
+	guint i;
+
+	for (i = 0; i < LOG_RING_SLOTS; i ++) {
+		slot = &ring->slots[i];
+
+		if (slot->ready && slot->data != slot->buf) {
+			g_free (slot->data);
+		}
+
+		slot->ready = 0;
+	}
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->pending = 0;
+	ring->dropped = 0;
+	ring->writer = 0;
+}
+
 static void
 rspamd_escape_log_string (gchar *str)
 {
@@ -190,11 +442,11 @@ rspamd_log_open_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
 	return -1;
 }
 
-void
-rspamd_log_close_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
+static void
+rspamd_log_close_internal (rspamd_logger_t *rspamd_log)
 {
+	struct rspamd_logger_thread *st = rspamd_log_thread_state ();
 	gchar tmpbuf[256];
-	rspamd_log_flush (rspamd_log);
 
 	switch (rspamd_log->type) {
 	case RSPAMD_LOG_CONSOLE:
@@ -205,23 +457,23 @@ rspamd_log_close_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
 		break;
 	case RSPAMD_LOG_FILE:
 		if (rspamd_log->enabled) {
-			if (rspamd_log->repeats > REPEATS_MIN) {
+			if (st->repeats > REPEATS_MIN) {
 				rspamd_snprintf (tmpbuf,
 					sizeof (tmpbuf),
 					"Last message repeated %ud times",
-					rspamd_log->repeats);
-				rspamd_log->repeats = 0;
-				if (rspamd_log->saved_message) {
+					st->repeats);
+				st->repeats = 0;
+				if (st->saved_message) {
 					file_log_function (NULL,
-						rspamd_log->saved_function,
+						st->saved_function,
 						rspamd_log->cfg->log_level,
-						rspamd_log->saved_message,
+						st->saved_message,
 						TRUE,
 						rspamd_log);
-					g_free (rspamd_log->saved_message);
-					g_free (rspamd_log->saved_function);
-					rspamd_log->saved_message = NULL;
-					rspamd_log->saved_function = NULL;
+					g_free (st->saved_message);
+					g_free (st->saved_function);
+					st->saved_message = NULL;
+					st->saved_function = NULL;
 				}
 				/* It is safe to use temporary buffer here as it is not static */
 				file_log_function (NULL,
@@ -230,9 +482,10 @@ rspamd_log_close_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
 					tmpbuf,
 					TRUE,
 					rspamd_log);
-				return;
 			}
 
+			rspamd_log_ring_write (rspamd_log);
+
 			if (fsync (rspamd_log->fd) == -1) {
 				msg_err ("error syncing log file: %s", strerror (errno));
 			}
@@ -244,11 +497,28 @@ rspamd_log_close_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
 	rspamd_log->enabled = FALSE;
 }
 
+void
+rspamd_log_close_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
+{
+	/* Other threads must not write to the descriptor being closed */
+	rspamd_log_writer_acquire (rspamd_log);
+	rspamd_log_ring_write (rspamd_log);
+	rspamd_log_close_internal (rspamd_log);
+	rspamd_log_writer_release (rspamd_log);
+}
+
 gint
 rspamd_log_reopen_priv (rspamd_logger_t *rspamd_log, uid_t uid, gid_t gid)
 {
-	rspamd_log_close_priv (rspamd_log, uid, gid);
-	if (rspamd_log_open_priv (rspamd_log, uid, gid) == 0) {
+	gint ret;
+
+	rspamd_log_writer_acquire (rspamd_log);
+	rspamd_log_ring_write (rspamd_log);
+	rspamd_log_close_internal (rspamd_log);
+	ret = rspamd_log_open_priv (rspamd_log, uid, gid);
+	rspamd_log_writer_release (rspamd_log);
+
+	if (ret == 0) {
 		msg_info ("log file reopened");
 		return 0;
 	}
@@ -298,9 +568,10 @@ rspamd_set_logger (struct rspamd_config *cfg,
 	rspamd->logger->pid = getpid ();
 	rspamd->logger->process_type = ptype;
 
-	/* Small pool for interlocking */
-	rspamd->logger->pool = rspamd_mempool_new (512);
-	rspamd->logger->mtx = rspamd_mempool_get_mutex (rspamd->logger->pool);
+	if (rspamd->logger->ring.slots == NULL) {
+		rspamd->logger->ring.slots = g_malloc0 (
+				sizeof (struct rspamd_log_slot) * LOG_RING_SLOTS);
+	}
 
 	switch (cfg->log_type) {
 	case RSPAMD_LOG_CONSOLE:
@@ -316,16 +587,18 @@ rspamd_set_logger (struct rspamd_config *cfg,
 	}
 
 	rspamd->logger->cfg = cfg;
-	/* Set up buffer */
+	/* Set up buffering */
 	if (rspamd->cfg->log_buffered) {
 		if (rspamd->cfg->log_buf_size != 0) {
-			rspamd->logger->io_buf.size = rspamd->cfg->log_buf_size;
+			rspamd->logger->flush_size = rspamd->cfg->log_buf_size;
 		}
 		else {
-			rspamd->logger->io_buf.size = BUFSIZ;
+			rspamd->logger->flush_size = BUFSIZ;
 		}
 		rspamd->logger->is_buffered = TRUE;
-		rspamd->logger->io_buf.buf = g_malloc (rspamd->logger->io_buf.size);
+	}
+	else {
+		rspamd->logger->is_buffered = FALSE;
 	}
 	/* Set up conditional logging */
 	if (rspamd->cfg->debug_ip_map != NULL) {
@@ -358,6 +631,7 @@ rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *rspamd_log)
 {
 	rspamd_log->pid = getpid ();
 	rspamd_log->process_type = ptype;
+	rspamd_log_ring_reset (rspamd_log);
 }
 
 /**
@@ -366,14 +640,11 @@ rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *rspamd_log)
 void
 rspamd_log_flush (rspamd_logger_t *rspamd_log)
 {
-	if (rspamd_log->is_buffered &&
-		(rspamd_log->type == RSPAMD_LOG_CONSOLE || rspamd_log->type ==
-		RSPAMD_LOG_FILE)) {
-		direct_write_log_line (rspamd_log,
-			rspamd_log->io_buf.buf,
-			rspamd_log->io_buf.used,
-			FALSE);
-		rspamd_log->io_buf.used = 0;
+	if (rspamd_log->type == RSPAMD_LOG_CONSOLE ||
+		rspamd_log->type == RSPAMD_LOG_FILE) {
+		rspamd_log_writer_acquire (rspamd_log);
+		rspamd_log_ring_write (rspamd_log);
+		rspamd_log_writer_release (rspamd_log);
 	}
 }
 
@@ -385,7 +656,7 @@ rspamd_common_logv (rspamd_logger_t *rspamd_log,
 	const gchar *fmt,
 	va_list args)
 {
-	static gchar logbuf[BUFSIZ];
+	struct rspamd_logger_thread *st;
 	u_char *end;
 
 	if (rspamd_log == NULL) {
@@ -395,24 +666,24 @@ rspamd_common_logv (rspamd_logger_t *rspamd_log,
 	if (rspamd_log == NULL) {
 		/* Just fprintf message to stderr */
 		if (log_level >= G_LOG_LEVEL_INFO) {
-			end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, args);
+			st = rspamd_log_thread_state ();
+			end = rspamd_vsnprintf (st->logbuf, sizeof (st->logbuf), fmt, args);
 			*end = '\0';
-			rspamd_escape_log_string (logbuf);
-			fprintf (stderr, "%s\n", logbuf);
+			rspamd_escape_log_string (st->logbuf);
+			fprintf (stderr, "%s\n", st->logbuf);
 		}
 	}
 	else if (log_level <= rspamd_log->cfg->log_level) {
-		rspamd_mempool_lock_mutex (rspamd_log->mtx);
-		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, args);
+		st = rspamd_log_thread_state ();
+		end = rspamd_vsnprintf (st->logbuf, sizeof (st->logbuf), fmt, args);
 		*end = '\0';
-		rspamd_escape_log_string (logbuf);
+		rspamd_escape_log_string (st->logbuf);
 		rspamd_log->log_func (NULL,
 			function,
 			log_level,
-			logbuf,
+			st->logbuf,
 			FALSE,
 			rspamd_log);
-		rspamd_mempool_unlock_mutex (rspamd_log->mtx);
 	}
 }
 
@@ -453,58 +724,25 @@ rspamd_default_log_function (GLogLevelFlags log_level,
 }
 
 
-/**
- * Fill buffer with message (limits must be checked BEFORE this call)
- */
-static void
-fill_buffer (rspamd_logger_t *rspamd_log, const struct iovec *iov, gint iovcnt)
-{
-	gint i;
-
-	for (i = 0; i < iovcnt; i++) {
-		memcpy (rspamd_log->io_buf.buf + rspamd_log->io_buf.used,
-			iov[i].iov_base,
-			iov[i].iov_len);
-		rspamd_log->io_buf.used += iov[i].iov_len;
-	}
-
-}
-
 /*
- * Write message to buffer or to file (using direct_write_log_line function)
+ * Push message to the ring and flush it if needed
  */
 static void
 file_log_helper (rspamd_logger_t *rspamd_log,
 	const struct iovec *iov,
 	gint iovcnt)
 {
-	size_t len = 0;
-	gint i;
+	struct rspamd_log_ring *ring = &rspamd_log->ring;
 
-	if (!rspamd_log->is_buffered) {
-		/* Write string directly */
-		direct_write_log_line (rspamd_log, (void *)iov, iovcnt, TRUE);
-	}
-	else {
-		/* Calculate total length */
-		for (i = 0; i < iovcnt; i++) {
-			len += iov[i].iov_len;
-		}
-		/* Fill buffer */
-		if (rspamd_log->io_buf.size < len) {
-			/* Buffer is too small to hold this string, so write it dirrectly */
-			rspamd_log_flush (rspamd_log);
-			direct_write_log_line (rspamd_log, (void *)iov, iovcnt, TRUE);
-		}
-		else if (rspamd_log->io_buf.used + len >= rspamd_log->io_buf.size) {
-			/* Buffer is full, try to write it dirrectly */
-			rspamd_log_flush (rspamd_log);
-			fill_buffer (rspamd_log, iov, iovcnt);
-		}
-		else {
-			/* Copy incoming string to buffer */
-			fill_buffer (rspamd_log, iov, iovcnt);
-		}
+	rspamd_log_ring_push (rspamd_log, iov, iovcnt);
+
+	if (!rspamd_log->is_buffered ||
+		(guint)g_atomic_int_get (&ring->pending) >= rspamd_log->flush_size ||
+		(guint)g_atomic_int_get (&ring->head) -
+		(guint)g_atomic_int_get (&ring->tail) >= LOG_RING_SLOTS / 2 ||
+		time (NULL) - g_atomic_int_get (&ring->last_flush) >=
+		LOG_FLUSH_INTERVAL) {
+		rspamd_log_ring_flush (rspamd_log);
 	}
 }
 
@@ -571,7 +809,7 @@ file_log_function (const gchar * log_domain,
 {
 	gchar tmpbuf[256], timebuf[32];
 	time_t now;
-	struct tm *tms;
+	struct tm tms;
 	struct iovec iov[4];
 	gint r = 0;
 	guint32 cksum;
@@ -579,6 +817,7 @@ file_log_function (const gchar * log_domain,
 	const gchar *cptype = NULL;
 	gboolean got_time = FALSE;
 	rspamd_logger_t *rspamd_log = arg;
+	struct rspamd_logger_thread *st;
 
 	if (!rspamd_log->enabled) {
 		return;
@@ -599,31 +838,32 @@ file_log_function (const gchar * log_domain,
 			}
 		}
 		/* Check repeats */
+		st = rspamd_log_thread_state ();
 		mlen = strlen (message);
 		cksum = rspamd_log_calculate_cksum (message, mlen);
-		if (cksum == rspamd_log->last_line_cksum) {
-			rspamd_log->repeats++;
-			if (rspamd_log->repeats > REPEATS_MIN && rspamd_log->repeats <
+		if (cksum == st->last_line_cksum) {
+			st->repeats++;
+			if (st->repeats > REPEATS_MIN && st->repeats <
 				REPEATS_MAX) {
 				/* Do not log anything */
-				if (rspamd_log->saved_message == 0) {
-					rspamd_log->saved_message = g_strdup (message);
-					rspamd_log->saved_function = g_strdup (function);
+				if (st->saved_message == 0) {
+					st->saved_message = g_strdup (message);
+					st->saved_function = g_strdup (function);
 				}
 				return;
 			}
-			else if (rspamd_log->repeats > REPEATS_MAX) {
+			else if (st->repeats > REPEATS_MAX) {
 				rspamd_snprintf (tmpbuf,
 					sizeof (tmpbuf),
 					"Last message repeated %ud times",
-					rspamd_log->repeats);
-				rspamd_log->repeats = 0;
+					st->repeats);
+				st->repeats = 0;
 				/* It is safe to use temporary buffer here as it is not static */
-				if (rspamd_log->saved_message) {
+				if (st->saved_message) {
 					file_log_function (log_domain,
-						rspamd_log->saved_function,
+						st->saved_function,
 						log_level,
-						rspamd_log->saved_message,
+						st->saved_message,
 						forced,
 						arg);
 				}
@@ -639,30 +879,30 @@ file_log_function (const gchar * log_domain,
 					message,
 					forced,
 					arg);
-				rspamd_log->repeats = REPEATS_MIN + 1;
+				st->repeats = REPEATS_MIN + 1;
 				return;
 			}
 		}
 		else {
 			/* Reset counter if new message differs from saved message */
-			rspamd_log->last_line_cksum = cksum;
-			if (rspamd_log->repeats > REPEATS_MIN) {
+			st->last_line_cksum = cksum;
+			if (st->repeats > REPEATS_MIN) {
 				rspamd_snprintf (tmpbuf,
 					sizeof (tmpbuf),
 					"Last message repeated %ud times",
-					rspamd_log->repeats);
-				rspamd_log->repeats = 0;
-				if (rspamd_log->saved_message) {
+					st->repeats);
+				st->repeats = 0;
+				if (st->saved_message) {
 					file_log_function (log_domain,
-						rspamd_log->saved_function,
+						st->saved_function,
 						log_level,
-						rspamd_log->saved_message,
+						st->saved_message,
 						forced,
 						arg);
-					g_free (rspamd_log->saved_message);
-					g_free (rspamd_log->saved_function);
-					rspamd_log->saved_message = NULL;
-					rspamd_log->saved_function = NULL;
+					g_free (st->saved_message);
+					g_free (st->saved_function);
+					st->saved_message = NULL;
+					st->saved_function = NULL;
 				}
 				file_log_function (log_domain,
 					__FUNCTION__,
@@ -680,7 +920,7 @@ file_log_function (const gchar * log_domain,
 				return;
 			}
 			else {
-				rspamd_log->repeats = 0;
+				st->repeats = 0;
 			}
 		}
 
@@ -690,9 +930,9 @@ file_log_function (const gchar * log_domain,
 			}
 
 			/* Format time */
-			tms = localtime (&now);
+			localtime_r (&now, &tms);
 
-			strftime (timebuf, sizeof (timebuf), "%F %H:%M:%S", tms);
+			strftime (timebuf, sizeof (timebuf), "%F %H:%M:%S", &tms);
 			cptype = g_quark_to_string (rspamd_log->process_type);
 
 			if (rspamd_log->cfg->log_color) {
@@ -773,7 +1013,7 @@ void
 rspamd_conditional_debug (rspamd_logger_t *rspamd_log,
 	rspamd_inet_addr_t *addr, const gchar *function, const gchar *fmt, ...)
 {
-	static gchar logbuf[BUFSIZ];
+	struct rspamd_logger_thread *st;
 	va_list vp;
 	u_char *end;
 
@@ -785,19 +1025,18 @@ rspamd_conditional_debug (rspamd_logger_t *rspamd_log,
 				return;
 			}
 		}
-		rspamd_mempool_lock_mutex (rspamd_log->mtx);
+		st = rspamd_log_thread_state ();
 		va_start (vp, fmt);
-		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, vp);
+		end = rspamd_vsnprintf (st->logbuf, sizeof (st->logbuf), fmt, vp);
 		*end = '\0';
-		rspamd_escape_log_string (logbuf);
+		rspamd_escape_log_string (st->logbuf);
 		va_end (vp);
 		rspamd_log->log_func (NULL,
 			function,
 			G_LOG_LEVEL_DEBUG,
-			logbuf,
+			st->logbuf,
 			TRUE,
 			rspamd_log);
-		rspamd_mempool_unlock_mutex (rspamd_log->mtx);
 	}
 }
 /**
@@ -812,14 +1051,12 @@ rspamd_glib_log_function (const gchar *log_domain,
 	rspamd_logger_t *rspamd_log = arg;
 
 	if (rspamd_log->enabled) {
-		rspamd_mempool_lock_mutex (rspamd_log->mtx);
 		rspamd_log->log_func (log_domain,
 			NULL,
 			log_level,
 			message,
 			FALSE,
 			rspamd_log);
-		rspamd_mempool_unlock_mutex (rspamd_log->mtx);
 	}
 }
 
@@ -33,8 +33,10 @@
 #define MUTEX_SLEEP_TIME 10000000L
 #define MUTEX_SPIN_COUNT 100
 
-#define POOL_MTX_LOCK() do { rspamd_mutex_lock (pool->mtx); } while (0)
-#define POOL_MTX_UNLOCK()   do { rspamd_mutex_unlock (pool->mtx); } while (0)
+#define POOL_MTX_LOCK() do { \
+	if (pool->mtx != NULL) { rspamd_mutex_lock (pool->mtx); } } while (0)
+#define POOL_MTX_UNLOCK()   do { \
+	if (pool->mtx != NULL) { rspamd_mutex_unlock (pool->mtx); } } while (0)
 
 /*
  * This define specify whether we should check all pools for free space for new object
@@ -52,6 +54,21 @@ static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
 
+/*
+ * Pages of deleted recycled pools. This cache is per process, pools may be
+ * deleted and trimmed from other threads, so the cache and usage estimates
+ * are protected by a global lock
+ */
+#define POOL_CACHE_MAX_BYTES (8 * 1024 * 1024)
+#define POOL_ADAPTIVE_MAX_SIZE (1024 * 1024)
+#define POOL_ADAPTIVE_ALIGNMENT 4096
+static struct _pool_chain *pool_cache = NULL;
+static gsize pool_cache_bytes = 0;
+/* Moving average and deviation of recycled pools usage */
+static gsize pool_usage_avg = 0;
+static gsize pool_usage_dev = 0;
+G_LOCK_DEFINE_STATIC (pool_cache);
+
 /**
  * Function that return free space in pool page
  * @param x pool page struct
@@ -92,6 +109,181 @@ pool_chain_new (gsize size)
 	return chain;
 }
 
+/*
+ * Get page from cache, pages larger than twice the requested size are not
+ * used to avoid wasting memory
+ */
+static struct _pool_chain *
+pool_chain_new_recycled (gsize size)
+{
+	struct _pool_chain *cur, **prev = &pool_cache;
+
+	G_LOCK (pool_cache);
+	for (cur = pool_cache; cur != NULL; cur = cur->next) {
+		if (cur->len >= size && cur->len <= size * 2) {
+			*prev = cur->next;
+			pool_cache_bytes -= cur->len;
+			G_UNLOCK (pool_cache);
+			cur->pos = align_ptr (cur->begin, MEM_ALIGNMENT);
+			cur->next = NULL;
+			g_atomic_int_inc (&mem_pool_stat->chunks_recycled);
+
+			return cur;
+		}
+
+		prev = &cur->next;
+	}
+	G_UNLOCK (pool_cache);
+
+	return pool_chain_new (size);
+}
+
+static void
+pool_chain_release (struct _pool_chain *chain)
+{
+	g_atomic_int_inc (&mem_pool_stat->chunks_freed);
+	g_atomic_int_add (&mem_pool_stat->bytes_allocated, -chain->len);
+	g_slice_free1 (chain->len, chain->begin);
+	g_slice_free (struct _pool_chain, chain);
+}
+
+/*
+ * Estimate first page size of recycled pools, so that most of them fit in a
+ * single page
+ */
+static gsize
+pool_adaptive_size (void)
+{
+	gsize size;
+
+	G_LOCK (pool_cache);
+	size = pool_usage_avg + pool_usage_dev * 2;
+	G_UNLOCK (pool_cache);
+	size = (size + POOL_ADAPTIVE_ALIGNMENT - 1) &
+			~((gsize)POOL_ADAPTIVE_ALIGNMENT - 1);
+
+	return MIN (size, POOL_ADAPTIVE_MAX_SIZE);
+}
+
+static void
+pool_update_usage (rspamd_mempool_t *pool)
+{
+	struct _pool_chain *cur;
+	gsize used = 0, diff;
+
+	for (cur = pool->first_pool; cur != NULL; cur = cur->next) {
+		used += cur->pos - cur->begin;
+	}
+
+	G_LOCK (pool_cache);
+	/* Exponentially weighted with factor 1/8 */
+	if (used > pool_usage_avg) {
+		diff = used - pool_usage_avg;
+		pool_usage_avg += diff / 8;
+	}
+	else {
+		diff = pool_usage_avg - used;
+		pool_usage_avg -= diff / 8;
+	}
+
+	if (diff > pool_usage_dev) {
+		pool_usage_dev += (diff - pool_usage_dev) / 8;
+	}
+	else {
+		pool_usage_dev -= (pool_usage_dev - diff) / 8;
+	}
+	G_UNLOCK (pool_cache);
+}
+
+static void
+pool_chains_recycle (struct _pool_chain *cur)
+{
+	struct _pool_chain *tmp, *released = NULL;
+
+	G_LOCK (pool_cache);
+	while (cur) {
+		tmp = cur;
+		cur = cur->next;
+
+		if (tmp->len <= POOL_ADAPTIVE_MAX_SIZE * 2 &&
+				pool_cache_bytes + tmp->len <= POOL_CACHE_MAX_BYTES) {
+			tmp->next = pool_cache;
+			pool_cache = tmp;
+			pool_cache_bytes += tmp->len;
+		}
+		else {
+			tmp->next = released;
+			released = tmp;
+		}
+	}
+	G_UNLOCK (pool_cache);
+
+	/* Free pages that do not fit in cache outside of the lock */
+	while (released) {
+		tmp = released;
+		released = released->next;
+		pool_chain_release (tmp);
+	}
+}
+
+/*
+ * Cached pages are used only while the pool is not shared with other threads
+ */
+static inline struct _pool_chain *
+pool_chain_new_for (rspamd_mempool_t *pool, gsize size)
+{
+	if ((pool->flags & RSPAMD_MEMPOOL_RECYCLE) && pool->mtx == NULL) {
+		return pool_chain_new_recycled (size);
+	}
+
+	return pool_chain_new (size);
+}
+
+void
+rspamd_mempool_cache_trim (gsize max_bytes)
+{
+	struct _pool_chain *cur, *tmp, **prev = &pool_cache, *released = NULL;
+	gsize kept = 0;
+
+	G_LOCK (pool_cache);
+	/* Recently cached pages are at the head of the list */
+	for (cur = pool_cache; cur != NULL; ) {
+		if (kept + cur->len <= max_bytes) {
+			kept += cur->len;
+			prev = &cur->next;
+			cur = cur->next;
+		}
+		else {
+			tmp = cur;
+			cur = cur->next;
+			*prev = cur;
+			tmp->next = released;
+			released = tmp;
+		}
+	}
+
+	pool_cache_bytes = kept;
+	G_UNLOCK (pool_cache);
+
+	while (released) {
+		tmp = released;
+		released = released->next;
+		pool_chain_release (tmp);
+	}
+}
+
+gsize
+rspamd_mempool_cache_size (void)
+{
+	gsize ret;
+
+	G_LOCK (pool_cache);
+	ret = pool_cache_bytes;
+	G_UNLOCK (pool_cache);
+
+	return ret;
+}
+
 static struct _pool_chain_shared *
 pool_chain_new_shared (gsize size)
 {
@@ -148,13 +340,8 @@ pool_chain_new_shared (gsize size)
 }
 
 
-/**
- * Allocate new memory poll
- * @param size size of pool's page
- * @return new memory pool object
- */
 rspamd_mempool_t *
-rspamd_mempool_new (gsize size)
+rspamd_mempool_new_full (gsize size, guint flags)
 {
 	rspamd_mempool_t *new;
 	gpointer map;
@@ -216,7 +403,14 @@ rspamd_mempool_new (gsize size)
 		abort ();
 	}
 
-	new->cur_pool = pool_chain_new (size);
+	if (flags & RSPAMD_MEMPOOL_RECYCLE) {
+		size = MAX (size, pool_adaptive_size ());
+		new->cur_pool = pool_chain_new_recycled (size);
+	}
+	else {
+		new->cur_pool = pool_chain_new (size);
+	}
+
 	new->shared_pool = NULL;
 	new->first_pool = new->cur_pool;
 	new->cur_pool_tmp = NULL;
@@ -224,13 +418,40 @@ rspamd_mempool_new (gsize size)
 	new->destructors = NULL;
 	/* Set it upon first call of set variable */
 	new->variables = NULL;
-	new->mtx = rspamd_mutex_new ();
 
-	mem_pool_stat->pools_allocated++;
+	new->flags = flags;
+
+	if (flags & RSPAMD_MEMPOOL_SINGLE_OWNER) {
+		new->mtx = NULL;
+	}
+	else {
+		new->mtx = rspamd_mutex_new ();
+	}
+
+	g_atomic_int_inc (&mem_pool_stat->pools_allocated);
 
 	return new;
 }
 
+/**
+ * Allocate new memory poll
+ * @param size size of pool's page
+ * @return new memory pool object
+ */
+rspamd_mempool_t *
+rspamd_mempool_new (gsize size)
+{
+	return rspamd_mempool_new_full (size, RSPAMD_MEMPOOL_DEFAULT);
+}
+
+void
+rspamd_mempool_set_shared (rspamd_mempool_t *pool)
+{
+	if (pool->mtx == NULL) {
+		pool->mtx = rspamd_mutex_new ();
+	}
+}
+
 static void *
 memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size, gboolean is_tmp)
 {
@@ -239,6 +460,23 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size, gboolean is_tmp)
 	gint free;
 
 	if (pool) {
+		if (pool->mtx == NULL && !always_malloc) {
+			/*
+			 * Single owner pool: try to bump pointer in the current page,
+			 * new pages are taken and counted by the common path
+			 */
+			cur = is_tmp ? pool->cur_pool_tmp : pool->cur_pool;
+
+			if (cur != NULL) {
+				tmp = align_ptr (cur->pos, MEM_ALIGNMENT);
+
+				if (G_LIKELY (tmp + size <= cur->begin + cur->len)) {
+					cur->pos = tmp + size;
+					return tmp;
+				}
+			}
+		}
+
 		POOL_MTX_LOCK ();
 		if (always_malloc) {
 			void *ptr;
@@ -275,10 +513,10 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size, gboolean is_tmp)
 			/* Allocate new pool */
 			if (cur == NULL) {
 				if (pool->first_pool->len >= size + MEM_ALIGNMENT) {
-					new = pool_chain_new (pool->first_pool->len);
+					new = pool_chain_new_for (pool, pool->first_pool->len);
 				}
 				else {
-					new = pool_chain_new (
+					new = pool_chain_new_for (pool,
 						size + pool->first_pool->len + MEM_ALIGNMENT);
 				}
 				/* Connect to pool subsystem */
@@ -291,11 +529,11 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size, gboolean is_tmp)
 			}
 			else {
 				if (cur->len >= size + MEM_ALIGNMENT) {
-					new = pool_chain_new (cur->len);
+					new = pool_chain_new_for (pool, cur->len);
 				}
 				else {
-					mem_pool_stat->oversized_chunks++;
-					new = pool_chain_new (
+					g_atomic_int_inc (&mem_pool_stat->oversized_chunks);
+					new = pool_chain_new_for (pool,
 						size + pool->first_pool->len + MEM_ALIGNMENT);
 				}
 				/* Attach new pool to chain */
@@ -395,7 +633,7 @@ rspamd_mempool_alloc_shared (rspamd_mempool_t * pool, gsize size)
 				new = pool_chain_new_shared (cur->len);
 			}
 			else {
-				mem_pool_stat->oversized_chunks++;
+				g_atomic_int_inc (&mem_pool_stat->oversized_chunks);
 				new = pool_chain_new_shared (
 					size + pool->first_pool->len + MEM_ALIGNMENT);
 			}
@@ -583,23 +821,24 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 		destructor = destructor->prev;
 	}
 
-	while (cur) {
-		tmp = cur;
-		cur = cur->next;
-		g_atomic_int_inc (&mem_pool_stat->chunks_freed);
-		g_atomic_int_add (&mem_pool_stat->bytes_allocated, -tmp->len);
-		g_slice_free1 (tmp->len, tmp->begin);
-		g_slice_free (struct _pool_chain, tmp);
+	if (pool->flags & RSPAMD_MEMPOOL_RECYCLE) {
+		pool_update_usage (pool);
+		pool_chains_recycle (cur);
+		pool_chains_recycle (pool->first_pool_tmp);
 	}
-	/* Clean temporary pools */
-	cur = pool->first_pool_tmp;
-	while (cur) {
-		tmp = cur;
-		cur = cur->next;
-		g_atomic_int_inc (&mem_pool_stat->chunks_freed);
-		g_atomic_int_add (&mem_pool_stat->bytes_allocated, -tmp->len);
-		g_slice_free1 (tmp->len, tmp->begin);
-		g_slice_free (struct _pool_chain, tmp);
+	else {
+		while (cur) {
+			tmp = cur;
+			cur = cur->next;
+			pool_chain_release (tmp);
+		}
+		/* Clean temporary pools */
+		cur = pool->first_pool_tmp;
+		while (cur) {
+			tmp = cur;
+			cur = cur->next;
+			pool_chain_release (tmp);
+		}
 	}
 	/* Unmap shared memory */
 	while (cur_shared) {
@@ -616,7 +855,9 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 
 	g_atomic_int_inc (&mem_pool_stat->pools_freed);
 	POOL_MTX_UNLOCK ();
-	rspamd_mutex_free (pool->mtx);
+	if (pool->mtx != NULL) {
+		rspamd_mutex_free (pool->mtx);
+	}
 	g_slice_free (rspamd_mempool_t, pool);
 }
 
@@ -651,6 +892,7 @@ rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 		st->shared_chunks_allocated = mem_pool_stat->shared_chunks_allocated;
 		st->chunks_freed = mem_pool_stat->chunks_freed;
 		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+		st->chunks_recycled = mem_pool_stat->chunks_recycled;
 	}
 }
 
@@ -23,6 +23,15 @@ struct f_str_s;
 #define align_ptr(p, a)                                                   \
 	(guint8 *) (((uintptr_t) (p) + ((uintptr_t) a - 1)) & ~((uintptr_t) a - 1))
 
+/**
+ * Flags of memory pool
+ */
+enum rspamd_mempool_flags {
+	RSPAMD_MEMPOOL_DEFAULT = 0,
+	RSPAMD_MEMPOOL_SINGLE_OWNER = 1 << 0, /**< pool is used by a single thread, so no locking is needed */
+	RSPAMD_MEMPOOL_RECYCLE = 1 << 1, /**< pages are returned to the process cache and first page is sized by recent usage */
+};
+
 /**
  * Destructor type definition
  */
@@ -93,7 +102,8 @@ typedef struct memory_pool_s {
 	struct _pool_chain_shared *shared_pool; /**< shared chain							*/
 	struct _pool_destructors *destructors;  /**< destructors chain						*/
 	GHashTable *variables;                  /**< private memory pool variables			*/
-	struct rspamd_mutex_s *mtx;             /**< threads lock							*/
+	struct rspamd_mutex_s *mtx;             /**< threads lock (NULL for single owner pools) */
+	guint flags;                            /**< pool flags								*/
 } rspamd_mempool_t;
 
 /**
@@ -107,6 +117,7 @@ typedef struct memory_pool_stat_s {
 	guint shared_chunks_allocated;      /**< shared chunks allocated							*/
 	guint chunks_freed;                 /**< chunks freed										*/
 	guint oversized_chunks;             /**< oversized chunks									*/
+	guint chunks_recycled;              /**< chunks taken from pages cache						*/
 } rspamd_mempool_stat_t;
 
 
@@ -118,6 +129,25 @@ typedef struct memory_pool_stat_s {
  */
 rspamd_mempool_t * rspamd_mempool_new (gsize size);
 
+/**
+ * Allocate new memory pool with the specified flags. Allocations from pools
+ * with `RSPAMD_MEMPOOL_SINGLE_OWNER` flag take no locks and must be done from
+ * a single thread only. Pools with `RSPAMD_MEMPOOL_RECYCLE` flag reuse pages
+ * of previously deleted pools and must be created and deleted by the main
+ * thread of a process
+ * @param size size of pool's page
+ * @param flags flags from `enum rspamd_mempool_flags`
+ * @return new memory pool object
+ */
+rspamd_mempool_t * rspamd_mempool_new_full (gsize size, guint flags);
+
+/**
+ * Make single owner pool safe to be used from several threads. This function
+ * must be called before the pool is passed to another thread
+ * @param pool memory pool object
+ */
+void rspamd_mempool_set_shared (rspamd_mempool_t *pool);
+
 /**
  * Get memory from pool
  * @param pool memory pool object
@@ -295,6 +325,19 @@ void rspamd_mempool_stat_reset (void);
  */
 gsize rspamd_mempool_suggest_size (void);
 
+/**
+ * Free cached pages of recycled pools leaving at most `max_bytes` in cache.
+ * Pages cache is per process and is protected by a global lock
+ * @param max_bytes number of bytes to keep (0 to drop all cached pages)
+ */
+void rspamd_mempool_cache_trim (gsize max_bytes);
+
+/**
+ * Get number of bytes in cached pages of recycled pools
+ * @return size of pages cache
+ */
+gsize rspamd_mempool_cache_size (void);
+
 /**
  * Set memory pool variable
  * @param pool memory pool object
@@ -25,8 +25,20 @@
 #include "fstring.h"
 #include "siphash.h"
 #include "blake2.h"
+#include "xxhash.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #define SHINGLES_WINDOW 3
+/* Minimal number of buckets in shingles index */
+#define SHINGLE_INDEX_MIN_BUCKETS 1024
+/* Minimal number of removed items that causes index rebuild */
+#define SHINGLE_INDEX_MIN_REBUILD 1024
 
 static void
 rspamd_shingles_update_row (rspamd_fstring_t *in, struct siphash *h)
@@ -122,6 +134,106 @@ rspamd_shingles_generate (GArray *input,
 }
 
 
+/*
+ * Combines hashes of words from the window
+ */
+static inline guint64
+rspamd_shingles_window_hash (const guint64 *words, gint start, gint len,
+		guint64 seed)
+{
+	guint64 h = seed;
+	gint i;
+
+	for (i = 0; i < len; i ++) {
+		h ^= words[(start + i) % SHINGLES_WINDOW];
+		h *= 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+	}
+
+	return h;
+}
+
+struct rspamd_shingle*
+rspamd_shingles_generate_fast (GArray *input,
+		const guchar key[16],
+		rspamd_mempool_t *pool)
+{
+	struct rspamd_shingle *res;
+	guint64 mul[RSPAMD_SHINGLE_SIZE], add[RSPAMD_SHINGLE_SIZE];
+	guint64 words[SHINGLES_WINDOW], wh, v, seed;
+	guint32 wseeds[2];
+	guchar buf[BLAKE2B_OUTBYTES];
+	blake2b_state bs;
+	rspamd_fstring_t *w;
+	gint i, j, nwords = input->len;
+	guint8 n;
+
+	if (pool != NULL) {
+		res = rspamd_mempool_alloc (pool, sizeof (*res));
+	}
+	else {
+		res = g_malloc (sizeof (*res));
+	}
+
+	/*
+	 * Each shingle uses its own permutation h * mul + add, where odd
+	 * multiplier and addend are derived from the key
+	 */
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		n = i;
+		blake2b_init (&bs, BLAKE2B_OUTBYTES);
+		blake2b_update (&bs, key, 16);
+		blake2b_update (&bs, &n, sizeof (n));
+		blake2b_final (&bs, buf, sizeof (buf));
+		memcpy (&mul[i], buf, sizeof (mul[i]));
+		memcpy (&add[i], buf + sizeof (mul[i]), sizeof (add[i]));
+		mul[i] |= 1;
+
+		if (i == 0) {
+			memcpy (wseeds, buf + 16, sizeof (wseeds));
+			memcpy (&seed, buf + 24, sizeof (seed));
+		}
+
+		/* Shingles array is used as a buffer for minimums */
+		res->hashes[i] = G_MAXUINT64;
+	}
+
+	/*
+	 * Words are hashed once and windows are composed from their hashes. As
+	 * in siphash mode, short inputs produce a single window of all words
+	 */
+	for (i = 0; i < nwords || (i == 0 && nwords == 0); i ++) {
+		if (nwords > 0) {
+			w = &g_array_index (input, rspamd_fstring_t, i);
+			/* Bundled xxhash has 32 bits version only */
+			words[i % SHINGLES_WINDOW] =
+					((guint64)XXH32 (w->begin, w->len, wseeds[0]) << 32) |
+					XXH32 (w->begin, w->len, wseeds[1]);
+		}
+
+		if (i >= SHINGLES_WINDOW - 1) {
+			wh = rspamd_shingles_window_hash (words, i + 1, SHINGLES_WINDOW,
+					seed);
+		}
+		else if (i >= nwords - 1) {
+			wh = rspamd_shingles_window_hash (words, 0, nwords, seed);
+		}
+		else {
+			continue;
+		}
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			v = wh * mul[j] + add[j];
+
+			if (v < res->hashes[j]) {
+				res->hashes[j] = v;
+			}
+		}
+	}
+
+	return res;
+}
+
 guint64
 rspamd_shingles_default_filter (guint64 *input, gsize count,
 		gint shno, const guchar *key, gpointer ud)
@@ -139,16 +251,466 @@ rspamd_shingles_default_filter (guint64 *input, gsize count,
 }
 
 
-gdouble rspamd_shingles_compare (const struct rspamd_shingle *a,
+gdouble
+rspamd_shingles_compare (const struct rspamd_shingle *a,
 		const struct rspamd_shingle *b)
 {
 	gint i, common = 0;
+#if defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256 (), va, vb;
+	guint64 lanes[4];
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i += 4) {
+		va = _mm256_loadu_si256 ((const __m256i *)&a->hashes[i]);
+		vb = _mm256_loadu_si256 ((const __m256i *)&b->hashes[i]);
+		/* Equal lanes are all ones, so subtraction counts them */
+		acc = _mm256_sub_epi64 (acc, _mm256_cmpeq_epi64 (va, vb));
+	}
+
+	_mm256_storeu_si256 ((__m256i *)lanes, acc);
+	common = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128 (), eq;
+	guint64 lanes[2];
 
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i += 2) {
+		eq = _mm_cmpeq_epi32 (
+				_mm_loadu_si128 ((const __m128i *)&a->hashes[i]),
+				_mm_loadu_si128 ((const __m128i *)&b->hashes[i]));
+		/* SSE2 has no 64 bit compare, so both 32 bit halves should be equal */
+		eq = _mm_and_si128 (eq, _mm_shuffle_epi32 (eq, _MM_SHUFFLE (2, 3, 0, 1)));
+		acc = _mm_sub_epi64 (acc, eq);
+	}
+
+	_mm_storeu_si128 ((__m128i *)lanes, acc);
+	common = lanes[0] + lanes[1];
+#else
 	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
 		if (a->hashes[i] == b->hashes[i]) {
 			common ++;
 		}
 	}
+#endif
 
 	return (gdouble)common / (gdouble)RSPAMD_SHINGLE_SIZE;
 }
+
+/*
+ * Shingles index: each band of shingle hashes is hashed to a bucket that
+ * holds a chain of items with the same band. Removed items are skipped
+ * until the index is rebuilt
+ */
+struct rspamd_shingle_index_item {
+	struct rspamd_shingle sgl;
+	guint64 id;
+	guint32 mask;                   /**< bit set for each known hash			*/
+	gboolean removed;
+};
+
+struct rspamd_shingle_index_link {
+	guint32 item;
+	guint32 next;                   /**< link index + 1, 0 for the last link	*/
+};
+
+struct rspamd_shingle_index_bucket {
+	guint64 key;
+	guint32 head;                   /**< link index + 1, 0 for empty buckets	*/
+};
+
+struct rspamd_shingle_index {
+	guint bands;
+	guint rows;
+	GPtrArray *items;
+	GHashTable *ids;                /**< id -> item index + 1					*/
+	GArray *links;
+	struct rspamd_shingle_index_bucket *buckets;
+	gsize nbuckets;
+	gsize used;
+	gsize removed;
+};
+
+static inline guint64
+rspamd_shingle_index_mix (guint64 h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static guint64
+rspamd_shingle_index_band_key (struct rspamd_shingle_index *idx,
+		const struct rspamd_shingle *sgl, guint band)
+{
+	guint64 h = band;
+	guint i;
+
+	for (i = band * idx->rows; i < (band + 1) * idx->rows; i ++) {
+		h = rspamd_shingle_index_mix (h ^ sgl->hashes[i]);
+	}
+
+	return h;
+}
+
+/*
+ * Bands with unknown hashes are not indexed
+ */
+static gboolean
+rspamd_shingle_index_band_known (struct rspamd_shingle_index *idx,
+		guint32 mask, guint band)
+{
+	guint i;
+
+	for (i = band * idx->rows; i < (band + 1) * idx->rows; i ++) {
+		if (!(mask & (1U << i))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Unknown hashes never match, so the result is comparable with
+ * rspamd_shingles_compare
+ */
+static gdouble
+rspamd_shingle_index_compare_masked (const struct rspamd_shingle *a,
+		const struct rspamd_shingle *b, guint32 mask)
+{
+	gint i, common = 0;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		if ((mask & (1U << i)) && a->hashes[i] == b->hashes[i]) {
+			common ++;
+		}
+	}
+
+	return (gdouble)common / (gdouble)RSPAMD_SHINGLE_SIZE;
+}
+
+static struct rspamd_shingle_index_bucket *
+rspamd_shingle_index_bucket (struct rspamd_shingle_index *idx, guint64 key,
+		gboolean create)
+{
+	gsize mask = idx->nbuckets - 1, slot;
+	struct rspamd_shingle_index_bucket *bk;
+
+	slot = key & mask;
+
+	while ((bk = &idx->buckets[slot])->head != 0) {
+		if (bk->key == key) {
+			return bk;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	if (!create) {
+		return NULL;
+	}
+
+	bk->key = key;
+	idx->used ++;
+
+	return bk;
+}
+
+static void
+rspamd_shingle_index_link (struct rspamd_shingle_index *idx, guint32 n)
+{
+	struct rspamd_shingle_index_item *item = g_ptr_array_index (idx->items, n);
+	struct rspamd_shingle_index_bucket *bk, *old;
+	struct rspamd_shingle_index_link link;
+	gsize old_size, i;
+	guint band;
+
+	for (band = 0; band < idx->bands; band ++) {
+		if (!rspamd_shingle_index_band_known (idx, item->mask, band)) {
+			continue;
+		}
+
+		if ((idx->used + 1) * 2 > idx->nbuckets) {
+			old = idx->buckets;
+			old_size = idx->nbuckets;
+			idx->nbuckets *= 2;
+			idx->buckets = g_malloc0 (idx->nbuckets * sizeof (*idx->buckets));
+			idx->used = 0;
+
+			for (i = 0; i < old_size; i ++) {
+				if (old[i].head != 0) {
+					bk = rspamd_shingle_index_bucket (idx, old[i].key, TRUE);
+					bk->head = old[i].head;
+				}
+			}
+
+			g_free (old);
+		}
+
+		bk = rspamd_shingle_index_bucket (idx,
+				rspamd_shingle_index_band_key (idx, &item->sgl, band), TRUE);
+		link.item = n;
+		link.next = bk->head;
+		g_array_append_val (idx->links, link);
+		bk->head = idx->links->len;
+	}
+}
+
+struct rspamd_shingle_index *
+rspamd_shingle_index_new (guint bands)
+{
+	struct rspamd_shingle_index *idx;
+
+	if (bands == 0 || bands > RSPAMD_SHINGLE_SIZE ||
+			RSPAMD_SHINGLE_SIZE % bands != 0) {
+		bands = RSPAMD_SHINGLE_INDEX_BANDS;
+	}
+
+	idx = g_slice_alloc0 (sizeof (*idx));
+	idx->bands = bands;
+	idx->rows = RSPAMD_SHINGLE_SIZE / bands;
+	idx->items = g_ptr_array_new ();
+	/* Keys are ids stored in items */
+	idx->ids = g_hash_table_new (g_int64_hash, g_int64_equal);
+	idx->links = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_shingle_index_link));
+	idx->nbuckets = SHINGLE_INDEX_MIN_BUCKETS;
+	idx->buckets = g_malloc0 (idx->nbuckets * sizeof (*idx->buckets));
+
+	return idx;
+}
+
+/*
+ * Drop removed items and their links
+ */
+static void
+rspamd_shingle_index_rebuild (struct rspamd_shingle_index *idx)
+{
+	struct rspamd_shingle_index_item *item;
+	GPtrArray *old = idx->items;
+	guint i;
+
+	idx->items = g_ptr_array_sized_new (old->len - idx->removed);
+	g_hash_table_remove_all (idx->ids);
+	g_array_set_size (idx->links, 0);
+	memset (idx->buckets, 0, idx->nbuckets * sizeof (*idx->buckets));
+	idx->used = 0;
+	idx->removed = 0;
+
+	for (i = 0; i < old->len; i ++) {
+		item = g_ptr_array_index (old, i);
+
+		if (item->removed) {
+			g_slice_free1 (sizeof (*item), item);
+			continue;
+		}
+
+		g_ptr_array_add (idx->items, item);
+		g_hash_table_insert (idx->ids, &item->id,
+				GUINT_TO_POINTER (idx->items->len));
+		rspamd_shingle_index_link (idx, idx->items->len - 1);
+	}
+
+	g_ptr_array_free (old, TRUE);
+}
+
+void
+rspamd_shingle_index_insert (struct rspamd_shingle_index *idx,
+		const struct rspamd_shingle *sgl, guint64 id)
+{
+	rspamd_shingle_index_insert_partial (idx, sgl, RSPAMD_SHINGLE_FULL_MASK, id);
+}
+
+void
+rspamd_shingle_index_insert_partial (struct rspamd_shingle_index *idx,
+		const struct rspamd_shingle *sgl, guint32 mask, guint64 id)
+{
+	struct rspamd_shingle_index_item *item;
+
+	rspamd_shingle_index_remove (idx, id);
+
+	item = g_slice_alloc (sizeof (*item));
+	memcpy (&item->sgl, sgl, sizeof (item->sgl));
+	item->id = id;
+	item->mask = mask;
+	item->removed = FALSE;
+	g_ptr_array_add (idx->items, item);
+	g_hash_table_insert (idx->ids, &item->id,
+			GUINT_TO_POINTER (idx->items->len));
+	rspamd_shingle_index_link (idx, idx->items->len - 1);
+}
+
+gboolean
+rspamd_shingle_index_remove (struct rspamd_shingle_index *idx, guint64 id)
+{
+	struct rspamd_shingle_index_item *item;
+	guint n;
+
+	n = GPOINTER_TO_UINT (g_hash_table_lookup (idx->ids, &id));
+
+	if (n == 0) {
+		return FALSE;
+	}
+
+	item = g_ptr_array_index (idx->items, n - 1);
+	g_hash_table_remove (idx->ids, &id);
+	item->removed = TRUE;
+	idx->removed ++;
+
+	if (idx->removed > SHINGLE_INDEX_MIN_REBUILD &&
+			idx->removed * 2 > idx->items->len) {
+		rspamd_shingle_index_rebuild (idx);
+	}
+
+	return TRUE;
+}
+
+static gint
+rspamd_shingle_index_item_cmp (const void *a, const void *b)
+{
+	guint32 ia = *(const guint32 *)a, ib = *(const guint32 *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+guint
+rspamd_shingle_index_lookup (struct rspamd_shingle_index *idx,
+		const struct rspamd_shingle *sgl,
+		gdouble min_similarity,
+		rspamd_shingle_index_cb cb,
+		gpointer ud)
+{
+	struct rspamd_shingle_index_bucket *bk;
+	struct rspamd_shingle_index_link *link;
+	struct rspamd_shingle_index_item *item;
+	GArray *candidates;
+	guint32 next, n, last = G_MAXUINT32;
+	guint band, i, found = 0;
+	gdouble similarity;
+
+	candidates = g_array_sized_new (FALSE, FALSE, sizeof (guint32),
+			idx->bands);
+
+	for (band = 0; band < idx->bands; band ++) {
+		bk = rspamd_shingle_index_bucket (idx,
+				rspamd_shingle_index_band_key (idx, sgl, band), FALSE);
+
+		if (bk == NULL) {
+			continue;
+		}
+
+		for (next = bk->head; next != 0; next = link->next) {
+			link = &g_array_index (idx->links,
+					struct rspamd_shingle_index_link, next - 1);
+			item = g_ptr_array_index (idx->items, link->item);
+
+			if (!item->removed) {
+				g_array_append_val (candidates, link->item);
+			}
+		}
+	}
+
+	/* The same item could be found in several bands */
+	qsort (candidates->data, candidates->len, sizeof (guint32),
+			rspamd_shingle_index_item_cmp);
+
+	for (i = 0; i < candidates->len; i ++) {
+		n = g_array_index (candidates, guint32, i);
+
+		if (n == last) {
+			continue;
+		}
+
+		last = n;
+		item = g_ptr_array_index (idx->items, n);
+
+		if (item->mask == RSPAMD_SHINGLE_FULL_MASK) {
+			similarity = rspamd_shingles_compare (sgl, &item->sgl);
+		}
+		else {
+			similarity = rspamd_shingle_index_compare_masked (sgl, &item->sgl,
+					item->mask);
+		}
+
+		if (similarity >= min_similarity) {
+			found ++;
+
+			if (cb) {
+				cb (item->id, similarity, ud);
+			}
+		}
+	}
+
+	g_array_free (candidates, TRUE);
+
+	return found;
+}
+
+struct rspamd_shingle_index_best_cbdata {
+	guint64 id;
+	gdouble similarity;
+};
+
+static void
+rspamd_shingle_index_best_cb (guint64 id, gdouble similarity, gpointer ud)
+{
+	struct rspamd_shingle_index_best_cbdata *cbd = ud;
+
+	if (similarity > cbd->similarity) {
+		cbd->id = id;
+		cbd->similarity = similarity;
+	}
+}
+
+gboolean
+rspamd_shingle_index_best (struct rspamd_shingle_index *idx,
+		const struct rspamd_shingle *sgl,
+		guint64 *id,
+		gdouble *similarity)
+{
+	struct rspamd_shingle_index_best_cbdata cbd;
+
+	cbd.id = 0;
+	cbd.similarity = -1.0;
+
+	if (rspamd_shingle_index_lookup (idx, sgl, 0.0,
+			rspamd_shingle_index_best_cb, &cbd) == 0) {
+		return FALSE;
+	}
+
+	if (id) {
+		*id = cbd.id;
+	}
+	if (similarity) {
+		*similarity = cbd.similarity;
+	}
+
+	return TRUE;
+}
+
+gsize
+rspamd_shingle_index_size (struct rspamd_shingle_index *idx)
+{
+	return g_hash_table_size (idx->ids);
+}
+
+void
+rspamd_shingle_index_destroy (struct rspamd_shingle_index *idx)
+{
+	guint i;
+
+	if (idx != NULL) {
+		for (i = 0; i < idx->items->len; i ++) {
+			g_slice_free1 (sizeof (struct rspamd_shingle_index_item),
+					g_ptr_array_index (idx->items, i));
+		}
+
+		g_ptr_array_free (idx->items, TRUE);
+		g_hash_table_unref (idx->ids);
+		g_array_free (idx->links, TRUE);
+		g_free (idx->buckets);
+		g_slice_free1 (sizeof (*idx), idx);
+	}
+}
@@ -27,6 +27,10 @@
 #include "mem_pool.h"
 
 #define RSPAMD_SHINGLE_SIZE 32
+/* Default number of bands in shingles index */
+#define RSPAMD_SHINGLE_INDEX_BANDS 16
+/* Mask of a shingle with all hashes known */
+#define RSPAMD_SHINGLE_FULL_MASK G_MAXUINT32
 
 struct rspamd_shingle {
 	guint64 hashes[RSPAMD_SHINGLE_SIZE];
@@ -57,6 +61,21 @@ struct rspamd_shingle* rspamd_shingles_generate (GArray *input,
 		rspamd_shingles_filter filter,
 		gpointer filterd);
 
+/**
+ * Generate shingles from the input of fixed size strings. Unlike
+ * `rspamd_shingles_generate` each word is hashed only once and hashes of
+ * windows are permuted by universal hashing, so shingles are not compatible
+ * with the ones produced by `rspamd_shingles_generate`. Minimal value is
+ * always selected for each shingle
+ * @param input array of `rspamd_fstring_t`
+ * @param key secret key used to generate shingles
+ * @param pool pool to allocate shigles array
+ * @return shingles array
+ */
+struct rspamd_shingle* rspamd_shingles_generate_fast (GArray *input,
+		const guchar key[16],
+		rspamd_mempool_t *pool);
+
 /**
  * Compares two shingles and return result as a floating point value - 1.0
  * for completely similar shingles and 0.0 for completely different ones
@@ -73,4 +92,94 @@ gdouble rspamd_shingles_compare (const struct rspamd_shingle *a,
 guint64 rspamd_shingles_default_filter (guint64 *input, gsize count,
 		gint shno, const guchar *key, gpointer ud);
 
+struct rspamd_shingle_index;
+
+/**
+ * Callback for shingles index lookup
+ * @param id id of indexed shingle
+ * @param similarity result of `rspamd_shingles_compare` for indexed shingle
+ * @param ud opaque data
+ */
+typedef void (*rspamd_shingle_index_cb) (guint64 id, gdouble similarity,
+		gpointer ud);
+
+/**
+ * Create new shingles index. Shingle hashes are split to `bands` bands and
+ * shingles that are equal in at least one band are considered as candidates
+ * for comparison. More bands find less similar shingles at the cost of more
+ * candidates to compare. Index is not thread safe
+ * @param bands number of bands, should divide RSPAMD_SHINGLE_SIZE, if it is
+ * zero or invalid then RSPAMD_SHINGLE_INDEX_BANDS is used
+ * @return new index
+ */
+struct rspamd_shingle_index * rspamd_shingle_index_new (guint bands);
+
+/**
+ * Insert shingle to the index. If `id` is already indexed then its shingle
+ * is replaced
+ * @param idx
+ * @param sgl shingle to insert (copied)
+ * @param id id of shingle
+ */
+void rspamd_shingle_index_insert (struct rspamd_shingle_index *idx,
+		const struct rspamd_shingle *sgl, guint64 id);
+
+/**
+ * Insert shingle with some hashes unknown. Unknown hashes are never matched
+ * and bands that contain them are not indexed
+ * @param idx
+ * @param sgl shingle to insert (copied)
+ * @param mask bit `i` is set if `sgl->hashes[i]` is known
+ * @param id id of shingle
+ */
+void rspamd_shingle_index_insert_partial (struct rspamd_shingle_index *idx,
+		const struct rspamd_shingle *sgl, guint32 mask, guint64 id);
+
+/**
+ * Remove shingle from the index
+ * @param idx
+ * @param id id of shingle
+ * @return TRUE if shingle has been removed
+ */
+gboolean rspamd_shingle_index_remove (struct rspamd_shingle_index *idx,
+		guint64 id);
+
+/**
+ * Find indexed shingles similar to `sgl`
+ * @param idx
+ * @param sgl shingle to find
+ * @param min_similarity minimal similarity of shingles to report
+ * @param cb callback that is called once for each similar shingle
+ * @param ud opaque data for callback
+ * @return number of shingles found
+ */
+guint rspamd_shingle_index_lookup (struct rspamd_shingle_index *idx,
+		const struct rspamd_shingle *sgl,
+		gdouble min_similarity,
+		rspamd_shingle_index_cb cb,
+		gpointer ud);
+
+/**
+ * Find the most similar indexed shingle
+ * @param idx
+ * @param sgl shingle to find
+ * @param id id of the best shingle
+ * @param similarity similarity of the best shingle
+ * @return TRUE if any candidate has been found
+ */
+gboolean rspamd_shingle_index_best (struct rspamd_shingle_index *idx,
+		const struct rspamd_shingle *sgl,
+		guint64 *id,
+		gdouble *similarity);
+
+/**
+ * Returns number of shingles in the index
+ */
+gsize rspamd_shingle_index_size (struct rspamd_shingle_index *idx);
+
+/**
+ * Destroy index
+ */
+void rspamd_shingle_index_destroy (struct rspamd_shingle_index *idx);
+
 #endif /* SHINGLES_H_ */
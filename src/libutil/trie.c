@@ -25,21 +25,27 @@
 #include "mem_pool.h"
 #include "trie.h"
 
+/*
+ * Compiled state of trie
+ */
+struct rspamd_trie_node {
+	gint id;                /**< id of pattern that ends in this state or -1 */
+	guint len;              /**< length of pattern						*/
+	guint32 out;            /**< longest pattern ending here (0 if none)	*/
+	guint32 out_next;       /**< next shorter pattern ending here (0 if none) */
+};
+
 rspamd_trie_t *
 rspamd_trie_create (gboolean icase)
 {
 	rspamd_trie_t *new;
 
-	new = g_malloc (sizeof (rspamd_trie_t));
+	new = g_malloc0 (sizeof (rspamd_trie_t));
 
 	new->icase = icase;
 	new->pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
-	new->root.fail = NULL;
-	new->root.final = 0;
-	new->root.id = 0;
-	new->root.next = NULL;
-	new->root.match = NULL;
-	new->fail_states = g_ptr_array_sized_new (8);
+	new->root.id = -1;
+	new->nstates = 1;
 
 	return new;
 }
@@ -69,20 +75,9 @@ rspamd_trie_insert_char (rspamd_trie_t *trie,
 		rspamd_mempool_alloc (trie->pool, sizeof (struct rspamd_trie_state));
 	new_pos = new_match->state;
 	new_pos->match = NULL;
-	new_pos->fail = &trie->root;
-	new_pos->final = 0;
 	new_pos->id = -1;
-
-	if (trie->fail_states->len < depth + 1) {
-		/* Grow fail states array if depth is more than its size */
-		guint size = trie->fail_states->len;
-
-		size = MAX (size * 2, depth + 1);
-		g_ptr_array_set_size (trie->fail_states, size);
-	}
-
-	new_pos->next = trie->fail_states->pdata[depth];
-	trie->fail_states->pdata[depth] = new_pos;
+	new_pos->depth = depth + 1;
+	new_pos->idx = trie->nstates ++;
 
 	return new_pos;
 }
@@ -104,12 +99,15 @@ void
 rspamd_trie_insert (rspamd_trie_t *trie, const gchar *pattern, gint pattern_id)
 {
 	const guchar *p = pattern;
-	struct rspamd_trie_state *q, *q1, *r, *cur_node;
-	struct rspamd_trie_match *m, *n;
-	guint i, depth = 0;
+	struct rspamd_trie_state *cur_node;
+	struct rspamd_trie_match *m;
+	guint depth = 0;
 	gchar c;
 
-	/* Insert pattern to the trie */
+	if (*p == '\0') {
+		/* Empty patterns match nothing */
+		return;
+	}
 
 	cur_node = &trie->root;
 
@@ -127,47 +125,94 @@ rspamd_trie_insert (rspamd_trie_t *trie, const gchar *pattern, gint pattern_id)
 		depth++;
 	}
 
-	cur_node->final = depth;
 	cur_node->id = pattern_id;
+	trie->compiled = FALSE;
+}
+
+void
+rspamd_trie_compile (rspamd_trie_t *trie)
+{
+	struct rspamd_trie_state **queue, *s;
+	struct rspamd_trie_match *m;
+	struct rspamd_trie_node *node;
+	guint32 *row, *fail_row, *fail;
+	guint i, qhead = 0, qtail = 0, ncls, cls;
+	gboolean used[256];
+
+	/* Assign a class to each character that is used in patterns */
+	memset (used, 0, sizeof (used));
+	queue = g_malloc (sizeof (*queue) * trie->nstates);
+	queue[qtail++] = &trie->root;
+
+	while (qhead < qtail) {
+		s = queue[qhead++];
+
+		for (m = s->match; m != NULL; m = m->next) {
+			used[(guchar)m->c] = TRUE;
+			queue[qtail++] = m->state;
+		}
+	}
 
-	/* Update fail states and build fail states graph */
-	/* Go through the whole depth of prefixes */
-	for (i = 0; i < trie->fail_states->len; i++) {
-		q = trie->fail_states->pdata[i];
-		while (q) {
-			m = q->match;
-			while (m) {
-				c = m->c;
-				q1 = m->state;
-				r = q->fail;
-				/* Move q->fail to last known fail location for this character (or to NULL) */
-				while (r && (n = check_match (r, c)) == NULL) {
-					r = r->fail;
-				}
-
-				/* We have found new fail location for character c, so set it in q1 */
-				if (r != NULL) {
-					q1->fail = n->state;
-					if (q1->fail->final > q1->final) {
-						q1->final = q1->fail->final;
-					}
-				}
-				else {
-					/* Search from root */
-					if ((n = check_match (&trie->root, c))) {
-						q1->fail = n->state;
-					}
-					else {
-						q1->fail = &trie->root;
-					}
-				}
-
-				m = m->next;
+	/* Class 0 is for characters that are not used in any pattern */
+	memset (trie->classes, 0, sizeof (trie->classes));
+	ncls = 1;
+
+	for (i = 0; i < 256; i ++) {
+		if (used[i]) {
+			trie->classes[i] = ncls++;
+		}
+	}
+
+	if (trie->icase) {
+		for (i = 'A'; i <= 'Z'; i ++) {
+			trie->classes[i] = trie->classes[g_ascii_tolower (i)];
+		}
+	}
+
+	g_free (trie->delta);
+	g_free (trie->nodes);
+	trie->nclasses = ncls;
+	trie->delta = g_malloc0 (sizeof (guint32) * ncls * trie->nstates);
+	trie->nodes = g_malloc0 (sizeof (struct rspamd_trie_node) * trie->nstates);
+	fail = g_malloc0 (sizeof (guint32) * trie->nstates);
+
+	/*
+	 * Breadth first traversal: fail state of each state is less deep, so its
+	 * transitions are already known when the state is processed
+	 */
+	for (qhead = 0; qhead < qtail; qhead ++) {
+		s = queue[qhead];
+		row = &trie->delta[s->idx * ncls];
+		node = &trie->nodes[s->idx];
+		node->id = s->id;
+		node->len = s->depth;
+
+		if (s == &trie->root) {
+			fail_row = NULL;
+		}
+		else {
+			fail_row = &trie->delta[fail[s->idx] * ncls];
+			memcpy (row, fail_row, sizeof (guint32) * ncls);
+			/* Link to the next pattern that is a suffix of this one */
+			if (s->id != -1) {
+				node->out = s->idx;
+				node->out_next = trie->nodes[fail[s->idx]].out;
+			}
+			else {
+				node->out = trie->nodes[fail[s->idx]].out;
 			}
+		}
 
-			q = q->next;
+		for (m = s->match; m != NULL; m = m->next) {
+			cls = trie->classes[(guchar)m->c];
+			fail[m->state->idx] = fail_row ? fail_row[cls] : 0;
+			row[cls] = m->state->idx;
 		}
 	}
+
+	g_free (fail);
+	g_free (queue);
+	trie->compiled = TRUE;
 }
 
 const gchar *
@@ -176,63 +221,85 @@ rspamd_trie_lookup (rspamd_trie_t *trie,
 	gsize buflen,
 	gint *matched_id)
 {
-	const guchar *p = buffer, *prev, *ret;
-	struct rspamd_trie_state *cur_node;
-	struct rspamd_trie_match *m = NULL;
-	gchar c;
+	const guchar *p = buffer, *end = p + buflen;
+	const guint32 *delta;
+	const guint16 *classes;
+	struct rspamd_trie_node *node;
+	guint32 state = 0, ncls;
+
+	if (!trie->compiled) {
+		rspamd_trie_compile (trie);
+	}
 
+	delta = trie->delta;
+	classes = trie->classes;
+	ncls = trie->nclasses;
 
-	cur_node = &trie->root;
-	prev = p;
-	ret = p;
+	while (p < end) {
+		state = delta[state * ncls + classes[*p]];
 
-	while (buflen) {
-		c = trie->icase ? g_ascii_tolower (*p) : *p;
+		if (G_UNLIKELY (trie->nodes[state].out != 0)) {
+			/* The longest pattern that ends at this position */
+			node = &trie->nodes[trie->nodes[state].out];
 
-		/* Match pattern or use fail-path to restore state */
-		while (cur_node != NULL && (m = check_match (cur_node, c)) == NULL) {
-			cur_node = cur_node->fail;
-		}
+			if (matched_id != NULL) {
+				*matched_id = node->id;
+			}
 
-		/* Shift left in the text */
-		if (cur_node == &trie->root) {
-			/* 1 character pattern found */
-			ret = prev;
-		}
-		else if (cur_node == NULL) {
-			/* We have tried the pattern but eventually it was not found */
-			cur_node = &trie->root;
-			ret = p;
-			p++;
-			prev = p;
-			buflen--;
-			continue;
+			return (const gchar *)p - node->len + 1;
 		}
 
-		if (m != NULL) {
-			/* Match found */
-			cur_node = m->state;
+		p++;
+	}
 
-			if (cur_node->final) {
-				/* The complete pattern found */
-				if (matched_id != NULL) {
-					*matched_id = cur_node->id;
-				}
-				return (const gchar *) ret;
+	return NULL;
+}
+
+gint
+rspamd_trie_lookup_all (rspamd_trie_t *trie,
+	const gchar *buffer,
+	gsize buflen,
+	rspamd_trie_cb_t cb,
+	void *ud)
+{
+	const guchar *p = buffer, *end = p + buflen;
+	const guint32 *delta;
+	const guint16 *classes;
+	guint32 state = 0, out, ncls;
+	gint nmatches = 0;
+
+	if (!trie->compiled) {
+		rspamd_trie_compile (trie);
+	}
+
+	delta = trie->delta;
+	classes = trie->classes;
+	ncls = trie->nclasses;
+
+	while (p < end) {
+		state = delta[state * ncls + classes[*p]];
+
+		/* Report all patterns that end at this position */
+		for (out = trie->nodes[state].out; G_UNLIKELY (out != 0);
+				out = trie->nodes[out].out_next) {
+			nmatches++;
+
+			if (cb != NULL && !cb (trie->nodes[out].id, (const gchar *)p, ud)) {
+				return nmatches;
 			}
 		}
+
 		p++;
-		prev = p;
-		buflen--;
 	}
 
-	return NULL;
+	return nmatches;
 }
 
 void
 rspamd_trie_free (rspamd_trie_t *trie)
 {
-	g_ptr_array_free (trie->fail_states, TRUE);
+	g_free (trie->delta);
+	g_free (trie->nodes);
 	rspamd_mempool_delete (trie->pool);
 	g_free (trie);
 }
@@ -29,17 +29,19 @@
 #include "mem_pool.h"
 
 /*
- * Rspamd implements basic bitwise prefixed trie structure
+ * Rspamd implements Aho-Corasick automaton: patterns are inserted into a
+ * prefix trie which is then compiled to a dense table of transitions over
+ * classes of input characters
  */
 
 struct rspamd_trie_match;
+struct rspamd_trie_node;
 
 struct rspamd_trie_state {
-	struct rspamd_trie_state *next;
-	struct rspamd_trie_state *fail;
 	struct rspamd_trie_match *match;
-	guint final;
 	gint id;
+	guint depth;
+	guint idx;
 };
 
 struct rspamd_trie_match {
@@ -50,8 +52,13 @@ struct rspamd_trie_match {
 
 typedef struct rspamd_trie_s {
 	struct rspamd_trie_state root;
-	GPtrArray *fail_states;
 	gboolean icase;
+	gboolean compiled;
+	guint nstates;                          /**< number of states in trie			*/
+	guint nclasses;                         /**< number of characters classes		*/
+	guint16 classes[256];                   /**< class of each input character		*/
+	guint32 *delta;                         /**< transitions table					*/
+	struct rspamd_trie_node *nodes;         /**< compiled states					*/
 	rspamd_mempool_t *pool;
 } rspamd_trie_t;
 
@@ -70,19 +77,51 @@ void rspamd_trie_insert (rspamd_trie_t *trie,
 	const gchar *pattern,
 	gint pattern_id);
 
+/*
+ * Compile trie to the transitions table. Trie is compiled automatically on
+ * the first lookup after insertions, however, tries that are used from
+ * several threads must be compiled explicitly after all insertions
+ * @param trie suffix trie
+ */
+void rspamd_trie_compile (rspamd_trie_t *trie);
+
 /*
  * Search for a text using suffix trie
  * @param trie suffix trie
  * @param buffer a text where to search for trie patterns
  * @param buflen a length of text
  * @param mached_id on a successfull search here would be stored id of pattern found
- * @return Position in a text where pattern was found or NULL if no patterns were found
+ * @return Position in a text where the first pattern found begins or NULL if no patterns were found
  */
 const gchar * rspamd_trie_lookup (rspamd_trie_t *trie,
 	const gchar *buffer,
 	gsize buflen,
 	gint *matched_id);
 
+/*
+ * Callback for a multiple patterns search
+ * @param id id of the pattern found
+ * @param pos position of the last character of the pattern in a text
+ * @param ud opaque user data
+ * @return FALSE to stop search
+ */
+typedef gboolean (*rspamd_trie_cb_t)(gint id, const gchar *pos, void *ud);
+
+/*
+ * Search for all patterns in a text using a single pass over it
+ * @param trie suffix trie
+ * @param buffer a text where to search for trie patterns
+ * @param buflen a length of text
+ * @param cb callback that is called for each match found (including overlapping ones)
+ * @param ud opaque data for callback
+ * @return number of matches found
+ */
+gint rspamd_trie_lookup_all (rspamd_trie_t *trie,
+	const gchar *buffer,
+	gsize buflen,
+	rspamd_trie_cb_t cb,
+	void *ud);
+
 /*
  * Deallocate suffix trie
  */
@@ -41,6 +41,9 @@
 #ifdef HAVE_TERMIOS_H
 #include <termios.h>
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef HAVE_READPASSPHRASE_H
 #include <readpassphrase.h>
 #endif
@@ -657,6 +660,112 @@ rspamd_str_lc (gchar *str, guint size)
 	}
 }
 
+/* Check continuation bytes of a sequence, the second byte has its own range */
+static inline gboolean
+rspamd_utf8_check_seq (const guchar *p, guint n, guchar lo, guchar hi)
+{
+	guint i;
+
+	if (p[1] < lo || p[1] > hi) {
+		return FALSE;
+	}
+
+	for (i = 2; i <= n; i ++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fast_utf8_validate (const guchar *data, gsize len)
+{
+	const guchar *p = data, *end = data + len;
+	guint n;
+	guchar lo, hi;
+#ifdef __SSE2__
+	__m128i v, zero = _mm_setzero_si128 ();
+	gint mask;
+#else
+	guint64 w;
+#endif
+
+	while (p < end) {
+#ifdef __SSE2__
+		if (end - p >= 16) {
+			v = _mm_loadu_si128 ((const __m128i *)p);
+			/* High bit is set for non ascii bytes and for NUL after compare */
+			mask = _mm_movemask_epi8 (_mm_or_si128 (v,
+					_mm_cmpeq_epi8 (v, zero)));
+
+			if (mask == 0) {
+				p += 16;
+				continue;
+			}
+
+			p += g_bit_nth_lsf (mask, -1);
+		}
+#else
+		if (end - p >= 8) {
+			memcpy (&w, p, sizeof (w));
+
+			if (((w | ((w - 0x0101010101010101ULL) & ~w)) &
+				0x8080808080808080ULL) == 0) {
+				p += 8;
+				continue;
+			}
+		}
+#endif
+
+		if (*p < 0x80) {
+			if (*p == '\0') {
+				return FALSE;
+			}
+			p ++;
+			continue;
+		}
+
+		/* Forbid overlong forms, surrogates and codepoints above U+10FFFF */
+		lo = 0x80;
+		hi = 0xbf;
+
+		if (*p >= 0xc2 && *p <= 0xdf) {
+			n = 1;
+		}
+		else if (*p >= 0xe0 && *p <= 0xef) {
+			n = 2;
+			if (*p == 0xe0) {
+				lo = 0xa0;
+			}
+			else if (*p == 0xed) {
+				hi = 0x9f;
+			}
+		}
+		else if (*p >= 0xf0 && *p <= 0xf4) {
+			n = 3;
+			if (*p == 0xf0) {
+				lo = 0x90;
+			}
+			else if (*p == 0xf4) {
+				hi = 0x8f;
+			}
+		}
+		else {
+			return FALSE;
+		}
+
+		if ((gsize)(end - p) <= n || !rspamd_utf8_check_seq (p, n, lo, hi)) {
+			return FALSE;
+		}
+
+		p += n + 1;
+	}
+
+	return TRUE;
+}
+
 #ifndef HAVE_SETPROCTITLE
 
 static gchar *title_buffer = 0;
@@ -2166,12 +2275,6 @@ rspamd_decode_base32 (const gchar *in, gsize inlen, gsize *outlen)
 	for (i = 0; i < inlen; i ++) {
 		c = (guchar)in[i];
 
-		if (processed_bits >= 8) {
-			processed_bits -= 8;
-			res[olen++] = acc & 0xFF;
-			acc >>= 8;
-		}
-
 		decoded = b32_dec[c];
 		if (decoded == 0xff) {
 			g_free (res);
@@ -2180,13 +2283,16 @@ rspamd_decode_base32 (const gchar *in, gsize inlen, gsize *outlen)
 
 		acc = (decoded << processed_bits) | acc;
 		processed_bits += 5;
-	}
 
-	if (processed_bits > 0) {
-		res[olen++] = (acc & 0xFF);
+		if (processed_bits >= 8) {
+			processed_bits -= 8;
+			res[olen++] = acc & 0xFF;
+			acc >>= 8;
+		}
 	}
 
-	*outlen = olen > 0 ? olen - 1 : 0;
+	/* Bits left are the padding of the last character */
+	*outlen = olen;
 
 	return res;
 }
@@ -110,6 +110,12 @@ void rspamd_pass_signal (GHashTable *, gint );
  */
 void rspamd_str_lc (gchar *str, guint size);
 
+/*
+ * Check that text is valid utf8, unlike g_utf8_validate ascii text is checked
+ * by blocks. NUL characters are treated as invalid like in g_utf8_validate.
+ */
+gboolean rspamd_fast_utf8_validate (const guchar *data, gsize len);
+
 #ifndef HAVE_SETPROCTITLE
 /*
  * Process title utility functions
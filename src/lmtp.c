@@ -117,17 +117,12 @@ rcpt_destruct (void *pointer)
 static void
 free_lmtp_task (struct rspamd_lmtp_proto *lmtp, gboolean is_soft)
 {
-	GList *part;
-	struct mime_part *p;
 	struct rspamd_task *task = lmtp->task;
 
 	if (lmtp) {
 		debug_task ("free pointer %p", lmtp->task);
-		while ((part = g_list_first (lmtp->task->parts))) {
-			lmtp->task->parts = g_list_remove_link (lmtp->task->parts, part);
-			p = (struct mime_part *)part->data;
-			g_byte_array_free (p->content, FALSE);
-			g_list_free_1 (part);
+		if (lmtp->task->parts) {
+			g_list_free (lmtp->task->parts);
 		}
 		rspamd_mempool_delete (lmtp->task->task_pool);
 		if (is_soft) {
@@ -28,6 +28,7 @@
 #include "util.h"
 #include "lmtp.h"
 #include "lmtp_proto.h"
+#include "message.h"
 
 /* Max line size as it is defined in rfc2822 */
 #define OUTBUFSIZ 1000
@@ -449,6 +450,10 @@ mta_read_socket (rspamd_fstring_t * in, void *arg)
 			close_mta_connection (cd, FALSE);
 			return FALSE;
 		}
+		if (message_get_gmime (cd->task) == NULL) {
+			close_mta_connection (cd, FALSE);
+			return FALSE;
+		}
 		c = g_mime_object_to_string ((GMimeObject *) cd->task->message);
 		r = strlen (c);
 		if (!rspamd_dispatcher_write (cd->task->dispatcher, c, r, TRUE, TRUE)) {
@@ -673,7 +678,8 @@ lmtp_deliver_lda (struct rspamd_task *task)
 	close (p[0]);
 	stream = g_mime_stream_fs_new (p[1]);
 
-	if (g_mime_object_write_to_stream ((GMimeObject *) task->message,
+	if (message_get_gmime (task) == NULL ||
+		g_mime_object_write_to_stream ((GMimeObject *) task->message,
 		stream) == -1) {
 		g_strfreev (argv);
 		msg_info ("cannot write stream to lda");
@@ -205,6 +205,13 @@ LUA_FUNCTION_DEF (config, register_virtual_symbol);
  */
 LUA_FUNCTION_DEF (config, register_callback_symbol);
 LUA_FUNCTION_DEF (config, register_callback_symbol_priority);
+/***
+ * @method rspamd_config:register_dependency(name, dependency)
+ * Make symbol `name` to be checked only after symbol `dependency` is checked.
+ * @param {string} name name of dependent symbol
+ * @param {string} dependency name of symbol that should be checked first
+ */
+LUA_FUNCTION_DEF (config, register_dependency);
 /***
  * @method rspamd_config:register_pre_filter(callback)
  * Register function to be called prior to symbols processing.
@@ -289,6 +296,7 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, register_virtual_symbol),
 	LUA_INTERFACE_DEF (config, register_callback_symbol),
 	LUA_INTERFACE_DEF (config, register_callback_symbol_priority),
+	LUA_INTERFACE_DEF (config, register_dependency),
 	LUA_INTERFACE_DEF (config, register_module_option),
 	LUA_INTERFACE_DEF (config, register_pre_filter),
 	LUA_INTERFACE_DEF (config, register_post_filter),
@@ -1088,6 +1096,23 @@ lua_config_register_callback_symbol_priority (lua_State * L)
 	return 0;
 }
 
+static gint
+lua_config_register_dependency (lua_State * L)
+{
+	struct rspamd_config *cfg = lua_check_config (L);
+	const gchar *name, *from;
+
+	if (cfg) {
+		name = luaL_checkstring (L, 2);
+		from = luaL_checkstring (L, 3);
+
+		if (name && from) {
+			register_dependency (cfg->cache, name, from);
+		}
+	}
+
+	return 0;
+}
 
 static gint
 lua_config_newindex (lua_State *L)
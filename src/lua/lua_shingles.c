@@ -0,0 +1,405 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lua_common.h"
+#include "shingles.h"
+
+/***
+ * Rspamd shingles module allows to compare shingles and to find similar
+ * shingles in an index. Shingle is represented either as a binary string of
+ * 32 64 bit hashes in host byte order or as a table of 32 hashes.
+ *
+ * Lua numbers cannot represent all 64 bit values, so hashes and ids could be
+ * also passed as decimal strings or as 8 byte binary strings in host byte
+ * order. Ids are returned as numbers if they fit the 53 bit mantissa and as
+ * decimal strings otherwise
+ * @module rspamd_shingles
+ * @example
+ * local rspamd_shingles = require "rspamd_shingles"
+ *
+ * local idx = rspamd_shingles.create_index()
+ * idx:add(1, sgl1)
+ * local id, similarity = idx:best(sgl2)
+ */
+
+LUA_FUNCTION_DEF (shingles, compare);
+LUA_FUNCTION_DEF (shingles, create_index);
+LUA_FUNCTION_DEF (shingle_index, add);
+LUA_FUNCTION_DEF (shingle_index, remove);
+LUA_FUNCTION_DEF (shingle_index, lookup);
+LUA_FUNCTION_DEF (shingle_index, best);
+LUA_FUNCTION_DEF (shingle_index, size);
+LUA_FUNCTION_DEF (shingle_index, destroy);
+
+static const struct luaL_reg shingle_indexlib_m[] = {
+	LUA_INTERFACE_DEF (shingle_index, add),
+	LUA_INTERFACE_DEF (shingle_index, remove),
+	LUA_INTERFACE_DEF (shingle_index, lookup),
+	LUA_INTERFACE_DEF (shingle_index, best),
+	LUA_INTERFACE_DEF (shingle_index, size),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_shingle_index_destroy},
+	{NULL, NULL}
+};
+static const struct luaL_reg shingleslib_f[] = {
+	LUA_INTERFACE_DEF (shingles, compare),
+	LUA_INTERFACE_DEF (shingles, create_index),
+	{NULL, NULL}
+};
+
+static struct rspamd_shingle_index *
+lua_check_shingle_index (lua_State * L)
+{
+	void *ud = luaL_checkudata (L, 1, "rspamd{shingle_index}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'shingle_index' expected");
+	return ud ? *((struct rspamd_shingle_index **)ud) : NULL;
+}
+
+/* Largest integer that is represented exactly by lua number */
+#define LUA_SHINGLES_MAX_EXACT (G_GUINT64_CONSTANT (1) << 53)
+
+/*
+ * Reads 64 bit value from number, decimal string or 8 byte binary string
+ */
+static gboolean
+lua_check_uint64 (lua_State *L, gint pos, guint64 *val)
+{
+	const gchar *data;
+	gchar *end;
+	gsize len;
+
+	if (lua_type (L, pos) == LUA_TNUMBER) {
+		*val = (guint64)lua_tonumber (L, pos);
+
+		return TRUE;
+	}
+	else if (lua_type (L, pos) == LUA_TSTRING) {
+		data = lua_tolstring (L, pos, &len);
+
+		if (len > 0 && strspn (data, "0123456789") == len) {
+			errno = 0;
+			*val = strtoull (data, &end, 10);
+
+			return errno == 0 && *end == '\0';
+		}
+		else if (len == sizeof (*val)) {
+			memcpy (val, data, sizeof (*val));
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void
+lua_push_uint64 (lua_State *L, guint64 val)
+{
+	gchar numbuf[32];
+
+	if (val <= LUA_SHINGLES_MAX_EXACT) {
+		lua_pushnumber (L, val);
+	}
+	else {
+		rspamd_snprintf (numbuf, sizeof (numbuf), "%uL", val);
+		lua_pushstring (L, numbuf);
+	}
+}
+
+/*
+ * Reads shingle from string or table at the specified position
+ */
+static gboolean
+lua_check_shingle (lua_State *L, gint pos, struct rspamd_shingle *sgl)
+{
+	const gchar *data;
+	gsize len;
+	gint i;
+
+	if (lua_type (L, pos) == LUA_TSTRING) {
+		data = lua_tolstring (L, pos, &len);
+
+		if (len != sizeof (*sgl)) {
+			return FALSE;
+		}
+
+		memcpy (sgl, data, sizeof (*sgl));
+	}
+	else if (lua_type (L, pos) == LUA_TTABLE) {
+		if (lua_objlen (L, pos) != RSPAMD_SHINGLE_SIZE) {
+			return FALSE;
+		}
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			lua_rawgeti (L, pos, i + 1);
+
+			if (!lua_check_uint64 (L, -1, &sgl->hashes[i])) {
+				lua_pop (L, 1);
+
+				return FALSE;
+			}
+
+			lua_pop (L, 1);
+		}
+	}
+	else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/***
+ * @function rspamd_shingles.compare(a, b)
+ * Compares two shingles
+ * @param {string|table} a the first shingle
+ * @param {string|table} b the second shingle
+ * @return {number} similarity from 0.0 to 1.0 or nil if shingles are invalid
+ */
+static gint
+lua_shingles_compare (lua_State *L)
+{
+	struct rspamd_shingle a, b;
+
+	if (lua_check_shingle (L, 1, &a) && lua_check_shingle (L, 2, &b)) {
+		lua_pushnumber (L, rspamd_shingles_compare (&a, &b));
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @function rspamd_shingles.create_index([bands])
+ * Creates new shingles index
+ * @param {number} bands number of bands, more bands find less similar shingles
+ * @return {shingle_index} new index
+ */
+static gint
+lua_shingles_create_index (lua_State *L)
+{
+	struct rspamd_shingle_index **pidx;
+	guint bands = RSPAMD_SHINGLE_INDEX_BANDS;
+
+	if (lua_gettop (L) >= 1) {
+		bands = luaL_checknumber (L, 1);
+	}
+
+	pidx = lua_newuserdata (L, sizeof (struct rspamd_shingle_index *));
+	rspamd_lua_setclass (L, "rspamd{shingle_index}", -1);
+	*pidx = rspamd_shingle_index_new (bands);
+
+	return 1;
+}
+
+/***
+ * @method shingle_index:add(id, shingle)
+ * Adds shingle to the index replacing the previous shingle with the same id
+ * @param {number|string} id id of shingle
+ * @param {string|table} shingle shingle to add
+ * @return {boolean} true if shingle has been added
+ */
+static gint
+lua_shingle_index_add (lua_State *L)
+{
+	struct rspamd_shingle_index *idx = lua_check_shingle_index (L);
+	struct rspamd_shingle sgl;
+	guint64 id;
+
+	if (idx && lua_check_uint64 (L, 2, &id) && lua_check_shingle (L, 3, &sgl)) {
+		rspamd_shingle_index_insert (idx, &sgl, id);
+		lua_pushboolean (L, TRUE);
+	}
+	else {
+		lua_pushboolean (L, FALSE);
+	}
+
+	return 1;
+}
+
+/***
+ * @method shingle_index:remove(id)
+ * Removes shingle from the index
+ * @param {number|string} id id of shingle
+ * @return {boolean} true if shingle has been removed
+ */
+static gint
+lua_shingle_index_remove (lua_State *L)
+{
+	struct rspamd_shingle_index *idx = lua_check_shingle_index (L);
+	guint64 id;
+
+	if (idx && lua_check_uint64 (L, 2, &id)) {
+		lua_pushboolean (L, rspamd_shingle_index_remove (idx, id));
+	}
+	else {
+		lua_pushboolean (L, FALSE);
+	}
+
+	return 1;
+}
+
+struct lua_shingle_index_cbdata {
+	lua_State *L;
+	gint n;
+};
+
+static void
+lua_shingle_index_lookup_cb (guint64 id, gdouble similarity, gpointer ud)
+{
+	struct lua_shingle_index_cbdata *cbd = ud;
+	lua_State *L = cbd->L;
+
+	lua_newtable (L);
+	lua_pushstring (L, "id");
+	lua_push_uint64 (L, id);
+	lua_settable (L, -3);
+	lua_pushstring (L, "similarity");
+	lua_pushnumber (L, similarity);
+	lua_settable (L, -3);
+	lua_rawseti (L, -2, ++cbd->n);
+}
+
+/***
+ * @method shingle_index:lookup(shingle[, min_similarity])
+ * Finds shingles similar to the specified one
+ * @param {string|table} shingle shingle to find
+ * @param {number} min_similarity minimal similarity of shingles to return
+ * @return {table} array of tables with `id` and `similarity` fields
+ */
+static gint
+lua_shingle_index_lookup (lua_State *L)
+{
+	struct rspamd_shingle_index *idx = lua_check_shingle_index (L);
+	struct rspamd_shingle sgl;
+	struct lua_shingle_index_cbdata cbd;
+	gdouble min_similarity = 0.0;
+
+	if (idx && lua_check_shingle (L, 2, &sgl)) {
+		if (lua_gettop (L) >= 3) {
+			min_similarity = luaL_checknumber (L, 3);
+		}
+
+		lua_newtable (L);
+		cbd.L = L;
+		cbd.n = 0;
+		rspamd_shingle_index_lookup (idx, &sgl, min_similarity,
+				lua_shingle_index_lookup_cb, &cbd);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @method shingle_index:best(shingle)
+ * Finds the most similar shingle
+ * @param {string|table} shingle shingle to find
+ * @return {number|string,number} id and similarity of the best shingle or nil
+ */
+static gint
+lua_shingle_index_best (lua_State *L)
+{
+	struct rspamd_shingle_index *idx = lua_check_shingle_index (L);
+	struct rspamd_shingle sgl;
+	guint64 id;
+	gdouble similarity;
+
+	if (idx && lua_check_shingle (L, 2, &sgl) &&
+			rspamd_shingle_index_best (idx, &sgl, &id, &similarity)) {
+		lua_push_uint64 (L, id);
+		lua_pushnumber (L, similarity);
+
+		return 2;
+	}
+
+	lua_pushnil (L);
+
+	return 1;
+}
+
+/***
+ * @method shingle_index:size()
+ * @return {number} number of shingles in the index
+ */
+static gint
+lua_shingle_index_size (lua_State *L)
+{
+	struct rspamd_shingle_index *idx = lua_check_shingle_index (L);
+
+	if (idx) {
+		lua_pushnumber (L, rspamd_shingle_index_size (idx));
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static gint
+lua_shingle_index_destroy (lua_State *L)
+{
+	struct rspamd_shingle_index **pidx = luaL_checkudata (L, 1,
+			"rspamd{shingle_index}");
+
+	if (pidx && *pidx) {
+		rspamd_shingle_index_destroy (*pidx);
+		/* Methods called after destruction should see an empty index */
+		*pidx = NULL;
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_shingles (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, shingleslib_f);
+
+	return 1;
+}
+
+void
+luaopen_shingles (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{shingle_index}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{shingle_index}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, shingle_indexlib_m);
+	lua_pop (L, 1);                      /* remove metatable from stack */
+
+	rspamd_lua_add_preload (L, "rspamd_shingles", lua_load_shingles);
+}
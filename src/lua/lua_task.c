@@ -405,7 +405,8 @@ LUA_FUNCTION_DEF (task, get_metric_action);
  * `bayes` classifier.
  * @param {boolean} is_spam learn spam or ham
  * @param {string} classifier classifier's name
- * @return {boolean} `true` if classifier has been learnt successfully
+ * @return {boolean} `true` if classifier has been learnt successfully (or if
+ * learning has been started for statfiles that are loaded asynchronously)
  */
 LUA_FUNCTION_DEF (task, learn);
 /***
@@ -511,6 +512,13 @@ LUA_FUNCTION_DEF (textpart, get_fuzzy);
  * @return {string} language code for the part or nil if language has not been detected
  */
 LUA_FUNCTION_DEF (textpart, get_language);
+/***
+ * @method textpart:get_scripts()
+ * Return number of letters of each unicode script found in the sample of the
+ * part used for language detection
+ * @return {table} table indexed by script names (such as `cyrillic`)
+ */
+LUA_FUNCTION_DEF (textpart, get_scripts);
 /***
  * @method textpart:compare_distance(part)
  * Compares two parts
@@ -526,6 +534,7 @@ static const struct luaL_reg textpartlib_m[] = {
 	LUA_INTERFACE_DEF (textpart, is_html),
 	LUA_INTERFACE_DEF (textpart, get_fuzzy),
 	LUA_INTERFACE_DEF (textpart, get_language),
+	LUA_INTERFACE_DEF (textpart, get_scripts),
 	LUA_INTERFACE_DEF (textpart, compare_distance),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
@@ -783,7 +792,7 @@ lua_task_get_message (lua_State * L)
 	GMimeMessage **pmsg;
 	struct rspamd_task *task = lua_check_task (L);
 
-	if (task != NULL && task->message != NULL) {
+	if (task != NULL && message_get_gmime (task) != NULL) {
 		pmsg = lua_newuserdata (L, sizeof (GMimeMessage *));
 		rspamd_lua_setclass (L, "rspamd{message}", -1);
 		*pmsg = task->message;
@@ -1742,6 +1751,7 @@ static gint
 lua_task_get_date (lua_State *L)
 {
 	struct rspamd_task *task = lua_check_task (L);
+	struct raw_header *rh;
 	gdouble tim;
 	enum lua_date_type type = DATE_CONNECT;
 	gboolean gmt = TRUE;
@@ -1768,10 +1778,11 @@ lua_task_get_date (lua_State *L)
 			}
 		}
 		else {
-			if (task->message) {
+			rh = g_hash_table_lookup (task->raw_headers, "Date");
+			if (rh != NULL) {
 				time_t tt;
 				gint offset;
-				g_mime_message_get_date (task->message, &tt, &offset);
+				tt = g_mime_utils_header_decode_date (rh->value, &offset);
 
 				if (!gmt) {
 					tt += (offset * 60 * 60) / 100 + (offset * 60 * 60) % 100;
@@ -2104,6 +2115,33 @@ lua_textpart_get_language (lua_State * L)
 	return 1;
 }
 
+static gint
+lua_textpart_get_scripts (lua_State * L)
+{
+	struct mime_text_part *part = lua_check_textpart (L);
+	const gchar *name;
+	guint i;
+
+	if (part == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	lua_newtable (L);
+
+	for (i = 0; i < part->nscripts; i ++) {
+		name = rspamd_script_name (part->scripts[i].script);
+
+		if (name != NULL) {
+			lua_pushstring (L, name);
+			lua_pushnumber (L, part->scripts[i].count);
+			lua_settable (L, -3);
+		}
+	}
+
+	return 1;
+}
+
 /***
  * @method text_part:compare_distance(other)
  * Calculates the difference to another text part.  This function is intended to work with
@@ -2119,23 +2157,12 @@ lua_textpart_compare_distance (lua_State * L)
 	struct mime_text_part *part = lua_check_textpart (L), *other;
 	void *ud = luaL_checkudata (L, 2, "rspamd{textpart}");
 	gint diff = -1;
-	GMimeObject *parent;
-	const GMimeContentType *ct;
 
 	luaL_argcheck (L, ud != NULL, 2, "'textpart' expected");
 	other = ud ? *((struct mime_text_part **)ud) : NULL;
 
 	if (other != NULL && part->parent && part->parent == other->parent) {
-		parent = part->parent;
-		ct = g_mime_object_get_content_type (parent);
-#ifndef GMIME24
-		if (ct == NULL ||
-			!g_mime_content_type_is_type (ct, "multipart", "alternative")) {
-#else
-		if (ct == NULL ||
-			!g_mime_content_type_is_type ((GMimeContentType *)ct, "multipart",
-			"alternative")) {
-#endif
+		if (g_ascii_strcasecmp (part->parent->subtype, "alternative") != 0) {
 			diff = -1;
 
 		}
@@ -2172,13 +2199,15 @@ static gint
 lua_mimepart_get_content (lua_State * L)
 {
 	struct mime_part *part = lua_check_mimepart (L);
+	GByteArray *content;
 
 	if (part == NULL) {
 		lua_pushnil (L);
 		return 1;
 	}
 
-	lua_pushlstring (L, (const gchar *)part->content->data, part->content->len);
+	content = mime_part_get_content (part);
+	lua_pushlstring (L, (const gchar *)content->data, content->len);
 
 	return 1;
 }
@@ -2193,7 +2222,7 @@ lua_mimepart_get_length (lua_State * L)
 		return 1;
 	}
 
-	lua_pushinteger (L, part->content->len);
+	lua_pushinteger (L, mime_part_get_content (part)->len);
 
 	return 1;
 }
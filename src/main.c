@@ -577,7 +577,8 @@ af_cmp_workaround (const void *a, const void *b)
 }
 
 static GList *
-create_listen_socket (rspamd_inet_addr_t *addrs, guint cnt, gint listen_type)
+create_listen_socket (rspamd_inet_addr_t *addrs, guint cnt, gint listen_type,
+	gboolean reuseport)
 {
 	GList *result = NULL;
 	gint fd;
@@ -586,7 +587,8 @@ create_listen_socket (rspamd_inet_addr_t *addrs, guint cnt, gint listen_type)
 	/* Fuck morons that have invented ipv6/v4 sockets */
 	qsort (addrs, cnt, sizeof (*addrs), af_cmp_workaround);
 	for (i = 0; i < cnt; i ++) {
-		fd = rspamd_inet_address_listen (&addrs[i], listen_type, TRUE);
+		fd = rspamd_inet_address_listen (&addrs[i], listen_type, TRUE,
+				reuseport);
 		if (fd != -1) {
 			result = g_list_prepend (result, GINT_TO_POINTER (fd));
 		}
@@ -701,7 +703,7 @@ spawn_workers (struct rspamd_main *rspamd)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									cf->worker->listen_type, cf->worker->reuseport);
 						}
 						else {
 							ls = systemd_get_socket (bcf->cnt);
@@ -863,9 +865,8 @@ init_cfg_cache (struct rspamd_config *cfg)
 static void
 print_symbols_cache (struct rspamd_config *cfg)
 {
-	GList *cur;
 	struct cache_item *item;
-	gint i;
+	guint i;
 
 	if (!init_symbols_cache (cfg->cfg_pool, cfg->cache, cfg,
 		cfg->cache_filename, TRUE)) {
@@ -877,38 +878,18 @@ print_symbols_cache (struct rspamd_config *cfg)
 			"-----------------------------------------------------------------\n");
 		printf (
 			"| Pri  | Symbol                | Weight | Frequency | Avg. time |\n");
-		i = 0;
-		cur = cfg->cache->negative_items;
-		while (cur) {
-			item = cur->data;
+		for (i = 0; i < cfg->cache->items_by_order->d->len; i ++) {
+			item = g_ptr_array_index (cfg->cache->items_by_order->d, i);
 			if (!item->is_callback) {
 				printf (
 						"-----------------------------------------------------------------\n");
-				printf ("| %3d | %22s | %6.1f | %9d | %9.3f |\n",
+				printf ("| %3u | %22s | %6.1f | %9d | %9.3f |\n",
 					i,
 					item->s->symbol,
 					item->s->weight,
 					item->s->frequency,
 					item->s->avg_time);
 			}
-			cur = g_list_next (cur);
-			i++;
-		}
-		cur = cfg->cache->static_items;
-		while (cur) {
-			item = cur->data;
-			if (!item->is_callback) {
-				printf (
-						"-----------------------------------------------------------------\n");
-				printf ("| %3d | %22s | %6.1f | %9d | %9.3f |\n",
-					i,
-					item->s->symbol,
-					item->s->weight,
-					item->s->frequency,
-					item->s->avg_time);
-			}
-			cur = g_list_next (cur);
-			i++;
 		}
 
 		printf (
@@ -1113,13 +1094,8 @@ rspamd_init_cfg (struct rspamd_config *cfg)
 		(rspamd_mempool_destruct_t)lua_close, cfg->lua_state);
 
 	/* Pre-init of cache */
-	cfg->cache = g_new0 (struct symbols_cache, 1);
-	cfg->cache->static_pool = rspamd_mempool_new (
-		rspamd_mempool_suggest_size ());
+	cfg->cache = rspamd_symbols_cache_new ();
 	cfg->cache->cfg = cfg;
-	cfg->cache->items_by_symbol = g_hash_table_new (
-		rspamd_str_hash,
-		rspamd_str_equal);
 }
 
 static void
@@ -1378,6 +1354,10 @@ main (gint argc, gchar **argv, gchar **env)
 			rspamd_main->cfg->history_file);
 	}
 
+	/* Shared dns cache is inherited by all workers, so its size is not reloaded */
+	rspamd_main->dns_cache = rspamd_dns_shared_cache_new (
+		rspamd_main->server_pool, rspamd_main->cfg->dns_shared_cache_size);
+
 	/* Spawn workers */
 	rspamd_main->workers = g_hash_table_new (g_direct_hash, g_direct_equal);
 	spawn_workers (rspamd_main);
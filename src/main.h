@@ -94,6 +94,10 @@ struct rspamd_stat {
 	guint messages_learned;                             /**< messages learned								*/
 	guint fuzzy_hashes;                                 /**< number of fuzzy hashes stored					*/
 	guint fuzzy_hashes_expired;                         /**< number of fuzzy hashes expired					*/
+	guint dns_cache_hits;                               /**< dns replies taken from cache					*/
+	guint dns_cache_misses;                             /**< dns queries sent to servers					*/
+	guint dns_requests_coalesced;                       /**< dns requests joined to pending queries			*/
+	guint dns_shared_hits;                              /**< dns replies taken from other workers			*/
 };
 
 /**
@@ -115,6 +119,7 @@ struct rspamd_main {
 	gid_t workers_gid;                                          /**< worker's gid running to						*/
 	gboolean is_privilleged;                                    /**< true if run in privilleged mode                */
 	struct roll_history *history;                               /**< rolling history								*/
+	struct rspamd_dns_shared_cache *dns_cache;                  /**< dns replies shared by workers					*/
 };
 
 /**
@@ -81,6 +81,7 @@ struct fuzzy_rule {
 	double max_score;
 	gboolean read_only;
 	gboolean skip_unknown;
+	gboolean fast_shingles;
 };
 
 struct fuzzy_ctx {
@@ -348,6 +349,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj)
 	if ((value = ucl_object_find_key (obj, "skip_unknown")) != NULL) {
 		rule->skip_unknown = ucl_obj_toboolean (value);
 	}
+	if ((value = ucl_object_find_key (obj, "fast_shingles")) != NULL) {
+		rule->fast_shingles = ucl_obj_toboolean (value);
+	}
 
 	if ((value = ucl_object_find_key (obj, "servers")) != NULL) {
 		rule->servers = rspamd_upstreams_create ();
@@ -629,9 +633,15 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 		blake2b_final (&st, shcmd->basic.digest, sizeof (shcmd->basic.digest));
 
 		msg_debug ("loading shingles with key %*xs", 16, rule->shingles_key->str);
-		sh = rspamd_shingles_generate (words,
-				rule->shingles_key->str, pool,
-				rspamd_shingles_default_filter, NULL);
+		if (rule->fast_shingles) {
+			sh = rspamd_shingles_generate_fast (words,
+					rule->shingles_key->str, pool);
+		}
+		else {
+			sh = rspamd_shingles_generate (words,
+					rule->shingles_key->str, pool,
+					rspamd_shingles_default_filter, NULL);
+		}
 		if (sh != NULL) {
 			memcpy (&shcmd->sgl, sh, sizeof (shcmd->sgl));
 			shcmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
@@ -1088,8 +1098,8 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 	cur = task->parts;
 	while (cur) {
 		mime_part = cur->data;
-		if (mime_part->content->len > 0 &&
-			fuzzy_check_content_type (rule, mime_part->type)) {
+		if (fuzzy_check_content_type (rule, mime_part->type) &&
+			mime_part_get_content (mime_part)->len > 0) {
 			if (fuzzy_module_ctx->min_bytes <= 0 || mime_part->content->len >=
 				fuzzy_module_ctx->min_bytes) {
 				if (c == FUZZY_CHECK) {
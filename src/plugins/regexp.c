@@ -31,10 +31,13 @@
 #include "libmime/message.h"
 #include "libmime/expressions.h"
 #include "libutil/map.h"
+#include "libutil/trie.h"
 #include "lua/lua_common.h"
 #include "main.h"
 
 #define DEFAULT_STATFILE_PREFIX "./"
+/* Minimal length of a literal that is worth to be used for prefiltering */
+#define PREFILTER_MIN_LITERAL 3
 
 struct regexp_module_item {
 	struct expression *expr;
@@ -50,6 +53,30 @@ struct regexp_ctx {
 	gsize max_size;
 	gsize max_threads;
 	GThreadPool *workers;
+
+	GHashTable *prefilters;
+	GHashTable *re_prefilters;
+	guint nprefilters;
+};
+
+/*
+ * Group of regexps of the same type that are matched against the same
+ * data (e.g. all regexps for `Subject` header or all mime regexps). For each
+ * regexp in a group we extract a literal that must be present in data for the
+ * regexp to match. All literals of a group are compiled into a single trie,
+ * so data is scanned once per task and all regexps whose literals are not
+ * found are marked as not matched in the task's cache without running them.
+ */
+struct regexp_prefilter {
+	enum rspamd_regexp_type type;
+	const gchar *header;
+	gboolean is_strong;
+	gboolean is_raw;
+	guint idx;
+	rspamd_trie_t *trie;            /**< case sensitive literals				*/
+	rspamd_trie_t *itrie;           /**< case insensitive literals			*/
+	GHashTable *literals_idx;       /**< literal -> id						*/
+	GPtrArray *literals;            /**< id -> array of regexps				*/
 };
 
 /* Lua regexp module for checking rspamd regexps */
@@ -111,65 +138,57 @@ module_t regexp_module = {
 	NULL
 };
 
-/* Task cache functions */
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-static GStaticMutex task_cache_mtx = G_STATIC_MUTEX_INIT;
-#else
-G_LOCK_DEFINE (task_cache_mtx);
-#endif
+/*
+ * Task cache functions
+ *
+ * Task cache is a vector of two bits per regexp indexed by regexp id: the
+ * lower bit means that regexp has been checked and the higher one means
+ * that it has been matched. A new result replaces the previous one, so slots
+ * are updated by compare and swap to be safe for the threaded workers.
+ * Regexps that are parsed after task creation are not cached.
+ */
+#define TASK_CACHE_SHIFT(id) (((id) % 16) * 2)
 
 void
 task_cache_add (struct rspamd_task *task,
 	struct rspamd_regexp *re,
 	gint32 result)
 {
-	if (result == 0) {
-		result = -1;
+	guint32 bits, mask, old, *slot;
+
+	if (re->id >= task->re_cache_len) {
+		return;
 	}
-	/* Avoid concurrenting inserting of results */
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_lock (&task_cache_mtx);
-#else
-	G_LOCK (task_cache_mtx);
-#endif
-	g_hash_table_insert (task->re_cache, re->regexp_text,
-		GINT_TO_POINTER (result));
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_unlock (&task_cache_mtx);
+
+	slot = &task->re_cache[re->id / 16];
+	mask = 3U << TASK_CACHE_SHIFT (re->id);
+	bits = (result ? 3U : 1U) << TASK_CACHE_SHIFT (re->id);
+#ifdef HAVE_ATOMIC_BUILTINS
+	do {
+		old = *slot;
+	} while (!__sync_bool_compare_and_swap (slot, old, (old & ~mask) | bits));
 #else
-	G_UNLOCK (task_cache_mtx);
+	old = *slot;
+	*slot = (old & ~mask) | bits;
 #endif
 }
 
 gint32
 task_cache_check (struct rspamd_task *task, struct rspamd_regexp *re)
 {
-	gpointer res;
-	gint32 r;
+	guint32 bits;
 
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_lock (&task_cache_mtx);
-#else
-	G_LOCK (task_cache_mtx);
-#endif
-	if ((res = g_hash_table_lookup (task->re_cache, re->regexp_text)) != NULL) {
-		r = GPOINTER_TO_INT (res);
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-		g_static_mutex_unlock (&task_cache_mtx);
-#else
-		G_UNLOCK (task_cache_mtx);
-#endif
-		if (r == -1) {
-			return 0;
-		}
-		return 1;
+	if (re->id >= task->re_cache_len) {
+		return -1;
 	}
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
-	g_static_mutex_unlock (&task_cache_mtx);
-#else
-	G_UNLOCK (task_cache_mtx);
-#endif
-	return -1;
+
+	bits = (task->re_cache[re->id / 16] >> TASK_CACHE_SHIFT (re->id)) & 3;
+
+	if (bits == 0) {
+		return -1;
+	}
+
+	return bits >> 1;
 }
 
 
@@ -211,6 +230,611 @@ op_less_equal (gint a, gint b)
 	return a <= b;
 }
 
+/*
+ * Prefilter functions
+ */
+static const gchar *
+prefilter_skip_class (const gchar *p)
+{
+	/* Skip [...] character class, p points to '[' */
+	p++;
+	if (*p == '^') {
+		p++;
+	}
+	if (*p == ']') {
+		p++;
+	}
+	while (*p && *p != ']') {
+		if (*p == '\\') {
+			if (p[1] == '\0') {
+				return NULL;
+			}
+			p += 2;
+			continue;
+		}
+		else if (*p == '[' && p[1] == ':') {
+			/* Posix class */
+			p = strstr (p + 2, ":]");
+			if (p == NULL) {
+				return NULL;
+			}
+			p += 2;
+			continue;
+		}
+		p++;
+	}
+
+	return *p ? p + 1 : NULL;
+}
+
+static const gchar *
+prefilter_skip_group (const gchar *p)
+{
+	gint depth = 0;
+
+	/* Skip (...) group, p points to '(' */
+	while (*p) {
+		switch (*p) {
+		case '\\':
+			if (p[1] == '\0') {
+				return NULL;
+			}
+			p += 2;
+			break;
+		case '[':
+			p = prefilter_skip_class (p);
+			if (p == NULL) {
+				return NULL;
+			}
+			break;
+		case '(':
+			depth++;
+			p++;
+			break;
+		case ')':
+			p++;
+			if (--depth == 0) {
+				return p;
+			}
+			break;
+		default:
+			p++;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static inline void
+prefilter_flush_literal (GString *cur, GString *best)
+{
+	if (cur->len > best->len) {
+		g_string_assign (best, cur->str);
+	}
+	g_string_truncate (cur, 0);
+}
+
+/*
+ * Extract the longest literal that must be present in any text matched by
+ * a pattern. The parser is conservative: alternations on the top level,
+ * inline options and escapes with arguments disable prefiltering.
+ */
+static gchar *
+prefilter_extract_literal (rspamd_mempool_t *pool,
+	const gchar *pattern,
+	gint flags)
+{
+	const gchar *p = pattern, *q;
+	GString *cur, *best;
+	gboolean icase, utf, failed = FALSE;
+	guint last_len = 0, min, clen;
+	gchar c, *res = NULL;
+
+	if (flags & G_REGEX_EXTENDED) {
+		return NULL;
+	}
+
+	icase = (flags & G_REGEX_CASELESS) != 0;
+	utf = (flags & G_REGEX_RAW) == 0;
+	cur = g_string_sized_new (32);
+	best = g_string_sized_new (32);
+
+	while (*p && !failed) {
+		c = *p;
+
+		switch (c) {
+		case '\\':
+			c = p[1];
+			if (c == '\0') {
+				failed = TRUE;
+			}
+			else if ((guchar)c >= 0x80) {
+				failed = TRUE;
+			}
+			else if (!g_ascii_isalnum (c)) {
+				/* Escaped special character */
+				g_string_append_c (cur, c);
+				last_len = 1;
+				p += 2;
+			}
+			else if (strchr ("dDwWsSbBAzZGhHvVRXnrtfeaK", c) != NULL) {
+				/* Character types and assertions have no arguments */
+				prefilter_flush_literal (cur, best);
+				last_len = 0;
+				p += 2;
+			}
+			else {
+				/* Backreferences, \x, \p, \Q and so on */
+				failed = TRUE;
+			}
+			break;
+		case '[':
+			prefilter_flush_literal (cur, best);
+			last_len = 0;
+			p = prefilter_skip_class (p);
+			if (p == NULL) {
+				failed = TRUE;
+			}
+			break;
+		case '(':
+			if (p[1] == '*' || (p[1] == '?' && p[2] == '#')) {
+				/* Verbs and comments */
+				failed = TRUE;
+				break;
+			}
+			if (p[1] == '?') {
+				/* Inline options, e.g. (?i), change matching of the rest */
+				q = p + 2;
+				while (g_ascii_isalpha (*q) || *q == '-') {
+					q++;
+				}
+				if (*q == ')') {
+					failed = TRUE;
+					break;
+				}
+			}
+			prefilter_flush_literal (cur, best);
+			last_len = 0;
+			p = prefilter_skip_group (p);
+			if (p == NULL) {
+				failed = TRUE;
+			}
+			break;
+		case ')':
+		case '|':
+			/* Unbalanced group or top level alternation */
+			failed = TRUE;
+			break;
+		case '.':
+		case '^':
+		case '$':
+			prefilter_flush_literal (cur, best);
+			last_len = 0;
+			p++;
+			break;
+		case '{':
+			q = p + 1;
+			min = 0;
+			while (g_ascii_isdigit (*q)) {
+				min = min * 10 + (*q - '0');
+				q++;
+			}
+			if (q == p + 1) {
+				/* Not a quantifier, literal '{' */
+				g_string_append_c (cur, c);
+				last_len = 1;
+				p++;
+				break;
+			}
+			if (*q == ',') {
+				q++;
+				while (g_ascii_isdigit (*q)) {
+					q++;
+				}
+			}
+			if (*q != '}') {
+				g_string_append_c (cur, c);
+				last_len = 1;
+				p++;
+				break;
+			}
+			p = q;
+			/* FALLTHROUGH */
+		case '*':
+		case '?':
+		case '+':
+			if (c == '+') {
+				min = 1;
+			}
+			else if (c != '{') {
+				min = 0;
+			}
+			if (min == 0 && last_len > 0) {
+				/* Previous character is optional */
+				g_string_truncate (cur, cur->len - last_len);
+			}
+			prefilter_flush_literal (cur, best);
+			last_len = 0;
+			p++;
+			/* Lazy and possessive quantifiers */
+			if (*p == '?' || *p == '+') {
+				p++;
+			}
+			break;
+		default:
+			if ((guchar)c >= 0x80) {
+				clen = utf ? (guint)g_utf8_skip[(guchar)c] : 1;
+				if (icase || strlen (p) < clen) {
+					/* We cannot fold non-ascii characters */
+					prefilter_flush_literal (cur, best);
+					last_len = 0;
+					p += MIN (clen, strlen (p));
+					break;
+				}
+				g_string_append_len (cur, p, clen);
+				last_len = clen;
+				p += clen;
+			}
+			else if (icase && utf && strchr ("kKsS", c) != NULL) {
+				/* Unicode folding maps these to non-ascii characters */
+				prefilter_flush_literal (cur, best);
+				last_len = 0;
+				p++;
+			}
+			else {
+				g_string_append_c (cur, c);
+				last_len = 1;
+				p++;
+			}
+			break;
+		}
+	}
+
+	if (!failed) {
+		prefilter_flush_literal (cur, best);
+
+		if (best->len >= PREFILTER_MIN_LITERAL) {
+			res = rspamd_mempool_strdup (pool, best->str);
+		}
+	}
+
+	g_string_free (cur, TRUE);
+	g_string_free (best, TRUE);
+
+	return res;
+}
+
+static void
+prefilter_dtor (gpointer p)
+{
+	struct regexp_prefilter *pf = p;
+	guint i;
+
+	if (pf->trie) {
+		rspamd_trie_free (pf->trie);
+	}
+	if (pf->itrie) {
+		rspamd_trie_free (pf->itrie);
+	}
+	for (i = 0; i < pf->literals->len; i++) {
+		g_ptr_array_free (g_ptr_array_index (pf->literals, i), TRUE);
+	}
+	g_ptr_array_free (pf->literals, TRUE);
+	g_hash_table_unref (pf->literals_idx);
+}
+
+static void
+prefilter_add_regexp (struct rspamd_regexp *re)
+{
+	struct regexp_prefilter *pf;
+	rspamd_mempool_t *pool = regexp_module_ctx->regexp_pool;
+	GPtrArray *lit_regexps;
+	gchar *literal, *key, *header = NULL;
+	gboolean is_raw = FALSE, is_strong = FALSE, icase;
+	gint flags, id;
+	gpointer idp;
+
+	if (re == NULL || re->regexp == NULL || re->is_test ||
+		g_hash_table_lookup (regexp_module_ctx->re_prefilters, re) != NULL) {
+		return;
+	}
+
+	switch (re->type) {
+	case REGEXP_HEADER:
+	case REGEXP_RAW_HEADER:
+		if (re->header == NULL) {
+			return;
+		}
+		is_strong = re->is_strong;
+		header = rspamd_mempool_strdup (pool, re->header);
+		if (!is_strong) {
+			g_ascii_strdown (header, -1);
+		}
+		break;
+	case REGEXP_MIME:
+		is_raw = re->is_raw;
+		break;
+	case REGEXP_MESSAGE:
+	case REGEXP_URL:
+		break;
+	default:
+		return;
+	}
+
+	flags = g_regex_get_compile_flags (re->regexp);
+	literal = prefilter_extract_literal (pool,
+			g_regex_get_pattern (re->regexp),
+			flags);
+
+	if (literal == NULL) {
+		return;
+	}
+
+	icase = (flags & G_REGEX_CASELESS) != 0;
+	key = rspamd_mempool_alloc (pool, 64 + (header ? strlen (header) : 0));
+	rspamd_snprintf (key, 64 + (header ? strlen (header) : 0), "%d:%d:%d:%s",
+		(gint)re->type, is_raw, is_strong, header ? header : "");
+
+	pf = g_hash_table_lookup (regexp_module_ctx->prefilters, key);
+
+	if (pf == NULL) {
+		pf = rspamd_mempool_alloc0 (pool, sizeof (*pf));
+		pf->type = re->type;
+		pf->header = header;
+		pf->is_strong = is_strong;
+		pf->is_raw = is_raw;
+		pf->idx = regexp_module_ctx->nprefilters++;
+		pf->literals = g_ptr_array_new ();
+		pf->literals_idx = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+		rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)prefilter_dtor, pf);
+		g_hash_table_insert (regexp_module_ctx->prefilters, key, pf);
+	}
+
+	if (icase) {
+		/* Case insensitive literals are stored in a separate namespace */
+		g_ascii_strdown (literal, -1);
+		key = rspamd_mempool_alloc (pool, strlen (literal) + 2);
+		key[0] = 'i';
+		strcpy (key + 1, literal);
+	}
+	else {
+		key = rspamd_mempool_alloc (pool, strlen (literal) + 2);
+		key[0] = 'c';
+		strcpy (key + 1, literal);
+	}
+
+	if ((idp = g_hash_table_lookup (pf->literals_idx, key)) != NULL) {
+		lit_regexps = g_ptr_array_index (pf->literals,
+				GPOINTER_TO_INT (idp) - 1);
+	}
+	else {
+		id = pf->literals->len;
+		lit_regexps = g_ptr_array_new ();
+		g_ptr_array_add (pf->literals, lit_regexps);
+		g_hash_table_insert (pf->literals_idx, key, GINT_TO_POINTER (id + 1));
+
+		if (icase) {
+			if (pf->itrie == NULL) {
+				pf->itrie = rspamd_trie_create (TRUE);
+			}
+			rspamd_trie_insert (pf->itrie, literal, id);
+		}
+		else {
+			if (pf->trie == NULL) {
+				pf->trie = rspamd_trie_create (FALSE);
+			}
+			rspamd_trie_insert (pf->trie, literal, id);
+		}
+	}
+
+	g_ptr_array_add (lit_regexps, re);
+	g_hash_table_insert (regexp_module_ctx->re_prefilters, re, pf);
+}
+
+struct prefilter_scan_cbdata {
+	struct regexp_prefilter *pf;
+	guint8 *found;
+	guint nfound;
+	guint total;
+};
+
+/*
+ * Tries are scanned from the threaded workers, so compile them in advance
+ */
+static void
+prefilter_compile (gpointer key, gpointer value, gpointer ud)
+{
+	struct regexp_prefilter *pf = value;
+
+	if (pf->trie) {
+		rspamd_trie_compile (pf->trie);
+	}
+	if (pf->itrie) {
+		rspamd_trie_compile (pf->itrie);
+	}
+}
+
+static gboolean
+prefilter_scan_cb (gint id, const gchar *pos, void *ud)
+{
+	struct prefilter_scan_cbdata *cbd = ud;
+
+	if (!cbd->found[id]) {
+		cbd->found[id] = 1;
+		cbd->nfound++;
+	}
+
+	/* Stop if all literals are found */
+	return cbd->nfound < cbd->total;
+}
+
+static void
+prefilter_scan (struct prefilter_scan_cbdata *cbd,
+	const gchar *in,
+	gsize len)
+{
+	if (cbd->nfound < cbd->total && cbd->pf->trie) {
+		rspamd_trie_lookup_all (cbd->pf->trie, in, len, prefilter_scan_cb, cbd);
+	}
+	if (cbd->nfound < cbd->total && cbd->pf->itrie) {
+		rspamd_trie_lookup_all (cbd->pf->itrie, in, len, prefilter_scan_cb,
+			cbd);
+	}
+}
+
+static gboolean
+prefilter_url_callback (gpointer key, gpointer value, void *data)
+{
+	struct prefilter_scan_cbdata *cbd = data;
+	struct uri *url = value;
+	const gchar *in;
+
+	in = struri (url);
+	prefilter_scan (cbd, in, strlen (in));
+
+	return cbd->nfound >= cbd->total;
+}
+
+/*
+ * Scan data for all literals of a prefilter group and mark regexps that
+ * cannot match as not matched in the task's cache
+ */
+static void
+prefilter_process (struct regexp_prefilter *pf, struct rspamd_task *task)
+{
+	struct prefilter_scan_cbdata cbd;
+	struct mime_text_part *part;
+	struct raw_header *rh;
+	struct rspamd_regexp *re;
+	GPtrArray *lit_regexps;
+	GList *cur;
+	const gchar *in;
+	guint i, j;
+
+	cbd.pf = pf;
+	cbd.total = pf->literals->len;
+	cbd.nfound = 0;
+	cbd.found = g_malloc0 (cbd.total);
+
+	switch (pf->type) {
+	case REGEXP_HEADER:
+	case REGEXP_RAW_HEADER:
+		cur = message_get_header (task, pf->header, pf->is_strong);
+		while (cur && cbd.nfound < cbd.total) {
+			rh = cur->data;
+			in = pf->type == REGEXP_RAW_HEADER ? rh->value : rh->decoded;
+			if (in != NULL) {
+				prefilter_scan (&cbd, in, strlen (in));
+			}
+			cur = g_list_next (cur);
+		}
+		break;
+	case REGEXP_MIME:
+		cur = g_list_first (task->text_parts);
+		while (cur && cbd.nfound < cbd.total) {
+			part = (struct mime_text_part *)cur->data;
+			if (!part->is_empty && (regexp_module_ctx->max_size == 0 ||
+				part->content->len <= regexp_module_ctx->max_size)) {
+				if (pf->is_raw) {
+					prefilter_scan (&cbd, part->orig->data, part->orig->len);
+				}
+				else {
+					prefilter_scan (&cbd, part->content->data,
+						part->content->len);
+				}
+			}
+			cur = g_list_next (cur);
+		}
+		break;
+	case REGEXP_MESSAGE:
+		if (regexp_module_ctx->max_size != 0 && task->msg->len >
+			regexp_module_ctx->max_size) {
+			/* Regexps are not checked for such messages */
+			g_free (cbd.found);
+			return;
+		}
+		prefilter_scan (&cbd, task->msg->str, task->msg->len);
+		break;
+	case REGEXP_URL:
+		if (task->urls) {
+			g_tree_foreach (task->urls, prefilter_url_callback, &cbd);
+		}
+		if (task->emails && cbd.nfound < cbd.total) {
+			g_tree_foreach (task->emails, prefilter_url_callback, &cbd);
+		}
+		break;
+	default:
+		break;
+	}
+
+	debug_task ("prefilter %ud: found %ud of %ud literals", pf->idx,
+		cbd.nfound, cbd.total);
+
+	for (i = 0; i < cbd.total; i++) {
+		if (cbd.found[i]) {
+			continue;
+		}
+		lit_regexps = g_ptr_array_index (pf->literals, i);
+		for (j = 0; j < lit_regexps->len; j++) {
+			re = g_ptr_array_index (lit_regexps, j);
+			if (task_cache_check (task, re) == -1) {
+				task_cache_add (task, re, 0);
+			}
+		}
+	}
+
+	g_free (cbd.found);
+}
+
+static guint8 *
+prefilter_task_state (struct rspamd_task *task)
+{
+	guint8 *st;
+
+	st = rspamd_mempool_get_variable (task->task_pool, "regexp_prefilter");
+
+	if (st == NULL && regexp_module_ctx->nprefilters > 0) {
+		st = rspamd_mempool_alloc0 (task->task_pool,
+				regexp_module_ctx->nprefilters);
+		rspamd_mempool_set_variable (task->task_pool, "regexp_prefilter", st,
+			NULL);
+	}
+
+	return st;
+}
+
+/*
+ * Returns 0 if regexp cannot match according to its prefilter group and -1
+ * if regexp should be checked
+ */
+static gint
+prefilter_check (struct rspamd_task *task, struct rspamd_regexp *re)
+{
+	struct regexp_prefilter *pf;
+	guint8 *st;
+
+	if (regexp_module_ctx->re_prefilters == NULL ||
+		(pf = g_hash_table_lookup (regexp_module_ctx->re_prefilters,
+		re)) == NULL) {
+		return -1;
+	}
+
+	st = prefilter_task_state (task);
+
+	if (!st[pf->idx]) {
+		/*
+		 * Concurrent scans from the threaded workers are harmless, as they
+		 * produce the same results
+		 */
+		prefilter_process (pf, task);
+		st[pf->idx] = 1;
+	}
+
+	return task_cache_check (task, re) == 0 ? 0 : -1;
+}
+
 /* Process regexp expression */
 static gboolean
 read_regexp_expression (rspamd_mempool_t * pool,
@@ -240,6 +864,7 @@ read_regexp_expression (rspamd_mempool_t * pool,
 				return FALSE;
 			}
 			cur->type = EXPR_REGEXP_PARSED;
+			prefilter_add_regexp (cur->content.operand);
 		}
 		cur = cur->next;
 	}
@@ -256,7 +881,12 @@ regexp_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 
 	regexp_module_ctx->regexp_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
+	/* Rules share ids with regexps parsed from the config pool */
+	rspamd_regexp_share_ids (regexp_module_ctx->regexp_pool, &cfg->re_ids);
 	regexp_module_ctx->workers = NULL;
+	regexp_module_ctx->prefilters = NULL;
+	regexp_module_ctx->re_prefilters = NULL;
+	regexp_module_ctx->nprefilters = 0;
 
 	*ctx = (struct module_ctx *)regexp_module_ctx;
 	register_expression_function ("regexp_match_number",
@@ -312,6 +942,17 @@ regexp_module_config (struct rspamd_config *cfg)
 	regexp_module_ctx->max_size = 0;
 	regexp_module_ctx->max_threads = 0;
 	regexp_module_ctx->workers = NULL;
+	regexp_module_ctx->nprefilters = 0;
+	regexp_module_ctx->prefilters = g_hash_table_new (rspamd_str_hash,
+			rspamd_str_equal);
+	regexp_module_ctx->re_prefilters = g_hash_table_new (g_direct_hash,
+			g_direct_equal);
+	rspamd_mempool_add_destructor (regexp_module_ctx->regexp_pool,
+		(rspamd_mempool_destruct_t)g_hash_table_unref,
+		regexp_module_ctx->prefilters);
+	rspamd_mempool_add_destructor (regexp_module_ctx->regexp_pool,
+		(rspamd_mempool_destruct_t)g_hash_table_unref,
+		regexp_module_ctx->re_prefilters);
 
 	while ((value = ucl_iterate_object (sec, &it, true)) != NULL) {
 		if (g_ascii_strncasecmp (ucl_object_key (value), "max_size",
@@ -354,15 +995,25 @@ regexp_module_config (struct rspamd_config *cfg)
 		}
 	}
 
+	g_hash_table_foreach (regexp_module_ctx->prefilters, prefilter_compile,
+		NULL);
+	msg_info ("init regexp module: %ud regexps are prefiltered in %ud groups",
+		g_hash_table_size (regexp_module_ctx->re_prefilters),
+		regexp_module_ctx->nprefilters);
+
 	return res;
 }
 
 gint
 regexp_module_reconfig (struct rspamd_config *cfg)
 {
+	regexp_module_ctx->prefilters = NULL;
+	regexp_module_ctx->re_prefilters = NULL;
 	rspamd_mempool_delete (regexp_module_ctx->regexp_pool);
 	regexp_module_ctx->regexp_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
+	/* Rules share ids with regexps parsed from the config pool */
+	rspamd_regexp_share_ids (regexp_module_ctx->regexp_pool, &cfg->re_ids);
 
 	return regexp_module_config (cfg);
 }
@@ -442,6 +1093,11 @@ process_regexp (struct rspamd_regexp *re,
 		return r == 1;
 	}
 
+	if (additional == NULL && prefilter_check (task, re) == 0) {
+		debug_task ("regexp /%s/ is skipped by prefilter", re->regexp_text);
+		return 0;
+	}
+
 	if (additional != NULL) {
 		/* We have additional parameter defined, so ignore type of regexp expression and use it for parsing */
 		if (G_UNLIKELY (re->is_test)) {
@@ -1089,6 +1745,9 @@ process_regexp_item (struct rspamd_task *task, void *user_data)
 
 
 	if (!item->lua_function && regexp_module_ctx->max_threads > 1) {
+		/* Allocate prefilter state before passing task to threads */
+		(void)prefilter_task_state (task);
+
 		if (regexp_module_ctx->workers == NULL) {
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
 # if GLIB_MINOR_VERSION > 20
@@ -1123,7 +1782,12 @@ process_regexp_item (struct rspamd_task *task, void *user_data)
 				sizeof (struct regexp_threaded_ud));
 		thr_ud->item = item;
 		thr_ud->task = task;
-
+		/*
+		 * Expressions allocate from the task pool in threads and must not
+		 * evaluate message's data lazily
+		 */
+		rspamd_mempool_set_shared (task->task_pool);
+		message_prepare_threaded (task);
 
 		register_async_thread (task->s);
 		g_thread_pool_push (regexp_module_ctx->workers, thr_ud, &err);
@@ -1504,7 +2168,6 @@ rspamd_content_type_compare_param (struct rspamd_task * task,
 	const gchar *param_data;
 	struct rspamd_regexp *re;
 	struct expression_argument *arg, *arg1;
-	GMimeObject *part;
 	GMimeContentType *ct;
 	gint r;
 	gboolean recursive = FALSE, result = FALSE;
@@ -1526,9 +2189,8 @@ rspamd_content_type_compare_param (struct rspamd_task * task,
 	param_pattern = arg->data;
 
 
-	part = g_mime_message_get_mime_part (task->message);
-	if (part) {
-		ct = (GMimeContentType *)g_mime_object_get_content_type (part);
+	ct = message_get_content_type (task);
+	if (ct) {
 		if (args->next) {
 			args = g_list_next (args);
 			arg1 = get_function_arg (args->data, task, TRUE);
@@ -1551,9 +2213,6 @@ rspamd_content_type_compare_param (struct rspamd_task * task,
 			cur = task->parts;
 		}
 
-#ifndef GMIME24
-		g_object_unref (part);
-#endif
 		for (;; ) {
 			if ((param_data =
 				g_mime_content_type_get_parameter ((GMimeContentType *)ct,
@@ -1624,7 +2283,6 @@ rspamd_content_type_has_param (struct rspamd_task * task,
 	gchar *param_name;
 	const gchar *param_data;
 	struct expression_argument *arg, *arg1;
-	GMimeObject *part;
 	GMimeContentType *ct;
 	gboolean recursive = FALSE, result = FALSE;
 	GList *cur = NULL;
@@ -1637,9 +2295,8 @@ rspamd_content_type_has_param (struct rspamd_task * task,
 	arg = get_function_arg (args->data, task, TRUE);
 	param_name = arg->data;
 
-	part = g_mime_message_get_mime_part (task->message);
-	if (part) {
-		ct = (GMimeContentType *)g_mime_object_get_content_type (part);
+	ct = message_get_content_type (task);
+	if (ct) {
 		if (args->next) {
 			args = g_list_next (args);
 			arg1 = get_function_arg (args->data, task, TRUE);
@@ -1662,9 +2319,6 @@ rspamd_content_type_has_param (struct rspamd_task * task,
 			cur = task->parts;
 		}
 
-#ifndef GMIME24
-		g_object_unref (part);
-#endif
 		for (;; ) {
 			if ((param_data =
 				g_mime_content_type_get_parameter ((GMimeContentType *)ct,
@@ -1701,7 +2355,6 @@ rspamd_content_type_is_subtype (struct rspamd_task *task,
 	gchar *param_pattern;
 	struct rspamd_regexp *re;
 	struct expression_argument *arg, *arg1;
-	GMimeObject *part;
 	GMimeContentType *ct;
 	gint r;
 	gboolean recursive = FALSE, result = FALSE;
@@ -1715,9 +2368,8 @@ rspamd_content_type_is_subtype (struct rspamd_task *task,
 	arg = get_function_arg (args->data, task, TRUE);
 	param_pattern = arg->data;
 
-	part = g_mime_message_get_mime_part (task->message);
-	if (part) {
-		ct = (GMimeContentType *)g_mime_object_get_content_type (part);
+	ct = message_get_content_type (task);
+	if (ct) {
 		if (args->next) {
 			args = g_list_next (args);
 			arg1 = get_function_arg (args->data, task, TRUE);
@@ -1740,9 +2392,6 @@ rspamd_content_type_is_subtype (struct rspamd_task *task,
 			cur = task->parts;
 		}
 
-#ifndef GMIME24
-		g_object_unref (part);
-#endif
 		for (;; ) {
 			if (*param_pattern == '/') {
 				/* This is regexp, so compile and create g_regexp object */
@@ -1806,7 +2455,6 @@ rspamd_content_type_is_type (struct rspamd_task * task,
 	gchar *param_pattern;
 	struct rspamd_regexp *re;
 	struct expression_argument *arg, *arg1;
-	GMimeObject *part;
 	GMimeContentType *ct;
 	gint r;
 	gboolean recursive = FALSE, result = FALSE;
@@ -1821,9 +2469,8 @@ rspamd_content_type_is_type (struct rspamd_task * task,
 	param_pattern = arg->data;
 
 
-	part = g_mime_message_get_mime_part (task->message);
-	if (part) {
-		ct = (GMimeContentType *)g_mime_object_get_content_type (part);
+	ct = message_get_content_type (task);
+	if (ct) {
 		if (args->next) {
 			args = g_list_next (args);
 			arg1 = get_function_arg (args->data, task, TRUE);
@@ -1846,9 +2493,6 @@ rspamd_content_type_is_type (struct rspamd_task * task,
 			cur = task->parts;
 		}
 
-#ifndef GMIME24
-		g_object_unref (part);
-#endif
 		for (;; ) {
 			if (*param_pattern == '/') {
 				/* This is regexp, so compile and create g_regexp object */
@@ -1950,18 +2594,22 @@ compare_subtype (struct rspamd_task *task, GMimeContentType * ct,
 static gboolean
 compare_len (struct mime_part *part, guint min, guint max)
 {
+	guint len;
+
 	if (min == 0 && max == 0) {
 		return TRUE;
 	}
 
+	len = mime_part_get_content (part)->len;
+
 	if (min == 0) {
-		return part->content->len <= max;
+		return len <= max;
 	}
 	else if (max == 0) {
-		return part->content->len >= min;
+		return len >= min;
 	}
 	else {
-		return part->content->len >= min && part->content->len <= max;
+		return len >= min && len <= max;
 	}
 }
 
@@ -35,6 +35,7 @@
 #include "libserver/url.h"
 #include "libserver/dns.h"
 #include "libmime/message.h"
+#include "libstat/stat_api.h"
 #include "main.h"
 
 #include "lua/lua_common.h"
@@ -45,6 +46,8 @@
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
+/* Interval of trimming cached pages of task pools */
+#define POOL_CACHE_TRIM_INTERVAL 10
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
@@ -88,8 +91,26 @@ struct rspamd_worker_ctx {
 	struct event_base *ev_base;
 	/* Encryption key */
 	gpointer key;
+	/* Directories of local files that may be scanned */
+	GList *files_dirs;
+	/* Pages cache trim timer */
+	struct event cache_trim_ev;
+	struct timeval cache_trim_tv;
 };
 
+/*
+ * Return half of cached pool pages on each tick: under load the cache is
+ * refilled by deleted tasks, while an idle worker releases its memory
+ */
+static void
+rspamd_worker_cache_trim (gint fd, short what, void *arg)
+{
+	struct rspamd_worker_ctx *ctx = arg;
+
+	rspamd_mempool_cache_trim (rspamd_mempool_cache_size () / 2);
+	evtimer_add (&ctx->cache_trim_ev, &ctx->cache_trim_tv);
+}
+
 /*
  * Reduce number of tasks proceeded
  */
@@ -121,15 +142,8 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		return 0;
 	}
 
-	if (msg->body->len == 0) {
-		msg_err ("got zero length body, cannot continue");
-		task->last_error = "message's body is empty";
-		task->error_code = RSPAMD_LENGTH_ERROR;
-		task->state = WRITE_REPLY;
-		return 0;
-	}
-
-	if (!rspamd_task_process (task, msg, ctx->classify_pool, TRUE)) {
+	if (!rspamd_task_process (task, msg, chunk, len, ctx->classify_pool,
+			TRUE)) {
 		task->state = WRITE_REPLY;
 	}
 
@@ -244,6 +258,11 @@ accept_socket (gint fd, short what, void *arg)
 			rspamd_task_restore, rspamd_task_free_hard, new_task);
 
 	new_task->classify_pool = ctx->classify_pool;
+	new_task->files_dirs = ctx->files_dirs;
+
+	if (ctx->classify_pool != NULL) {
+		rspamd_mempool_set_shared (new_task->task_pool);
+	}
 
 	if (ctx->key) {
 		rspamd_http_connection_set_key (new_task->http_conn, ctx->key);
@@ -302,6 +321,10 @@ init_worker (struct rspamd_config *cfg)
 		classify_threads), RSPAMD_CL_FLAG_INT_32);
 
 
+	rspamd_rcl_register_worker_option (cfg, type, "files_dirs",
+		rspamd_rcl_parse_struct_string_list, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx, files_dirs), 0);
+
 	rspamd_rcl_register_worker_option (cfg, type, "keypair",
 		rspamd_rcl_parse_struct_keypair, ctx,
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
@@ -332,10 +355,21 @@ start_worker (struct rspamd_worker *worker)
 
 	rspamd_upstreams_library_init (ctx->resolver->r, ctx->ev_base);
 	rspamd_upstreams_library_config (worker->srv->cfg);
+	rspamd_symbols_cache_start_refresh (worker->srv->cfg->cache, ctx->ev_base);
+
+	evtimer_set (&ctx->cache_trim_ev, rspamd_worker_cache_trim, ctx);
+	event_base_set (ctx->ev_base, &ctx->cache_trim_ev);
+	ctx->cache_trim_tv.tv_sec = POOL_CACHE_TRIM_INTERVAL;
+	ctx->cache_trim_tv.tv_usec = 0;
+	evtimer_add (&ctx->cache_trim_ev, &ctx->cache_trim_tv);
 
 	/* Create classify pool */
 	ctx->classify_pool = NULL;
-	if (ctx->classify_threads > 1) {
+	if (ctx->classify_threads > 1 && rspamd_stat_is_async ()) {
+		msg_warn ("statfiles are loaded asynchronously, so classify_threads "
+				"option is ignored");
+	}
+	else if (ctx->classify_threads > 1) {
 		nL = rspamd_init_lua_locked (worker->srv->cfg);
 		ctx->classify_pool = g_thread_pool_new (rspamd_process_statistic_threaded,
 				nL,
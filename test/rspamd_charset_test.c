@@ -0,0 +1,196 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "util.h"
+#include "charset.h"
+#include "ottery.h"
+#include "tests.h"
+
+/* Sequences that are placed at different offsets of ascii blocks */
+static const gchar *utf8_seqs[] = {
+	"\xc3\xa9",             /* U+E9 */
+	"\xe2\x82\xac",         /* U+20AC */
+	"\xf0\x9f\x98\x80",     /* U+1F600 */
+	"\xf4\x8f\xbf\xbf",     /* U+10FFFF */
+	"\xc0\xaf",             /* Overlong '/' */
+	"\xc1\xbf",             /* Overlong */
+	"\xe0\x80\xaf",         /* Overlong '/' */
+	"\xe0\x9f\xbf",         /* Overlong */
+	"\xf0\x80\x80\xaf",     /* Overlong '/' */
+	"\xf0\x8f\xbf\xbf",     /* Overlong */
+	"\xed\xa0\x80",         /* Surrogate U+D800 */
+	"\xed\xbf\xbf",         /* Surrogate U+DFFF */
+	"\xf4\x90\x80\x80",     /* U+110000 */
+	"\xf5\x80\x80\x80",
+	"\xf8\x88\x80\x80\x80",
+	"\xff",
+	"\x80",
+	"\xc3",                 /* Truncated sequences */
+	"\xe2\x82",
+	"\xf0\x9f\x98",
+	"\xc3\x28",
+	"\xe2\x28\xac",
+	NULL
+};
+
+static void
+test_utf8_check (const guchar *data, gsize len)
+{
+	g_assert (rspamd_fast_utf8_validate (data, len) ==
+			g_utf8_validate ((const gchar *)data, len, NULL));
+}
+
+static void
+test_utf8_validate (void)
+{
+	guchar buf[64];
+	const gchar **seq;
+	gsize slen, off, i, len;
+
+	for (seq = utf8_seqs; *seq != NULL; seq ++) {
+		slen = strlen (*seq);
+
+		/* Sequence crosses and ends at 16 bytes blocks edges */
+		for (off = 0; off + slen < sizeof (buf); off ++) {
+			memset (buf, 'a', sizeof (buf));
+			memcpy (buf + off, *seq, slen);
+
+			test_utf8_check (buf, off + slen);
+			test_utf8_check (buf, sizeof (buf));
+
+			/* Truncated sequence at the end of text */
+			for (len = off + 1; len < off + slen; len ++) {
+				test_utf8_check (buf, len);
+			}
+		}
+	}
+
+	/* NUL at any position is invalid */
+	for (off = 0; off < sizeof (buf); off ++) {
+		memset (buf, 'a', sizeof (buf));
+		buf[off] = '\0';
+		test_utf8_check (buf, sizeof (buf));
+	}
+
+	/* Random text with mostly ascii characters */
+	for (i = 0; i < 10000; i ++) {
+		len = ottery_rand_range (sizeof (buf) - 1) + 1;
+
+		for (off = 0; off < len; off ++) {
+			buf[off] = ottery_rand_range (7) == 0 ?
+					ottery_rand_range (0xff) : 'a' + ottery_rand_range (25);
+		}
+
+		test_utf8_check (buf, len);
+	}
+}
+
+static void
+test_convert_sample (rspamd_mempool_t *pool, const gchar *charset,
+	const gchar *in, const gchar *expected)
+{
+	GError *err = NULL;
+	gchar *res;
+	gsize olen;
+
+	res = rspamd_mime_text_to_utf8 (pool, (gchar *)in, strlen (in), charset,
+			&olen, &err);
+	g_assert (res != NULL);
+	g_assert_cmpuint (olen, ==, strlen (expected));
+	g_assert_cmpstr (res, ==, expected);
+}
+
+/* Compare tables with iconv for characters defined in both */
+static void
+test_convert_all (rspamd_mempool_t *pool, const gchar *charset)
+{
+	gchar in[2], *res, *ref;
+	gsize olen;
+	guint c;
+
+	for (c = 0x80; c <= 0xff; c ++) {
+		in[0] = c;
+		in[1] = '\0';
+		res = rspamd_mime_text_to_utf8 (pool, in, 1, charset, &olen, NULL);
+		g_assert (res != NULL);
+		g_assert (g_utf8_validate (res, olen, NULL));
+		ref = g_convert (in, 1, "UTF-8", charset, NULL, NULL, NULL);
+
+		if (ref != NULL) {
+			g_assert_cmpstr (res, ==, ref);
+			g_free (ref);
+		}
+	}
+}
+
+static void
+test_convert (void)
+{
+	rspamd_mempool_t *pool;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+
+	test_convert_sample (pool, "windows-1251", "\xcf\xf0\xe8\xe2\xe5\xf2, "
+			"\xb8\xe6 \xb9",
+			"\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, "
+			"\xd1\x91\xd0\xb6 \xe2\x84\x96");
+	test_convert_sample (pool, "KOI8-R", "\xf0\xd2\xc9\xd7\xc5\xd4, "
+			"\xa3\xd6",
+			"\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, "
+			"\xd1\x91\xd0\xb6");
+	test_convert_sample (pool, "cp1252", "caf\xe9 \x80\x35 \x93q\x94",
+			"caf\xc3\xa9 \xe2\x82\xac\x35 \xe2\x80\x9cq\xe2\x80\x9d");
+	test_convert_sample (pool, "ISO-8859-1", "caf\xe9", "caf\xc3\xa9");
+	/* Non ascii characters are not defined in us-ascii */
+	test_convert_sample (pool, "us-ascii", "caf\xe9", "caf?");
+
+	/* Different spellings and aliases of the same charset */
+	test_convert_sample (pool, "latin1", "caf\xe9", "caf\xc3\xa9");
+	test_convert_sample (pool, "CP-1251", "\xb8", "\xd1\x91");
+	test_convert_sample (pool, "ISO-8859-2", "\xb1", "\xc4\x85");
+	test_convert_sample (pool, "iso_8859-2", "\xb1", "\xc4\x85");
+	test_convert_sample (pool, "Latin2", "\xb1", "\xc4\x85");
+	test_convert_sample (pool, "windows-1250", "\x9a", "\xc5\xa1");
+	test_convert_sample (pool, "CP1250", "\x9a", "\xc5\xa1");
+	test_convert_sample (pool, "Win-1250", "\x9a", "\xc5\xa1");
+	test_convert_sample (pool, "Shift_JIS", "\x82\xa0", "\xe3\x81\x82");
+	test_convert_sample (pool, "SJIS", "\x82\xa0", "\xe3\x81\x82");
+	test_convert_sample (pool, "UTF-8", "caf\xc3\xa9", "caf\xc3\xa9");
+	test_convert_sample (pool, "utf8", "caf\xc3\xa9", "caf\xc3\xa9");
+
+	test_convert_all (pool, "CP1251");
+	test_convert_all (pool, "KOI8-R");
+	test_convert_all (pool, "CP1252");
+	test_convert_all (pool, "ISO-8859-1");
+
+	rspamd_mempool_delete (pool);
+}
+
+void
+rspamd_charset_test_func (void)
+{
+	test_utf8_validate ();
+	test_convert ();
+}
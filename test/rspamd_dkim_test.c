@@ -34,8 +34,115 @@ static const gchar test_dkim_sig[] = "v=1; a=rsa-sha256; c=relaxed/relaxed; "
 		"oq3BLHap0GcMTTpSOgfQOKa8Df35Ns11JoOFjdBQ8GpM99kOrJP+vZcT8b7AMfthYm0Kwy"
 		"D9TjlkpScuoY5LjsWVnijh9dSNVLFqLatzg=;";
 
+/* Signature template for body hash tests: canonicalization and l= tag */
+#define TEST_BH_SIG "v=1; a=rsa-sha256; c=%s; d=%s; s=dkim; " \
+		"bh=47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=; h=From; b=AAAA;%s"
+
 extern struct event_base *base;
 
+static rspamd_dkim_context_t *
+test_bh_ctx (rspamd_mempool_t *pool, const gchar *canon, const gchar *domain,
+	const gchar *len)
+{
+	rspamd_dkim_context_t *ctx;
+	GError *err = NULL;
+	gchar *sig;
+
+	sig = rspamd_mempool_alloc (pool, sizeof (TEST_BH_SIG) + 64);
+	rspamd_snprintf (sig, sizeof (TEST_BH_SIG) + 64, TEST_BH_SIG, canon, domain,
+			len);
+	ctx = rspamd_create_dkim_context (sig, pool, 0, &err);
+	g_assert (ctx != NULL);
+
+	return ctx;
+}
+
+/* Compare body hash with sha256 of expected canonical body */
+static void
+test_bh_check (const gchar *canon, const gchar *len, const gchar *body,
+	const gchar *expected)
+{
+	struct rspamd_task task;
+	rspamd_dkim_context_t *ctx;
+	GChecksum *ck;
+	guchar digest[32];
+	const guchar *bh;
+	gsize dlen, explen = sizeof (digest);
+
+	memset (&task, 0, sizeof (task));
+	task.task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	ctx = test_bh_ctx (task.task_pool, canon, "example.com", len);
+	bh = rspamd_dkim_body_digest (ctx, &task, body, body + strlen (body),
+			&dlen);
+
+	ck = g_checksum_new (G_CHECKSUM_SHA256);
+	g_checksum_update (ck, expected, strlen (expected));
+	g_checksum_get_digest (ck, digest, &explen);
+	g_checksum_free (ck);
+
+	g_assert_cmpuint (dlen, ==, explen);
+	g_assert (memcmp (bh, digest, dlen) == 0);
+	rspamd_mempool_delete (task.task_pool);
+}
+
+static void
+test_dkim_body_hash (void)
+{
+	struct rspamd_task task;
+	rspamd_dkim_context_t *ctx;
+	const gchar body1[] = "a\r\n", body2[] = "b\r\n";
+	const guchar *bh1, *bh2;
+	gsize dlen1, dlen2;
+
+	/* Empty bodies */
+	test_bh_check ("simple/simple", "", "", "\r\n");
+	test_bh_check ("simple/simple", "", "\r\n\r\n", "\r\n");
+	test_bh_check ("relaxed/relaxed", "", "", "");
+	test_bh_check ("relaxed/relaxed", "", " \r\n\t\r\n", "");
+
+	/* Bare LF and CR are converted to CRLF */
+	test_bh_check ("simple/simple", "", "a\nb\rc\r\n", "a\r\nb\r\nc\r\n");
+	test_bh_check ("relaxed/relaxed", "", "a\nb\n", "a\r\nb\r\n");
+
+	/* Unterminated last line */
+	test_bh_check ("simple/simple", "", "a\r\nb", "a\r\nb\r\n");
+	test_bh_check ("relaxed/relaxed", "", "a\r\nb \t", "a\r\nb\r\n");
+
+	/* Whitespace runs */
+	test_bh_check ("simple/simple", "", " a \t b \r\n", " a \t b \r\n");
+	test_bh_check ("relaxed/relaxed", "", " a \t b \r\n\tc  d\r\n",
+			" a b\r\n c d\r\n");
+
+	/* Trailing empty and whitespace only lines */
+	test_bh_check ("simple/simple", "", "a\r\n\r\nb\r\n\r\n\n\r\n",
+			"a\r\n\r\nb\r\n");
+	test_bh_check ("simple/simple", "", "a\r\n \r\n\r\n", "a\r\n \r\n");
+	test_bh_check ("relaxed/relaxed", "", "a\r\n \r\nb \r\n \t\r\n\r\n",
+			"a\r\n\r\nb\r\n");
+
+	/* l= counts canonicalized octets */
+	test_bh_check ("simple/simple", " l=3;", "ab\ncd\r\n", "ab\r");
+	test_bh_check ("relaxed/relaxed", " l=4;", "a  b\r\ncd\r\n", "a b\r");
+	test_bh_check ("simple/simple", " l=1;", "", "\r");
+
+	/* Signatures with the same parameters share the digest within a task */
+	memset (&task, 0, sizeof (task));
+	task.task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	ctx = test_bh_ctx (task.task_pool, "relaxed/relaxed", "example.com", "");
+	bh1 = rspamd_dkim_body_digest (ctx, &task, body1, body1 + strlen (body1),
+			&dlen1);
+	ctx = test_bh_ctx (task.task_pool, "relaxed/relaxed", "example.net", "");
+	bh2 = rspamd_dkim_body_digest (ctx, &task, body2, body2 + strlen (body2),
+			&dlen2);
+	g_assert (bh1 == bh2);
+	/* Other canonicalization is hashed separately */
+	ctx = test_bh_ctx (task.task_pool, "simple/simple", "example.net", "");
+	bh2 = rspamd_dkim_body_digest (ctx, &task, body2, body2 + strlen (body2),
+			&dlen2);
+	g_assert (dlen1 == dlen2 && memcmp (bh1, bh2, dlen1) != 0);
+	rspamd_mempool_delete (task.task_pool);
+}
+
 static void
 test_key_handler (rspamd_dkim_key_t *key, gsize keylen, rspamd_dkim_context_t *ctx, gpointer ud, GError *err)
 {
@@ -68,6 +175,8 @@ rspamd_dkim_test_func ()
 	GError *err = NULL;
 	struct rspamd_async_session *s;
 
+	test_dkim_body_hash ();
+
 	cfg = (struct rspamd_config *)g_malloc (sizeof (struct rspamd_config));
 	bzero (cfg, sizeof (struct rspamd_config));
 	cfg->cfg_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
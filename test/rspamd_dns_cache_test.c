@@ -0,0 +1,262 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "dns.h"
+#include "cfg_file.h"
+#include "utlist.h"
+#include "tests.h"
+
+#define TEST_DNS_TTL 60
+#define TEST_DNS_TXT "v=spf1 ip4:192.0.2.1 -all"
+
+extern struct event_base *base;
+static guint test_dns_replies = 0;
+
+static void
+test_dns_cache_add (struct rdns_reply *reply, struct rdns_reply_entry *elt,
+	enum rdns_request_type type, gint32 ttl)
+{
+	memset (elt, 0, sizeof (*elt));
+	elt->type = type;
+	elt->ttl = ttl;
+	DL_APPEND (reply->entries, elt);
+}
+
+/* Checks reply rebuilt from the shared cache */
+static void
+test_dns_cache_check (struct rdns_reply *reply, enum rdns_request_type type)
+{
+	struct rdns_reply_entry *elt = reply->entries;
+	struct in_addr addr;
+
+	g_assert (rspamd_dns_reply_has_type (reply, type));
+
+	switch (type) {
+	case RDNS_REQUEST_A:
+		if (reply->code == RDNS_RC_NXDOMAIN) {
+			g_assert (elt == NULL);
+			break;
+		}
+
+		g_assert (reply->code == RDNS_RC_NOERROR);
+		g_assert (strcmp (rspamd_dns_reply_name (reply), "Example.COM") == 0);
+		g_assert (elt != NULL && elt->type == RDNS_REQUEST_A);
+		inet_aton ("192.0.2.1", &addr);
+		g_assert (elt->content.a.addr.s_addr == addr.s_addr);
+		/* Entries cannot live longer than the reply in the shared cache */
+		g_assert (elt->ttl > 0 && elt->ttl <= TEST_DNS_TTL);
+		elt = elt->next;
+		g_assert (elt != NULL && elt->type == RDNS_REQUEST_A);
+		inet_aton ("192.0.2.2", &addr);
+		g_assert (elt->content.a.addr.s_addr == addr.s_addr);
+		g_assert (elt->ttl == 30);
+		g_assert (elt->next == NULL);
+		break;
+	case RDNS_REQUEST_MX:
+		g_assert (strcmp (rspamd_dns_reply_name (reply), "example.com") == 0);
+		g_assert (elt != NULL && elt->type == RDNS_REQUEST_MX);
+		g_assert (elt->content.mx.priority == 10);
+		g_assert (strcmp (elt->content.mx.name, "mx1.example.com") == 0);
+		elt = elt->next;
+		g_assert (elt != NULL && elt->type == RDNS_REQUEST_MX);
+		g_assert (elt->content.mx.priority == 20);
+		g_assert (strcmp (elt->content.mx.name, "mx2.example.com") == 0);
+		g_assert (elt->next == NULL);
+		break;
+	case RDNS_REQUEST_TXT:
+		g_assert (elt != NULL && elt->type == RDNS_REQUEST_TXT);
+		g_assert (strcmp (elt->content.txt.data, TEST_DNS_TXT) == 0);
+		g_assert (elt->next == NULL);
+		break;
+	case RDNS_REQUEST_SRV:
+		g_assert (elt != NULL && elt->type == RDNS_REQUEST_SRV);
+		g_assert (elt->content.srv.priority == 5);
+		g_assert (elt->content.srv.weight == 10);
+		g_assert (elt->content.srv.port == 5269);
+		g_assert (strcmp (elt->content.srv.target, "xmpp.example.com") == 0);
+		g_assert (elt->next == NULL);
+		break;
+	default:
+		g_assert_not_reached ();
+		break;
+	}
+}
+
+static void
+test_dns_cache_cb (struct rdns_reply *reply, gpointer arg)
+{
+	test_dns_cache_check (reply, GPOINTER_TO_INT (arg));
+
+	if (-- test_dns_replies == 0) {
+		event_base_loopbreak (base);
+	}
+}
+
+static void
+test_dns_cache_request (struct rspamd_dns_resolver *resolver,
+	enum rdns_request_type type, const gchar *name)
+{
+	test_dns_replies ++;
+	g_assert (make_dns_request (resolver, NULL, NULL, test_dns_cache_cb,
+		GINT_TO_POINTER (type), type, name));
+}
+
+void
+rspamd_dns_cache_test_func (void)
+{
+	struct rspamd_dns_shared_cache *cache, *saved_cache;
+	struct rspamd_dns_resolver *resolver;
+	struct rspamd_config *cfg;
+	struct rdns_reply reply, *res;
+	struct rdns_reply_entry elts[2];
+	static struct rspamd_stat st;
+	rspamd_mempool_t *pool;
+	gchar big[600];
+	guint ttl;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	g_assert (rspamd_dns_shared_cache_new (pool, 0) == NULL);
+	cache = rspamd_dns_shared_cache_new (pool, 64);
+	g_assert (cache != NULL);
+
+	/* Replies are stored as they are received by some worker */
+	memset (&reply, 0, sizeof (reply));
+	test_dns_cache_add (&reply, &elts[0], RDNS_REQUEST_A, 300);
+	inet_aton ("192.0.2.1", &elts[0].content.a.addr);
+	test_dns_cache_add (&reply, &elts[1], RDNS_REQUEST_A, 30);
+	inet_aton ("192.0.2.2", &elts[1].content.a.addr);
+	rspamd_dns_shared_insert (cache, "1:example.com", "Example.COM", &reply,
+		TEST_DNS_TTL);
+
+	memset (&reply, 0, sizeof (reply));
+	test_dns_cache_add (&reply, &elts[0], RDNS_REQUEST_MX, TEST_DNS_TTL);
+	elts[0].content.mx.priority = 10;
+	elts[0].content.mx.name = "mx1.example.com";
+	test_dns_cache_add (&reply, &elts[1], RDNS_REQUEST_MX, TEST_DNS_TTL);
+	elts[1].content.mx.priority = 20;
+	elts[1].content.mx.name = "mx2.example.com";
+	rspamd_dns_shared_insert (cache, "15:example.com", "example.com", &reply,
+		TEST_DNS_TTL);
+
+	memset (&reply, 0, sizeof (reply));
+	test_dns_cache_add (&reply, &elts[0], RDNS_REQUEST_TXT, TEST_DNS_TTL);
+	elts[0].content.txt.data = TEST_DNS_TXT;
+	rspamd_dns_shared_insert (cache, "16:example.com", "example.com", &reply,
+		TEST_DNS_TTL);
+
+	memset (&reply, 0, sizeof (reply));
+	test_dns_cache_add (&reply, &elts[0], RDNS_REQUEST_SRV, TEST_DNS_TTL);
+	elts[0].content.srv.priority = 5;
+	elts[0].content.srv.weight = 10;
+	elts[0].content.srv.port = 5269;
+	elts[0].content.srv.target = "xmpp.example.com";
+	rspamd_dns_shared_insert (cache, "33:_xmpp-server._tcp.example.com",
+		"_xmpp-server._tcp.example.com", &reply, TEST_DNS_TTL);
+
+	memset (&reply, 0, sizeof (reply));
+	reply.code = RDNS_RC_NXDOMAIN;
+	rspamd_dns_shared_insert (cache, "1:nonexistent.example.com",
+		"nonexistent.example.com", &reply, TEST_DNS_TTL);
+
+	/* Replies are found by their type and name */
+	res = rspamd_dns_shared_lookup (cache, "1:example.com", &ttl);
+	g_assert (res != NULL);
+	g_assert (ttl > 0 && ttl <= TEST_DNS_TTL);
+	g_assert (res->entries->ttl == (gint32)ttl);
+	test_dns_cache_check (res, RDNS_REQUEST_A);
+	g_free (res);
+	g_assert (rspamd_dns_shared_lookup (cache, "28:example.com", &ttl) == NULL);
+	g_assert (rspamd_dns_shared_lookup (cache, "1:www.example.com", &ttl) ==
+		NULL);
+
+	/* Oversized replies are kept by the local cache of a worker only */
+	memset (big, 'a', sizeof (big) - 1);
+	big[sizeof (big) - 1] = '\0';
+	memset (&reply, 0, sizeof (reply));
+	test_dns_cache_add (&reply, &elts[0], RDNS_REQUEST_TXT, TEST_DNS_TTL);
+	elts[0].content.txt.data = big;
+	rspamd_dns_shared_insert (cache, "16:big.example.com", "big.example.com",
+		&reply, TEST_DNS_TTL);
+	g_assert (rspamd_dns_shared_lookup (cache, "16:big.example.com", &ttl) ==
+		NULL);
+
+	/* So are records of types that are not shared */
+	memset (&reply, 0, sizeof (reply));
+	test_dns_cache_add (&reply, &elts[0], RDNS_REQUEST_SOA, TEST_DNS_TTL);
+	rspamd_dns_shared_insert (cache, "6:example.com", "example.com", &reply,
+		TEST_DNS_TTL);
+	g_assert (rspamd_dns_shared_lookup (cache, "6:example.com", &ttl) == NULL);
+
+	/* Expired replies are not returned */
+	memset (&reply, 0, sizeof (reply));
+	test_dns_cache_add (&reply, &elts[0], RDNS_REQUEST_TXT, 0);
+	elts[0].content.txt.data = TEST_DNS_TXT;
+	rspamd_dns_shared_insert (cache, "16:expired.example.com",
+		"expired.example.com", &reply, 0);
+	g_assert (rspamd_dns_shared_lookup (cache, "16:expired.example.com",
+		&ttl) == NULL);
+
+	/* Another worker gets replies without sending queries */
+	cfg = g_malloc0 (sizeof (struct rspamd_config));
+	cfg->cfg_pool = pool;
+	cfg->dns_retransmits = 2;
+	cfg->dns_timeout = 0.5;
+	cfg->dns_cache_size = 16;
+	cfg->dns_cache_negative_ttl = 10000;
+
+	memset (&st, 0, sizeof (st));
+	saved_cache = rspamd_main->dns_cache;
+	rspamd_main->dns_cache = cache;
+	rspamd_main->stat = &st;
+	resolver = dns_resolver_init (NULL, base, cfg);
+	g_assert (resolver != NULL);
+
+	/* Names are compared without case */
+	test_dns_cache_request (resolver, RDNS_REQUEST_A, "EXAMPLE.com");
+	test_dns_cache_request (resolver, RDNS_REQUEST_MX, "example.com");
+	test_dns_cache_request (resolver, RDNS_REQUEST_TXT, "Example.Com");
+	test_dns_cache_request (resolver, RDNS_REQUEST_SRV,
+		"_xmpp-server._tcp.EXAMPLE.com");
+	test_dns_cache_request (resolver, RDNS_REQUEST_A,
+		"nonexistent.example.com");
+	g_assert (st.dns_shared_hits == 5);
+	g_assert (st.dns_cache_misses == 0);
+
+	event_base_loop (base, 0);
+	g_assert (test_dns_replies == 0);
+
+	/* Then they are taken from its local cache */
+	test_dns_cache_request (resolver, RDNS_REQUEST_MX, "EXAMPLE.COM");
+	g_assert (st.dns_cache_hits == 1);
+	g_assert (st.dns_shared_hits == 5);
+
+	event_base_loop (base, 0);
+	g_assert (test_dns_replies == 0);
+
+	rspamd_main->dns_cache = saved_cache;
+	rspamd_main->stat = NULL;
+	g_free (cfg);
+	rspamd_mempool_delete (pool);
+}
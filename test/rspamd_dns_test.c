@@ -71,17 +71,22 @@ rspamd_dns_test_func ()
 	struct rspamd_config *cfg;
 	rspamd_mempool_t *pool;
 	struct rspamd_async_session *s;
+	static struct rspamd_stat st;
 
 	cfg = (struct rspamd_config *)g_malloc (sizeof (struct rspamd_config));
 	bzero (cfg, sizeof (struct rspamd_config));
 	cfg->cfg_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
 	cfg->dns_retransmits = 2;
 	cfg->dns_timeout = 0.5;
+	cfg->dns_cache_size = 16;
+	cfg->dns_cache_negative_ttl = 10000;
 
 	pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
 
 	s = new_async_session (pool, session_fin, NULL, NULL, NULL);
 
+	memset (&st, 0, sizeof (st));
+	rspamd_main->stat = &st;
 	resolver = dns_resolver_init (NULL, base, cfg);
 
 	requests ++;
@@ -100,8 +105,21 @@ rspamd_dns_test_func ()
 	g_assert (make_dns_request (resolver, s, pool, test_dns_cb, NULL, RDNS_REQUEST_SRV, "_xmpp-server._tcp.jabber.org"));
 	requests ++;
 	g_assert (make_dns_request (resolver, s, pool, test_dns_cb, NULL, RDNS_REQUEST_TXT, "non-existent.arpa"));
+	/* Identical query must wait for the pending one */
+	requests ++;
+	g_assert (make_dns_request (resolver, s, pool, test_dns_cb, NULL, RDNS_REQUEST_A, "Google.com"));
+	g_assert (st.dns_requests_coalesced == 1);
+	g_assert (st.dns_cache_misses == 8);
 
 	g_assert (resolver != NULL);
 
 	event_loop (0);
+
+	/* Repeated query is either cached or sent again if it has failed */
+	requests ++;
+	g_assert (make_dns_request (resolver, s, pool, test_dns_cb, NULL, RDNS_REQUEST_TXT, "non-existent.arpa"));
+	g_assert (st.dns_cache_hits + st.dns_cache_misses == 9);
+
+	event_loop (0);
+	rspamd_main->stat = NULL;
 }
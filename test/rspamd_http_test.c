@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "http.h"
+#include "tests.h"
+
+/* Number of requests processed concurrently */
+#define TEST_BATCH 64
+#define TEST_ROUNDS 16
+#define TEST_BODY_LEN 8192
+
+extern struct event_base *base;
+
+static struct timeval test_tv = { 10, 0 };
+static guint test_served, test_done;
+
+struct test_http_peer {
+	gint fd;
+	gboolean replied;
+};
+
+static gint
+test_http_body_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *chunk, gsize len)
+{
+	g_assert (len == TEST_BODY_LEN);
+	g_assert (chunk[0] == 'a' && chunk[len - 1] == 'a');
+
+	return 0;
+}
+
+static void
+test_http_error_handler (struct rspamd_http_connection *conn, GError *err)
+{
+	msg_err ("http error: %s", err->message);
+	g_assert_not_reached ();
+}
+
+static gint
+test_http_server_finish (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg)
+{
+	struct test_http_peer *peer = conn->ud;
+	struct rspamd_http_message *reply;
+
+	if (peer->replied) {
+		test_served ++;
+		close (peer->fd);
+		g_slice_free1 (sizeof (*peer), peer);
+		rspamd_http_connection_unref (conn);
+	}
+	else {
+		peer->replied = TRUE;
+		reply = rspamd_http_new_message (HTTP_RESPONSE);
+		reply->date = time (NULL);
+		reply->code = 200;
+		reply->body = g_string_new ("ok");
+		rspamd_http_connection_reset (conn);
+		rspamd_http_connection_write_message (conn, reply, NULL, "text/plain",
+				peer, peer->fd, &test_tv, base);
+	}
+
+	return 0;
+}
+
+static gint
+test_http_client_finish (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg)
+{
+	struct test_http_peer *peer = conn->ud;
+
+	g_assert (msg->code == 200);
+	test_done ++;
+	close (peer->fd);
+	g_slice_free1 (sizeof (*peer), peer);
+	rspamd_http_connection_unref (conn);
+
+	return 0;
+}
+
+static void
+test_http_request (gpointer server_key, gpointer client_key, GString *peer_key,
+	const GString *body)
+{
+	struct rspamd_http_connection *conn;
+	struct rspamd_http_message *msg;
+	struct test_http_peer *srv, *cl;
+	gint sv[2];
+
+	g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	rspamd_socket_nonblocking (sv[0]);
+	rspamd_socket_nonblocking (sv[1]);
+
+	srv = g_slice_alloc0 (sizeof (*srv));
+	srv->fd = sv[0];
+	conn = rspamd_http_connection_new (test_http_body_handler,
+			test_http_error_handler,
+			test_http_server_finish,
+			0,
+			RSPAMD_HTTP_SERVER);
+	rspamd_http_connection_set_key (conn, server_key);
+	rspamd_http_connection_read_message (conn, srv, srv->fd, &test_tv, base);
+
+	cl = g_slice_alloc0 (sizeof (*cl));
+	cl->fd = sv[1];
+	conn = rspamd_http_connection_new (NULL,
+			test_http_error_handler,
+			test_http_client_finish,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT);
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	g_string_assign (msg->url, "/check");
+	msg->body = g_string_new_len (body->str, body->len);
+
+	if (client_key != NULL) {
+		rspamd_http_connection_set_key (conn, client_key);
+		msg->peer_key = g_string_new_len (peer_key->str, peer_key->len);
+	}
+
+	rspamd_http_connection_write_message (conn, msg, "localhost", NULL, cl,
+			cl->fd, &test_tv, base);
+}
+
+/*
+ * Run batches of requests, if `new_keys` is TRUE then each request uses its
+ * own client keypair, so shared keys cannot be reused
+ */
+static void
+test_http_bench (const gchar *what, gpointer server_key, gboolean encrypted,
+	gboolean new_keys, const GString *body)
+{
+	struct timespec ts1, ts2;
+	gpointer client_key = NULL;
+	GString *peer_key = NULL;
+	double diff;
+	guint i, j;
+
+	if (encrypted) {
+		peer_key = rspamd_http_connection_print_key (server_key,
+				RSPAMD_KEYPAIR_PUBKEY);
+		client_key = rspamd_http_connection_gen_key ();
+	}
+
+	test_served = 0;
+	test_done = 0;
+	clock_gettime (CLOCK_MONOTONIC, &ts1);
+
+	for (i = 0; i < TEST_ROUNDS; i ++) {
+		for (j = 0; j < TEST_BATCH; j ++) {
+			if (new_keys) {
+				rspamd_http_connection_key_destroy (client_key);
+				client_key = rspamd_http_connection_gen_key ();
+			}
+
+			test_http_request (server_key, client_key, peer_key, body);
+		}
+
+		event_base_loop (base, 0);
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &ts2);
+	diff = (ts2.tv_sec - ts1.tv_sec) * 1000. +   /* Seconds */
+		(ts2.tv_nsec - ts1.tv_nsec) / 1000000.;  /* Nanoseconds */
+
+	g_assert (test_served == TEST_ROUNDS * TEST_BATCH);
+	g_assert (test_done == TEST_ROUNDS * TEST_BATCH);
+	msg_info ("%s: processed %d requests in %.6f ms", what,
+			TEST_ROUNDS * TEST_BATCH, diff);
+
+	if (encrypted) {
+		rspamd_http_connection_key_destroy (client_key);
+		g_string_free (peer_key, TRUE);
+	}
+}
+
+void
+rspamd_http_test_func (void)
+{
+	gpointer server_key;
+	GString *body;
+
+	server_key = rspamd_http_connection_gen_key ();
+	body = g_string_sized_new (TEST_BODY_LEN);
+	memset (body->str, 'a', TEST_BODY_LEN);
+	body->len = TEST_BODY_LEN;
+	body->str[body->len] = '\0';
+
+	test_http_bench ("plain", server_key, FALSE, FALSE, body);
+	test_http_bench ("encrypted", server_key, TRUE, FALSE, body);
+	test_http_bench ("encrypted, new client keys", server_key, TRUE, TRUE,
+			body);
+
+	rspamd_http_connection_key_destroy (server_key);
+	g_string_free (body, TRUE);
+}
@@ -11,8 +11,10 @@ rspamd_mem_pool_test_func ()
 	rspamd_mempool_t *pool;
 	rspamd_mempool_stat_t st;
 	char *tmp, *tmp2, *tmp3;
+	GPtrArray *ptrs;
 	pid_t pid;
-	int ret;
+	guint chunks;
+	int ret, i;
 
 	pool = rspamd_mempool_new (sizeof (TEST_BUF));
 	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
@@ -42,6 +44,55 @@ rspamd_mem_pool_test_func ()
 	g_assert (*tmp3 == 't');
 	
 	rspamd_mempool_delete (pool);
+
+	/* Single owner pool */
+	rspamd_mempool_stat (&st);
+	chunks = st.chunks_allocated;
+	pool = rspamd_mempool_new_full (sizeof (TEST_BUF) * 4,
+			RSPAMD_MEMPOOL_SINGLE_OWNER);
+	ptrs = g_ptr_array_new ();
+
+	for (i = 0; i < 100; i ++) {
+		tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+		g_assert (((uintptr_t)tmp & (MEM_ALIGNMENT - 1)) == 0);
+		snprintf (tmp, sizeof (TEST_BUF), "%s", TEST_BUF);
+		tmp[0] = 'a' + i % 26;
+		g_ptr_array_add (ptrs, tmp);
+	}
+
+	/* Pages taken by the lock free path are counted as well */
+	rspamd_mempool_stat (&st);
+	g_assert_cmpuint (st.chunks_allocated - chunks, >=, 100 / 4);
+
+	rspamd_mempool_set_shared (pool);
+	tmp2 = rspamd_mempool_strdup (pool, TEST2_BUF);
+
+	for (i = 0; i < 100; i ++) {
+		tmp = g_ptr_array_index (ptrs, i);
+		g_assert (tmp[0] == 'a' + i % 26);
+		g_assert (strcmp (tmp + 1, TEST_BUF + 1) == 0);
+	}
+
+	g_assert (strcmp (tmp2, TEST2_BUF) == 0);
+	g_ptr_array_free (ptrs, TRUE);
+	rspamd_mempool_delete (pool);
+
+	/* Recycled pools reuse pages of each other */
+	for (i = 0; i < 16; i ++) {
+		pool = rspamd_mempool_new_full (rspamd_mempool_suggest_size (),
+				RSPAMD_MEMPOOL_SINGLE_OWNER | RSPAMD_MEMPOOL_RECYCLE);
+		tmp = rspamd_mempool_alloc (pool, rspamd_mempool_suggest_size () / 2);
+		memset (tmp, 'a', rspamd_mempool_suggest_size () / 2);
+		tmp2 = rspamd_mempool_strdup (pool, TEST2_BUF);
+		g_assert (strcmp (tmp2, TEST2_BUF) == 0);
+		rspamd_mempool_delete (pool);
+	}
+
+	rspamd_mempool_stat (&st);
+	g_assert (st.chunks_recycled >= 15);
+	g_assert (rspamd_mempool_cache_size () > 0);
+	rspamd_mempool_cache_trim (0);
+	g_assert (rspamd_mempool_cache_size () == 0);
 	rspamd_mempool_stat (&st);
 	
 }
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "mime_parser.h"
+#include "tests.h"
+
+static const gchar test_msg[] = "From: <a@example.com>\r\n"
+	"Subject: test\r\n"
+	"Content-Type: multipart/mixed;\r\n"
+	"\tboundary=\"=_outer\"\r\n"
+	"\r\n"
+	"preamble\r\n"
+	"--=_outer\r\n"
+	"Content-Type: multipart/alternative; boundary=inner\r\n"
+	"\r\n"
+	"--inner\r\n"
+	"Content-Type: text/plain; charset=utf-8\r\n"
+	"Content-Transfer-Encoding: quoted-printable\r\n"
+	"\r\n"
+	"caf=C3=A9 =\r\n"
+	"au lait\r\n"
+	"--inner\r\n"
+	"Content-Type: TEXT/HTML\r\n"
+	"\r\n"
+	"<b>cafe</b>\r\n"
+	"--inner--\r\n"
+	"--=_outer\r\n"
+	"Content-Type: application/octet-stream\r\n"
+	"Content-Disposition: attachment; filename=\"a b.bin\"\r\n"
+	"Content-Transfer-Encoding: base64\r\n"
+	"\r\n"
+	"AAEC\r\n"
+	"/w==\r\n"
+	"--=_outer--\r\n"
+	"epilogue\r\n";
+
+void
+rspamd_mime_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	struct rspamd_mime_desc *desc, *alt, *text, *html, *att;
+	GByteArray *content;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+
+	desc = rspamd_mime_parse (pool, test_msg, sizeof (test_msg) - 1);
+	g_assert (desc != NULL);
+	g_assert (strcmp (desc->type, "multipart") == 0);
+	g_assert (strcmp (desc->boundary, "=_outer") == 0);
+
+	alt = desc->children;
+	g_assert (alt != NULL && strcmp (alt->subtype, "alternative") == 0);
+	att = alt->next;
+	g_assert (att != NULL && att->next == NULL);
+
+	text = alt->children;
+	g_assert (text != NULL && text->cte == RSPAMD_CTE_QP);
+	content = rspamd_mime_decode (pool, text);
+	g_assert (content->len == sizeof ("caf\xc3\xa9 au lait") - 1);
+	g_assert (memcmp (content->data, "caf\xc3\xa9 au lait", content->len) == 0);
+
+	html = text->next;
+	g_assert (html != NULL && html->next == NULL);
+	g_assert (strcmp (html->type, "text") == 0 &&
+		strcmp (html->subtype, "html") == 0);
+	/* Identity encodings are not copied */
+	content = rspamd_mime_decode (pool, html);
+	g_assert (content->data == (const guint8 *)html->body);
+	g_assert (content->len == sizeof ("<b>cafe</b>") - 1);
+
+	g_assert (att->is_attachment);
+	g_assert (strcmp (att->filename, "a b.bin") == 0);
+	content = rspamd_mime_decode (pool, att);
+	g_assert (content->len == 4);
+	g_assert (content->data[2] == 0x2 && content->data[3] == 0xff);
+
+	/* Missing boundary is left for the fallback parser */
+	g_assert (rspamd_mime_parse (pool,
+		"Content-Type: multipart/mixed; boundary=x\r\n\r\ntext\r\n",
+		sizeof ("Content-Type: multipart/mixed; boundary=x\r\n\r\ntext\r\n") -
+		1) == NULL);
+
+	rspamd_mempool_delete (pool);
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "cfg_file.h"
+#include "stat_internal.h"
+#include "tests.h"
+#include "ottery.h"
+
+#define TEST_TOKENS 256
+
+extern struct rspamd_main *rspamd_main;
+extern struct event_base *base;
+
+/*
+ * Minimal stand-in for a redis server that keeps a single hash table and
+ * understands commands used by the statistics backend
+ */
+struct test_redis_server {
+	gint sock;
+	GHashTable *hash;
+	guint commands;
+	gboolean mute;                          /**< do not reply to commands */
+};
+
+static gboolean
+test_redis_read_command (FILE *in, GPtrArray *args)
+{
+	gchar line[64], *arg;
+	gint nargs, len, i;
+
+	if (fgets (line, sizeof (line), in) == NULL || line[0] != '*') {
+		return FALSE;
+	}
+
+	nargs = atoi (line + 1);
+
+	for (i = 0; i < nargs; i ++) {
+		if (fgets (line, sizeof (line), in) == NULL || line[0] != '$') {
+			return FALSE;
+		}
+
+		len = atoi (line + 1);
+		arg = g_malloc (len + 2);
+
+		if (fread (arg, 1, len + 2, in) != (gsize)len + 2) {
+			g_free (arg);
+			return FALSE;
+		}
+
+		arg[len] = '\0';
+		g_ptr_array_add (args, arg);
+	}
+
+	return TRUE;
+}
+
+static void
+test_redis_reply_bulk (FILE *out, const gchar *val)
+{
+	if (val == NULL) {
+		fprintf (out, "$-1\r\n");
+	}
+	else {
+		fprintf (out, "$%d\r\n%s\r\n", (gint)strlen (val), val);
+	}
+}
+
+static void
+test_redis_serve (struct test_redis_server *srv, gint fd)
+{
+	GPtrArray *args;
+	FILE *in, *out;
+	const gchar *cmd;
+	gchar *val;
+	guint i;
+
+	in = fdopen (fd, "r");
+	out = fdopen (dup (fd), "w");
+
+	for (;;) {
+		args = g_ptr_array_new_with_free_func (g_free);
+
+		if (!test_redis_read_command (in, args) || args->len < 3) {
+			g_ptr_array_free (args, TRUE);
+			break;
+		}
+
+		srv->commands ++;
+		cmd = g_ptr_array_index (args, 0);
+
+		if (srv->mute) {
+			g_ptr_array_free (args, TRUE);
+			continue;
+		}
+
+		if (strcmp (cmd, "HGET") == 0) {
+			test_redis_reply_bulk (out, g_hash_table_lookup (srv->hash,
+					g_ptr_array_index (args, 2)));
+		}
+		else if (strcmp (cmd, "HMGET") == 0) {
+			fprintf (out, "*%u\r\n", args->len - 2);
+
+			for (i = 2; i < args->len; i ++) {
+				test_redis_reply_bulk (out, g_hash_table_lookup (srv->hash,
+						g_ptr_array_index (args, i)));
+			}
+		}
+		else if (strcmp (cmd, "HINCRBYFLOAT") == 0) {
+			val = g_hash_table_lookup (srv->hash, g_ptr_array_index (args, 2));
+			val = g_strdup_printf ("%.2f", (val ? strtod (val, NULL) : 0.0) +
+					strtod (g_ptr_array_index (args, 3), NULL));
+			g_hash_table_insert (srv->hash,
+					g_strdup (g_ptr_array_index (args, 2)), val);
+			test_redis_reply_bulk (out, val);
+		}
+		else if (strcmp (cmd, "HINCRBY") == 0) {
+			val = g_hash_table_lookup (srv->hash, g_ptr_array_index (args, 2));
+			i = (val ? atoi (val) : 0) + atoi (g_ptr_array_index (args, 3));
+			g_hash_table_insert (srv->hash,
+					g_strdup (g_ptr_array_index (args, 2)),
+					g_strdup_printf ("%u", i));
+			fprintf (out, ":%u\r\n", i);
+		}
+		else {
+			fprintf (out, "-ERR unknown command\r\n");
+		}
+
+		fflush (out);
+		g_ptr_array_free (args, TRUE);
+	}
+
+	fclose (in);
+	fclose (out);
+}
+
+static gpointer
+test_redis_server_thread (gpointer ud)
+{
+	struct test_redis_server *srv = ud;
+	gint fd;
+
+	/* Backend opens a new connection for each request of a task */
+	while ((fd = accept (srv->sock, NULL, NULL)) != -1) {
+		test_redis_serve (srv, fd);
+	}
+
+	return NULL;
+}
+
+static gboolean
+test_redis_session_fin (gpointer ud)
+{
+	event_base_loopbreak (base);
+
+	return TRUE;
+}
+
+/* Run event loop until all events of task are finished */
+static void
+test_redis_wait (struct rspamd_task *task)
+{
+	task->s->wanna_die = TRUE;
+
+	if (check_session_pending (task->s)) {
+		event_base_loop (base, 0);
+	}
+}
+
+void
+rspamd_redis_stat_test_func (void)
+{
+	static struct test_redis_server srv;
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_stat_ctx stat_ctx;
+	struct rspamd_statfile_config stcf;
+	struct rspamd_classifier_config clcf;
+	struct rspamd_statfile_runtime st_runtime;
+	struct rspamd_token_result *results;
+	struct rspamd_task task;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof (sin);
+	rspamd_token_t *tok, new;
+	GArray *tokens;
+	GList *saved_classifiers, *classifiers;
+	GThread *thr;
+	GError *err = NULL;
+	gpointer ctx;
+	gchar server[64];
+	guint i;
+
+	/* Start stand-in server */
+	memset (&srv, 0, sizeof (srv));
+	srv.hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	srv.sock = socket (AF_INET, SOCK_STREAM, 0);
+	g_assert (srv.sock != -1);
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	g_assert (bind (srv.sock, (struct sockaddr *)&sin, sizeof (sin)) == 0);
+	g_assert (listen (srv.sock, 1) == 0);
+	g_assert (getsockname (srv.sock, (struct sockaddr *)&sin, &slen) == 0);
+	thr = rspamd_create_thread ("redis", test_redis_server_thread, &srv, &err);
+	g_assert (thr != NULL);
+
+	/* Configure a single redis statfile */
+	memset (&stcf, 0, sizeof (stcf));
+	stcf.symbol = "BAYES_SPAM";
+	stcf.backend = "redis";
+	stcf.is_spam = TRUE;
+	stcf.opts = ucl_object_typed_new (UCL_OBJECT);
+	rspamd_snprintf (server, sizeof (server), "127.0.0.1:%d",
+			(gint)ntohs (sin.sin_port));
+	ucl_object_insert_key (stcf.opts, ucl_object_fromstring (server),
+			"servers", 0, false);
+	ucl_object_insert_key (stcf.opts, ucl_object_fromdouble (0.2),
+			"timeout", 0, false);
+	memset (&clcf, 0, sizeof (clcf));
+	clcf.statfiles = g_list_prepend (NULL, &stcf);
+
+	saved_classifiers = cfg->classifiers;
+	classifiers = g_list_prepend (NULL, &clcf);
+	cfg->classifiers = classifiers;
+	memset (&stat_ctx, 0, sizeof (stat_ctx));
+	ctx = rspamd_redis_init (&stat_ctx, cfg);
+	g_assert (stat_ctx.statfiles == 1);
+	g_assert (stat_ctx.async_statfiles == 1);
+
+	/* Requests are bound to the session and the event loop of a task */
+	memset (&task, 0, sizeof (task));
+	task.task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	task.ev_base = base;
+	task.s = new_async_session (task.task_pool, test_redis_session_fin, NULL,
+			NULL, &task);
+
+	memset (&st_runtime, 0, sizeof (st_runtime));
+	st_runtime.st = &stcf;
+	st_runtime.backend_runtime = rspamd_redis_runtime (&task, &stcf, TRUE, ctx);
+	g_assert (st_runtime.backend_runtime != NULL);
+
+	tokens = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_token_t),
+			TEST_TOKENS);
+	results = g_malloc0 (sizeof (*results) * TEST_TOKENS);
+
+	for (i = 0; i < TEST_TOKENS; i ++) {
+		new.data = ((guint64)ottery_rand_uint32 () << 32) | i;
+		new.results = &results[i];
+		new.results->st_runtime = &st_runtime;
+		new.results->value = i + 1;
+		g_array_append_val (tokens, new);
+	}
+
+	/* Learn by a single pipeline followed by increment of learns */
+	g_assert (rspamd_redis_learn_tokens (tokens, 0, &st_runtime, ctx) ==
+			TEST_TOKENS);
+	g_assert (rspamd_redis_inc_learns (st_runtime.backend_runtime, ctx) == 1);
+	test_redis_wait (&task);
+	g_assert (srv.commands == TEST_TOKENS + 1);
+	g_assert (task.error_code == 0);
+	g_assert (rspamd_redis_total_learns (st_runtime.backend_runtime, ctx) == 1);
+
+	/* Classify by a single command, values are set by reply */
+	for (i = 0; i < TEST_TOKENS; i ++) {
+		results[i].value = 0;
+	}
+
+	rspamd_redis_process_tokens (tokens, 0, &st_runtime, ctx);
+	test_redis_wait (&task);
+	g_assert (srv.commands == TEST_TOKENS + 2);
+
+	for (i = 0; i < TEST_TOKENS; i ++) {
+		tok = &g_array_index (tokens, rspamd_token_t, i);
+		g_assert (tok->results[0].value == i + 1);
+	}
+
+	/*
+	 * Learns on another node between loading and storing of tokens are
+	 * not lost, and unchanged tokens are not written
+	 */
+	for (i = 0; i < TEST_TOKENS; i ++) {
+		results[i].orig_value = results[i].value;
+	}
+
+	tok = &g_array_index (tokens, rspamd_token_t, 10);
+	tok->results[0].value ++;
+	g_hash_table_insert (srv.hash, g_strdup_printf ("%" G_GUINT64_FORMAT,
+			tok->data), g_strdup ("20"));
+	g_assert (rspamd_redis_learn_tokens (tokens, 0, &st_runtime, ctx) ==
+			TEST_TOKENS);
+	g_assert (rspamd_redis_inc_learns (st_runtime.backend_runtime, ctx) == 2);
+	test_redis_wait (&task);
+	g_assert (srv.commands == TEST_TOKENS + 4);
+
+	rspamd_redis_process_tokens (tokens, 0, &st_runtime, ctx);
+	test_redis_wait (&task);
+	g_assert (tok->results[0].value == 21);
+	g_assert (rspamd_redis_total_learns (st_runtime.backend_runtime, ctx) == 2);
+
+	/* Server that does not reply delays the task only up to timeout */
+	srv.mute = TRUE;
+	rspamd_redis_process_tokens (tokens, 0, &st_runtime, ctx);
+	test_redis_wait (&task);
+	g_assert (tok->results[0].value == 0);
+
+	rspamd_redis_inc_learns (st_runtime.backend_runtime, ctx);
+	test_redis_wait (&task);
+	g_assert (task.error_code == RSPAMD_STATFILE_ERROR);
+	srv.mute = FALSE;
+
+	rspamd_mempool_delete (task.task_pool);
+	cfg->classifiers = saved_classifiers;
+	g_array_free (tokens, TRUE);
+	g_free (results);
+	ucl_object_unref (stcf.opts);
+	g_list_free (clcf.statfiles);
+	g_list_free (classifiers);
+
+	/* Shut the listening socket down to stop the stand-in server */
+	shutdown (srv.sock, SHUT_RDWR);
+	g_thread_join (thr);
+	close (srv.sock);
+	g_hash_table_unref (srv.hash);
+}
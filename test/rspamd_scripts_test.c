@@ -0,0 +1,110 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "scripts.h"
+#include "tests.h"
+
+static gchar *
+test_scripts_text (const gchar *first, const gchar *second, guint n)
+{
+	GString *buf;
+	guint i;
+
+	buf = g_string_new (NULL);
+
+	for (i = 0; i < n; i ++) {
+		g_string_append (buf, first);
+		g_string_append_c (buf, ' ');
+	}
+
+	for (i = 0; second != NULL && i < n; i ++) {
+		g_string_append (buf, second);
+		g_string_append_c (buf, ' ');
+	}
+
+	return g_string_free (buf, FALSE);
+}
+
+static struct rspamd_script_count *
+test_scripts_detect (rspamd_mempool_t *pool, const gchar *text, guint sample,
+	guint *nscripts)
+{
+	return rspamd_scripts_detect (pool, (const guchar *)text, strlen (text),
+			sample, nscripts);
+}
+
+void
+rspamd_scripts_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	struct rspamd_script_count *res;
+	gchar *text;
+	guint n, i;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+
+	/* Detection stops once the first script has the majority of letters */
+	text = test_scripts_text ("\xd0\xb4", "b", 100);
+	res = test_scripts_detect (pool, text, 256, &n);
+	g_assert (res != NULL);
+	g_assert_cmpuint (n, ==, 1);
+	g_assert_cmpint (res[0].script, ==, G_UNICODE_SCRIPT_CYRILLIC);
+	g_assert_cmpuint (res[0].count, ==, 32);
+	g_assert_cmpstr (rspamd_script_name (res[0].script), ==, "cyrillic");
+	g_free (text);
+
+	/* Mixed scripts are counted up to the sample size */
+	text = test_scripts_text ("\xd0\xb4" "b" "\xce\xb1", NULL, 100);
+	res = test_scripts_detect (pool, text, 60, &n);
+	g_assert (res != NULL);
+	g_assert_cmpuint (n, ==, 3);
+
+	for (i = 0; i < n; i ++) {
+		g_assert_cmpuint (res[i].count, ==, 20);
+	}
+
+	g_assert_cmpint (res[0].script, <, res[1].script);
+	g_assert_cmpint (res[1].script, <, res[2].script);
+
+	/* The most common script goes first */
+	res = test_scripts_detect (pool, "b \xd0\xb4\xd0\xb4 \xce\xb1", 256, &n);
+	g_assert (res != NULL);
+	g_assert_cmpuint (n, ==, 3);
+	g_assert_cmpint (res[0].script, ==, G_UNICODE_SCRIPT_CYRILLIC);
+	g_assert_cmpuint (res[0].count, ==, 2);
+
+	/* Too small sample is raised to the minimal one */
+	res = test_scripts_detect (pool, text, 0, &n);
+	g_assert (res != NULL);
+	g_assert_cmpuint (res[0].count + res[1].count + res[2].count, >=, 32);
+	g_free (text);
+
+	/* No letters at all */
+	res = test_scripts_detect (pool, "123 !?", 256, &n);
+	g_assert (res == NULL);
+	g_assert_cmpuint (n, ==, 0);
+
+	rspamd_mempool_delete (pool);
+}
@@ -87,7 +87,7 @@ free_fuzzy_words (GArray *ar)
 }
 
 static void
-test_case (gsize cnt, gsize max_len, gdouble perm_factor)
+test_case (gsize cnt, gsize max_len, gdouble perm_factor, gboolean fast)
 {
 	GArray *input;
 	struct rspamd_shingle *sgl, *sgl_permuted;
@@ -98,12 +98,22 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor)
 	ottery_rand_bytes (key, sizeof (key));
 	input = generate_fuzzy_words (cnt, max_len);
 	clock_gettime (CLOCK_MONOTONIC, &ts1);
-	sgl = rspamd_shingles_generate (input, key, NULL,
-			rspamd_shingles_default_filter, NULL);
+	if (fast) {
+		sgl = rspamd_shingles_generate_fast (input, key, NULL);
+	}
+	else {
+		sgl = rspamd_shingles_generate (input, key, NULL,
+				rspamd_shingles_default_filter, NULL);
+	}
 	clock_gettime (CLOCK_MONOTONIC, &ts2);
 	permute_vector (input, perm_factor);
-	sgl_permuted = rspamd_shingles_generate (input, key, NULL,
-			rspamd_shingles_default_filter, NULL);
+	if (fast) {
+		sgl_permuted = rspamd_shingles_generate_fast (input, key, NULL);
+	}
+	else {
+		sgl_permuted = rspamd_shingles_generate (input, key, NULL,
+				rspamd_shingles_default_filter, NULL);
+	}
 
 	res = rspamd_shingles_compare (sgl, sgl_permuted);
 
@@ -116,13 +126,106 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor)
 	g_free (sgl_permuted);
 }
 
+static void
+test_index (gsize cnt, gdouble perm_factor)
+{
+	struct rspamd_shingle_index *idx;
+	struct rspamd_shingle *sgl, query;
+	guint64 id;
+	gdouble similarity;
+	gsize i, j, found = 0;
+
+	idx = rspamd_shingle_index_new (0);
+	sgl = g_malloc (sizeof (*sgl) * cnt);
+	ottery_rand_bytes (sgl, sizeof (*sgl) * cnt);
+
+	for (i = 0; i < cnt; i ++) {
+		rspamd_shingle_index_insert (idx, &sgl[i], i);
+	}
+
+	g_assert_cmpuint (rspamd_shingle_index_size (idx), ==, cnt);
+
+	for (i = 0; i < cnt; i ++) {
+		memcpy (&query, &sgl[i], sizeof (query));
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			if (ottery_rand_unsigned () <= G_MAXUINT * perm_factor) {
+				query.hashes[j] = ottery_rand_uint64 ();
+			}
+		}
+
+		if (rspamd_shingle_index_best (idx, &query, &id, &similarity)) {
+			g_assert_cmpuint (id, ==, i);
+			g_assert_cmpfloat (similarity, ==,
+					rspamd_shingles_compare (&query, &sgl[i]));
+			found ++;
+		}
+	}
+
+	msg_debug ("found %z of %z shingles with %.2f permutations", found, cnt,
+			perm_factor);
+	g_assert_cmpfloat ((gdouble)found / cnt, >=, 0.9);
+
+	for (i = 0; i < cnt; i ++) {
+		g_assert (rspamd_shingle_index_remove (idx, i));
+	}
+
+	g_assert (!rspamd_shingle_index_best (idx, &sgl[0], &id, &similarity));
+	rspamd_shingle_index_destroy (idx);
+	g_free (sgl);
+}
+
+/*
+ * Unknown hashes should be skipped and never matched, even if they are zero
+ */
+static void
+test_index_partial (void)
+{
+	struct rspamd_shingle_index *idx;
+	struct rspamd_shingle sgl, query;
+	guint64 id;
+	gdouble similarity;
+	guint32 mask;
+
+	idx = rspamd_shingle_index_new (0);
+	ottery_rand_bytes (&sgl, sizeof (sgl));
+	/* The first band is unknown */
+	mask = RSPAMD_SHINGLE_FULL_MASK & ~3U;
+	sgl.hashes[0] = 0;
+	sgl.hashes[1] = 0;
+	rspamd_shingle_index_insert_partial (idx, &sgl, mask, 1);
+
+	/* Query that matches only the unknown band */
+	ottery_rand_bytes (&query, sizeof (query));
+	query.hashes[0] = 0;
+	query.hashes[1] = 0;
+	g_assert (!rspamd_shingle_index_best (idx, &query, &id, &similarity));
+
+	/* Query that matches the known bands */
+	memcpy (&query, &sgl, sizeof (query));
+	g_assert (rspamd_shingle_index_best (idx, &query, &id, &similarity));
+	g_assert_cmpuint (id, ==, 1);
+	g_assert_cmpfloat (similarity, ==,
+			(gdouble)(RSPAMD_SHINGLE_SIZE - 2) / RSPAMD_SHINGLE_SIZE);
+
+	rspamd_shingle_index_destroy (idx);
+}
+
 void
 rspamd_shingles_test_func (void)
 {
-	//test_case (5, 100, 0.5);
-	test_case (200, 10, 0.1);
-	test_case (500, 20, 0.01);
-	test_case (5000, 20, 0.01);
-	test_case (5000, 15, 0);
-	test_case (5000, 30, 1.0);
+	//test_case (5, 100, 0.5, FALSE);
+	test_case (200, 10, 0.1, FALSE);
+	test_case (500, 20, 0.01, FALSE);
+	test_case (5000, 20, 0.01, FALSE);
+	test_case (5000, 15, 0, FALSE);
+	test_case (5000, 30, 1.0, FALSE);
+	test_case (200, 10, 0.1, TRUE);
+	test_case (500, 20, 0.01, TRUE);
+	test_case (5000, 20, 0.01, TRUE);
+	test_case (5000, 15, 0, TRUE);
+	test_case (5000, 30, 1.0, TRUE);
+	test_index (5000, 0.0);
+	test_index (5000, 0.3);
+	test_index_partial ();
 }
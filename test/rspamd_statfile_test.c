@@ -1,45 +1,282 @@
 #include "config.h"
 #include "main.h"
-#include "statfile.h"
+#include "cfg_file.h"
+#include "stat_internal.h"
 #include "tests.h"
 #include "ottery.h"
 
 #define TEST_FILENAME "/tmp/rspamd_test.stat"
-#define HASHES_NUM 256
-
-void 
-rspamd_statfile_test_func ()
-{
-	statfile_pool_t *pool;
-	rspamd_mempool_t *p;
-	stat_file_t *st;
-	uint32_t random_hashes[HASHES_NUM], i, v;
-	time_t now = time (NULL);
-	
-	p = rspamd_mempool_new (rspamd_mempool_suggest_size ());
-	umask (S_IWGRP | S_IWOTH);
-	pool = statfile_pool_new (p, TRUE);
+#define HASHES_NUM 4096
+/* Header, section and padding of bucketed statfile */
+#define TEST_BUCKETS_OFFSET 320
+#define TEST_BUCKET_SIZE 64
 
-	for (i = 0; i < HASHES_NUM; i ++) {
-		random_hashes[i] = ottery_rand_uint32 ();
+extern struct rspamd_main *rspamd_main;
+
+struct test_statfile {
+	struct rspamd_statfile_config stcf;
+	struct rspamd_classifier_config clcf;
+	struct rspamd_statfile_runtime st_runtime;
+	struct rspamd_stat_ctx stat_ctx;
+	gpointer ctx;
+};
+
+static void
+test_statfile_init (struct test_statfile *st, gsize size, gsize max_size)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	GList *saved_classifiers;
+
+	memset (st, 0, sizeof (*st));
+	st->stcf.symbol = "BAYES_SPAM";
+	st->stcf.is_spam = TRUE;
+	st->stcf.opts = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (st->stcf.opts, ucl_object_fromstring (TEST_FILENAME),
+			"filename", 0, false);
+	ucl_object_insert_key (st->stcf.opts, ucl_object_fromint (size),
+			"size", 0, false);
+
+	if (max_size > 0) {
+		ucl_object_insert_key (st->stcf.opts, ucl_object_fromint (max_size),
+				"max_size", 0, false);
 	}
 
-	/* Create new file */
-	g_assert (rspamd_mmaped_file_create (pool, TEST_FILENAME, 65535) != -1);
-	g_assert ((st = rspamd_mmaped_file_open (pool, TEST_FILENAME, 65535, FALSE)) != NULL);
-	
-	/* Get and set random blocks */
-	rspamd_mmaped_file_lock_file (pool, st);
-	for (i = 0; i < HASHES_NUM; i ++) {
-		rspamd_mmaped_file_set_block (pool, st, random_hashes[i], random_hashes[i], now, 1.0);
+	st->clcf.statfiles = g_list_prepend (NULL, &st->stcf);
+
+	saved_classifiers = cfg->classifiers;
+	cfg->classifiers = g_list_prepend (NULL, &st->clcf);
+	st->ctx = rspamd_mmaped_file_init (&st->stat_ctx, cfg);
+	g_list_free (cfg->classifiers);
+	cfg->classifiers = saved_classifiers;
+
+	st->st_runtime.st = &st->stcf;
+	st->st_runtime.backend_runtime = rspamd_mmaped_file_runtime (NULL, &st->stcf,
+			TRUE, st->ctx);
+	g_assert (st->st_runtime.backend_runtime != NULL);
+}
+
+static void
+test_statfile_destroy (struct test_statfile *st)
+{
+	ucl_object_unref (st->stcf.opts);
+	g_list_free (st->clcf.statfiles);
+}
+
+static gsize
+test_statfile_size (void)
+{
+	struct stat sb;
+
+	g_assert (stat (TEST_FILENAME, &sb) != -1);
+
+	return sb.st_size;
+}
+
+static void
+test_statfile_learn (struct test_statfile *st, guint64 *hashes, guint cnt)
+{
+	struct rspamd_token_result res;
+	rspamd_token_t tok;
+	guint i;
+
+	for (i = 0; i < cnt; i ++) {
+		memset (&res, 0, sizeof (res));
+		tok.data = hashes[i];
+		tok.results = &res;
+		res.st_runtime = &st->st_runtime;
+		res.value = i + 1;
+		rspamd_mmaped_file_learn_token (&tok, &res, st->ctx);
 	}
-	rspamd_mmaped_file_unlock_file (pool, st);
+}
+
+/* Learns all tokens at once, like the statistics module does */
+static guint
+test_statfile_learn_tokens (struct test_statfile *st, guint64 *hashes,
+		guint cnt)
+{
+	struct rspamd_token_result *results;
+	rspamd_token_t tok;
+	GArray *tokens;
+	guint i, learned;
+
+	tokens = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_token_t), cnt);
+	results = g_malloc0 (sizeof (*results) * cnt);
+
+	for (i = 0; i < cnt; i ++) {
+		tok.data = hashes[i];
+		tok.results = &results[i];
+		results[i].st_runtime = &st->st_runtime;
+		results[i].value = i + 1;
+		g_array_append_val (tokens, tok);
+	}
+
+	learned = rspamd_mmaped_file_learn_tokens (tokens, 0, &st->st_runtime,
+			st->ctx);
+
+	g_array_free (tokens, TRUE);
+	g_free (results);
+
+	return learned;
+}
+
+/* Returns number of tokens with the learned values */
+static guint
+test_statfile_check (struct test_statfile *st, guint64 *hashes, guint cnt)
+{
+	struct rspamd_token_result *results;
+	rspamd_token_t tok;
+	GArray *tokens;
+	guint i, found = 0;
+
+	st->st_runtime.backend_runtime = rspamd_mmaped_file_runtime (NULL, &st->stcf,
+			FALSE, st->ctx);
+	tokens = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_token_t), cnt);
+	results = g_malloc0 (sizeof (*results) * cnt);
+
+	for (i = 0; i < cnt; i ++) {
+		tok.data = hashes[i];
+		tok.results = &results[i];
+		results[i].st_runtime = &st->st_runtime;
+		g_array_append_val (tokens, tok);
+	}
+
+	rspamd_mmaped_file_process_tokens (tokens, 0, &st->st_runtime, st->ctx);
+
+	for (i = 0; i < cnt; i ++) {
+		if (results[i].value == i + 1) {
+			found ++;
+		}
+	}
+
+	g_array_free (tokens, TRUE);
+	g_free (results);
+
+	return found;
+}
+
+/*
+ * Write statfile of version 1.2: header, section and blocks of hash1, hash2
+ * and double value
+ */
+static void
+test_statfile_write_legacy (guint64 *hashes, guint cnt, guint nblocks)
+{
+	struct {
+		guint32 hash1;
+		guint32 hash2;
+		double value;
+	} block;
+	guchar header[288];
+	guint64 section[2], used;
+	guint i;
+	FILE *f;
+
+	memset (header, 0, sizeof (header));
+	memcpy (header, "rsd12", 5);
+	/* Number of used blocks defines the size of the converted statfile */
+	used = nblocks;
+	memcpy (header + 32, &used, sizeof (used));
+	memcpy (header + 40, &used, sizeof (used));
+	section[0] = 1;
+	section[1] = nblocks;
+
+	f = fopen (TEST_FILENAME, "w");
+	g_assert (f != NULL);
+	g_assert (fwrite (header, sizeof (header), 1, f) == 1);
+	g_assert (fwrite (section, sizeof (section), 1, f) == 1);
+
+	for (i = 0; i < nblocks; i ++) {
+		memset (&block, 0, sizeof (block));
+
+		if (i < cnt) {
+			block.hash1 = hashes[i] & 0xffffffffULL;
+			block.hash2 = hashes[i] >> 32;
+			block.value = i + 1;
+		}
+
+		g_assert (fwrite (&block, sizeof (block), 1, f) == 1);
+	}
+
+	fclose (f);
+}
+
+void
+rspamd_statfile_test_func (void)
+{
+	struct test_statfile st, st2;
+	guint64 hashes[HASHES_NUM];
+	gchar version[5];
+	gsize size;
+	FILE *f;
+	guint i;
+
+	umask (S_IWGRP | S_IWOTH);
 
 	for (i = 0; i < HASHES_NUM; i ++) {
-		v = rspamd_mmaped_file_get_block (pool, st, random_hashes[i], random_hashes[i], now);
-		g_assert(v == 1.0);
+		hashes[i] = ottery_rand_uint64 ();
 	}
 
-	rspamd_mmaped_file_destroy (pool);
-	
+	/* Without max_size the statfile keeps its size and expires tokens */
+	unlink (TEST_FILENAME);
+	size = TEST_BUCKETS_OFFSET + TEST_BUCKET_SIZE * 64;
+	test_statfile_init (&st, size, 0);
+	test_statfile_learn (&st, hashes, HASHES_NUM);
+	g_assert_cmpuint (test_statfile_size (), ==, size);
+	g_assert_cmpuint (test_statfile_check (&st, hashes, HASHES_NUM), <,
+			HASHES_NUM);
+	test_statfile_destroy (&st);
+
+	/*
+	 * Online rehash: a statfile that has been rehashed through one context is
+	 * reopened by another one, like by another process
+	 */
+	unlink (TEST_FILENAME);
+	test_statfile_init (&st, size, size * 1024);
+	test_statfile_init (&st2, size, size * 1024);
+	test_statfile_learn (&st, hashes, HASHES_NUM / 2);
+	g_assert_cmpuint (test_statfile_size (), >, size);
+	g_assert_cmpuint (test_statfile_check (&st, hashes, HASHES_NUM / 2), ==,
+			HASHES_NUM / 2);
+	/* Learn through the stale context, that should reopen the file first */
+	test_statfile_learn (&st2, hashes, HASHES_NUM);
+	g_assert_cmpuint (test_statfile_check (&st, hashes, HASHES_NUM), ==,
+			HASHES_NUM);
+	g_assert_cmpuint (test_statfile_check (&st2, hashes, HASHES_NUM), ==,
+			HASHES_NUM);
+	test_statfile_destroy (&st);
+	test_statfile_destroy (&st2);
+
+	/*
+	 * Tokens learned at once: the statfile is grown while inserting them and
+	 * a stale context reopens it before storing its tokens
+	 */
+	unlink (TEST_FILENAME);
+	test_statfile_init (&st, size, size * 1024);
+	test_statfile_init (&st2, size, size * 1024);
+	g_assert_cmpuint (test_statfile_learn_tokens (&st, hashes, HASHES_NUM / 2),
+			==, HASHES_NUM / 2);
+	g_assert_cmpuint (test_statfile_size (), >, size);
+	g_assert_cmpuint (test_statfile_learn_tokens (&st2, hashes, HASHES_NUM),
+			==, HASHES_NUM);
+	g_assert_cmpuint (test_statfile_check (&st, hashes, HASHES_NUM), ==,
+			HASHES_NUM);
+	g_assert_cmpuint (test_statfile_check (&st2, hashes, HASHES_NUM), ==,
+			HASHES_NUM);
+	test_statfile_destroy (&st);
+	test_statfile_destroy (&st2);
+
+	/* Statfile of version 1.2 is converted on open */
+	unlink (TEST_FILENAME);
+	test_statfile_write_legacy (hashes, HASHES_NUM, HASHES_NUM * 2);
+	test_statfile_init (&st, size, 0);
+	g_assert_cmpuint (test_statfile_check (&st, hashes, HASHES_NUM), ==,
+			HASHES_NUM);
+	f = fopen (TEST_FILENAME, "r");
+	g_assert (f != NULL);
+	g_assert (fread (version, sizeof (version), 1, f) == 1);
+	fclose (f);
+	g_assert (memcmp (version, "rsd13", 5) == 0);
+	test_statfile_destroy (&st);
+
+	unlink (TEST_FILENAME);
 }
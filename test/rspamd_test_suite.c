@@ -55,6 +55,13 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/rrd", rspamd_rrd_test_func);
 	g_test_add_func ("/rspamd/upstream", rspamd_upstream_test_func);
 	g_test_add_func ("/rspamd/shingles", rspamd_shingles_test_func);
+	g_test_add_func ("/rspamd/redis_stat", rspamd_redis_stat_test_func);
+	g_test_add_func ("/rspamd/http", rspamd_http_test_func);
+	g_test_add_func ("/rspamd/mime", rspamd_mime_test_func);
+	g_test_add_func ("/rspamd/charset", rspamd_charset_test_func);
+	g_test_add_func ("/rspamd/scripts", rspamd_scripts_test_func);
+	g_test_add_func ("/rspamd/trie", rspamd_trie_test_func);
+	g_test_add_func ("/rspamd/dns_cache", rspamd_dns_cache_test_func);
 
 	g_test_run ();
 
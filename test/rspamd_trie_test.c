@@ -0,0 +1,186 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "trie.h"
+#include "tests.h"
+
+enum {
+	PAT_HE = 0,
+	PAT_SHE,
+	PAT_HIS,
+	PAT_HERS,
+	PAT_A,
+	PAT_AA,
+	PAT_US,
+	PAT_MAX
+};
+
+static const gchar *patterns[] = {
+	[PAT_HE] = "he",
+	[PAT_SHE] = "she",
+	[PAT_HIS] = "his",
+	[PAT_HERS] = "hers",
+	[PAT_A] = "a",
+	[PAT_AA] = "aa",
+	[PAT_US] = "us",
+};
+
+struct test_trie_cbdata {
+	const gchar *text;
+	guint found[PAT_MAX][16];   /* bitmask of end offsets per pattern */
+	gint nfound;
+	gint limit;
+};
+
+static gboolean
+test_trie_cb (gint id, const gchar *pos, void *ud)
+{
+	struct test_trie_cbdata *cbd = ud;
+	gint end = pos - cbd->text;
+
+	g_assert (id >= 0 && id < PAT_MAX);
+	g_assert (end >= 0 && end < 16);
+	/* Pattern really ends at this position */
+	g_assert (end + 1 >= (gint)strlen (patterns[id]));
+	g_assert (g_ascii_strncasecmp (pos - strlen (patterns[id]) + 1,
+			patterns[id], strlen (patterns[id])) == 0);
+
+	cbd->found[id][end] ++;
+	cbd->nfound ++;
+
+	return cbd->limit == 0 || cbd->nfound < cbd->limit;
+}
+
+static gint
+test_trie_lookup_all (rspamd_trie_t *trie, const gchar *text,
+		struct test_trie_cbdata *cbd, gint limit)
+{
+	memset (cbd, 0, sizeof (*cbd));
+	cbd->text = text;
+	cbd->limit = limit;
+
+	return rspamd_trie_lookup_all (trie, text, strlen (text), test_trie_cb, cbd);
+}
+
+static void
+test_trie_lookup (rspamd_trie_t *trie, const gchar *text,
+		gint expected_start, gint expected_id)
+{
+	const gchar *res;
+	gint id = -1;
+
+	res = rspamd_trie_lookup (trie, text, strlen (text), &id);
+
+	if (expected_start == -1) {
+		g_assert (res == NULL);
+	}
+	else {
+		msg_debug ("lookup '%s': start %d, id %d", text,
+				res ? (gint)(res - text) : -1, id);
+		g_assert (res != NULL);
+		g_assert (res - text == expected_start);
+		g_assert (id == expected_id);
+	}
+}
+
+void
+rspamd_trie_test_func (void)
+{
+	rspamd_trie_t *trie;
+	struct test_trie_cbdata cbd;
+	gint i;
+
+	trie = rspamd_trie_create (FALSE);
+
+	for (i = PAT_HE; i <= PAT_AA; i ++) {
+		rspamd_trie_insert (trie, patterns[i], i);
+	}
+
+	/* Overlapping patterns and nested suffixes */
+	g_assert (test_trie_lookup_all (trie, "ushers", &cbd, 0) == 3);
+	g_assert (cbd.found[PAT_SHE][3] == 1);
+	g_assert (cbd.found[PAT_HE][3] == 1);
+	g_assert (cbd.found[PAT_HERS][5] == 1);
+
+	g_assert (test_trie_lookup_all (trie, "aaa", &cbd, 0) == 5);
+	g_assert (cbd.found[PAT_A][0] == 1);
+	g_assert (cbd.found[PAT_A][1] == 1);
+	g_assert (cbd.found[PAT_A][2] == 1);
+	g_assert (cbd.found[PAT_AA][1] == 1);
+	g_assert (cbd.found[PAT_AA][2] == 1);
+
+	/* The longest pattern that ends first is returned */
+	test_trie_lookup (trie, "ushers", 1, PAT_SHE);
+	test_trie_lookup (trie, "xhe", 1, PAT_HE);
+	test_trie_lookup (trie, "shoe", -1, -1);
+	test_trie_lookup (trie, "", -1, -1);
+
+	/* Matches found through fail links: "sh" -> "hi", "she" -> "her" */
+	test_trie_lookup (trie, "shis", 1, PAT_HIS);
+	g_assert (test_trie_lookup_all (trie, "shis", &cbd, 0) == 1);
+	g_assert (cbd.found[PAT_HIS][3] == 1);
+	g_assert (test_trie_lookup_all (trie, "shers", &cbd, 0) == 3);
+	g_assert (cbd.found[PAT_HERS][4] == 1);
+
+	/* Callback can stop or continue the search */
+	g_assert (test_trie_lookup_all (trie, "ushers aaa", &cbd, 1) == 1);
+	g_assert (cbd.nfound == 1);
+	g_assert (test_trie_lookup_all (trie, "ushers aaa", &cbd, 4) == 4);
+	g_assert (cbd.nfound == 4);
+	g_assert (cbd.found[PAT_HERS][5] == 1);
+	g_assert (cbd.found[PAT_A][7] == 1);
+	g_assert (test_trie_lookup_all (trie, "ushers aaa", &cbd, 0) == 8);
+	g_assert (cbd.nfound == 8);
+	g_assert (rspamd_trie_lookup_all (trie, "ushers", 6, NULL, NULL) == 3);
+
+	/* Case sensitive trie does not match other cases */
+	test_trie_lookup (trie, "USHERS", -1, -1);
+	g_assert (test_trie_lookup_all (trie, "uSHers", &cbd, 0) == 0);
+
+	/* Patterns inserted after compilation are found by the next lookup */
+	rspamd_trie_compile (trie);
+	test_trie_lookup (trie, "ushers", 1, PAT_SHE);
+	rspamd_trie_insert (trie, patterns[PAT_US], PAT_US);
+	test_trie_lookup (trie, "ushers", 0, PAT_US);
+	g_assert (test_trie_lookup_all (trie, "ushers", &cbd, 0) == 4);
+	g_assert (cbd.found[PAT_US][1] == 1);
+
+	rspamd_trie_free (trie);
+
+	/* Case insensitive trie matches any case of patterns and text */
+	trie = rspamd_trie_create (TRUE);
+	rspamd_trie_insert (trie, "SHe", PAT_SHE);
+	rspamd_trie_insert (trie, "hErs", PAT_HERS);
+	rspamd_trie_insert (trie, "he", PAT_HE);
+
+	test_trie_lookup (trie, "USHERS", 1, PAT_SHE);
+	test_trie_lookup (trie, "xHe", 1, PAT_HE);
+	g_assert (test_trie_lookup_all (trie, "uShErS", &cbd, 0) == 3);
+	g_assert (cbd.found[PAT_SHE][3] == 1);
+	g_assert (cbd.found[PAT_HE][3] == 1);
+	g_assert (cbd.found[PAT_HERS][5] == 1);
+
+	rspamd_trie_free (trie);
+}
@@ -2,6 +2,7 @@
 #include "main.h"
 #include "cfg_file.h"
 #include "url.h"
+#include "message.h"
 #include "tests.h"
 
 const char *test_text =
@@ -53,9 +54,144 @@ const char *test_text =
 "http://vsem.ru?action;\n";
 const char *test_html = "<some_tag>This is test file with <a href=\"http://microsoft.com\">http://TesT.com/././?%45%46%20 url</a></some_tag>";
 
+/* Urls repeated in text and html parts of one message */
+static const gchar test_rep_text[] = "Visit http://example.com/a or www.example.com/b,\n"
+	"write to user@example.org or mailto:other@example.org.\n"
+	"Again: http://example.com/a and HTTP://EXAMPLE.COM/a\n"
+	"http://redir.com/go?u=www.inner.com/x\n"
+	"http://spam.ru/bad=victim@domain.com\n";
+static const gchar test_rep_html[] = "Visit http://example.com/a here http://example.com/a";
+
+/* Urls expected in offsets of test_rep_text */
+static const gchar *test_rep_offsets[] = {
+	"http://example.com/a",
+	"www.example.com/b",
+	"user@example.org",
+	"other@example.org",
+	"http://example.com/a",
+	"HTTP://EXAMPLE.COM/a",
+	"http://redir.com/go?u=www.inner.com/x",
+	"http://spam.ru/bad=victim@domain.com",
+	NULL
+};
+
+static struct mime_text_part *
+test_url_part (struct rspamd_task *task, const gchar *text, gboolean is_html)
+{
+	struct mime_text_part *part;
+
+	part = rspamd_mempool_alloc0 (task->task_pool, sizeof (*part));
+	part->is_html = is_html;
+	part->content = g_byte_array_new ();
+	g_byte_array_append (part->content, text, strlen (text));
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t)g_byte_array_unref, part->content);
+	url_parse_text (task->task_pool, task, part, is_html);
+
+	return part;
+}
+
+static void
+test_url_offsets (struct mime_text_part *part, const gchar **expected)
+{
+	struct process_exception *ex;
+	GList *cur;
+	guint i = 0;
+
+	for (cur = part->urls_offset; cur != NULL; cur = g_list_next (cur), i ++) {
+		ex = cur->data;
+		msg_debug ("url at %z: %*s", ex->pos, (gint)ex->len,
+			part->content->data + ex->pos);
+		g_assert (expected[i] != NULL);
+		g_assert (ex->pos + ex->len <= part->content->len);
+		g_assert (ex->len == strlen (expected[i]));
+		g_assert (memcmp (part->content->data + ex->pos, expected[i],
+			ex->len) == 0);
+	}
+
+	g_assert (expected[i] == NULL);
+}
+
+struct test_url_cbdata {
+	const gchar *host;
+	gboolean found;
+};
+
+static gboolean
+test_url_find (gpointer key, gpointer value, gpointer ud)
+{
+	struct uri *uri = value;
+	struct test_url_cbdata *cbd = ud;
+
+	if (uri->hostlen == strlen (cbd->host) &&
+		g_ascii_strncasecmp (uri->host, cbd->host, uri->hostlen) == 0) {
+		cbd->found = TRUE;
+	}
+
+	return cbd->found;
+}
+
+static gboolean
+test_url_has_host (GTree *tree, const gchar *host)
+{
+	struct test_url_cbdata cbd;
+
+	cbd.host = host;
+	cbd.found = FALSE;
+	g_tree_foreach (tree, test_url_find, &cbd);
+
+	return cbd.found;
+}
+
 /* Function for using in glib test suite */
 void
 rspamd_url_test_func ()
 {
-	/* XXX: maybe write test for this */
+	struct rspamd_task *task;
+	struct mime_text_part *part, *html_part;
+	struct process_exception *ex;
+	const gchar *html_offsets[] = {
+		"http://example.com/a",
+		"http://example.com/a",
+		NULL
+	};
+	GList *cur;
+
+	task = rspamd_task_new (NULL);
+
+	part = test_url_part (task, test_rep_text, FALSE);
+	test_url_offsets (part, test_rep_offsets);
+
+	/* The same urls in a html part are recorded but not added twice */
+	html_part = test_url_part (task, test_rep_html, TRUE);
+	test_url_offsets (html_part, html_offsets);
+
+	/* Hosts are compared without case, so there is one url per host */
+	g_assert (g_tree_nnodes (task->urls) == 4);
+	g_assert (test_url_has_host (task->urls, "example.com"));
+	g_assert (test_url_has_host (task->urls, "www.example.com"));
+	g_assert (test_url_has_host (task->urls, "redir.com"));
+	g_assert (test_url_has_host (task->urls, "spam.ru"));
+	/* Urls that start inside of other urls are not extracted */
+	g_assert (!test_url_has_host (task->urls, "www.inner.com"));
+
+	g_assert (g_tree_nnodes (task->emails) == 2);
+	g_assert (!test_url_has_host (task->emails, "domain.com"));
+
+	/* Offsets of urls in a larger text are valid and do not overlap */
+	part = test_url_part (task, test_text, FALSE);
+	g_assert (part->urls_offset != NULL);
+
+	for (cur = part->urls_offset, ex = NULL; cur != NULL; cur = g_list_next (cur)) {
+		if (ex != NULL) {
+			g_assert (((struct process_exception *)cur->data)->pos >=
+				ex->pos + ex->len);
+		}
+
+		ex = cur->data;
+		g_assert (ex->len > 0);
+		g_assert (ex->pos + ex->len <= part->content->len);
+	}
+
+	rspamd_task_free (task, FALSE);
 }
@@ -39,4 +39,18 @@ void rspamd_upstream_test_func (void);
 
 void rspamd_shingles_test_func (void);
 
+void rspamd_redis_stat_test_func (void);
+
+void rspamd_http_test_func (void);
+
+void rspamd_mime_test_func (void);
+
+void rspamd_charset_test_func (void);
+
+void rspamd_scripts_test_func (void);
+
+void rspamd_trie_test_func (void);
+
+void rspamd_dns_cache_test_func (void);
+
 #endif